@@ -0,0 +1,493 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "MeshSimplifier.h"
+
+namespace
+{
+	//Symmetric 4x4 error quadric, stored as the upper triangle
+	struct FQuadric
+	{
+		double m[10];
+
+		FQuadric()
+		{
+			FMemory::Memzero(m, sizeof(m));
+		}
+
+		//Quadric of the plane ax + by + cz + d = 0
+		FQuadric(double a, double b, double c, double d)
+		{
+			m[0] = a * a; m[1] = a * b; m[2] = a * c; m[3] = a * d;
+			m[4] = b * b; m[5] = b * c; m[6] = b * d;
+			m[7] = c * c; m[8] = c * d;
+			m[9] = d * d;
+		}
+
+		FQuadric& operator+=(const FQuadric& Other)
+		{
+			for (int i = 0; i < 10; i++) {
+				m[i] += Other.m[i];
+			}
+			return *this;
+		}
+
+		double Det(int a11, int a12, int a13, int a21, int a22, int a23, int a31, int a32, int a33) const
+		{
+			return m[a11] * m[a22] * m[a33] + m[a13] * m[a21] * m[a32] + m[a12] * m[a23] * m[a31]
+				- m[a13] * m[a22] * m[a31] - m[a11] * m[a23] * m[a32] - m[a12] * m[a21] * m[a33];
+		}
+
+		double Error(const FVector& P) const
+		{
+			double x = P.X;
+			double y = P.Y;
+			double z = P.Z;
+			return m[0] * x * x + 2 * m[1] * x * y + 2 * m[2] * x * z + 2 * m[3] * x
+				+ m[4] * y * y + 2 * m[5] * y * z + 2 * m[6] * y
+				+ m[7] * z * z + 2 * m[8] * z
+				+ m[9];
+		}
+	};
+
+	struct FSimplifyTriangle
+	{
+		int32 v[3];
+		double err[4];
+		bool bDeleted = false;
+		bool bDirty = false;
+		FVector n;
+	};
+
+	struct FSimplifyVertex
+	{
+		FVector p;
+		FQuadric q;
+		int32 tstart = 0;
+		int32 tcount = 0;
+		bool bLocked = false;
+	};
+
+	struct FSimplifyRef
+	{
+		int32 tid;
+		int32 tvertex;
+	};
+
+	//Number of welding steps per voxel. MC vertices sit on edge midpoints so this is far finer than needed.
+	const double WeldPrecision = 256.0;
+
+	//Error that can never be under the collapse threshold
+	const double LockedError = 1e30;
+
+	class FQuadricSimplifier
+	{
+	public:
+		TArray<FSimplifyTriangle> Triangles;
+		TArray<FSimplifyVertex> Vertices;
+		TArray<FSimplifyRef> Refs;
+
+		void Run(int32 TargetCount)
+		{
+			int32 deletedTriangles = 0;
+			int32 triangleCount = Triangles.Num();
+			TArray<bool> deleted0;
+			TArray<bool> deleted1;
+
+			for (int iteration = 0; iteration < 100; iteration++) {
+				if (triangleCount - deletedTriangles <= TargetCount) {
+					break;
+				}
+
+				//Compact and rebuild vertex -> triangle references every few passes
+				if (iteration % 5 == 0) {
+					UpdateMesh(iteration);
+					triangleCount = Triangles.Num();
+					deletedTriangles = 0;
+				}
+
+				for (FSimplifyTriangle& t : Triangles) {
+					t.bDirty = false;
+				}
+
+				//Threshold grows each pass so cheap collapses go first
+				double threshold = 0.000000001 * FMath::Pow(double(iteration + 3), 7.0);
+
+				for (int32 ti = 0; ti < Triangles.Num(); ti++) {
+					FSimplifyTriangle& t = Triangles[ti];
+					if (t.err[3] > threshold || t.bDeleted || t.bDirty) {
+						continue;
+					}
+
+					for (int j = 0; j < 3; j++) {
+						if (t.err[j] >= threshold) {
+							continue;
+						}
+
+						int32 i0 = t.v[j];
+						int32 i1 = t.v[(j + 1) % 3];
+						if (Vertices[i0].bLocked && Vertices[i1].bLocked) {
+							continue;
+						}
+
+						//A locked vertex always survives the collapse
+						if (Vertices[i1].bLocked) {
+							Swap(i0, i1);
+						}
+						FSimplifyVertex& v0 = Vertices[i0];
+						FSimplifyVertex& v1 = Vertices[i1];
+
+						FVector p;
+						CalculateError(i0, i1, p);
+
+						deleted0.SetNumZeroed(v0.tcount);
+						deleted1.SetNumZeroed(v1.tcount);
+
+						if (Flipped(p, i1, v0, deleted0) || Flipped(p, i0, v1, deleted1)) {
+							continue;
+						}
+
+						v0.p = p;
+						v0.q += v1.q;
+
+						int32 tstart = Refs.Num();
+						UpdateTriangles(i0, v0, deleted0, deletedTriangles);
+						UpdateTriangles(i0, v1, deleted1, deletedTriangles);
+						int32 tcount = Refs.Num() - tstart;
+
+						if (tcount <= v0.tcount) {
+							//Reuse the old slot
+							if (tcount > 0) {
+								FMemory::Memmove(&Refs[v0.tstart], &Refs[tstart], tcount * sizeof(FSimplifyRef));
+							}
+						}
+						else {
+							v0.tstart = tstart;
+						}
+						v0.tcount = tcount;
+						break;
+					}
+
+					if (triangleCount - deletedTriangles <= TargetCount) {
+						break;
+					}
+				}
+			}
+
+			CompactMesh();
+		}
+
+		void LockOpenEdges()
+		{
+			TArray<int32> neighbourCount;
+			TArray<int32> neighbourId;
+			for (int32 vi = 0; vi < Vertices.Num(); vi++) {
+				FSimplifyVertex& v = Vertices[vi];
+				neighbourCount.Reset();
+				neighbourId.Reset();
+
+				for (int32 k = 0; k < v.tcount; k++) {
+					const FSimplifyTriangle& t = Triangles[Refs[v.tstart + k].tid];
+					for (int j = 0; j < 3; j++) {
+						int32 id = t.v[j];
+						int32 found = neighbourId.Find(id);
+						if (found == INDEX_NONE) {
+							neighbourId.Add(id);
+							neighbourCount.Add(1);
+						}
+						else {
+							neighbourCount[found]++;
+						}
+					}
+				}
+
+				//An edge used by a single triangle is open
+				for (int32 n = 0; n < neighbourId.Num(); n++) {
+					if (neighbourCount[n] == 1) {
+						Vertices[neighbourId[n]].bLocked = true;
+					}
+				}
+			}
+		}
+
+		void UpdateMesh(int iteration)
+		{
+			if (iteration > 0) {
+				Triangles.RemoveAll([](const FSimplifyTriangle& t) { return t.bDeleted; });
+			}
+
+			//Build vertex -> triangle references
+			for (FSimplifyVertex& v : Vertices) {
+				v.tstart = 0;
+				v.tcount = 0;
+			}
+			for (const FSimplifyTriangle& t : Triangles) {
+				for (int j = 0; j < 3; j++) {
+					Vertices[t.v[j]].tcount++;
+				}
+			}
+			int32 tstart = 0;
+			for (FSimplifyVertex& v : Vertices) {
+				v.tstart = tstart;
+				tstart += v.tcount;
+				v.tcount = 0;
+			}
+			Refs.SetNumUninitialized(Triangles.Num() * 3);
+			for (int32 ti = 0; ti < Triangles.Num(); ti++) {
+				const FSimplifyTriangle& t = Triangles[ti];
+				for (int j = 0; j < 3; j++) {
+					FSimplifyVertex& v = Vertices[t.v[j]];
+					Refs[v.tstart + v.tcount].tid = ti;
+					Refs[v.tstart + v.tcount].tvertex = j;
+					v.tcount++;
+				}
+			}
+
+			if (iteration == 0) {
+				LockOpenEdges();
+
+				for (FSimplifyTriangle& t : Triangles) {
+					const FVector& p0 = Vertices[t.v[0]].p;
+					FVector n = FVector::CrossProduct(Vertices[t.v[1]].p - p0, Vertices[t.v[2]].p - p0);
+					n.Normalize();
+					t.n = n;
+
+					FQuadric plane(n.X, n.Y, n.Z, -FVector::DotProduct(n, p0));
+					for (int j = 0; j < 3; j++) {
+						Vertices[t.v[j]].q += plane;
+					}
+				}
+
+				FVector p;
+				for (FSimplifyTriangle& t : Triangles) {
+					for (int j = 0; j < 3; j++) {
+						t.err[j] = CalculateError(t.v[j], t.v[(j + 1) % 3], p);
+					}
+					t.err[3] = FMath::Min3(t.err[0], t.err[1], t.err[2]);
+				}
+			}
+		}
+
+	private:
+
+		double CalculateError(int32 id0, int32 id1, FVector& OutP) const
+		{
+			const FSimplifyVertex& v0 = Vertices[id0];
+			const FSimplifyVertex& v1 = Vertices[id1];
+
+			FQuadric q = v0.q;
+			q += v1.q;
+
+			if (v0.bLocked && v1.bLocked) {
+				OutP = v0.p;
+				return LockedError;
+			}
+			if (v0.bLocked || v1.bLocked) {
+				OutP = v0.bLocked ? v0.p : v1.p;
+				return q.Error(OutP);
+			}
+
+			//Optimal position if the quadric is invertible
+			double det = q.Det(0, 1, 2, 1, 4, 5, 2, 5, 7);
+			if (det != 0) {
+				OutP.X = -1 / det * q.Det(1, 2, 3, 4, 5, 6, 5, 7, 8);
+				OutP.Y = 1 / det * q.Det(0, 2, 3, 1, 5, 6, 2, 7, 8);
+				OutP.Z = -1 / det * q.Det(0, 1, 3, 1, 4, 6, 2, 5, 8);
+				return q.Error(OutP);
+			}
+
+			//Otherwise the best of the endpoints and midpoint
+			FVector mid = (v0.p + v1.p) / 2;
+			double e0 = q.Error(v0.p);
+			double e1 = q.Error(v1.p);
+			double e2 = q.Error(mid);
+			double error = FMath::Min3(e0, e1, e2);
+			if (error == e0) {
+				OutP = v0.p;
+			}
+			else if (error == e1) {
+				OutP = v1.p;
+			}
+			else {
+				OutP = mid;
+			}
+			return error;
+		}
+
+		//Checks if moving v to p would flip any of its triangles that are not removed by the collapse with other
+		bool Flipped(const FVector& p, int32 other, const FSimplifyVertex& v, TArray<bool>& deleted) const
+		{
+			for (int32 k = 0; k < v.tcount; k++) {
+				const FSimplifyRef& r = Refs[v.tstart + k];
+				const FSimplifyTriangle& t = Triangles[r.tid];
+				if (t.bDeleted) {
+					continue;
+				}
+
+				int32 id1 = t.v[(r.tvertex + 1) % 3];
+				int32 id2 = t.v[(r.tvertex + 2) % 3];
+				if (id1 == other || id2 == other) {
+					deleted[k] = true;
+					continue;
+				}
+
+				FVector d1 = Vertices[id1].p - p;
+				d1.Normalize();
+				FVector d2 = Vertices[id2].p - p;
+				d2.Normalize();
+				if (FMath::Abs(FVector::DotProduct(d1, d2)) > 0.999) {
+					return true;
+				}
+
+				FVector n = FVector::CrossProduct(d1, d2);
+				n.Normalize();
+				deleted[k] = false;
+				if (FVector::DotProduct(n, t.n) < 0.2) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void UpdateTriangles(int32 i0, const FSimplifyVertex& v, const TArray<bool>& deleted, int32& deletedTriangles)
+		{
+			FVector p;
+			for (int32 k = 0; k < v.tcount; k++) {
+				FSimplifyRef r = Refs[v.tstart + k];
+				FSimplifyTriangle& t = Triangles[r.tid];
+				if (t.bDeleted) {
+					continue;
+				}
+				if (deleted[k]) {
+					t.bDeleted = true;
+					deletedTriangles++;
+					continue;
+				}
+
+				t.v[r.tvertex] = i0;
+				t.bDirty = true;
+				t.err[0] = CalculateError(t.v[0], t.v[1], p);
+				t.err[1] = CalculateError(t.v[1], t.v[2], p);
+				t.err[2] = CalculateError(t.v[2], t.v[0], p);
+				t.err[3] = FMath::Min3(t.err[0], t.err[1], t.err[2]);
+				Refs.Add(r);
+			}
+		}
+
+		void CompactMesh()
+		{
+			Triangles.RemoveAll([](const FSimplifyTriangle& t) { return t.bDeleted; });
+
+			TArray<int32> remap;
+			remap.Init(INDEX_NONE, Vertices.Num());
+			for (const FSimplifyTriangle& t : Triangles) {
+				for (int j = 0; j < 3; j++) {
+					remap[t.v[j]] = 0;
+				}
+			}
+
+			int32 dst = 0;
+			for (int32 vi = 0; vi < Vertices.Num(); vi++) {
+				if (remap[vi] != INDEX_NONE) {
+					remap[vi] = dst;
+					Vertices[dst].p = Vertices[vi].p;
+					dst++;
+				}
+			}
+			Vertices.SetNum(dst);
+
+			for (FSimplifyTriangle& t : Triangles) {
+				for (int j = 0; j < 3; j++) {
+					t.v[j] = remap[t.v[j]];
+				}
+			}
+		}
+	};
+}
+
+void FMeshSimplifier::Simplify(const TArray<FVector>& InPositions, const TArray<int32>& InIndices, int32 TargetTriangleCount,
+	const FBox& LockedBounds, float VertexScale,
+	TArray<FVector>& OutPositions, TArray<int32>& OutIndices, TArray<FVector>& OutNormals)
+{
+	OutPositions.Reset();
+	OutIndices.Reset();
+	OutNormals.Reset();
+
+	if (InIndices.Num() < 3 || VertexScale <= 0) {
+		return;
+	}
+
+	FQuadricSimplifier simplifier;
+	double invScale = 1.0 / VertexScale;
+	FVector boundsMin = LockedBounds.Min * invScale;
+	FVector boundsMax = LockedBounds.Max * invScale;
+	const double lockTolerance = 1e-3;
+
+	//Weld the triangle soup so edges are shared between triangles
+	TMap<FIntVector, int32> weldMap;
+	weldMap.Reserve(InPositions.Num() / 2);
+	TArray<int32> welded;
+	welded.Init(INDEX_NONE, InPositions.Num());
+
+	for (int32 i = 0; i < InPositions.Num(); i++) {
+		FVector p = InPositions[i] * invScale;
+		FIntVector key(FMath::RoundToInt(p.X * WeldPrecision), FMath::RoundToInt(p.Y * WeldPrecision), FMath::RoundToInt(p.Z * WeldPrecision));
+
+		if (int32* existing = weldMap.Find(key)) {
+			welded[i] = *existing;
+			continue;
+		}
+
+		FSimplifyVertex v;
+		v.p = p;
+		v.bLocked = FMath::Abs(p.X - boundsMin.X) < lockTolerance || FMath::Abs(p.X - boundsMax.X) < lockTolerance
+			|| FMath::Abs(p.Y - boundsMin.Y) < lockTolerance || FMath::Abs(p.Y - boundsMax.Y) < lockTolerance
+			|| FMath::Abs(p.Z - boundsMin.Z) < lockTolerance || FMath::Abs(p.Z - boundsMax.Z) < lockTolerance;
+
+		welded[i] = simplifier.Vertices.Add(v);
+		weldMap.Add(key, welded[i]);
+	}
+
+	simplifier.Triangles.Reserve(InIndices.Num() / 3);
+	for (int32 i = 0; i + 2 < InIndices.Num(); i += 3) {
+		FSimplifyTriangle t;
+		t.v[0] = welded[InIndices[i]];
+		t.v[1] = welded[InIndices[i + 1]];
+		t.v[2] = welded[InIndices[i + 2]];
+
+		//Triangles collapsed by welding carry no surface
+		if (t.v[0] == t.v[1] || t.v[1] == t.v[2] || t.v[2] == t.v[0]) {
+			continue;
+		}
+		simplifier.Triangles.Add(t);
+	}
+
+	simplifier.Run(TargetTriangleCount);
+
+	//Write out an indexed mesh with area weighted normals
+	OutPositions.SetNumUninitialized(simplifier.Vertices.Num());
+	OutNormals.SetNumZeroed(simplifier.Vertices.Num());
+	for (int32 vi = 0; vi < simplifier.Vertices.Num(); vi++) {
+		OutPositions[vi] = simplifier.Vertices[vi].p * VertexScale;
+	}
+
+	OutIndices.SetNumUninitialized(simplifier.Triangles.Num() * 3);
+	for (int32 ti = 0; ti < simplifier.Triangles.Num(); ti++) {
+		const FSimplifyTriangle& t = simplifier.Triangles[ti];
+		OutIndices[3 * ti] = t.v[0];
+		OutIndices[3 * ti + 1] = t.v[1];
+		OutIndices[3 * ti + 2] = t.v[2];
+
+		//Same winding as the face normals in AVObject::DrawChunk
+		FVector e1 = OutPositions[t.v[0]] - OutPositions[t.v[1]];
+		FVector e2 = OutPositions[t.v[2]] - OutPositions[t.v[1]];
+		FVector n = FVector::CrossProduct(e1, e2);
+		for (int j = 0; j < 3; j++) {
+			OutNormals[t.v[j]] += n;
+		}
+	}
+
+	for (FVector& n : OutNormals) {
+		n.Normalize();
+	}
+}
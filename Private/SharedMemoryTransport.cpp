@@ -0,0 +1,518 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "SharedMemoryTransport.h"
+#include "HAL/PlatformMemory.h"
+#include "HAL/PlatformProcess.h"
+
+namespace
+{
+    static_assert(FMath::IsPowerOfTwo(FSharedMemoryTransportFormat::RingCapacity), "ring positions wrap with a mask");
+
+    // int32 like the State field they are stored in
+    constexpr int32 SlotFree = FSharedMemoryTransportFormat::SlotFree;
+    constexpr int32 SlotClaimed = FSharedMemoryTransportFormat::SlotClaimed;
+    constexpr int32 SlotConnecting = FSharedMemoryTransportFormat::SlotConnecting;
+    constexpr int32 SlotOpen = FSharedMemoryTransportFormat::SlotOpen;
+    constexpr int32 SlotClosed = FSharedMemoryTransportFormat::SlotClosed;
+
+    // ring 0 carries what the client sends, ring 1 what the server sends
+    constexpr int32 ClientToServer = 0;
+    constexpr int32 ServerToClient = 1;
+
+    // each ring has a doorbell for its reader and one for its writer
+    constexpr int32 DataBell = 0;
+    constexpr int32 SpaceBell = 1;
+    constexpr int32 BellsPerSlot = 4;
+
+    constexpr double PeerCheckIntervalSeconds = 0.5;
+    constexpr float ConnectPollSeconds = 0.001f;
+
+    struct alignas(64) FRegionHeader
+    {
+        uint32 Magic;
+        uint32 Version;
+        uint32 SlotCount;
+        uint32 RingCapacity;
+
+        /* Written last when the region is ready, zero once the server has gone */
+        volatile int32 ServerProcessId;
+    };
+
+    // positions only grow and wrap at 2^32, their difference is the bytes in the ring
+    struct alignas(64) FRingControl
+    {
+        volatile int32 WritePos;
+        alignas(64) volatile int32 ReadPos;
+        alignas(64) volatile int32 bReaderSleeping;
+        volatile int32 bWriterSleeping;
+    };
+
+    struct alignas(64) FSlotControl
+    {
+        volatile int32 State;
+        volatile int32 ClientProcessId;
+        FRingControl Rings[2];
+    };
+
+    constexpr SIZE_T ControlSize = sizeof(FRegionHeader) + FSharedMemoryTransportFormat::SlotCount * sizeof(FSlotControl);
+    constexpr SIZE_T DataOffset = (ControlSize + 4095) & ~(SIZE_T)4095;
+    constexpr SIZE_T RegionSize = DataOffset + (SIZE_T)FSharedMemoryTransportFormat::SlotCount * 2 * FSharedMemoryTransportFormat::RingCapacity;
+
+    void CopyToRing(uint8* Ring, uint32 Position, const uint8* Source, uint32 Count)
+    {
+        uint32 offset = Position & (FSharedMemoryTransportFormat::RingCapacity - 1);
+        uint32 first = FMath::Min(Count, FSharedMemoryTransportFormat::RingCapacity - offset);
+        FMemory::Memcpy(Ring + offset, Source, first);
+        FMemory::Memcpy(Ring, Source + first, Count - first);
+    }
+
+    void CopyFromRing(const uint8* Ring, uint32 Position, uint8* Destination, uint32 Count)
+    {
+        uint32 offset = Position & (FSharedMemoryTransportFormat::RingCapacity - 1);
+        uint32 first = FMath::Min(Count, FSharedMemoryTransportFormat::RingCapacity - offset);
+        FMemory::Memcpy(Destination, Ring + offset, first);
+        FMemory::Memcpy(Destination + first, Ring, Count - first);
+    }
+
+    uint32 GetUsed(const FRingControl& Ring)
+    {
+        return (uint32)FPlatformAtomics::AtomicRead(&Ring.WritePos) - (uint32)FPlatformAtomics::AtomicRead(&Ring.ReadPos);
+    }
+
+    bool IsProcessRunning(int32 ProcessId)
+    {
+        return ProcessId != 0 && FPlatformProcess::IsApplicationRunning((uint32)ProcessId);
+    }
+}
+
+class FSharedMemoryTransportRegion
+{
+public:
+    ~FSharedMemoryTransportRegion()
+    {
+        for (FPlatformProcess::FSemaphore* bell : Bells)
+        {
+            if (bell)
+            {
+                FPlatformProcess::DeleteInterprocessSynchObject(bell);
+            }
+        }
+
+        if (Mapping)
+        {
+            // clients still mapping a region left behind see no server and give up instead of waiting on it
+            if (bServer)
+            {
+                FPlatformAtomics::AtomicStore(&GetHeader().ServerProcessId, 0);
+            }
+            FPlatformMemory::UnmapNamedSharedMemoryRegion(Mapping);
+        }
+    }
+
+    bool Create(const FString& InName)
+    {
+        Name = InName;
+        bServer = true;
+        Mapping = FPlatformMemory::MapNamedSharedMemoryRegion(Name, true,
+            FPlatformMemory::ESharedMemoryAccess::Read | FPlatformMemory::ESharedMemoryAccess::Write, RegionSize);
+        if (!Mapping)
+        {
+            return false;
+        }
+
+        // every doorbell exists before a client can see the region, so opening them never races with creating them
+        Bells.SetNumZeroed(FSharedMemoryTransportFormat::SlotCount * BellsPerSlot);
+        for (int32 slot = 0; slot < FSharedMemoryTransportFormat::SlotCount; slot++)
+        {
+            if (!OpenBells(slot, true))
+            {
+                return false;
+            }
+        }
+
+        // zeroed control blocks leave every slot Free, ring data is always written before it is read
+        FMemory::Memzero(Mapping->GetAddress(), ControlSize);
+        FRegionHeader& header = GetHeader();
+        header.Magic = FSharedMemoryTransportFormat::Magic;
+        header.Version = FSharedMemoryTransportFormat::Version;
+        header.SlotCount = FSharedMemoryTransportFormat::SlotCount;
+        header.RingCapacity = FSharedMemoryTransportFormat::RingCapacity;
+        FPlatformAtomics::AtomicStore(&header.ServerProcessId, (int32)FPlatformProcess::GetCurrentProcessId());
+        return true;
+    }
+
+    /* False if the region is missing, of another layout or left behind by a server that is gone */
+    bool Open(const FString& InName)
+    {
+        Name = InName;
+        bServer = false;
+        Mapping = FPlatformMemory::MapNamedSharedMemoryRegion(Name, false,
+            FPlatformMemory::ESharedMemoryAccess::Read | FPlatformMemory::ESharedMemoryAccess::Write, RegionSize);
+        if (!Mapping)
+        {
+            return false;
+        }
+
+        Bells.SetNumZeroed(FSharedMemoryTransportFormat::SlotCount * BellsPerSlot);
+        FRegionHeader& header = GetHeader();
+        return IsProcessRunning(FPlatformAtomics::AtomicRead(&header.ServerProcessId)) &&
+            header.Magic == FSharedMemoryTransportFormat::Magic && header.Version == FSharedMemoryTransportFormat::Version &&
+            header.SlotCount == FSharedMemoryTransportFormat::SlotCount && header.RingCapacity == FSharedMemoryTransportFormat::RingCapacity;
+    }
+
+    /* The server creates the doorbells of every slot, a client opens those of the slot it claimed */
+    bool OpenBells(int32 Slot, bool bCreate)
+    {
+        for (int32 index = 0; index < BellsPerSlot; index++)
+        {
+            FPlatformProcess::FSemaphore*& bell = Bells[Slot * BellsPerSlot + index];
+            bell = FPlatformProcess::NewInterprocessSynchObject(FString::Printf(TEXT("%s_%d_%d"), *Name, Slot, index), bCreate, 1);
+            if (!bell)
+            {
+                return false;
+            }
+
+            // a new semaphore starts with its one lock available, taken here so the first sleep is a real one
+            if (bCreate)
+            {
+                bell->TryLock(0);
+            }
+        }
+        return true;
+    }
+
+    FRegionHeader& GetHeader()
+    {
+        return *(FRegionHeader*)Mapping->GetAddress();
+    }
+
+    FSlotControl& GetSlot(int32 Slot)
+    {
+        return ((FSlotControl*)((uint8*)Mapping->GetAddress() + sizeof(FRegionHeader)))[Slot];
+    }
+
+    uint8* GetRingData(int32 Slot, int32 RingIndex)
+    {
+        return (uint8*)Mapping->GetAddress() + DataOffset + ((SIZE_T)Slot * 2 + RingIndex) * FSharedMemoryTransportFormat::RingCapacity;
+    }
+
+    FPlatformProcess::FSemaphore* GetBell(int32 Slot, int32 RingIndex, int32 Bell)
+    {
+        return Bells[Slot * BellsPerSlot + RingIndex * 2 + Bell];
+    }
+
+    /* Posts the doorbell if its sleeper flag is up, taking the flag down so one sleep gets one post */
+    void Notify(volatile int32* bSleeping, int32 Slot, int32 RingIndex, int32 Bell)
+    {
+        if (FPlatformAtomics::InterlockedCompareExchange(bSleeping, 0, 1) == 1)
+        {
+            GetBell(Slot, RingIndex, Bell)->Unlock();
+        }
+    }
+
+    /* Raises the sleeper flag and sleeps unless bReady turns true, the flag is checked by the other side after every change */
+    template<typename ReadyFunc>
+    bool SleepUntil(volatile int32* bSleeping, int32 Slot, int32 RingIndex, int32 Bell, FTimespan WaitTime, ReadyFunc&& bReady)
+    {
+        if (bReady())
+        {
+            return true;
+        }
+
+        FPlatformAtomics::AtomicStore(bSleeping, 1);
+        if (!bReady())
+        {
+            GetBell(Slot, RingIndex, Bell)->TryLock((uint64)WaitTime.GetTicks() * 100);
+        }
+        FPlatformAtomics::AtomicStore(bSleeping, 0);
+        return bReady();
+    }
+
+private:
+    FString Name;
+    bool bServer = false;
+    FPlatformMemory::FSharedMemoryRegion* Mapping = nullptr;
+    TArray<FPlatformProcess::FSemaphore*> Bells;
+};
+
+bool FSharedMemoryTransportFormat::ParseHost(const FString& Host, FString& OutName)
+{
+    if (!Host.StartsWith(Scheme, ESearchCase::IgnoreCase))
+    {
+        return false;
+    }
+    OutName = Host.RightChop(FCString::Strlen(Scheme));
+    return !OutName.IsEmpty();
+}
+
+FString FSharedMemoryTransportFormat::GetRegionName(const FString& Name, int32 Port)
+{
+    return FString::Printf(TEXT("VoxelShm_%s_%d"), *Name, Port);
+}
+
+TUniquePtr<FSharedMemoryConnection> FSharedMemoryConnection::Connect(const FString& Name, int32 Port, FTimespan Timeout)
+{
+    FString regionName = FSharedMemoryTransportFormat::GetRegionName(Name, Port);
+    TSharedRef<FSharedMemoryTransportRegion> region = MakeShared<FSharedMemoryTransportRegion>();
+    if (!region->Open(regionName))
+    {
+        UE_LOG(LogTemp, Warning, TEXT("No shared memory server at %s"), *regionName);
+        return nullptr;
+    }
+
+    for (int32 slot = 0; slot < FSharedMemoryTransportFormat::SlotCount; slot++)
+    {
+        // whoever moves a slot out of Free owns it, the rings are reset before the server can see it
+        FSlotControl& control = region->GetSlot(slot);
+        if (FPlatformAtomics::InterlockedCompareExchange(&control.State, SlotClaimed, SlotFree) != SlotFree)
+        {
+            continue;
+        }
+
+        if (!region->OpenBells(slot, false))
+        {
+            FPlatformAtomics::AtomicStore(&control.State, SlotFree);
+            UE_LOG(LogTemp, Warning, TEXT("Could not open the doorbells of %s slot %d"), *regionName, slot);
+            return nullptr;
+        }
+        for (FRingControl& ring : control.Rings)
+        {
+            FPlatformAtomics::AtomicStore(&ring.WritePos, 0);
+            FPlatformAtomics::AtomicStore(&ring.ReadPos, 0);
+            FPlatformAtomics::AtomicStore(&ring.bReaderSleeping, 0);
+            FPlatformAtomics::AtomicStore(&ring.bWriterSleeping, 0);
+        }
+        FPlatformAtomics::AtomicStore(&control.ClientProcessId, (int32)FPlatformProcess::GetCurrentProcessId());
+        FPlatformAtomics::AtomicStore(&control.State, SlotConnecting);
+
+        // connecting is done once per connection on the socket thread, polling keeps the server side free of another doorbell
+        TUniquePtr<FSharedMemoryConnection> connection = MakeUnique<FSharedMemoryConnection>(region, slot, false);
+        double deadline = FPlatformTime::Seconds() + Timeout.GetTotalSeconds();
+        while (FPlatformAtomics::AtomicRead(&control.State) == SlotConnecting)
+        {
+            if (FPlatformTime::Seconds() > deadline)
+            {
+                // a server accepting right now wins, then the connection is up after all
+                if (FPlatformAtomics::InterlockedCompareExchange(&control.State, SlotFree, SlotConnecting) == SlotConnecting)
+                {
+                    connection->bClosed = true;
+                    UE_LOG(LogTemp, Warning, TEXT("Shared memory server at %s did not accept in time"), *regionName);
+                    return nullptr;
+                }
+                break;
+            }
+            FPlatformProcess::Sleep(ConnectPollSeconds);
+        }
+        return connection;
+    }
+
+    UE_LOG(LogTemp, Warning, TEXT("Every slot of shared memory server %s is taken"), *regionName);
+    return nullptr;
+}
+
+FSharedMemoryConnection::FSharedMemoryConnection(TSharedRef<FSharedMemoryTransportRegion> InRegion, int32 InSlot, bool bInServer)
+    : Region(InRegion)
+    , Slot(InSlot)
+    , bServer(bInServer)
+    , ReadRing(bInServer ? ClientToServer : ServerToClient)
+    , WriteRing(bInServer ? ServerToClient : ClientToServer)
+{
+}
+
+FSharedMemoryConnection::~FSharedMemoryConnection()
+{
+    Close();
+}
+
+bool FSharedMemoryConnection::Recv(uint8* Data, int32 BufferSize, int32& BytesRead)
+{
+    BytesRead = 0;
+    if (bClosed)
+    {
+        return false;
+    }
+
+    // the peer writes before it closes, so looking at the state first never misses its last bytes
+    bool bOpen = IsOpen();
+    FRingControl& ring = Region->GetSlot(Slot).Rings[ReadRing];
+    uint32 readPos = (uint32)FPlatformAtomics::AtomicRead(&ring.ReadPos);
+    uint32 count = FMath::Min<uint32>(GetUsed(ring), (uint32)FMath::Max(BufferSize, 0));
+    if (count == 0)
+    {
+        return bOpen;
+    }
+
+    CopyFromRing(Region->GetRingData(Slot, ReadRing), readPos, Data, count);
+    FPlatformAtomics::AtomicStore(&ring.ReadPos, (int32)(readPos + count));
+    Region->Notify(&ring.bWriterSleeping, Slot, ReadRing, SpaceBell);
+
+    BytesRead = count;
+    return true;
+}
+
+bool FSharedMemoryConnection::Send(const uint8* Data, int32 Count, int32& BytesSent)
+{
+    BytesSent = 0;
+    if (!IsOpen())
+    {
+        return false;
+    }
+
+    FRingControl& ring = Region->GetSlot(Slot).Rings[WriteRing];
+    uint32 writePos = (uint32)FPlatformAtomics::AtomicRead(&ring.WritePos);
+    uint32 count = FMath::Min<uint32>(FSharedMemoryTransportFormat::RingCapacity - GetUsed(ring), (uint32)FMath::Max(Count, 0));
+    if (count == 0)
+    {
+        return true;
+    }
+
+    CopyToRing(Region->GetRingData(Slot, WriteRing), writePos, Data, count);
+    FPlatformAtomics::AtomicStore(&ring.WritePos, (int32)(writePos + count));
+    Region->Notify(&ring.bReaderSleeping, Slot, WriteRing, DataBell);
+
+    BytesSent = count;
+    return true;
+}
+
+int32 FSharedMemoryConnection::GetPendingData() const
+{
+    return bClosed ? 0 : (int32)GetUsed(Region->GetSlot(Slot).Rings[ReadRing]);
+}
+
+bool FSharedMemoryConnection::WaitForRead(FTimespan WaitTime)
+{
+    if (bClosed)
+    {
+        return true;
+    }
+
+    FRingControl& ring = Region->GetSlot(Slot).Rings[ReadRing];
+    return Region->SleepUntil(&ring.bReaderSleeping, Slot, ReadRing, DataBell, WaitTime,
+        [this, &ring]() { return GetUsed(ring) > 0 || !IsOpen(); });
+}
+
+bool FSharedMemoryConnection::WaitForWrite(FTimespan WaitTime)
+{
+    if (bClosed)
+    {
+        return true;
+    }
+
+    FRingControl& ring = Region->GetSlot(Slot).Rings[WriteRing];
+    return Region->SleepUntil(&ring.bWriterSleeping, Slot, WriteRing, SpaceBell, WaitTime,
+        [this, &ring]() { return GetUsed(ring) < FSharedMemoryTransportFormat::RingCapacity || !IsOpen(); });
+}
+
+bool FSharedMemoryConnection::IsOpen()
+{
+    if (bClosed || bPeerGone || FPlatformAtomics::AtomicRead(&Region->GetSlot(Slot).State) != SlotOpen)
+    {
+        return false;
+    }
+
+    // a crashed peer never closes its side, so now and then ask the OS whether it still runs
+    int64 now = (int64)FPlatformTime::Cycles64();
+    if (now >= NextPeerCheck.GetValue())
+    {
+        NextPeerCheck.Set(now + (int64)(PeerCheckIntervalSeconds / FPlatformTime::GetSecondsPerCycle64()));
+        int32 peerId = bServer ? FPlatformAtomics::AtomicRead(&Region->GetSlot(Slot).ClientProcessId)
+            : FPlatformAtomics::AtomicRead(&Region->GetHeader().ServerProcessId);
+        if (!IsProcessRunning(peerId))
+        {
+            bPeerGone = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+void FSharedMemoryConnection::Close()
+{
+    if (bClosed.AtomicSet(true))
+    {
+        return;
+    }
+
+    // the second side to close, or the one left after its peer crashed, hands the slot back for the next client
+    FSlotControl& control = Region->GetSlot(Slot);
+    if (bPeerGone || FPlatformAtomics::InterlockedCompareExchange(&control.State, SlotClosed, SlotOpen) != SlotOpen)
+    {
+        FPlatformAtomics::AtomicStore(&control.State, SlotFree);
+    }
+
+    for (int32 ring = 0; ring < 2; ring++)
+    {
+        Region->Notify(&control.Rings[ring].bReaderSleeping, Slot, ring, DataBell);
+        Region->Notify(&control.Rings[ring].bWriterSleeping, Slot, ring, SpaceBell);
+    }
+}
+
+FSharedMemoryTransportFormat::ESlotState FSharedMemoryConnection::GetSlotState() const
+{
+    return (FSharedMemoryTransportFormat::ESlotState)FPlatformAtomics::AtomicRead(&Region->GetSlot(Slot).State);
+}
+
+#if WITH_DEV_AUTOMATION_TESTS
+void FSharedMemoryConnection::SetPeerProcessIdForTest(int32 ProcessId)
+{
+    FPlatformAtomics::AtomicStore(bServer ? &Region->GetSlot(Slot).ClientProcessId : &Region->GetHeader().ServerProcessId, ProcessId);
+    NextPeerCheck.Set(0);
+}
+#endif
+
+FSharedMemoryListener::~FSharedMemoryListener()
+{
+    Stop();
+}
+
+bool FSharedMemoryListener::Start(const FString& Name, int32 Port)
+{
+    Stop();
+
+    FString regionName = FSharedMemoryTransportFormat::GetRegionName(Name, Port);
+    TSharedRef<FSharedMemoryTransportRegion> region = MakeShared<FSharedMemoryTransportRegion>();
+    if (!region->Create(regionName))
+    {
+        UE_LOG(LogTemp, Error, TEXT("Could not create shared memory region %s"), *regionName);
+        return false;
+    }
+
+    Region = region;
+    return true;
+}
+
+void FSharedMemoryListener::Stop()
+{
+    Region.Reset();
+}
+
+TUniquePtr<FSharedMemoryConnection> FSharedMemoryListener::Accept()
+{
+    if (!Region)
+    {
+        return nullptr;
+    }
+
+    for (int32 slot = 0; slot < FSharedMemoryTransportFormat::SlotCount; slot++)
+    {
+        FSlotControl& control = Region->GetSlot(slot);
+        if (FPlatformAtomics::AtomicRead(&control.State) != SlotConnecting)
+        {
+            continue;
+        }
+
+        // a client that died while connecting would hold its slot for good
+        if (!IsProcessRunning(FPlatformAtomics::AtomicRead(&control.ClientProcessId)))
+        {
+            FPlatformAtomics::InterlockedCompareExchange(&control.State, SlotFree, SlotConnecting);
+            continue;
+        }
+
+        if (FPlatformAtomics::InterlockedCompareExchange(&control.State, SlotOpen, SlotConnecting) == SlotConnecting)
+        {
+            return MakeUnique<FSharedMemoryConnection>(Region.ToSharedRef(), slot, true);
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,227 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "TcpFrameCapture.h"
+#include "HAL/FileManager.h"
+#include "HAL/PlatformProcess.h"
+#include "HAL/Thread.h"
+#include "Misc/ScopeLock.h"
+#include "VoxelByteStream.h"
+
+FTcpFrameRecorder::FTcpFrameRecorder()
+{
+    PendingEvent = FPlatformProcess::GetSynchEventFromPool(false);
+}
+
+FTcpFrameRecorder::~FTcpFrameRecorder()
+{
+    Stop();
+    FPlatformProcess::ReturnSynchEventToPool(PendingEvent);
+    PendingEvent = nullptr;
+}
+
+bool FTcpFrameRecorder::Start(const FString& Path)
+{
+    Stop();
+
+    File.Reset(IFileManager::Get().CreateFileWriter(*Path));
+    if (!File)
+    {
+        UE_LOG(LogTemp, Error, TEXT("Could not create capture file %s"), *Path);
+        return false;
+    }
+
+    TArray<uint8> header;
+    FVoxelByteWriter writer(header);
+    writer.WriteUInt32LE(FTcpFrameCaptureFormat::Magic);
+    writer.WriteUInt32LE(FTcpFrameCaptureFormat::Version);
+    writer.WriteUInt64LE(FDateTime::UtcNow().ToUnixTimestamp());
+    File->Serialize(header.GetData(), header.Num());
+
+    FramesRecorded.Reset();
+    BytesRecorded.Set(header.Num());
+    bStopWriter = false;
+    WriterThread = MakeUnique<FThread>(TEXT("FTcpFrameRecorder"), [this]() { WriteLoop(); });
+
+    FScopeLock lock(&Lock);
+    Pending.Reset();
+    StartTime = FPlatformTime::Seconds();
+    LastMicros = 0;
+    bRecording = true;
+
+    UE_LOG(LogTemp, Log, TEXT("Capturing network frames to %s"), *Path);
+    return true;
+}
+
+void FTcpFrameRecorder::Stop()
+{
+    {
+        // records appended from here on are refused, everything before it is still written
+        FScopeLock lock(&Lock);
+        bRecording = false;
+    }
+
+    if (WriterThread)
+    {
+        bStopWriter = true;
+        PendingEvent->Trigger();
+        WriterThread->Join();
+        WriterThread.Reset();
+    }
+
+    if (File)
+    {
+        File->Close();
+        File.Reset();
+        UE_LOG(LogTemp, Log, TEXT("Network capture finished, %lld frames, %lld bytes"), FramesRecorded.GetValue(), BytesRecorded.GetValue());
+    }
+}
+
+void FTcpFrameRecorder::WriteLoop()
+{
+    while (true)
+    {
+        // read before taking the records, so the last pass after a stop gets everything appended before it
+        bool bStopping = bStopWriter;
+        {
+            FScopeLock lock(&Lock);
+            Swap(Writing, Pending);
+        }
+
+        if (Writing.Num() > 0)
+        {
+            File->Serialize(Writing.GetData(), Writing.Num());
+            Writing.Reset();
+        }
+
+        if (bStopping)
+        {
+            break;
+        }
+        PendingEvent->Wait(WriteIntervalMs);
+    }
+}
+
+void FTcpFrameRecorder::Record(int32 ConnectionId, ETcpFrameDirection Direction, TArrayView<const uint8> Payload)
+{
+    if (!bRecording)
+    {
+        return;
+    }
+
+    bool bWakeWriter = false;
+    {
+        FScopeLock lock(&Lock);
+        if (!bRecording)
+        {
+            return;
+        }
+
+        // the clock is read under the lock, so records are in time order whichever thread wrote them
+        uint64 micros = (uint64)((FPlatformTime::Seconds() - StartTime) * 1000000.0);
+        micros = FMath::Max(micros, LastMicros);
+
+        int32 recordStart = Pending.Num();
+        FVoxelByteWriter writer(Pending);
+        writer.WriteVarUInt64(micros - LastMicros);
+        writer.WriteUInt8((uint8)Direction);
+        writer.WriteVarUInt64((uint32)ConnectionId);
+        writer.WriteVarUInt64(Payload.Num());
+        writer.WriteBytes(Payload);
+        LastMicros = micros;
+
+        BytesRecorded.Add(Pending.Num() - recordStart);
+        bWakeWriter = recordStart < WakeWriterBytes && Pending.Num() >= WakeWriterBytes;
+    }
+    FramesRecorded.Increment();
+
+    if (bWakeWriter)
+    {
+        PendingEvent->Trigger();
+    }
+}
+
+bool FTcpFrameCaptureReader::Open(const FString& Path)
+{
+    Payload.Reset();
+    Position = 0;
+    Micros = 0;
+    bError = false;
+
+    File.Reset(IFileManager::Get().CreateFileReader(*Path));
+    if (!File)
+    {
+        UE_LOG(LogTemp, Error, TEXT("Could not read capture file %s"), *Path);
+        return false;
+    }
+    FileSize = File->TotalSize();
+
+    uint8 headerBytes[16];
+    bool bHeaderRead = FileSize >= (int64)sizeof(headerBytes);
+    if (bHeaderRead)
+    {
+        File->Serialize(headerBytes, sizeof(headerBytes));
+    }
+
+    FVoxelByteReader reader(TArrayView<const uint8>(headerBytes, bHeaderRead ? sizeof(headerBytes) : 0));
+    uint32 magic = reader.ReadUInt32LE();
+    uint32 version = reader.ReadUInt32LE();
+    reader.ReadUInt64LE();
+    if (reader.IsError() || File->IsError() || magic != FTcpFrameCaptureFormat::Magic || version != FTcpFrameCaptureFormat::Version)
+    {
+        UE_LOG(LogTemp, Error, TEXT("%s is not a capture this build can read"), *Path);
+        File.Reset();
+        return false;
+    }
+
+    Position = reader.Tell();
+    return true;
+}
+
+bool FTcpFrameCaptureReader::Next(FTcpCapturedFrame& OutFrame)
+{
+    if (bError || !File || Position >= FileSize)
+    {
+        return false;
+    }
+
+    // the record header is parsed from a peek at the bytes ahead, the payload is then read right after it
+    uint8 headerBytes[MaxRecordHeaderSize];
+    int32 peeked = (int32)FMath::Min<int64>(MaxRecordHeaderSize, FileSize - Position);
+    File->Seek(Position);
+    File->Serialize(headerBytes, peeked);
+
+    FVoxelByteReader reader(TArrayView<const uint8>(headerBytes, peeked));
+    uint64 delta = reader.ReadVarUInt64();
+    uint8 direction = reader.ReadUInt8();
+    uint64 connectionId = reader.ReadVarUInt64();
+    uint64 size = reader.ReadVarUInt64();
+    int64 payloadStart = Position + reader.Tell();
+    if (reader.IsError() || File->IsError() || direction > (uint8)ETcpFrameDirection::Outbound ||
+        size > (uint64)(FileSize - payloadStart) || size > (uint64)MAX_int32)
+    {
+        // a capture cut short by a crash still replays up to its last whole record
+        UE_LOG(LogTemp, Warning, TEXT("Capture ends in a truncated record at byte %lld"), Position);
+        bError = true;
+        return false;
+    }
+
+    Payload.SetNumUninitialized((int32)size);
+    File->Seek(payloadStart);
+    File->Serialize(Payload.GetData(), Payload.Num());
+    if (File->IsError())
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Could not read the capture record at byte %lld"), Position);
+        bError = true;
+        return false;
+    }
+
+    Micros += delta;
+    OutFrame.Time = Micros / 1000000.0;
+    OutFrame.ConnectionId = (int32)(uint32)connectionId;
+    OutFrame.Direction = (ETcpFrameDirection)direction;
+    OutFrame.Payload = Payload;
+
+    Position = payloadStart + size;
+    return true;
+}
@@ -0,0 +1,71 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "TcpReceiveBuffer.h"
+
+FTcpReceiveBuffer::FTcpReceiveBuffer(int32 InitialCapacity)
+{
+    Data.SetNumUninitialized(InitialCapacity);
+}
+
+uint8* FTcpReceiveBuffer::PrepareWrite(int32 MinBytes, int32& OutWritable)
+{
+    // everything was handed out, start over at the front
+    if (ReadPos == WritePos)
+    {
+        ReadPos = 0;
+        WritePos = 0;
+    }
+
+    if (Data.Num() - WritePos < MinBytes)
+    {
+        // move the unread tail (usually part of one frame) to the front
+        int32 unread = WritePos - ReadPos;
+        if (ReadPos > 0)
+        {
+            FMemory::Memmove(Data.GetData(), Data.GetData() + ReadPos, unread);
+            ReadPos = 0;
+            WritePos = unread;
+        }
+
+        // still not enough, grow geometrically so a big frame only reallocates a few times
+        if (Data.Num() - WritePos < MinBytes)
+        {
+            Data.SetNumUninitialized(FMath::Max(Data.Num() * 2, WritePos + MinBytes));
+        }
+    }
+
+    OutWritable = Data.Num() - WritePos;
+    return Data.GetData() + WritePos;
+}
+
+void FTcpReceiveBuffer::CommitWrite(int32 BytesWritten)
+{
+    check(BytesWritten >= 0 && WritePos + BytesWritten <= Data.Num());
+    WritePos += BytesWritten;
+}
+
+FTcpReceiveBuffer::EFrameResult FTcpReceiveBuffer::NextFrame(TArrayView<const uint8>& OutFrame)
+{
+    // header can arrive split over several reads
+    if (Num() < 4)
+    {
+        return EFrameResult::NeedMoreData;
+    }
+
+    const uint8* header = Data.GetData() + ReadPos;
+    uint32 frameSize = ((uint32)header[0] << 24) | ((uint32)header[1] << 16) | ((uint32)header[2] << 8) | (uint32)header[3];
+    if (frameSize > MaxFrameSize)
+    {
+        return EFrameResult::TooLarge;
+    }
+
+    if ((uint32)Num() - 4 < frameSize)
+    {
+        return EFrameResult::NeedMoreData;
+    }
+
+    OutFrame = TArrayView<const uint8>(header + 4, frameSize);
+    ReadPos += 4 + frameSize;
+    return EFrameResult::Frame;
+}
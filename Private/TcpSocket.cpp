@@ -7,6 +7,12 @@
 #include "IPAddress.h"
 #include "Sockets.h"
 #include "HAL/RunnableThread.h"
+#include "HAL/Thread.h"
+#include "TcpReceiveBuffer.h"
+#include "TcpFrameCapture.h"
+#include "SharedMemoryTransport.h"
+#include "VoxelByteStream.h"
+#include "VoxelWireSchema.h"
 #include "Async/Async.h"
 #include <string>
 #include "Logging/MessageLog.h"
@@ -15,6 +21,7 @@
 
 // Sets default values
 ATcpSocket::ATcpSocket()
+    : FrameRecorder(MakeShared<FTcpFrameRecorder, ESPMode::ThreadSafe>())
 {
     // Set this actor to call Tick() every frame.  You can turn this off to improve performance if you don't need it.
     PrimaryActorTick.bCanEverTick = true;
@@ -35,6 +42,7 @@ void ATcpSocket::Tick(float DeltaTime)
 void ATcpSocket::EndPlay(const EEndPlayReason::Type EndPlayReason)
 {
     Super::EndPlay(EndPlayReason);
+    StopCapture();
     TArray<int32> keys;
     TcpWorkers.GetKeys(keys);
 
@@ -52,11 +60,15 @@ void ATcpSocket::Connect(const FString& ipAddress, int32 port, const FTcpSocketD
     ConnectedDelegate = OnConnected;
     MessageReceivedDelegate = OnMessageReceived;
 
-    ConnectionId = TcpWorkers.Num();
+    ConnectionId = NextConnectionId++;
 
     TWeakObjectPtr<ATcpSocket> thisWeakObjPtr = TWeakObjectPtr<ATcpSocket>(this);
     TSharedRef<FTcpSocketWorker> worker(new FTcpSocketWorker(ipAddress, port, thisWeakObjPtr, ConnectionId,
-        ReceiveBufferSize, SendBufferSize, TimeBetweenTicks));
+        ReceiveBufferSize, SendBufferSize, MaxWaitTime));
+    worker->SetReceivedMessageHook(ReceivedMessageHook);
+    worker->SetReceiveBackpressureHook(ReceiveBackpressureHook);
+    worker->SetFrameRecorder(FrameRecorder);
+    worker->SetQueueLimits(InboxHighWatermark, InboxLowWatermark, OutboxHighWatermark, OutboxLowWatermark, OutboxMaxBytes);
     TcpWorkers.Add(ConnectionId, worker);
     worker->Start();
 }
@@ -73,13 +85,26 @@ void ATcpSocket::Disconnect(int32 ConnectionId)
 }
 
 bool ATcpSocket::SendData(int32 ConnectionId /*= 0*/, TArray<uint8> DataToSend)
+{
+    return QueueSend(ConnectionId, MoveTemp(DataToSend), false);
+}
+
+bool ATcpSocket::SendFrame(int32 ConnectionId, TArray<uint8> Frame)
+{
+    return QueueSend(ConnectionId, MoveTemp(Frame), true);
+}
+
+bool ATcpSocket::QueueSend(int32 ConnectionId, TArray<uint8>&& Message, bool bFramed)
 {
     if (TcpWorkers.Contains(ConnectionId))
     {
         if (TcpWorkers[ConnectionId]->isConnected())
         {
-            TcpWorkers[ConnectionId]->AddToOutbox(DataToSend);
-            return true;
+            if (TcpWorkers[ConnectionId]->AddToOutbox(MoveTemp(Message), bFramed))
+            {
+                return true;
+            }
+            UE_LOG(LogTemp, Warning, TEXT("Log: Socket %d outbox is full, message dropped"), ConnectionId);
         }
         else
         {
@@ -93,6 +118,15 @@ bool ATcpSocket::SendData(int32 ConnectionId /*= 0*/, TArray<uint8> DataToSend)
     return false;
 }
 
+TArray<uint8> ATcpSocket::AcquireSendBuffer(int32 ConnectionId)
+{
+    if (TcpWorkers.Contains(ConnectionId))
+    {
+        return TcpWorkers[ConnectionId]->AcquireSendBuffer();
+    }
+    return TArray<uint8>();
+}
+
 void ATcpSocket::ExecuteOnMessageReceived(int32 ConnectionId, TWeakObjectPtr<ATcpSocket> thisObj)
 {
     // the second check is for when we quit PIE, we may get a message about a disconnect, but it's too late to act on it, because the thread has already been killed
@@ -108,8 +142,15 @@ void ATcpSocket::ExecuteOnMessageReceived(int32 ConnectionId, TWeakObjectPtr<ATc
         return;
     }
 
-    TArray<uint8> msg = TcpWorkers[ConnectionId]->ReadFromInbox();
-    MessageReceivedDelegate.ExecuteIfBound(ConnectionId, msg);
+    // the delegate may disconnect, keep the worker alive until the drain is done
+    TSharedRef<FTcpSocketWorker> worker = TcpWorkers[ConnectionId];
+    worker->ClearInboxNotify();
+
+    TArray<uint8> msg;
+    while (worker->ReadFromInbox(msg))
+    {
+        MessageReceivedDelegate.ExecuteIfBound(ConnectionId, msg);
+    }
 }
 
 TArray<uint8> ATcpSocket::Concat_BytesBytes(TArray<uint8> A, TArray<uint8> B)
@@ -132,10 +173,8 @@ TArray<uint8> ATcpSocket::Concat_BytesBytes(TArray<uint8> A, TArray<uint8> B)
 TArray<uint8> ATcpSocket::Conv_IntToBytes(int32 InInt)
 {
     TArray<uint8> result;
-    for (int i = 0; i < 4; i++)
-    {
-        result.Add(InInt >> i * 8);
-    }
+    FVoxelByteWriter writer(result);
+    FVoxelWire::Write<FVoxelWire::ClientOrder>(writer, InInt);
     return result;
 }
 
@@ -185,16 +224,10 @@ int32 ATcpSocket::Message_ReadInt(TArray<uint8>& Message)
         return -1;
     }
 
-    uint32 result;
-    unsigned char byteArray[4];
-
-    for (int i = 3; i >= 0; i--)
-    {
-        byteArray[i] = Message[0];
-        Message.RemoveAt(0);
-    }
-
-    FMemory::Memcpy(&result, byteArray, 4);
+    FVoxelByteReader reader(Message);
+    int32 result;
+    FVoxelWire::Read<FVoxelWire::ServerOrder>(reader, result);
+    Message.RemoveAt(0, 4, false);
 
     return result;
 }
@@ -208,23 +241,21 @@ uint8 ATcpSocket::Message_ReadByte(TArray<uint8>& Message)
     }
 
     uint8 result = Message[0];
-    Message.RemoveAt(0);
+    Message.RemoveAt(0, 1, false);
     return result;
 }
 
 bool ATcpSocket::Message_ReadBytes(int32 NumBytes, TArray<uint8>& Message, TArray<uint8>& returnArray)
 {
-    for (int i = 0; i < NumBytes; i++)
+    // on a short message everything left is still consumed, as before
+    int32 available = FMath::Clamp(NumBytes, 0, Message.Num());
+    returnArray.Append(Message.GetData(), available);
+    Message.RemoveAt(0, available, false);
+
+    if (available < NumBytes)
     {
-        if (Message.Num() >= 1)
-        {
-            returnArray.Add(Message_ReadByte(Message));
-        }
-        else
-        {
-            UE_LOG(LogTemp, Log, TEXT("Log: amount read before failure: %d"), returnArray.Num());
-            return false;
-        }
+        UE_LOG(LogTemp, Log, TEXT("Log: amount read before failure: %d"), available);
+        return false;
     }
     return true;
 }
@@ -237,16 +268,9 @@ float ATcpSocket::Message_ReadFloat(TArray<uint8>& Message)
         return -1.f;
     }
 
-    float result;
-    unsigned char byteArray[4];
-
-    for (int i = 0; i < 4; i++)
-    {
-        byteArray[i] = Message[0];
-        Message.RemoveAt(0);
-    }
-
-    FMemory::Memcpy(&result, byteArray, 4);
+    FVoxelByteReader reader(Message);
+    float result = reader.ReadFloatLE();
+    Message.RemoveAt(0, 4, false);
 
     return result;
 }
@@ -265,19 +289,11 @@ FString ATcpSocket::Message_ReadString(TArray<uint8>& Message, int32 BytesLength
         return FString("");
     }
 
-    TArray<ANSICHAR> StringAsArray;
-    StringAsArray.Reserve(BytesLength);
-
-    for (int i = 0; i < BytesLength; i++)
-    {
-        StringAsArray.Add(Message[0]);
-        Message.RemoveAt(0);
-    }
-
-    TCHAR* dst = new TCHAR[BytesLength];
-    FUTF8ToTCHAR_Convert::Convert(dst, BytesLength, StringAsArray.GetData(), StringAsArray.Num());
+    FUTF8ToTCHAR converted(reinterpret_cast<const ANSICHAR*>(Message.GetData()), BytesLength);
+    FString result(converted.Length(), converted.Get());
+    Message.RemoveAt(0, BytesLength, false);
 
-    return FString(dst);
+    return result;
 }
 
 bool ATcpSocket::isConnected(int32 ConnectionId)
@@ -287,6 +303,43 @@ bool ATcpSocket::isConnected(int32 ConnectionId)
     return false;
 }
 
+bool ATcpSocket::GetConnectionStats(int32 ConnectionId, FTcpConnectionStats& OutStats)
+{
+    if (!TcpWorkers.Contains(ConnectionId))
+    {
+        return false;
+    }
+    OutStats = TcpWorkers[ConnectionId]->GetStats();
+    return true;
+}
+
+bool ATcpSocket::IsSendBackedUp(int32 ConnectionId)
+{
+    if (TcpWorkers.Contains(ConnectionId))
+    {
+        return TcpWorkers[ConnectionId]->IsSendBackedUp();
+    }
+    return false;
+}
+
+void ATcpSocket::ResumeReceiving(int32 ConnectionId)
+{
+    if (TcpWorkers.Contains(ConnectionId))
+    {
+        TcpWorkers[ConnectionId]->ResumeReceiving();
+    }
+}
+
+bool ATcpSocket::StartCapture(const FString& Path)
+{
+    return FrameRecorder->Start(Path);
+}
+
+void ATcpSocket::StopCapture()
+{
+    FrameRecorder->Stop();
+}
+
 void ATcpSocket::PrintToConsole(FString Str, bool Error)
 {
     // if (auto tcpSocketSettings = GetDefault<UTcpSocketSettings>())
@@ -332,16 +385,35 @@ bool FTcpSocketWorker::isConnected()
     return bConnected;
 }
 
+FTcpConnectionStats FTcpSocketWorker::GetStats() const
+{
+    FTcpConnectionStats stats;
+    stats.MessagesSent = MessagesSent.GetValue();
+    stats.BytesSent = BytesSent.GetValue();
+    stats.MessagesReceived = MessagesReceived.GetValue();
+    stats.BytesReceived = BytesReceived.GetValue();
+    stats.OutboxDepth = OutboxDepth.GetValue();
+    stats.OutboxBytes = OutboxBytes.GetValue();
+    stats.InboxDepth = InboxDepth.GetValue();
+    stats.InboxBytes = InboxBytes.GetValue();
+    stats.ReceivePauses = ReceivePauses.GetValue();
+    stats.bReceivePaused = bReceivePaused;
+    stats.SendsRejected = SendsRejected.GetValue();
+    return stats;
+}
+
 FTcpSocketWorker::FTcpSocketWorker(FString inIp, const int32 inPort, TWeakObjectPtr<ATcpSocket> InOwner, int32 inId,
-    int32 inRecvBufferSize, int32 inSendBufferSize, float inTimeBetweenTicks)
+    int32 inRecvBufferSize, int32 inSendBufferSize, float inMaxWaitTime)
     : ipAddress(inIp)
     , port(inPort)
     , ThreadSpawnerActor(InOwner)
     , id(inId)
     , RecvBufferSize(inRecvBufferSize)
     , SendBufferSize(inSendBufferSize)
-    , TimeBetweenTicks(inTimeBetweenTicks)
+    , MaxWaitTime(inMaxWaitTime)
 {
+    OutboxEvent = FPlatformProcess::GetSynchEventFromPool(false);
+    ResumeEvent = FPlatformProcess::GetSynchEventFromPool(false);
 }
 
 FTcpSocketWorker::~FTcpSocketWorker()
@@ -357,6 +429,10 @@ FTcpSocketWorker::~FTcpSocketWorker()
         delete Thread;
         Thread = nullptr;
     }
+    FPlatformProcess::ReturnSynchEventToPool(OutboxEvent);
+    OutboxEvent = nullptr;
+    FPlatformProcess::ReturnSynchEventToPool(ResumeEvent);
+    ResumeEvent = nullptr;
 }
 
 void FTcpSocketWorker::Start()
@@ -372,16 +448,103 @@ void FTcpSocketWorker::Start()
     UE_LOG(LogTemp, Log, TEXT("Log: Created thread"));
 }
 
-void FTcpSocketWorker::AddToOutbox(TArray<uint8> Message)
+void FTcpSocketWorker::SetQueueLimits(int32 InInboxHigh, int32 InInboxLow, int32 InOutboxHigh, int32 InOutboxLow, int32 InOutboxMax)
 {
-    Outbox.Enqueue(Message);
+    InboxHighWatermark = InInboxHigh;
+    InboxLowWatermark = FMath::Min(InInboxLow, InInboxHigh);
+    OutboxHighWatermark = InOutboxHigh;
+    OutboxLowWatermark = FMath::Min(InOutboxLow, InOutboxHigh);
+    OutboxMaxBytes = FMath::Max(InOutboxMax, InOutboxHigh);
 }
 
-TArray<uint8> FTcpSocketWorker::ReadFromInbox()
+bool FTcpSocketWorker::AddToOutbox(TArray<uint8> Message, bool bFramed)
 {
-    TArray<uint8> msg;
-    Inbox.Dequeue(msg);
-    return msg;
+    // the game thread must never block on the network, so past the hard limit messages are refused instead
+    if (OutboxBytes.GetValue() + Message.Num() > OutboxMaxBytes)
+    {
+        SendsRejected.Increment();
+        return false;
+    }
+
+    if (OutboxBytes.Add(Message.Num()) + Message.Num() >= OutboxHighWatermark)
+    {
+        bOutboxFull = true;
+    }
+    // recorded as frames like the inbound side, without the length the caller put in front
+    if (FrameRecorder && FrameRecorder->IsRecording())
+    {
+        TArrayView<const uint8> payload(Message);
+        if (bFramed && payload.Num() >= 4)
+        {
+            payload = payload.Slice(4, payload.Num() - 4);
+        }
+        FrameRecorder->Record(id, ETcpFrameDirection::Outbound, payload);
+    }
+
+    OutboxDepth.Increment();
+    Outbox.Enqueue(MoveTemp(Message));
+    OutboxEvent->Trigger();
+    return true;
+}
+
+void FTcpSocketWorker::ResumeReceiving()
+{
+    if (bReceivePaused)
+    {
+        ResumeEvent->Trigger();
+    }
+}
+
+bool FTcpSocketWorker::ShouldPauseReceiving()
+{
+    int64 inboxBytes = InboxBytes.GetValue();
+    if (inboxBytes >= InboxHighWatermark)
+    {
+        bInboxFull = true;
+    }
+    else if (inboxBytes <= InboxLowWatermark)
+    {
+        bInboxFull = false;
+    }
+    return bInboxFull || (ReceiveBackpressureHook && ReceiveBackpressureHook());
+}
+
+TArray<uint8> FTcpSocketWorker::AcquireSendBuffer()
+{
+    TArray<uint8> buffer;
+    if (FreeBuffers.Dequeue(buffer))
+    {
+        FreeBufferCount.Decrement();
+    }
+    return buffer;
+}
+
+void FTcpSocketWorker::RecycleSendBuffer(TArray<uint8>&& Buffer)
+{
+    // chunk sized buffers are not worth holding on to for the small messages we send
+    if (Buffer.Max() > MaxPooledBufferSize || FreeBufferCount.GetValue() >= MaxPooledBuffers)
+    {
+        return;
+    }
+
+    Buffer.Reset();
+    FreeBufferCount.Increment();
+    FreeBuffers.Enqueue(MoveTemp(Buffer));
+}
+
+bool FTcpSocketWorker::ReadFromInbox(TArray<uint8>& OutMessage)
+{
+    if (!Inbox.Dequeue(OutMessage))
+    {
+        return false;
+    }
+
+    InboxDepth.Decrement();
+    if (InboxBytes.Subtract(OutMessage.Num()) - OutMessage.Num() <= InboxLowWatermark)
+    {
+        ResumeReceiving();
+    }
+    return true;
 }
 
 bool FTcpSocketWorker::Init()
@@ -395,240 +558,189 @@ uint32 FTcpSocketWorker::Run()
 {
     AsyncTask(ENamedThreads::GameThread, []() { ATcpSocket::PrintToConsole("Starting Tcp socket thread.", false); });
 
-    uint32 message_size = 0;
-    uint32 data_read = 0;
-    TArray<uint8> receivedData;
-
-    while (bRun)
+    // Connect
+    FString sharedMemoryName;
+    if (FSharedMemoryTransportFormat::ParseHost(ipAddress, sharedMemoryName))
     {
-        FDateTime timeBeginningOfTick = FDateTime::UtcNow();
-
-        // Connect
-        if (!bConnected)
+        // a server on this machine, the same bytes go through a ring pair instead of the loopback stack
+        SharedMemory = FSharedMemoryConnection::Connect(sharedMemoryName, port, FTimespan::FromSeconds(SharedMemoryConnectTimeout));
+        bConnected = SharedMemory.IsValid();
+    }
+    else
+    {
+        Socket = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->CreateSocket(NAME_Stream, TEXT("default"), false);
+        if (!Socket)
         {
-            Socket = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->CreateSocket(NAME_Stream, TEXT("default"), false);
-            if (!Socket)
-            {
-                return 0;
-            }
+            return 0;
+        }
 
-            Socket->SetReceiveBufferSize(RecvBufferSize, ActualRecvBufferSize);
-            Socket->SetSendBufferSize(SendBufferSize, ActualSendBufferSize);
+        Socket->SetReceiveBufferSize(RecvBufferSize, ActualRecvBufferSize);
+        Socket->SetSendBufferSize(SendBufferSize, ActualSendBufferSize);
 
-            FIPv4Address ip;
-            FIPv4Address::Parse(ipAddress, ip);
+        FIPv4Address ip;
+        FIPv4Address::Parse(ipAddress, ip);
 
-            TSharedRef<FInternetAddr> internetAddr = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->
-                CreateInternetAddr();
-            internetAddr->SetIp(ip.Value);
-            internetAddr->SetPort(port);
+        TSharedRef<FInternetAddr> internetAddr = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->
+            CreateInternetAddr();
+        internetAddr->SetIp(ip.Value);
+        internetAddr->SetPort(port);
 
-            bConnected = Socket->Connect(*internetAddr);
-            if (bConnected)
+        bConnected = Socket->Connect(*internetAddr);
+    }
+    if (bConnected)
+    {
+        // the worker can be gone by the time the task runs, so it must not capture this
+        AsyncTask(ENamedThreads::GameThread, [workerId = id, owner = ThreadSpawnerActor]()
             {
-                AsyncTask(ENamedThreads::GameThread, [this]()
-                    {
-                        ThreadSpawnerActor.Get()->ExecuteOnConnected(id, ThreadSpawnerActor);
-                    });
+                if (owner.IsValid())
+                {
+                    owner->ExecuteOnConnected(workerId, owner);
+                }
+            });
+
+        // sending gets its own thread so a full send buffer never delays reading and the other way around
+        SendThread = MakeUnique<FThread>(*FString::Printf(TEXT("FTcpSocketWorker Send %s:%d"), *ipAddress, port),
+            [this]() { SendLoop(); });
+    }
+    else
+    {
+        AsyncTask(ENamedThreads::GameThread, []()
+            {
+                ATcpSocket::PrintToConsole(
+                    FString::Printf(
+                        TEXT("Couldn't connect to server. TcpSocketConnection.cpp: line %d"), __LINE__),
+                    true);
+            });
+        bRun = false;
+    }
+
+    FTcpReceiveBuffer receiveBuffer;
+    const FTimespan waitTime = FTimespan::FromSeconds(MaxWaitTime);
+
+    while (bRun)
+    {
+        // leave data in the socket while the game thread is behind, the full receive window makes the server wait
+        if (ShouldPauseReceiving())
+        {
+            if (!bReceivePaused.AtomicSet(true))
+            {
+                ReceivePauses.Increment();
             }
-            else
+            ResumeEvent->Wait(waitTime);
+            continue;
+        }
+        bReceivePaused = false;
+
+        // sleep until the server sends something, waking up now and then to see if we were stopped
+        if (SharedMemory ? !SharedMemory->WaitForRead(waitTime) : !Socket->Wait(ESocketWaitConditions::WaitForRead, waitTime))
+        {
+            if (Socket && Socket->GetConnectionState() == SCS_ConnectionError)
             {
-                AsyncTask(ENamedThreads::GameThread, []()
-                    {
-                        ATcpSocket::PrintToConsole(
-                            FString::Printf(
-                                TEXT("Couldn't connect to server. TcpSocketConnection.cpp: line %d"), __LINE__),
-                            true);
-                    });
                 bRun = false;
             }
             continue;
         }
 
-        if (!Socket)
+        // read everything that has arrived in one go, however many frames that is
+        uint32 PendingDataSize = 0;
+        if (SharedMemory)
         {
-            AsyncTask(ENamedThreads::GameThread, []()
-                {
-                    ATcpSocket::PrintToConsole(
-                        FString::Printf(TEXT("Socket is null. TcpSocketConnection.cpp: line %d"), __LINE__),
-                        true);
-                });
-            bRun = false;
-            continue;
+            PendingDataSize = SharedMemory->GetPendingData();
+        }
+        else
+        {
+            Socket->HasPendingData(PendingDataSize);
         }
+        int32 writable = 0;
+        uint8* writeTo = receiveBuffer.PrepareWrite(FMath::Max<int32>(PendingDataSize, MinReceiveSize), writable);
 
-        // check if we weren't disconnected from the socket
-        Socket->SetNonBlocking(true);
-        // set to NonBlocking, because Blocking can't check for a disconnect for some reason
-        int32 t_BytesRead;
-        uint8 t_Dummy;
-        if (!Socket->Recv(&t_Dummy, 1, t_BytesRead, ESocketReceiveFlags::Peek))
+        // readable with nothing to read means the server closed the connection
+        int32 BytesRead = 0;
+        if (SharedMemory ? !SharedMemory->Recv(writeTo, writable, BytesRead) : !Socket->Recv(writeTo, writable, BytesRead))
         {
             bRun = false;
             continue;
         }
-        Socket->SetNonBlocking(false); // set back to Blocking
+        receiveBuffer.CommitWrite(BytesRead);
 
-        // if Outbox has something to send, send it
-        while (!Outbox.IsEmpty())
+        //queue every complete message into the processing queue, a partial one stays in the buffer for the next read
+        TArrayView<const uint8> frame;
+        FTcpReceiveBuffer::EFrameResult result;
+        bool bQueuedAny = false;
+        while ((result = receiveBuffer.NextFrame(frame)) == FTcpReceiveBuffer::EFrameResult::Frame)
         {
-            TArray<uint8> toSend;
-            Outbox.Dequeue(toSend);
+            MessagesReceived.Increment();
+            BytesReceived.Add(frame.Num());
+            if (FrameRecorder)
+            {
+                FrameRecorder->Record(id, ETcpFrameDirection::Inbound, frame);
+            }
 
-            if (!BlockingSend(toSend.GetData(), toSend.Num()))
+            TArray<uint8> message(frame.GetData(), frame.Num());
+            if (ReceivedMessageHook && !ReceivedMessageHook(id, message))
             {
-                // if sending failed, stop running the thread
-                bRun = false;
-                UE_LOG(LogTemp, Log, TEXT("TCP send data failed !"));
                 continue;
             }
+
+            InboxDepth.Increment();
+            InboxBytes.Add(message.Num());
+            Inbox.Enqueue(MoveTemp(message));
+            bQueuedAny = true;
         }
 
-        if (bRun)
+        // one task drains everything queued, only post another once the game thread has started on the last one
+        if (bQueuedAny && !bInboxNotifyPending.AtomicSet(true))
         {
-            //Check if we need to pull header to message size
-            if (data_read == message_size)
-            {
-
-                //check if data in socket
-                    //break if not
-                uint32 PendingDataSize = 0;
-                if (Socket->HasPendingData(PendingDataSize))
-                {
-                    //pop message header for message size
-                    int32 BytesRead = 0;
-                    TArray<uint8> headerData;
-                    headerData.SetNumUninitialized(4);
-                    Socket->Recv(headerData.GetData(), 4, BytesRead);
-
-                    uint32 result;
-                    unsigned char byteArray[4];
-
-                    for (int i = 3; i >= 0; i--)
-                    {
-                        byteArray[i] = headerData[0];
-                        headerData.RemoveAt(0);
-                    }
-
-                    FMemory::Memcpy(&result, byteArray, 4);
-                    message_size = result;
-                    data_read = 0;
-                    receivedData.Empty();
-                }
-
-            }
-
-            //if there is data to pull for current message
-            if (data_read < message_size)
-            {
-                //pull data from socket
-                uint32 PendingDataSize = 0;
-                if (Socket->HasPendingData(PendingDataSize))
+            AsyncTask(ENamedThreads::GameThread, [workerId = id, owner = ThreadSpawnerActor]()
                 {
-
-                    uint32 dataLeftInMessage = message_size - data_read;
-                    uint32 dataSizeToGrab = FMath::Min<uint32>(PendingDataSize, dataLeftInMessage);
-                    receivedData.SetNumUninitialized(dataSizeToGrab + data_read);
-
-                    int32 BytesRead = 0;
-                    if (!Socket->Recv(receivedData.GetData() + data_read, dataSizeToGrab, BytesRead))
+                    if (owner.IsValid())
                     {
-                        AsyncTask(ENamedThreads::GameThread, []()
-                            {
-                                ATcpSocket::PrintToConsole(
-                                    FString::Printf(TEXT("In progress read failed. TcpSocketConnection.cpp: line %d"), __LINE__),
-                                    true);
-                            });
-                        UE_LOG(LogTemp, Log, TEXT("TCP read data failed !"));
-                        break;
+                        owner->ExecuteOnMessageReceived(workerId, owner);
                     }
-                    //take received data, convert to string, then read for debugging
-                    data_read = receivedData.Num();
-                }
-
-                //if message size == 0
-                //queue the message into the processing queue
-                if (message_size == data_read)
-                {
-                    Inbox.Enqueue(receivedData);
-                    AsyncTask(ENamedThreads::GameThread, [this]()
-                        {
-                            ThreadSpawnerActor.Get()->ExecuteOnMessageReceived(id, ThreadSpawnerActor);
-                        });
-                }
-            }
+                });
         }
 
-        // // if we can read something		
-        // uint32 PendingDataSize = 0;
-        // TArray<uint8> receivedData;
-        //
-        //
-        //
-        // int32 BytesReadTotal = 0;
-        // // keep going until we have no data.
-        // while (bRun)
-        // {
-        //     if (!Socket->HasPendingData(PendingDataSize))
-        //     {
-        //         // no messages
-        //         UE_LOG(LogTemp, Log, TEXT("TCP no more data after  !"));
-        //         break;
-        //     }
-        //
-        //     AsyncTask(ENamedThreads::GameThread, []() { ATcpSocket::PrintToConsole("Pending data", false); });
-        //
-        //     receivedData.SetNumUninitialized(BytesReadTotal + PendingDataSize);
-        //
-        //     int32 BytesRead = 0;
-        //     if (!Socket->Recv(receivedData.GetData() + BytesReadTotal, receivedData.Num(), BytesRead))
-        //     {
-        //         // ISocketSubsystem* SocketSubsystem = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM);
-        //         // error code: (int32)SocketSubsystem->GetLastErrorCode()
-        //         AsyncTask(ENamedThreads::GameThread, []()
-        //         {
-        //             ATcpSocket::PrintToConsole(
-        //                 FString::Printf(TEXT("In progress read failed. TcpSocketConnection.cpp: line %d"), __LINE__),
-        //                 true);
-        //         });
-        //         UE_LOG(LogTemp, Log, TEXT("TCP read data failed !"));
-        //         break;
-        //     }
-        //     BytesReadTotal += BytesRead;
-        //
-        //     /* TODO: if we have more PendingData than we could read, continue the while loop so that we can send messages if we have any, and then keep recving*/
-        // }
-        //
-        // // if we received data, inform the main thread about it, so it can read TQueue
-        // if (bRun && receivedData.Num() != 0)
-        // {
-        //     Inbox.Enqueue(receivedData);
-        //     AsyncTask(ENamedThreads::GameThread, [this]()
-        //     {
-        //         ThreadSpawnerActor.Get()->ExecuteOnMessageReceived(id, ThreadSpawnerActor);
-        //     });
-        // }
-
-        /* In order to sleep, we will account for how much this tick took due to sending and receiving */
-        FDateTime timeEndOfTick = FDateTime::UtcNow();
-        FTimespan tickDuration = timeEndOfTick - timeBeginningOfTick;
-        float secondsThisTickTook = tickDuration.GetTotalSeconds();
-        float timeToSleep = TimeBetweenTicks - secondsThisTickTook;
-        if (timeToSleep > 0.f)
+        if (result == FTcpReceiveBuffer::EFrameResult::TooLarge)
         {
-            //AsyncTask(ENamedThreads::GameThread, [timeToSleep]() { ATcpSocket::PrintToConsole(FString::Printf(TEXT("Sleeping: %f seconds"), timeToSleep), false); });
-            FPlatformProcess::Sleep(timeToSleep);
+            AsyncTask(ENamedThreads::GameThread, []()
+                {
+                    ATcpSocket::PrintToConsole(
+                        FString::Printf(TEXT("Frame larger than the limit, stream is corrupt. TcpSocketConnection.cpp: line %d"), __LINE__),
+                        true);
+                });
+            UE_LOG(LogTemp, Log, TEXT("TCP frame too large !"));
+            bRun = false;
         }
     }
 
     bConnected = false;
+    bRun = false;
 
-    AsyncTask(ENamedThreads::GameThread, [this]()
+    AsyncTask(ENamedThreads::GameThread, [workerId = id, owner = ThreadSpawnerActor]()
         {
-            ThreadSpawnerActor.Get()->ExecuteOnDisconnected(id, ThreadSpawnerActor);
+            if (owner.IsValid())
+            {
+                owner->ExecuteOnDisconnected(workerId, owner);
+            }
         });
 
-    SocketShutdown();
+    // closing the socket unblocks a send in progress, then the send thread sees bRun is false.
+    // a shared memory send gives up by itself, and has to be done before the slot goes back to the server.
+    if (!SharedMemory)
+    {
+        SocketShutdown();
+    }
+    if (SendThread)
+    {
+        OutboxEvent->Trigger();
+        SendThread->Join();
+        SendThread.Reset();
+    }
+    if (SharedMemory)
+    {
+        SocketShutdown();
+        SharedMemory.Reset();
+    }
     if (Socket)
     {
         delete Socket;
@@ -638,9 +750,69 @@ uint32 FTcpSocketWorker::Run()
     return 0;
 }
 
+void FTcpSocketWorker::SendLoop()
+{
+    // everything queued since the last wakeup is gathered here and sent with one write, kept between wakeups so it never reallocates
+    TArray<uint8> coalesced;
+    coalesced.Reserve(MaxCoalescedSize);
+
+    auto sendCoalesced = [this, &coalesced]()
+        {
+            if (coalesced.Num() > 0 && bRun && !BlockingSend(coalesced.GetData(), coalesced.Num()))
+            {
+                // if sending failed, stop the worker
+                bRun = false;
+                UE_LOG(LogTemp, Log, TEXT("TCP send data failed !"));
+            }
+            coalesced.Reset();
+        };
+
+    while (bRun)
+    {
+        OutboxEvent->Wait();
+
+        // if Outbox has something to send, send it
+        TArray<uint8> toSend;
+        while (bRun && Outbox.Dequeue(toSend))
+        {
+            OutboxDepth.Decrement();
+            if (OutboxBytes.Subtract(toSend.Num()) - toSend.Num() <= OutboxLowWatermark)
+            {
+                bOutboxFull = false;
+            }
+            MessagesSent.Increment();
+            BytesSent.Add(toSend.Num());
+
+            if (toSend.Num() >= MaxCoalescedSize)
+            {
+                // keep message order, then send the big one straight from its own buffer
+                sendCoalesced();
+                if (bRun && !BlockingSend(toSend.GetData(), toSend.Num()))
+                {
+                    bRun = false;
+                    UE_LOG(LogTemp, Log, TEXT("TCP send data failed !"));
+                }
+            }
+            else
+            {
+                if (coalesced.Num() + toSend.Num() > MaxCoalescedSize)
+                {
+                    sendCoalesced();
+                }
+                coalesced.Append(toSend);
+            }
+            RecycleSendBuffer(MoveTemp(toSend));
+        }
+
+        sendCoalesced();
+    }
+}
+
 void FTcpSocketWorker::Stop()
 {
     bRun = false;
+    OutboxEvent->Trigger();
+    ResumeEvent->Trigger();
 }
 
 void FTcpSocketWorker::Exit()
@@ -649,13 +821,42 @@ void FTcpSocketWorker::Exit()
 
 bool FTcpSocketWorker::BlockingSend(const uint8* Data, int32 BytesToSend)
 {
-    if (BytesToSend > 0)
+    if (SharedMemory)
+    {
+        // the ring takes what fits, the rest waits for the server to read
+        const FTimespan waitTime = FTimespan::FromSeconds(MaxWaitTime);
+        while (BytesToSend > 0)
+        {
+            int32 bytesSent = 0;
+            if (!SharedMemory->Send(Data, BytesToSend, bytesSent))
+            {
+                return false;
+            }
+            if (bytesSent == 0)
+            {
+                if (!bRun)
+                {
+                    return false;
+                }
+                SharedMemory->WaitForWrite(waitTime);
+                continue;
+            }
+            Data += bytesSent;
+            BytesToSend -= bytesSent;
+        }
+        return true;
+    }
+
+    // Send may take only part of the data when the socket's send buffer is full
+    while (BytesToSend > 0)
     {
         int32 BytesSent = 0;
         if (!Socket->Send(Data, BytesToSend, BytesSent))
         {
             return false;
         }
+        Data += BytesSent;
+        BytesToSend -= BytesSent;
     }
     return true;
 }
@@ -667,4 +868,8 @@ void FTcpSocketWorker::SocketShutdown()
     {
         Socket->Close();
     }
+    if (SharedMemory)
+    {
+        SharedMemory->Close();
+    }
 }
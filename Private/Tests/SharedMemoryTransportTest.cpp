@@ -0,0 +1,161 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "CoreMinimal.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+#include "HAL/PlatformProcess.h"
+#include "HAL/Thread.h"
+#include "SharedMemoryTransport.h"
+
+namespace
+{
+    const TCHAR* TransportTestName = TEXT("VoxelTransportTest");
+    constexpr int32 TransportTestPort = 1;
+
+    constexpr uint32 RingCapacity = FSharedMemoryTransportFormat::RingCapacity;
+
+    // Connect blocks until the server accepts, so it runs on its own thread while this one accepts
+    bool ConnectPair(FSharedMemoryListener& Listener, TUniquePtr<FSharedMemoryConnection>& OutClient, TUniquePtr<FSharedMemoryConnection>& OutServer)
+    {
+        OutClient.Reset();
+        OutServer.Reset();
+        FThread connectThread(TEXT("SharedMemoryTransportTest"), [&OutClient]()
+            {
+                OutClient = FSharedMemoryConnection::Connect(TransportTestName, TransportTestPort, FTimespan::FromSeconds(5));
+            });
+
+        double deadline = FPlatformTime::Seconds() + 5.0;
+        while (!OutServer && FPlatformTime::Seconds() < deadline)
+        {
+            OutServer = Listener.Accept();
+            if (!OutServer)
+            {
+                FPlatformProcess::Sleep(0.001f);
+            }
+        }
+        connectThread.Join();
+        return OutClient.IsValid() && OutServer.IsValid();
+    }
+
+    // a process id nothing runs as, counting down from the top where the OS hands them out last
+    int32 FindDeadProcessId()
+    {
+        int32 processId = MAX_int32 - 1;
+        while (FPlatformProcess::IsApplicationRunning((uint32)processId))
+        {
+            processId--;
+        }
+        return processId;
+    }
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FSharedMemoryTransportTest, "VoxelGame.Network.SharedMemory.Transport",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::ProductFilter)
+
+bool FSharedMemoryTransportTest::RunTest(const FString& Parameters)
+{
+    FSharedMemoryListener listener;
+    if (!TestTrue(TEXT("Listener creates its region"), listener.Start(TransportTestName, TransportTestPort)))
+    {
+        return false;
+    }
+    TestFalse(TEXT("Nothing to accept before a client connects"), listener.Accept().IsValid());
+
+    // Free to Claimed to Connecting, and back to Free when nobody accepts in time
+    TUniquePtr<FSharedMemoryConnection> unanswered = FSharedMemoryConnection::Connect(TransportTestName, TransportTestPort, FTimespan::FromMilliseconds(20));
+    TestFalse(TEXT("Connect gives up when the server does not accept"), unanswered.IsValid());
+
+    // Connecting to Open, in the slot the unanswered client handed back
+    TUniquePtr<FSharedMemoryConnection> client;
+    TUniquePtr<FSharedMemoryConnection> server;
+    if (!TestTrue(TEXT("Client and server connect"), ConnectPair(listener, client, server)))
+    {
+        return false;
+    }
+    TestEqual(TEXT("The slot of the timed out connect is free again"), client->GetSlot(), 0);
+    TestEqual(TEXT("Both sides share the slot"), server->GetSlot(), client->GetSlot());
+    TestTrue(TEXT("Accepted slot is Open"), client->GetSlotState() == FSharedMemoryTransportFormat::SlotOpen);
+
+    // one frame several rings long, written in the pieces that fit and read in sizes that never line up with the ring
+    TArray<uint8> frame;
+    frame.SetNumUninitialized(3 * RingCapacity + 12345);
+    for (int32 i = 0; i < frame.Num(); i++)
+    {
+        frame[i] = (uint8)(i * 31 + 7);
+    }
+
+    int32 sent = 0;
+    TestTrue(TEXT("Send into an empty ring"), client->Send(frame.GetData(), frame.Num(), sent));
+    TestEqual(TEXT("A frame larger than the free space takes what fits"), sent, (int32)RingCapacity);
+    TestEqual(TEXT("Everything sent is pending on the other side"), server->GetPendingData(), (int32)RingCapacity);
+
+    int32 sentNow = 0;
+    TestTrue(TEXT("Send into a full ring is not an error"), client->Send(frame.GetData() + sent, frame.Num() - sent, sentNow));
+    TestEqual(TEXT("A full ring takes nothing"), sentNow, 0);
+    TestFalse(TEXT("Writer waits while the ring is full"), client->WaitForWrite(FTimespan::FromMilliseconds(1)));
+
+    TArray<uint8> received;
+    TArray<uint8> buffer;
+    buffer.SetNumUninitialized(65521);
+    int32 read = 0;
+    TestTrue(TEXT("Recv from a full ring"), server->Recv(buffer.GetData(), buffer.Num(), read));
+    received.Append(buffer.GetData(), read);
+    TestTrue(TEXT("Writer wakes once there is space"), client->WaitForWrite(FTimespan::FromMilliseconds(100)));
+
+    while (received.Num() < frame.Num())
+    {
+        sentNow = 0;
+        if (sent < frame.Num() && client->Send(frame.GetData() + sent, FMath::Min(frame.Num() - sent, 700001), sentNow))
+        {
+            sent += sentNow;
+        }
+        if (!server->Recv(buffer.GetData(), buffer.Num(), read) || (read == 0 && sentNow == 0))
+        {
+            break;
+        }
+        received.Append(buffer.GetData(), read);
+    }
+    TestTrue(TEXT("Bytes come out in order across every wrap of the ring"), received == frame);
+
+    // Open to Closed to Free, the peer still reads what was sent before the close
+    uint8 last[3] = { 1, 2, 3 };
+    client->Send(last, 3, sent);
+    client->Close();
+    TestTrue(TEXT("First close leaves the slot Closed"), client->GetSlotState() == FSharedMemoryTransportFormat::SlotClosed);
+    TestFalse(TEXT("Server sees the close"), server->IsOpen());
+    TestTrue(TEXT("Bytes sent before the close are still read"), server->Recv(buffer.GetData(), buffer.Num(), read) && read == 3);
+    TestFalse(TEXT("Recv fails once they are read"), server->Recv(buffer.GetData(), buffer.Num(), read));
+    server->Close();
+    TestTrue(TEXT("Second close hands the slot back"), server->GetSlotState() == FSharedMemoryTransportFormat::SlotFree);
+
+    if (!TestTrue(TEXT("A closed slot is used again"), ConnectPair(listener, client, server)))
+    {
+        return false;
+    }
+    TestEqual(TEXT("The next client gets the freed slot"), client->GetSlot(), 0);
+
+    // a client that dies never closes, the server finds out from the OS and frees the slot on its own
+    int32 deadProcessId = FindDeadProcessId();
+    server->SetPeerProcessIdForTest(deadProcessId);
+    TestFalse(TEXT("Server notices its client died"), server->IsOpen());
+    TestFalse(TEXT("Recv fails once the client died"), server->Recv(buffer.GetData(), buffer.Num(), read));
+    server->Close();
+    TestTrue(TEXT("Closing after the client died frees the slot"), server->GetSlotState() == FSharedMemoryTransportFormat::SlotFree);
+    client->Close();
+
+    // and a client notices its server died, new clients no longer connect to what it left behind
+    if (TestTrue(TEXT("Connect after a dead client"), ConnectPair(listener, client, server)))
+    {
+        client->SetPeerProcessIdForTest(deadProcessId);
+        TestFalse(TEXT("Client notices its server died"), client->IsOpen());
+        TestFalse(TEXT("Region of a dead server is not connected to"),
+            FSharedMemoryConnection::Connect(TransportTestName, TransportTestPort, FTimespan::FromMilliseconds(20)).IsValid());
+    }
+
+    return true;
+}
+
+#endif
@@ -0,0 +1,132 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "CoreMinimal.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+#include "HAL/FileManager.h"
+#include "HAL/Thread.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "TcpFrameCapture.h"
+
+namespace
+{
+    constexpr int32 FramesPerConnection = 2000;
+
+    // sizes from empty to several times the writer's wake threshold, so some records go out early and some on the interval
+    int32 GetFrameSize(int32 Index)
+    {
+        return (Index * 7919) % 4096 + (Index % 500 == 0 ? 600 * 1024 : 0);
+    }
+
+    TArray<uint8> MakeFrame(int32 ConnectionId, int32 Index)
+    {
+        TArray<uint8> frame;
+        frame.SetNumUninitialized(GetFrameSize(Index));
+        for (int32 i = 0; i < frame.Num(); i++)
+        {
+            frame[i] = (uint8)(ConnectionId * 131 + Index * 31 + i);
+        }
+        return frame;
+    }
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTcpFrameCaptureTest, "VoxelGame.Network.FrameCapture",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::ProductFilter)
+
+bool FTcpFrameCaptureTest::RunTest(const FString& Parameters)
+{
+    FString path = FPaths::Combine(FPaths::AutomationTransientDir(), TEXT("FrameCaptureTest.tcap"));
+    FString truncatedPath = FPaths::Combine(FPaths::AutomationTransientDir(), TEXT("FrameCaptureTestTruncated.tcap"));
+
+    // two socket threads recording at once while the writer thread drains them
+    FTcpFrameRecorder recorder;
+    if (!TestTrue(TEXT("Capture file is created"), recorder.Start(path)))
+    {
+        return false;
+    }
+
+    auto recordFrames = [&recorder](int32 ConnectionId)
+    {
+        for (int32 index = 0; index < FramesPerConnection; index++)
+        {
+            ETcpFrameDirection direction = index % 3 == 0 ? ETcpFrameDirection::Outbound : ETcpFrameDirection::Inbound;
+            recorder.Record(ConnectionId, direction, MakeFrame(ConnectionId, index));
+        }
+    };
+    FThread firstSocket(TEXT("FrameCaptureTest 1"), [&recordFrames]() { recordFrames(1); });
+    FThread secondSocket(TEXT("FrameCaptureTest 2"), [&recordFrames]() { recordFrames(2); });
+    firstSocket.Join();
+    secondSocket.Join();
+    recorder.Stop();
+    TestEqual(TEXT("Every frame is counted"), recorder.GetFramesRecorded(), (int64)(2 * FramesPerConnection));
+    TestEqual(TEXT("Every byte counted is in the file"), IFileManager::Get().FileSize(*path), recorder.GetBytesRecorded());
+
+    // the reader gets back what each thread recorded, in its order, and the records in time order.
+    // Readers are scoped so their files are closed before the files are deleted.
+    {
+        FTcpFrameCaptureReader reader;
+        if (!TestTrue(TEXT("Capture file opens"), reader.Open(path)))
+        {
+            return false;
+        }
+
+        int32 nextIndex[3] = { 0, 0, 0 };
+        int32 frames = 0;
+        double lastTime = 0.0;
+        bool bFramesMatch = true;
+        bool bInTimeOrder = true;
+        FTcpCapturedFrame frame;
+        while (reader.Next(frame))
+        {
+            frames++;
+            if (frame.ConnectionId != 1 && frame.ConnectionId != 2)
+            {
+                bFramesMatch = false;
+                break;
+            }
+
+            int32 index = nextIndex[frame.ConnectionId]++;
+            ETcpFrameDirection direction = index % 3 == 0 ? ETcpFrameDirection::Outbound : ETcpFrameDirection::Inbound;
+            TArray<uint8> expected = MakeFrame(frame.ConnectionId, index);
+            bFramesMatch &= frame.Direction == direction && frame.Payload.Num() == expected.Num() &&
+                FMemory::Memcmp(frame.Payload.GetData(), expected.GetData(), expected.Num()) == 0;
+            bInTimeOrder &= frame.Time >= lastTime;
+            lastTime = frame.Time;
+        }
+        TestFalse(TEXT("A whole capture reads to its end"), reader.IsError());
+        TestEqual(TEXT("Every frame is read back"), frames, 2 * FramesPerConnection);
+        TestTrue(TEXT("Frames read back are the frames recorded, per connection in order"), bFramesMatch);
+        TestTrue(TEXT("Records are in time order"), bInTimeOrder);
+    }
+
+    // a capture cut off in its last record, as a crash leaves it, replays up to that record and reports it
+    TArray<uint8> bytes;
+    if (TestTrue(TEXT("Capture file loads"), FFileHelper::LoadFileToArray(bytes, *path)))
+    {
+        bytes.SetNum(bytes.Num() - 1);
+        FFileHelper::SaveArrayToFile(bytes, *truncatedPath);
+
+        FTcpFrameCaptureReader truncatedReader;
+        int32 frames = 0;
+        FTcpCapturedFrame frame;
+        if (TestTrue(TEXT("Truncated capture opens"), truncatedReader.Open(truncatedPath)))
+        {
+            while (truncatedReader.Next(frame))
+            {
+                frames++;
+            }
+            TestEqual(TEXT("Every whole record is read"), frames, 2 * FramesPerConnection - 1);
+            TestTrue(TEXT("The truncated record is reported"), truncatedReader.IsError());
+        }
+    }
+
+    IFileManager::Get().Delete(*path);
+    IFileManager::Get().Delete(*truncatedPath);
+    return true;
+}
+
+#endif
@@ -0,0 +1,109 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "CoreMinimal.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+#include "MarchingCubesUtil.h"
+#include "VGridComponent.h"
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FVGridComponentPublishListTest, "VoxelGame.Storage.PublishChunkList",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::ProductFilter)
+
+bool FVGridComponentPublishListTest::RunTest(const FString& Parameters)
+{
+    const int32 chunkResolution = 4;
+    const int32 voxelResPerChunk = 32;
+
+    UVGridComponent* storage = NewObject<UVGridComponent>();
+    storage->InitStorage(NewObject<UMarchingCubesUtil>(), chunkResolution, voxelResPerChunk);
+
+    TArray<uint8> densities;
+    TArray<uint8> materials;
+    densities.Init(200, voxelResPerChunk * voxelResPerChunk * voxelResPerChunk);
+    materials.Init((uint8)EVoxelType::Ground, densities.Num());
+
+    // a whole chunk list published before one redraw, the map grows several times on the way
+    TArray<FIntVector> published;
+    for (int32 z = 0; z < 2; z++)
+    {
+        for (int32 y = 0; y < 2; y++)
+        {
+            for (int32 x = 0; x < 3; x++)
+            {
+                FChunk chunk;
+                uint32 dataHash = 0;
+                FIntVector coords(x, y, z);
+                if (TestTrue(TEXT("Chunk builds"), UVGridComponent::BuildChunk(coords, densities, materials, chunk, dataHash)))
+                {
+                    TestTrue(TEXT("Chunk publishes"), storage->PublishChunk(MoveTemp(chunk), dataHash));
+                    published.Add(coords);
+                }
+            }
+        }
+    }
+
+    for (const FIntVector& coords : published)
+    {
+        TestTrue(*FString::Printf(TEXT("Chunk %d %d %d is queued for redraw"), coords.X, coords.Y, coords.Z),
+            storage->changedChunksSet.Contains(storage->getChunkId(coords.X, coords.Y, coords.Z)));
+    }
+
+    // what the redraw reads has to be the stored chunk, wherever the map moved it
+    for (uint32 chunkId : storage->changedChunksSet)
+    {
+        FChunk* chunk = storage->getChunk(chunkId);
+        if (TestNotNull(TEXT("Changed chunk is stored"), chunk))
+        {
+            TestEqual(TEXT("Changed chunk id matches its offset"), (int64)storage->getChunkId(chunk->offset.X, chunk->offset.Y, chunk->offset.Z), (int64)chunkId);
+        }
+    }
+
+    return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FVGridComponentContentHashTest, "VoxelGame.Storage.ContentHash",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::ProductFilter)
+
+bool FVGridComponentContentHashTest::RunTest(const FString& Parameters)
+{
+    const int32 chunkResolution = 4;
+    const int32 voxelResPerChunk = 32;
+
+    UVGridComponent* storage = NewObject<UVGridComponent>();
+    storage->InitStorage(NewObject<UMarchingCubesUtil>(), chunkResolution, voxelResPerChunk);
+
+    TArray<uint8> densities;
+    TArray<uint8> materials;
+    densities.Init(200, voxelResPerChunk * voxelResPerChunk * voxelResPerChunk);
+    materials.Init((uint8)EVoxelType::Ground, densities.Num());
+    storage->SetChunk(0, 0, 0, densities, materials);
+
+    uint32 chunkId = storage->getChunkId(0, 0, 0);
+    uint32 publishedHash = storage->getContentHash(chunkId);
+
+    // an edit changes the hash, undoing it gives back the hash of the data it started from
+    storage->SetPoint(5, 5, 5, FPoint(EVoxelType::Ground, 10));
+    uint32 editedHash = storage->getContentHash(chunkId);
+    TestNotEqual(TEXT("Edited chunk hashes differently"), editedHash, publishedHash);
+
+    storage->SetPoint(5, 5, 5, FPoint(EVoxelType::Ground, 200));
+    TestEqual(TEXT("Undone edit hashes like the published chunk"), storage->getContentHash(chunkId), publishedHash);
+
+    // the same data reached by an edit and by publishing it hashes the same
+    storage->SetPoint(5, 5, 5, FPoint(EVoxelType::Ground, 10));
+    TArray<uint8> editedDensities;
+    TArray<uint8> editedMaterials;
+    storage->GetChunkData(0, 0, 0, editedDensities, editedMaterials);
+
+    UVGridComponent* republished = NewObject<UVGridComponent>();
+    republished->InitStorage(NewObject<UMarchingCubesUtil>(), chunkResolution, voxelResPerChunk);
+    republished->SetChunk(0, 0, 0, editedDensities, editedMaterials);
+    TestEqual(TEXT("Edited and published data hash the same"), republished->getContentHash(chunkId), storage->getContentHash(chunkId));
+
+    return true;
+}
+
+#endif
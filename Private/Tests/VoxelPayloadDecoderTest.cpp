@@ -0,0 +1,87 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "CoreMinimal.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+#include "VGridComponent.h"
+#include "VoxelChunkCache.h"
+#include "VoxelPayloadDecoder.h"
+
+namespace
+{
+    constexpr int32 DecoderTestStride = 4;
+    constexpr int32 DecoderTestChunkSize = 32;
+
+    // a ChunkDelta message as the server frames it, without the length prefix the socket strips
+    TArray<uint8> MakeDeltaMessage(const FIntVector& Chunk, uint32 Version, const TArray<FNetDiff>& Diffs)
+    {
+        FNetChunkDelta delta;
+        delta.x = Chunk.X;
+        delta.y = Chunk.Y;
+        delta.z = Chunk.Z;
+        delta.version = Version;
+        delta.diffs.list = Diffs;
+
+        TArray<uint8> message;
+        FVoxelByteWriter writer(message);
+        writer.WriteUInt8((uint8)EPayloadType::ChunkDelta);
+        delta.WriteFields<FVoxelWire::ServerOrder>(writer);
+        delta.diffs.WriteFields<FVoxelWire::ServerOrder>(writer);
+        return message;
+    }
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FVoxelPayloadDecoderDeltaTest, "VoxelGame.Network.Decoder.DeltaChunkId",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::ProductFilter)
+
+bool FVoxelPayloadDecoderDeltaTest::RunTest(const FString& Parameters)
+{
+    TSharedRef<FVoxelChunkCache, ESPMode::ThreadSafe> cache = MakeShared<FVoxelChunkCache, ESPMode::ThreadSafe>();
+    FVoxelPayloadDecoder decoder(cache);
+    decoder.SetChunkIdStride(DecoderTestStride);
+
+    TArray<uint8> densities;
+    TArray<uint8> materials;
+    densities.Init(200, DecoderTestChunkSize * DecoderTestChunkSize * DecoderTestChunkSize);
+    materials.Init((uint8)EVoxelType::Ground, densities.Num());
+
+    FIntVector chunk(1, 2, 3);
+    uint32 chunkId = chunk.X + chunk.Y * DecoderTestStride + chunk.Z * DecoderTestStride * DecoderTestStride;
+    cache->Put(chunk, 1, materials, densities);
+
+    // a diff numbered for a neighbour would land at the same position in this chunk
+    TArray<FNetDiff> diffs;
+    diffs.Add(FNetDiff(chunkId, 1, 2, 3, 10, (uint8)EVoxelType::Ground));
+    diffs.Add(FNetDiff(chunkId + 1, 4, 5, 6, 10, (uint8)EVoxelType::Ground));
+    TArray<uint8> message = MakeDeltaMessage(chunk, 3, diffs);
+    TestTrue(TEXT("Delta is decoded"), decoder.Decode(message, 1));
+
+    FVoxelDecodedPayload payload;
+    if (TestTrue(TEXT("Delta with a foreign diff is queued"), decoder.Dequeue(payload)))
+    {
+        TestTrue(TEXT("Delta with a foreign diff is dropped"), payload.Type == EVoxelDecodedPayloadType::Dropped);
+        TestEqual(TEXT("Dropped delta still returns its credit"), payload.CreditBytes, message.Num());
+    }
+    TestEqual(TEXT("Cached copy survives the dropped delta"), (int64)cache->GetVersion(chunk), (int64)1);
+
+    // the same delta with every diff for its own chunk restores the cached copy
+    diffs[1].chunk_id = chunkId;
+    message = MakeDeltaMessage(chunk, 3, diffs);
+    TestTrue(TEXT("Delta is decoded"), decoder.Decode(message, 1));
+    if (TestTrue(TEXT("Matching delta is queued"), decoder.Dequeue(payload)))
+    {
+        TestTrue(TEXT("Matching delta restores the chunk"), payload.Type == EVoxelDecodedPayloadType::Chunks && payload.Chunks.Num() == 1);
+        if (payload.Chunks.Num() == 1)
+        {
+            TestEqual(TEXT("Restored chunk has the delta version"), (int64)payload.Chunks[0].Version, (int64)3);
+        }
+    }
+    TestEqual(TEXT("Restoring takes the cached copy"), (int64)cache->GetVersion(chunk), (int64)0);
+
+    return true;
+}
+
+#endif
@@ -0,0 +1,387 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "CoreMinimal.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+#include "Async/TaskGraphInterfaces.h"
+#include "Engine/Engine.h"
+#include "Engine/World.h"
+#include "HAL/PlatformProcess.h"
+#include "VGridComponent.h"
+#include "VoxelChunkCache.h"
+#include "VoxelManager.h"
+#include "VoxelPayloadDecoder.h"
+#include "VoxelStandInServer.h"
+#include "VoxelTcpSocket.h"
+
+namespace
+{
+    constexpr int32 StandInTestPort = 47369;
+
+    // the shared memory run keeps its own port, a socket of the loopback run may still be closing
+    constexpr int32 StandInSharedMemoryTestPort = 47370;
+    const TCHAR* StandInTestSharedMemoryName = TEXT("VoxelStandInTest");
+
+    constexpr int32 StandInShardTestPorts[2] = { 47371, 47372 };
+
+    // loopback with no artificial latency, anything slower than this is a hang
+    constexpr double StandInTestTimeout = 10.0;
+
+    // game world the clients are spawned in, their connections close with it
+    struct FStandInTestWorld
+    {
+        UWorld* World = nullptr;
+        TArray<AVoxelTcpSocket*> Clients;
+
+        /* Where the clients find the servers, over loopback or shared memory */
+        TArray<FString> Endpoints;
+
+        explicit FStandInTestWorld(const TArray<FString>& InEndpoints)
+            : Endpoints(InEndpoints)
+        {
+            World = UWorld::CreateWorld(EWorldType::Game, false);
+            FWorldContext& worldContext = GEngine->CreateNewWorldContext(EWorldType::Game);
+            worldContext.SetCurrentWorld(World);
+            World->InitializeActorsForPlay(FURL());
+            World->BeginPlay();
+        }
+
+        ~FStandInTestWorld()
+        {
+            for (AVoxelTcpSocket* client : Clients)
+            {
+                client->Destroy();
+            }
+            GEngine->DestroyWorldContext(World);
+            World->DestroyWorld(false);
+        }
+
+        AVoxelTcpSocket* ConnectClient(int32 CreditPayloads)
+        {
+            AVoxelTcpSocket* client = World->SpawnActor<AVoxelTcpSocket>();
+            client->SetStorageEndpoints(Endpoints);
+            client->SetFlowControl(CreditPayloads, 8 * 1024 * 1024, 1024);
+            client->GetPayloadDecoder().SetChunkIdStride(AVoxelManager::MakeVObjectSettings(nullptr).chunkResolution);
+            client->ConnectToGameServer();
+            Clients.Add(client);
+            return client;
+        }
+    };
+
+    // connects and handshakes reach the clients through the game thread's task queue, which nothing else pumps during a test
+    bool WaitFor(TFunctionRef<bool()> Condition)
+    {
+        double deadline = FPlatformTime::Seconds() + StandInTestTimeout;
+        while (!Condition())
+        {
+            if (FPlatformTime::Seconds() > deadline)
+            {
+                return false;
+            }
+            FTaskGraphInterface::Get().ProcessThreadUntilIdle(ENamedThreads::GameThread);
+            FPlatformProcess::Sleep(0.001f);
+        }
+        return true;
+    }
+
+    // takes payloads off the client like AVoxelManager does, which returns their credit, until Count of the type arrived
+    bool WaitForPayloads(AVoxelTcpSocket* Client, EVoxelDecodedPayloadType Type, int32 Count, TArray<FVoxelDecodedPayload>& OutPayloads)
+    {
+        return WaitFor([Client, Type, Count, &OutPayloads]()
+            {
+                FVoxelDecodedPayload payload;
+                while (Client->DequeueDecodedPayload(payload))
+                {
+                    if (payload.Type == Type)
+                    {
+                        OutPayloads.Add(MoveTemp(payload));
+                    }
+                }
+                return OutPayloads.Num() >= Count;
+            });
+    }
+
+    // streaming, credit, diff fan-out and versioned replies, the same over either transport
+    bool RunStandInScenario(FAutomationTestBase& Test, bool bSharedMemory)
+    {
+        // the server sizes and numbers chunks exactly as the client does
+        FVObjectSettings vObjectSettings = AVoxelManager::MakeVObjectSettings(nullptr);
+        FVoxelStandInSettings settings;
+        settings.Port = bSharedMemory ? StandInSharedMemoryTestPort : StandInTestPort;
+        settings.SharedMemoryName = bSharedMemory ? StandInTestSharedMemoryName : TEXT("");
+        settings.ChunkSize = vObjectSettings.voxelResPerChunk;
+        settings.ChunkIdStride = vObjectSettings.chunkResolution;
+
+        FVoxelStandInServer server(settings);
+        if (!Test.TestTrue(TEXT("Stand-in server starts"), server.Start()))
+        {
+            return false;
+        }
+
+        auto getChunkId = [&settings](const FIntVector& Chunk)
+        {
+            return (uint32)(Chunk.X + Chunk.Y * settings.ChunkIdStride + Chunk.Z * settings.ChunkIdStride * settings.ChunkIdStride);
+        };
+
+        FString endpoint = bSharedMemory
+            ? FString::Printf(TEXT("%s%s:%d"), FSharedMemoryTransportFormat::Scheme, StandInTestSharedMemoryName, settings.Port)
+            : FString::Printf(TEXT("127.0.0.1:%d"), settings.Port);
+        FStandInTestWorld testWorld({ endpoint });
+
+        // a window of two chunk replies, the server has to hold back the rest until credit comes back
+        AVoxelTcpSocket* client = testWorld.ConnectClient(2);
+        AVoxelTcpSocket* observer = testWorld.ConnectClient(64);
+        if (!Test.TestTrue(TEXT("Both clients connect"), WaitFor([client, observer]() { return client->IsStorageServerConnected() && observer->IsStorageServerConnected(); })))
+        {
+            return false;
+        }
+
+        // streamed chunks and credit gating
+        const int32 requestedChunks = 8;
+        FNetChunkRequestList requests;
+        for (int32 x = 0; x < requestedChunks; x++)
+        {
+            requests.list.Add(FNetChunkRequest(x, 0, 0));
+        }
+        Test.TestTrue(TEXT("Chunk requests are sent"), client->SendPayloadToShard(0, EPayloadType::ChunkRequestList, requests));
+
+        Test.TestTrue(TEXT("Replies past the credit window wait on the server"), WaitFor([&server, client, requestedChunks]()
+            {
+                return server.GetStats().RepliesAwaitingCredit == requestedChunks - 2 && client->GetPayloadDecoder().GetQueuedChunks() == 2;
+            }));
+
+        TArray<FVoxelDecodedPayload> streamed;
+        Test.TestTrue(TEXT("Every chunk arrives once credit is returned"), WaitForPayloads(client, EVoxelDecodedPayloadType::Chunks, requestedChunks, streamed));
+        Test.TestEqual(TEXT("No replies left waiting for credit"), server.GetStats().RepliesAwaitingCredit, 0);
+
+        TSet<FVector> streamedOffsets;
+        for (const FVoxelDecodedPayload& payload : streamed)
+        {
+            for (const FVoxelBuiltChunk& builtChunk : payload.Chunks)
+            {
+                streamedOffsets.Add(builtChunk.Chunk.offset);
+                Test.TestEqual(TEXT("Streamed chunks have no version"), (int64)builtChunk.Version, (int64)0);
+            }
+        }
+        for (const FNetChunkRequest& request : requests.list)
+        {
+            Test.TestTrue(*FString::Printf(TEXT("Chunk %d %d %d was streamed"), request.x, request.y, request.z), streamedOffsets.Contains(FVector(request.x, request.y, request.z)));
+        }
+
+        // diff fan-out to every session registered for the chunk, the sender included
+        FIntVector edited(1, 0, 0);
+        TArray<FVoxelDecodedPayload> observed;
+        observer->SendPayloadToShard(0, EPayloadType::ChunkRequest, FNetChunkRequest(edited.X, edited.Y, edited.Z));
+        Test.TestTrue(TEXT("Observer receives the chunk it registers for"), WaitForPayloads(observer, EVoxelDecodedPayloadType::Chunks, 1, observed));
+
+        FNetDiff diff(getChunkId(edited), 3, 4, 5, 200, 2);
+        Test.TestTrue(TEXT("Diff is sent"), client->SendChunkPayload(diff.chunk_id, EPayloadType::Diff, diff));
+
+        for (AVoxelTcpSocket* registered : { client, observer })
+        {
+            TArray<FVoxelDecodedPayload> diffs;
+            if (Test.TestTrue(TEXT("Diff reaches every registered session"), WaitForPayloads(registered, EVoxelDecodedPayloadType::Diffs, 1, diffs)))
+            {
+                const FNetDiff& received = diffs[0].Diffs[0];
+                Test.TestTrue(TEXT("Diff arrives unchanged"), received.chunk_id == diff.chunk_id && received.x == diff.x && received.y == diff.y &&
+                    received.z == diff.z && received.density == diff.density && received.material == diff.material);
+            }
+        }
+
+        // versioned re-requests, the cached copy is what the server generated before the edit
+        TArray<uint8> materials;
+        TArray<uint8> densities;
+        FVoxelStandInServer::GenerateChunk(edited, settings.ChunkSize, settings.Seed, materials, densities);
+
+        uint32 index = UVGridComponent::MortonIndex(diff.x, diff.y, diff.z);
+        TArray<uint8> editedMaterials = materials;
+        TArray<uint8> editedDensities = densities;
+        editedMaterials[index] = diff.material;
+        editedDensities[index] = diff.density;
+        FChunk expectedChunk;
+        uint32 expectedHash = 0;
+        UVGridComponent::BuildChunk(edited, editedDensities, editedMaterials, expectedChunk, expectedHash);
+
+        FNetVersionedChunkRequestList versionedRequests;
+        versionedRequests.list.Add(FNetVersionedChunkRequest(edited.X, edited.Y, edited.Z, 1));
+
+        client->GetChunkCache().Put(edited, 1, materials, densities);
+        client->SendPayloadToShard(0, EPayloadType::VersionedChunkRequestList, versionedRequests);
+        TArray<FVoxelDecodedPayload> deltas;
+        if (Test.TestTrue(TEXT("Delta reply to an outdated version"), WaitForPayloads(client, EVoxelDecodedPayloadType::Chunks, 1, deltas)))
+        {
+            Test.TestEqual(TEXT("Server answered with a delta"), server.GetStats().DeltasSent, (int64)1);
+            Test.TestEqual(TEXT("Delta brings the chunk to the edited version"), (int64)deltas[0].Chunks[0].Version, (int64)2);
+            Test.TestEqual(TEXT("Delta applies the edit to the cached copy"), (int64)deltas[0].Chunks[0].DataHash, (int64)expectedHash);
+        }
+
+        versionedRequests.list[0].version = 2;
+        client->GetChunkCache().Put(edited, 2, editedMaterials, editedDensities);
+        client->SendPayloadToShard(0, EPayloadType::VersionedChunkRequestList, versionedRequests);
+        TArray<FVoxelDecodedPayload> unchanged;
+        if (Test.TestTrue(TEXT("Unchanged reply to the current version"), WaitForPayloads(client, EVoxelDecodedPayloadType::Chunks, 1, unchanged)))
+        {
+            Test.TestEqual(TEXT("Server answered unchanged"), server.GetStats().UnchangedSent, (int64)1);
+            Test.TestEqual(TEXT("Unchanged keeps the cached version"), (int64)unchanged[0].Chunks[0].Version, (int64)2);
+            Test.TestEqual(TEXT("Unchanged restores the cached copy"), (int64)unchanged[0].Chunks[0].DataHash, (int64)expectedHash);
+        }
+
+        // a resident chunk re-requested after a reconnect has no cached copy, the reply goes to the game thread as is
+        versionedRequests.list[0].version = 1;
+        client->SendPayloadToShard(0, EPayloadType::VersionedChunkRequestList, versionedRequests);
+        TArray<FVoxelDecodedPayload> residentDeltas;
+        if (Test.TestTrue(TEXT("Uncached delta reply"), WaitForPayloads(client, EVoxelDecodedPayloadType::CacheMiss, 1, residentDeltas)))
+        {
+            Test.TestEqual(TEXT("Uncached delta carries the new version"), (int64)residentDeltas[0].DeltaVersion, (int64)2);
+            Test.TestTrue(TEXT("Uncached delta carries the edit"), residentDeltas[0].Diffs.Num() == 1 && residentDeltas[0].Diffs[0].x == diff.x &&
+                residentDeltas[0].Diffs[0].y == diff.y && residentDeltas[0].Diffs[0].z == diff.z && residentDeltas[0].Diffs[0].density == diff.density);
+        }
+
+        versionedRequests.list[0].version = 2;
+        client->SendPayloadToShard(0, EPayloadType::VersionedChunkRequestList, versionedRequests);
+        TArray<FVoxelDecodedPayload> residentUnchanged;
+        if (Test.TestTrue(TEXT("Uncached unchanged reply"), WaitForPayloads(client, EVoxelDecodedPayloadType::CacheMiss, 1, residentUnchanged)))
+        {
+            Test.TestEqual(TEXT("Uncached unchanged keeps the version"), (int64)residentUnchanged[0].DeltaVersion, (int64)2);
+            Test.TestEqual(TEXT("Uncached unchanged has nothing to apply, so nothing is remeshed"), residentUnchanged[0].Diffs.Num(), 0);
+        }
+
+        return true;
+    }
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FVoxelStandInServerTest, "VoxelGame.Network.StandInServer",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::ProductFilter)
+
+bool FVoxelStandInServerTest::RunTest(const FString& Parameters)
+{
+    return RunStandInScenario(*this, false);
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FVoxelStandInServerSharedMemoryTest, "VoxelGame.Network.SharedMemory.StandInServer",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::ProductFilter)
+
+bool FVoxelStandInServerSharedMemoryTest::RunTest(const FString& Parameters)
+{
+    return RunStandInScenario(*this, true);
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FVoxelStandInShardingTest, "VoxelGame.Network.Sharding",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::ProductFilter)
+
+bool FVoxelStandInShardingTest::RunTest(const FString& Parameters)
+{
+    FVObjectSettings vObjectSettings = AVoxelManager::MakeVObjectSettings(nullptr);
+    TArray<TUniquePtr<FVoxelStandInServer>> servers;
+    TArray<FString> endpoints;
+    for (int32 port : StandInShardTestPorts)
+    {
+        FVoxelStandInSettings settings;
+        settings.Port = port;
+        settings.ChunkSize = vObjectSettings.voxelResPerChunk;
+        settings.ChunkIdStride = vObjectSettings.chunkResolution;
+        servers.Add(MakeUnique<FVoxelStandInServer>(settings));
+        if (!TestTrue(TEXT("Stand-in server starts"), servers.Last()->Start()))
+        {
+            return false;
+        }
+        endpoints.Add(FString::Printf(TEXT("127.0.0.1:%d"), port));
+    }
+
+    FStandInTestWorld testWorld(endpoints);
+    AVoxelTcpSocket* client = testWorld.ConnectClient(64);
+    client->reconnectDelayMin = 0.05f;
+    if (!TestTrue(TEXT("Client connects to both shards"), WaitFor([client]() { return client->IsStorageServerConnected(); })))
+    {
+        return false;
+    }
+
+    TestEqual(TEXT("One shard per endpoint"), client->GetShardCount(), endpoints.Num());
+    for (int32 shard = 0; shard < endpoints.Num(); shard++)
+    {
+        TestEqual(TEXT("Shards keep the order of their endpoints"), client->GetShardEndpoint(shard), endpoints[shard]);
+    }
+
+    // a region of neighbouring chunks spreads over both shards, each request list goes to the shard owning its chunks
+    TArray<FNetChunkRequestList> requestLists;
+    requestLists.SetNum(endpoints.Num());
+    TArray<FIntVector> shardChunks[2];
+    for (int32 y = 0; y < 2; y++)
+    {
+        for (int32 x = 0; x < 16; x++)
+        {
+            uint32 chunkId = (uint32)(x + y * vObjectSettings.chunkResolution);
+            int32 shard = client->GetShardForChunk(chunkId);
+            if (!TestTrue(TEXT("Chunk maps to a shard"), shard >= 0 && shard < endpoints.Num()))
+            {
+                return false;
+            }
+            requestLists[shard].list.Add(FNetChunkRequest(x, y, 0));
+            shardChunks[shard].Add(FIntVector(x, y, 0));
+        }
+    }
+    if (!TestTrue(TEXT("Both shards own part of the region"), requestLists[0].list.Num() > 0 && requestLists[1].list.Num() > 0))
+    {
+        return false;
+    }
+
+    for (int32 shard = 0; shard < endpoints.Num(); shard++)
+    {
+        client->SendPayloadToShard(shard, EPayloadType::ChunkRequestList, requestLists[shard]);
+    }
+    TArray<FVoxelDecodedPayload> streamed;
+    TestTrue(TEXT("Every chunk arrives"), WaitForPayloads(client, EVoxelDecodedPayloadType::Chunks, requestLists[0].list.Num() + requestLists[1].list.Num(), streamed));
+    for (int32 shard = 0; shard < endpoints.Num(); shard++)
+    {
+        TestEqual(*FString::Printf(TEXT("Shard %d served exactly its own chunks"), shard), servers[shard]->GetStats().ChunksSent, (int64)requestLists[shard].list.Num());
+    }
+
+    // a diff goes to the server owning its chunk and nowhere else
+    for (int32 shard = 0; shard < endpoints.Num(); shard++)
+    {
+        const FIntVector& edited = shardChunks[shard][0];
+        FNetDiff diff((uint32)(edited.X + edited.Y * vObjectSettings.chunkResolution), 1, 2, 3, 100, 1);
+        client->SendChunkPayload(diff.chunk_id, EPayloadType::Diff, diff);
+    }
+    TArray<FVoxelDecodedPayload> diffs;
+    TestTrue(TEXT("Both diffs come back"), WaitForPayloads(client, EVoxelDecodedPayloadType::Diffs, 2, diffs));
+    for (int32 shard = 0; shard < endpoints.Num(); shard++)
+    {
+        TestEqual(*FString::Printf(TEXT("Shard %d applied only the diff for its chunk"), shard), servers[shard]->GetStats().DiffsApplied, (int64)1);
+    }
+
+    // losing one server leaves the other alone, and the lost one is reconnected once it is back
+    bool bReconnected[2] = { false, false };
+    FDelegateHandle reconnectedHandle = client->OnStorageShardReconnected.AddLambda([&bReconnected](int32 shard)
+        {
+            if (shard >= 0 && shard < 2)
+            {
+                bReconnected[shard] = true;
+            }
+        });
+
+    servers[1]->Stop();
+    TestTrue(TEXT("Client notices the lost shard"), WaitFor([client]() { return !client->IsShardConnected(1); }));
+    TestTrue(TEXT("The other shard stays connected"), client->IsShardConnected(0));
+
+    TestTrue(TEXT("Lost server restarts"), servers[1]->Start());
+    TestTrue(TEXT("Lost shard reconnects"), WaitFor([client, &bReconnected]()
+        {
+            // reconnects are scheduled from the actor tick, which nothing else runs during a test
+            client->Tick(0.0f);
+            return bReconnected[1];
+        }));
+    TestFalse(TEXT("Only the lost shard reconnects"), bReconnected[0]);
+
+    client->SendPayloadToShard(1, EPayloadType::ChunkRequestList, requestLists[1]);
+    TArray<FVoxelDecodedPayload> refetched;
+    TestTrue(TEXT("Reconnected shard serves its chunks again"), WaitForPayloads(client, EVoxelDecodedPayloadType::Chunks, requestLists[1].list.Num(), refetched));
+
+    client->OnStorageShardReconnected.Remove(reconnectedHandle);
+    return true;
+}
+
+#endif
@@ -0,0 +1,257 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "CoreMinimal.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+#include "Math/RandomStream.h"
+#include "VoxelByteStream.h"
+#include "VoxelChunkCodec.h"
+#include "VoxelTcpSocket.h"
+#include "VoxelWireSchema.h"
+
+namespace
+{
+    template<EVoxelByteOrder Order, typename StructType>
+    bool RoundTripsIn(const StructType& Value)
+    {
+        TArray<uint8> bytes;
+        FVoxelByteWriter writer(bytes);
+        Value.template WriteFields<Order>(writer);
+
+        StructType decoded;
+        FVoxelByteReader reader(bytes);
+        return decoded.template ReadFields<Order>(reader) && reader.Remaining() == 0 && decoded.WireEquals(Value);
+    }
+
+    template<typename StructType>
+    bool RoundTrips(const StructType& Value)
+    {
+        return RoundTripsIn<EVoxelByteOrder::Little>(Value) && RoundTripsIn<EVoxelByteOrder::Big>(Value);
+    }
+
+    // bytes as the struct puts them on the wire, for comparing against fixed encodings
+    template<typename StructType>
+    TArray<uint8> Serialize(const StructType& Value)
+    {
+        TArray<uint8> bytes;
+        FVoxelByteWriter writer(bytes);
+        Value.serialize(writer);
+        return bytes;
+    }
+
+    // bytes as the server sends the struct, for payloads only the server sends
+    template<typename StructType>
+    TArray<uint8> ServerBytes(const StructType& Value)
+    {
+        TArray<uint8> bytes;
+        FVoxelByteWriter writer(bytes);
+        Value.template WriteFields<FVoxelWire::ServerOrder>(writer);
+        return bytes;
+    }
+
+    bool ChunksEqual(const FNetChunk& A, const FNetChunk& B)
+    {
+        return A.x == B.x && A.y == B.y && A.z == B.z && A.material == B.material && A.density == B.density;
+    }
+
+    // runs of one material like real terrain, so the run length codecs have something to do
+    FNetChunk RandomChunk(FRandomStream& Random, int32 ChunkSize)
+    {
+        FNetChunk chunk;
+        chunk.x = Random.GetUnsignedInt();
+        chunk.y = Random.GetUnsignedInt();
+        chunk.z = Random.GetUnsignedInt();
+        int32 numVoxels = ChunkSize * ChunkSize * ChunkSize;
+        while (chunk.material.Num() < numVoxels)
+        {
+            int32 run = FMath::Min(Random.RandRange(1, 64), numVoxels - chunk.material.Num());
+            uint8 material = (uint8)Random.RandRange(0, 3);
+            for (int32 i = 0; i < run; i++)
+            {
+                chunk.material.Add(material);
+                chunk.density.Add((uint8)Random.RandRange(0, 255));
+            }
+        }
+        return chunk;
+    }
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FVoxelWireSchemaTest, "VoxelGame.Network.WireSchema",
+    EAutomationTestFlags::EditorContext | EAutomationTestFlags::ProductFilter)
+
+bool FVoxelWireSchemaTest::RunTest(const FString& Parameters)
+{
+    // every struct both ways, with values covering the whole range of each field
+    FRandomStream random(1);
+    for (int32 i = 0; i < 100; i++)
+    {
+        TestTrue(TEXT("FNetDiff round trip"), RoundTrips(FNetDiff::MakeRandom(random)));
+        TestTrue(TEXT("FNetChunkRequest round trip"), RoundTrips(FNetChunkRequest(random.GetUnsignedInt(), random.GetUnsignedInt(), random.GetUnsignedInt())));
+        TestTrue(TEXT("FNetVersionedChunkRequest round trip"),
+            RoundTrips(FNetVersionedChunkRequest(random.GetUnsignedInt(), random.GetUnsignedInt(), random.GetUnsignedInt(), random.GetUnsignedInt())));
+        TestTrue(TEXT("FNetDeRegisterRequest round trip"), RoundTrips(FNetDeRegisterRequest(random.GetUnsignedInt())));
+
+        FNetCredit credit;
+        credit.payloads = random.GetUnsignedInt();
+        credit.bytes = random.GetUnsignedInt();
+        TestTrue(TEXT("FNetCredit round trip"), RoundTrips(credit));
+
+        FNetChunkDelta delta;
+        delta.x = random.GetUnsignedInt();
+        delta.y = random.GetUnsignedInt();
+        delta.z = random.GetUnsignedInt();
+        delta.version = random.GetUnsignedInt();
+        TestTrue(TEXT("FNetChunkDelta round trip"), RoundTrips(delta));
+
+        FNetHello hello;
+        hello.codecMask = random.GetUnsignedInt();
+        hello.sessionId = random.GetUnsignedInt();
+        hello.channel = random.RandRange(0, 1) ? EVoxelChannel::Bulk : EVoxelChannel::Interactive;
+        hello.protocolVersion = random.GetUnsignedInt();
+        TestTrue(TEXT("FNetHello round trip"), RoundTrips(hello));
+    }
+
+    // fixed encodings, these change only when the storage server does
+    FNetDiff diff(0x01020304, 5, 6, 7, 8, 9);
+    TArray<uint8> expectedClient = { 4, 3, 2, 1, 5, 0, 0, 0, 6, 0, 0, 0, 7, 0, 0, 0, 8, 9 };
+    TestTrue(TEXT("FNetDiff is sent little endian"), Serialize(diff) == expectedClient);
+
+    TArray<uint8> serverBytes = { 1, 2, 3, 4, 0, 0, 0, 5, 0, 0, 0, 6, 0, 0, 0, 7, 8, 9 };
+    FNetDiff serverDiff;
+    TestTrue(TEXT("FNetDiff is received big endian"), serverDiff.fromBytes(serverBytes) && serverDiff.WireEquals(diff));
+    TestTrue(TEXT("Wire sizes"), FNetDiff::MinWireSize == 18 && FNetHello::MinWireSize == 4);
+
+    // a hello from a server that only knows the codec mask keeps the defaults of everything after it
+    TArray<uint8> oldHello = { 0, 0, 0, 6 };
+    FNetHello parsedHello;
+    TestTrue(TEXT("Missing optional fields keep their defaults"), parsedHello.fromBytes(oldHello) && parsedHello.codecMask == 6 &&
+        parsedHello.sessionId == 0 && parsedHello.channel == EVoxelChannel::Interactive && parsedHello.protocolVersion == 1);
+
+    // fields added after ours are skipped, a field cut in half is not
+    FNetHello newHello;
+    newHello.codecMask = 6;
+    newHello.sessionId = 42;
+    newHello.protocolVersion = VoxelProtocolVersion;
+    TArray<uint8> newHelloBytes;
+    FVoxelByteWriter newHelloWriter(newHelloBytes);
+    newHello.WriteFields<FVoxelWire::ServerOrder>(newHelloWriter);
+    newHelloBytes.Append({ 0xAB, 0xCD, 0xEF });
+    parsedHello = FNetHello();
+    TestTrue(TEXT("Unknown trailing fields are ignored"), parsedHello.fromBytes(newHelloBytes) && parsedHello.WireEquals(newHello));
+    parsedHello = FNetHello();
+    TestFalse(TEXT("Truncated optional field is an error"), parsedHello.fromBytes(TArrayView<const uint8>(newHelloBytes).Slice(0, 6)));
+
+    // diff lists
+    FNetDiffList diffList;
+    for (int32 i = 0; i < 10; i++)
+    {
+        diffList.list.Add(FNetDiff::MakeRandom(random));
+    }
+    TArray<uint8> listBytes;
+    FVoxelByteWriter listWriter(listBytes);
+    diffList.WriteFields<FVoxelWire::ServerOrder>(listWriter);
+    FNetDiffList parsedList;
+    bool bListEqual = parsedList.fromBytes(listBytes) && parsedList.list.Num() == diffList.list.Num();
+    for (int32 i = 0; bListEqual && i < diffList.list.Num(); i++)
+    {
+        bListEqual = parsedList.list[i].WireEquals(diffList.list[i]);
+    }
+    TestTrue(TEXT("FNetDiffList round trip"), bListEqual);
+
+    TArray<uint8> hugeCount = { 0, 0, 0x10, 0 };
+    hugeCount.AddZeroed(FNetDiff::MinWireSize);
+    TestFalse(TEXT("List count larger than the payload is rejected"), parsedList.fromBytes(hugeCount));
+
+    FVoxelByteReader zeroSizeReader(hugeCount);
+    TestFalse(TEXT("List of zero size elements is rejected"), FVoxelWire::ReadList<FVoxelWire::ServerOrder>(zeroSizeReader, parsedList.list, 0));
+
+    // chunks, coordinates big endian, then materials, then densities last voxel first
+    FNetChunk chunk;
+    chunk.x = 1;
+    chunk.y = 2;
+    chunk.z = 0x01020304;
+    chunk.material = { 10, 11, 12 };
+    chunk.density = { 20, 21, 22 };
+    TArray<uint8> expectedChunk = { 0, 0, 0, 1, 0, 0, 0, 2, 1, 2, 3, 4, 10, 11, 12, 22, 21, 20 };
+    TestTrue(TEXT("FNetChunk golden bytes"), ServerBytes(chunk) == expectedChunk);
+
+    FNetChunk parsedChunk;
+    TestTrue(TEXT("FNetChunk reads its golden bytes"), parsedChunk.fromBytes(expectedChunk) && ChunksEqual(parsedChunk, chunk));
+
+    FNetChunk fullChunk = RandomChunk(random, 32);
+    TestTrue(TEXT("FNetChunk round trip"), parsedChunk.fromBytes(ServerBytes(fullChunk)) && ChunksEqual(parsedChunk, fullChunk));
+    TestTrue(TEXT("FNetChunk round trip in either byte order"), RoundTrips(fullChunk));
+
+    for (EVoxelChunkCodec codec : { EVoxelChunkCodec::None, EVoxelChunkCodec::Rle, EVoxelChunkCodec::RleLz4 })
+    {
+        TArray<uint8> compressedBytes;
+        FVoxelByteWriter compressedWriter(compressedBytes);
+        FVoxelWire::Write<FVoxelWire::ServerOrder>(compressedWriter, fullChunk.x);
+        FVoxelWire::Write<FVoxelWire::ServerOrder>(compressedWriter, fullChunk.y);
+        FVoxelWire::Write<FVoxelWire::ServerOrder>(compressedWriter, fullChunk.z);
+        FVoxelChunkCodec::Encode(codec, fullChunk.material, fullChunk.density, compressedWriter);
+
+        parsedChunk = FNetChunk();
+        TestTrue(*FString::Printf(TEXT("Compressed FNetChunk round trip with %s"), *UEnum::GetValueAsString(codec)),
+            parsedChunk.fromCompressedBytes(compressedBytes) && ChunksEqual(parsedChunk, fullChunk));
+    }
+
+    // versioned chunks, the version big endian ahead of a chunk payload
+    FNetVersionedChunk versionedChunk;
+    versionedChunk.version = 0x0A0B0C0D;
+    versionedChunk.chunk = chunk;
+    TArray<uint8> expectedVersioned = { 0x0A, 0x0B, 0x0C, 0x0D };
+    expectedVersioned.Append(expectedChunk);
+    TestTrue(TEXT("FNetVersionedChunk golden bytes"), ServerBytes(versionedChunk) == expectedVersioned);
+
+    FNetVersionedChunk parsedVersioned;
+    TestTrue(TEXT("FNetVersionedChunk reads its golden bytes"), parsedVersioned.fromBytes(expectedVersioned) &&
+        parsedVersioned.version == versionedChunk.version && ChunksEqual(parsedVersioned.chunk, chunk));
+
+    versionedChunk.version = random.GetUnsignedInt();
+    versionedChunk.chunk = fullChunk;
+    TestTrue(TEXT("FNetVersionedChunk round trip"), parsedVersioned.fromBytes(ServerBytes(versionedChunk)) &&
+        parsedVersioned.version == versionedChunk.version && ChunksEqual(parsedVersioned.chunk, fullChunk));
+    TestTrue(TEXT("FNetVersionedChunk round trip in either byte order"), RoundTrips(versionedChunk));
+
+    // chunk lists, the count and then every chunk behind its big endian byte length
+    FNetChunk smallChunk;
+    smallChunk.x = 5;
+    smallChunk.y = 6;
+    smallChunk.z = 7;
+    smallChunk.material = { 1 };
+    smallChunk.density = { 2 };
+    FNetChunkList chunkList;
+    chunkList.list = { chunk, smallChunk };
+    TArray<uint8> expectedList = { 0, 0, 0, 2, 0, 0, 0, 18 };
+    expectedList.Append(expectedChunk);
+    expectedList.Append({ 0, 0, 0, 14, 0, 0, 0, 5, 0, 0, 0, 6, 0, 0, 0, 7, 1, 2 });
+    TestTrue(TEXT("FNetChunkList golden bytes"), ServerBytes(chunkList) == expectedList);
+
+    FNetChunkList parsedChunkList;
+    TestTrue(TEXT("FNetChunkList reads its golden bytes"), parsedChunkList.fromBytes(expectedList) && parsedChunkList.list.Num() == 2 &&
+        ChunksEqual(parsedChunkList.list[0], chunk) && ChunksEqual(parsedChunkList.list[1], smallChunk));
+
+    chunkList.list = { fullChunk, RandomChunk(random, 32), smallChunk };
+    bool bChunkListEqual = parsedChunkList.fromBytes(ServerBytes(chunkList)) && parsedChunkList.list.Num() == chunkList.list.Num();
+    for (int32 i = 0; bChunkListEqual && i < chunkList.list.Num(); i++)
+    {
+        bChunkListEqual = ChunksEqual(parsedChunkList.list[i], chunkList.list[i]);
+    }
+    TestTrue(TEXT("FNetChunkList round trip"), bChunkListEqual);
+
+    TArray<uint8> truncatedList = expectedList;
+    truncatedList.SetNum(truncatedList.Num() - 1);
+    TestFalse(TEXT("Chunk list cut short is rejected"), parsedChunkList.fromBytes(truncatedList));
+
+    TArray<uint8> hugeChunkCount = { 0, 0x10, 0, 0 };
+    hugeChunkCount.Append(TArrayView<const uint8>(expectedList).Slice(4, expectedList.Num() - 4));
+    TestFalse(TEXT("Chunk count larger than the payload is rejected"), parsedChunkList.fromBytes(hugeChunkCount));
+
+    return true;
+}
+
+#endif
@@ -5,6 +5,24 @@
 #include "MarchingCubesUtil.h"
 #include "Engine.h"
 
+namespace
+{
+	//Offset of each voxel corner from the voxel's own point, in pointArray order
+	const FIntVector CornerOffsets[8] = {
+		FIntVector(0, 0, 0), FIntVector(1, 0, 0), FIntVector(1, 1, 0), FIntVector(0, 1, 0),
+		FIntVector(0, 0, 1), FIntVector(1, 0, 1), FIntVector(1, 1, 1), FIntVector(0, 1, 1)
+	};
+
+	uint32 SpreadBits(uint32 v)
+	{
+		uint32 spread = 0;
+		for (int bit = 0; bit < 10; bit++) {
+			spread |= ((v >> bit) & 1) << (3 * bit);
+		}
+		return spread;
+	}
+}
+
 // Sets default values for this component's properties
 UVGridComponent::UVGridComponent()
 {
@@ -66,6 +84,21 @@ FVoxel UVGridComponent::GetVoxel(int x, int y, int z)
 	return chunk->voxelArray[morton];
 }
 
+const FVoxel* UVGridComponent::FindVoxel(int x, int y, int z)
+{
+	if (x < 0 || y < 0 || z < 0) {
+		return nullptr;
+	}
+
+	FChunk* chunk = Chunks.Find(getChunkId(x / voxelResolutionPerChunk, y / voxelResolutionPerChunk, z / voxelResolutionPerChunk));
+	if (chunk == nullptr) {
+		return nullptr;
+	}
+
+	uint32 morton = MarchingCubesUtil->mortonEncode(x % voxelResolutionPerChunk, y % voxelResolutionPerChunk, z % voxelResolutionPerChunk, voxelResolutionPerChunk);
+	return &chunk->voxelArray[morton];
+}
+
 void UVGridComponent::FillVoxel(int x, int y, int z, FPoint point)
 {
 	TArray<FVector> voxelCoords = {
@@ -145,15 +178,21 @@ void UVGridComponent::SetPoint(int x, int y, int z, FPoint point)
 
 				if (chunk != NULL)
 				{
-					chunk->voxelArray[morton].pointArray[i].density = point.density;
-					chunk->voxelArray[morton].pointArray[i].type = point.type;
+					FPoint& storedPoint = chunk->voxelArray[morton].pointArray[i];
+					if (storedPoint.density != point.density || storedPoint.type != point.type) {
+						chunk->version = ++chunkVersionCounter;
+						chunk->bContentHashStale = true;
+					}
+
+					storedPoint.density = point.density;
+					storedPoint.type = point.type;
 
 					if (point.type != EVoxelType::Air) {
 						chunk->bIsEmpty = false;
 					}
 
 					chunk->voxelArray[morton].calcShape();
-					changedChunksSet.Add(chunk);
+					changedChunksSet.Add(getChunkId(xChunk, yChunk, zChunk));
 				}
 				else
 				{
@@ -189,17 +228,77 @@ FPoint UVGridComponent::GetPoint(int x, int y, int z)
 
 void UVGridComponent::SetChunk(int x, int y, int z, TArray<uint8> densities, TArray<uint8> materials)
 {
-	Chunks.Add(getChunkId(x, y, z), FChunk(FVector(x, y, z), GetVoxelResolutionPerChunk()));
+	FChunk chunk;
+	uint32 dataHash = 0;
+	if (BuildChunk(FIntVector(x, y, z), densities, materials, chunk, dataHash)) {
+		PublishChunk(MoveTemp(chunk), dataHash);
+	}
+}
 
+uint32 UVGridComponent::MortonIndex(int x, int y, int z)
+{
+	//Same interleaving as the util's lookup tables
+	return SpreadBits(x) | (SpreadBits(y) << 1) | (SpreadBits(z) << 2);
+}
+
+bool UVGridComponent::BuildChunk(const FIntVector& chunkCoords, TArrayView<const uint8> densities, TArrayView<const uint8> materials, FChunk& outChunk, uint32& outDataHash)
+{
+	int numVoxels = densities.Num();
+	int res = FMath::RoundToInt(FMath::Pow((float)numVoxels, 1.0f / 3.0f));
+	if (res < 1 || res > 1024 || res * res * res != numVoxels || !FMath::IsPowerOfTwo(res) || materials.Num() != numVoxels) {
+		return false;
+	}
+
+	outChunk = FChunk(FVector(chunkCoords), res);
+
+	//Every corner inside the chunk is one of the chunk's own points
+	for (int i = 0; i < res; i++) {
+		for (int j = 0; j < res; j++) {
+			for (int k = 0; k < res; k++) {
+				FVoxel& voxel = outChunk.voxelArray[MortonIndex(i, j, k)];
+				for (int c = 0; c < 8; c++) {
+					FIntVector corner = FIntVector(i, j, k) + CornerOffsets[c];
+					if (corner.X < res && corner.Y < res && corner.Z < res) {
+						int pointIndex = MortonIndex(corner.X, corner.Y, corner.Z);
+						voxel.pointArray[c] = FPoint(static_cast<EVoxelType>(materials[pointIndex]), densities[pointIndex]);
+					}
+				}
+				voxel.calcShape();
+
+				if (voxel.pointArray[0].type != EVoxelType::Air) {
+					outChunk.bIsEmpty = false;
+				}
+			}
+		}
+	}
+
+	outDataHash = GetDataHash(densities, materials);
+	return true;
+}
+
+bool UVGridComponent::PublishChunk(FChunk&& chunk, uint32 dataHash)
+{
+	if (chunk.resolution != voxelResolutionPerChunk) {
+		UE_LOG(LogTemp, Warning, TEXT("Chunk %f %f %f has resolution %d, storage uses %d"), chunk.offset.X, chunk.offset.Y, chunk.offset.Z, chunk.resolution, voxelResolutionPerChunk);
+		return false;
+	}
+
+	int x = chunk.offset.X;
+	int y = chunk.offset.Y;
+	int z = chunk.offset.Z;
+	FChunk& storedChunk = Chunks.Add(getChunkId(x, y, z), MoveTemp(chunk));
+	storedChunk.version = ++chunkVersionCounter;
+	changedChunksSet.Add(getChunkId(x, y, z));
+
+	//Points on the lower faces are also corners of the neighbours below, which the build could not reach
 	FVector voxelOffset = FVector(x, y, z) * voxelResolutionPerChunk;
 	for (int i = 0; i < voxelResolutionPerChunk; i++) {
 		for (int j = 0; j < voxelResolutionPerChunk; j++) {
 			for (int k = 0; k < voxelResolutionPerChunk; k++) {
-
-				int voxIndex = MarchingCubesUtil->mortonEncode(i, j, k, voxelResolutionPerChunk);
-
-				FPoint point = FPoint(static_cast<EVoxelType>(materials[voxIndex]), densities[voxIndex]);
-				SetPoint(i + voxelOffset.X, j + voxelOffset.Y, k + voxelOffset.Z, point);
+				if (i == 0 || j == 0 || k == 0) {
+					FPoint point = storedChunk.voxelArray[MarchingCubesUtil->mortonEncode(i, j, k, voxelResolutionPerChunk)].pointArray[0];
+					SetPoint(i + voxelOffset.X, j + voxelOffset.Y, k + voxelOffset.Z, point);
+				}
 			}
 		}
 	}
@@ -229,6 +328,65 @@ void UVGridComponent::SetChunk(int x, int y, int z, TArray<uint8> densities, TAr
 		}
 	}
 
+	//Seam points come from the neighbours so they are part of the content hash as well
+	FChunk* publishedChunk = Chunks.Find(getChunkId(x, y, z));
+	publishedChunk->contentHash = HashCombine(dataHash, GetSeamHash(x, y, z));
+	publishedChunk->bContentHashStale = false;
+	return true;
+}
+
+uint32 UVGridComponent::getContentHash(uint32 chunkId)
+{
+	FChunk* chunk = Chunks.Find(chunkId);
+	if (chunk == nullptr) {
+		return 0;
+	}
+
+	//Hashed the way PublishChunk hashes, so undoing an edit gives back the hash the chunk had before it
+	if (chunk->bContentHashStale) {
+		int x = chunk->offset.X;
+		int y = chunk->offset.Y;
+		int z = chunk->offset.Z;
+		TArray<uint8> densities;
+		TArray<uint8> materials;
+		GetChunkData(x, y, z, densities, materials);
+		chunk->contentHash = HashCombine(GetDataHash(densities, materials), GetSeamHash(x, y, z));
+		chunk->bContentHashStale = false;
+	}
+	return chunk->contentHash;
+}
+
+uint32 UVGridComponent::GetDataHash(TArrayView<const uint8> densities, TArrayView<const uint8> materials)
+{
+	return FCrc::MemCrc32(densities.GetData(), densities.Num(), FCrc::MemCrc32(materials.GetData(), materials.Num()));
+}
+
+uint32 UVGridComponent::GetSeamHash(int x, int y, int z)
+{
+	FVector voxelOffset = FVector(x, y, z) * voxelResolutionPerChunk;
+	uint32 seamHash = 0;
+
+	//x y
+	for (int i = 0; i <= voxelResolutionPerChunk; i++) {
+		for (int j = 0; j <= voxelResolutionPerChunk; j++) {
+			seamHash = HashCombine(seamHash, GetPointHash(GetPoint(i + voxelOffset.X, j + voxelOffset.Y, voxelResolutionPerChunk + voxelOffset.Z)));
+		}
+	}
+
+	//y z
+	for (int j = 0; j <= voxelResolutionPerChunk; j++) {
+		for (int k = 0; k <= voxelResolutionPerChunk; k++) {
+			seamHash = HashCombine(seamHash, GetPointHash(GetPoint(voxelResolutionPerChunk + voxelOffset.X, j + voxelOffset.Y, k + voxelOffset.Z)));
+		}
+	}
+
+	//x z
+	for (int i = 0; i <= voxelResolutionPerChunk; i++) {
+		for (int k = 0; k <= voxelResolutionPerChunk; k++) {
+			seamHash = HashCombine(seamHash, GetPointHash(GetPoint(i + voxelOffset.X, voxelResolutionPerChunk + voxelOffset.Y, k + voxelOffset.Z)));
+		}
+	}
+	return seamHash;
 }
 
 FChunk* UVGridComponent::getChunk(int x, int y, int z)
@@ -252,6 +410,24 @@ FChunk* UVGridComponent::getChunk(uint32 chunkId)
 	}
 }
 
+bool UVGridComponent::GetChunkData(int x, int y, int z, TArray<uint8>& densities, TArray<uint8>& materials)
+{
+	FChunk* chunk = getChunk(x, y, z);
+	if (chunk == nullptr) {
+		return false;
+	}
+
+	//Each voxel's first point is the grid point at its own coordinates, and both are indexed in Morton order
+	densities.SetNumUninitialized(chunk->voxelArray.Num());
+	materials.SetNumUninitialized(chunk->voxelArray.Num());
+	for (int i = 0; i < chunk->voxelArray.Num(); i++) {
+		const FPoint& point = chunk->voxelArray[i].pointArray[0];
+		densities[i] = point.density;
+		materials[i] = (uint8)point.type;
+	}
+	return true;
+}
+
 void UVGridComponent::printChunkData(int x, int y, int z)
 {
 	if (x < 0 || y < 0 || z < 0) {
@@ -296,11 +472,11 @@ TArray<uint32> UVGridComponent::getChunkSet()
 
 void UVGridComponent::addChunkToChangedChunkSet(int x, int y, int z)
 {
-	FChunk* chunk = Chunks.Find(getChunkId(x, y, z));
-	if (chunk != NULL)
+	uint32 chunkId = getChunkId(x, y, z);
+	if (Chunks.Contains(chunkId))
 	{
-		//UE_LOG(LogTemp, Warning, TEXT("Adding chunk to change queue %d"), MarchingCubesUtil->mortonEncode(chunk->offset.X, chunk->offset.Y, chunk->offset.Z, chunk->resolution));
-		changedChunksSet.Add(chunk);
+		//UE_LOG(LogTemp, Warning, TEXT("Adding chunk to change queue %d"), chunkId);
+		changedChunksSet.Add(chunkId);
 	}
 	else
 	{
@@ -311,3 +487,8 @@ void UVGridComponent::addChunkToChangedChunkSet(int x, int y, int z)
 uint32 UVGridComponent::getChunkId(int x, int y, int z) {
 	return x + (y * chunkResolution) + (z * chunkResolution * chunkResolution);
 }
+
+uint32 UVGridComponent::GetPointHash(FPoint point)
+{
+	return ((uint32)point.type << 8) | point.density;
+}
@@ -3,10 +3,14 @@
 
 #include "VObject.h"
 #include "Engine.h"
+#include "EngineUtils.h"
 #include "Async/Async.h"
+#include "Async/ParallelFor.h"
 #include "ProceduralMeshComponent.h"
 #include "MarchingCubesUtil.h"
 #include "VGridComponent.h"
+#include "MeshSimplifier.h"
+#include "VoxelMesher.h"
 #include "Net/UnrealNetwork.h"
 
 // Sets default values
@@ -50,12 +54,18 @@ void AVObject::initializeObject(FVObjectSettings parameters)
 	}
 	//Create MC utilities
 	MarchingCubesUtil = NewObject<UMarchingCubesUtil>();
+	Mesher = FVoxelMesher::Create(params.mesherType);
 
 	mapVoxelTypeToMaterial = GenerateColorMap();
 
 	//Initialize storage component
 	storage->InitStorage(MarchingCubesUtil, params.chunkResolution, params.voxelResPerChunk);
 
+	//Collision follows the pawns rather than the draw center, so it is refreshed on its own timer
+	if (params.bCalcCollision) {
+		GetWorldTimerManager().SetTimer(CollisionTimerHandle, this, &AVObject::UpdateCollision, 0.2f, true);
+	}
+
 }
 
 FTypeToMaterialMap AVObject::GenerateColorMap() {
@@ -187,6 +197,15 @@ void AVObject::SetCenterChunk(const FVector& CenterChunk)
 					{
 						storage->addChunkToChangedChunkSet(chunk.X, chunk.Y, chunk.Z);
 					}
+					else if (ChunksDrawn.Contains(chunk))
+					{
+						//Redraw chunks whose distance now calls for another detail level
+						FDrawnChunkMesh* drawnMesh = DrawnChunkMeshes.Find(storage->getChunkId(chunk.X, chunk.Y, chunk.Z));
+						if (drawnMesh != nullptr && drawnMesh->lodLevel != GetSimplificationLevel(chunk))
+						{
+							storage->addChunkToChangedChunkSet(chunk.X, chunk.Y, chunk.Z);
+						}
+					}
 					chunksToKeepDrawn.Add(chunk);
 				}
 			}
@@ -201,9 +220,14 @@ void AVObject::SetCenterChunk(const FVector& CenterChunk)
 			int iChunk = storage->getChunkId(chunk.X, chunk.Y, chunk.Z);
 			if (ChunkMeshMap.Contains(iChunk))
 			{
+				//The built mesh moves to MeshCache so re-entering does not need a remesh
+				StashChunkMesh(iChunk);
 				(*ChunkMeshMap.Find(iChunk))->ClearAllMeshSections();
+				(*ChunkMeshMap.Find(iChunk))->DestroyComponent();
 				ChunkMeshMap.Remove(iChunk);
 			}
+			DrawnChunkMeshes.Remove(iChunk);
+			RemoveChunkCollision(iChunk);
 			ChunksDrawn.Remove(chunk);
 		}
 	}
@@ -236,6 +260,11 @@ uint32 AVObject::getChunkId(int x, int y, int z)
 	return storage->getChunkId(x,y,z);
 }
 
+bool AVObject::containsChunkId(uint32 chunkId)
+{
+	return storage->containsChunk(chunkId);
+}
+
 FVector AVObject::getChunkOffset(uint32 chunkId)
 {
 	if (storage->containsChunk(chunkId)) {
@@ -260,7 +289,14 @@ void AVObject::ChangeAffectedChunks()
 	//This will prevent many chunks needing to be redrawn in one frame
 	//Order from closest radius to further away
 
-	for (auto& chunk : storage->changedChunksSet) {
+	for (uint32 chunkId : storage->changedChunksSet) {
+		//Removed since it changed
+		if (!storage->containsChunk(chunkId)) {
+			continue;
+		}
+
+		FChunk* chunk = storage->getChunk(chunkId);
+
 		//If chunk is within render distance
 		if (FVector::Dist(chunk->offset, centerChunk) <= RENDER_RADIUS)
 		{
@@ -322,6 +358,16 @@ void AVObject::DrawChunk(int x, int y, int z)
 	DrawChunk(chunk);
 }
 
+bool AVObject::GetChunkData(int x, int y, int z, TArray<uint8>& densities, TArray<uint8>& materials)
+{
+	return storage->GetChunkData(x, y, z, densities, materials);
+}
+
+bool AVObject::PublishChunk(FChunk&& chunk, uint32 dataHash)
+{
+	return storage->PublishChunk(MoveTemp(chunk), dataHash);
+}
+
 void AVObject::PrintChunk(int x, int y, int z)
 {
 	storage->printChunkData(x, y, z);
@@ -340,158 +386,211 @@ void AVObject::DrawChunk(FChunk* chunk)
 		return;
 	}
 
-	//Storage for calculating results
-	TArray<TFuture<TMap<EVoxelType, FTypeBuffer>>> waitingSubBuffers;
+	//Distant chunks get a reduced mesh
+	int lodLevel = GetSimplificationLevel(offset);
+	uint32 contentHash = storage->getContentHash(iChunk);
+
+	//Crossing a detail boundary keeps the mesh of the level being left, walking back needs no remesh
+	FDrawnChunkMesh* drawnMesh = DrawnChunkMeshes.Find(iChunk);
+	if (drawnMesh != nullptr && drawnMesh->lodLevel != lodLevel && drawnMesh->contentHash == contentHash) {
+		StashChunkMesh(iChunk);
+	}
+
+	//Skip meshing entirely if this content was already built at this level
+	FChunkMeshCacheEntry* cachedMesh = FindCachedMesh(iChunk, contentHash, lodLevel);
+	if (cachedMesh != nullptr) {
+		TMap<EVoxelType, FProcMeshSection> sections = MoveTemp(cachedMesh->sections);
+		RemoveCachedMesh(MeshCacheKey(iChunk, lodLevel));
+		UploadChunkSections(iChunk, contentHash, lodLevel, MoveTemp(sections));
+		ChunksDrawn.Add(chunk->offset);
+		return;
+	}
+
+	//Each worker meshes one slab into its own slot, so nothing is returned by value
+	FVoxelMeshInput input = MakeMeshInput(chunk);
 	int threadCount = 8;
+	TArray<TMap<EVoxelType, FProcMeshSection>> slabSections;
+	slabSections.SetNum(threadCount);
+	TArray<TFuture<void>> waitingSlabs;
 	for (int threadId = 0; threadId < threadCount; threadId++) {
 		int startX = (chunk->resolution / threadCount) * threadId;
-		//<TMap<EVoxelType, FTypeBuffer>>
-		waitingSubBuffers.Add(Async(EAsyncExecution::ThreadPool, [&, chunk, startX]() {
-			TMap<EVoxelType, FTypeBuffer> subTypeBuffers;
-
-			FVector offset = chunk->offset;
-
-			for (int x = startX; x < chunk->resolution; x++) {
-				for (int y = 0; y < chunk->resolution; y++) {
-					for (int z = 0; z < chunk->resolution; z++) {
-						FVoxel voxel = storage->GetVoxel(offset.X * chunk->resolution + x, offset.Y * chunk->resolution + y, offset.Z * chunk->resolution + z);
-						int shapeIndex = voxel.shape;
-						if (shapeIndex != 0 && shapeIndex != 255) {
-							//Get type for whole voxel. Based on the lowest index vertex thats not air.
-							EVoxelType voxelType = EVoxelType::Air;
-							for (int v = 0; v < 8; v++) {
-								if (voxel.pointArray[v].type != EVoxelType::Air) {
-									voxelType = voxel.pointArray[v].type;
-									break;
-								}
-							}
-
-							//Get triangle data for shape
-							TArray<int> voxelVertices;
-							if (MarchingCubesUtil) {
-								voxelVertices = MarchingCubesUtil->GetMCTrianglePoints(shapeIndex);
-							}
-							else {
-								UE_LOG(LogTemp, Warning, TEXT("MC util not valid"));
-							}
-
-							if (!subTypeBuffers.Contains(voxelType)) {
-								//UE_LOG(LogTemp, Warning, TEXT("Buffer type %d"), type);
-								subTypeBuffers.Add(voxelType, FTypeBuffer());
-							}
-							FTypeBuffer* curBuffer = subTypeBuffers.Find(voxelType);
-
-							//Insert triangle data into buffers for mesh
-							for (int vi = 0; vi < voxelVertices.Num(); vi++) {
-								int v = voxelVertices[vi];
-
-								//Calc edge intersection point for "smoother" surface
-								FVector2D points = MarchingCubesUtil->GetVerticesForMidPoints(v);
-
-								FVector P;
-								FVector P1 = MarchingCubesUtil->GetVoxelVertex(points.X);
-								FVector P2 = MarchingCubesUtil->GetVoxelVertex(points.Y);
-
-								//Check if interpolation is needed
-								if (params.bUseVoxelInterpolation) {
-									uint8 V1 = voxel.pointArray[points.X].density;
-									uint8 V2 = voxel.pointArray[points.Y].density;
-									//P = P1 + ((params.densityValue - V1) * (P2 - P1) / (V2 - V1));
-
-									if (V1 != 0) {
-										P1 = P1 * (V1 / 100);
-									}
-									
-									if (V2 != 0) {
-										P2 = P2 * (V2 / 100);
-									}
-
-									P = (P1 + P2) / 2;
-								}
-								else {
-									P = (P1 + P2) / 2;
-								}
-
-								FVector vertex = (offset * chunk->resolution + FVector(x, y, z) + P) * params.unitScale;
-								curBuffer->ShiftedVertices.Add(vertex);
-								curBuffer->Triangles.Add(curBuffer->NumOfVertices);
-								curBuffer->vertexColors.Add(FLinearColor::Black);
-								curBuffer->NumOfVertices++;
-							}
-
-							//For each triangle in voxel
-							for (int i = 0; i < voxelVertices.Num() / 3; i++) {
-								curBuffer->UV0.Add(FVector2D(0, 0));
-								curBuffer->UV0.Add(FVector2D(1, 0));
-								curBuffer->UV0.Add(FVector2D(0, 1));
-							}
-						}
-					}
-				}
-			}
+		int endX = (threadId == threadCount - 1) ? chunk->resolution : startX + (chunk->resolution / threadCount);
+		TMap<EVoxelType, FProcMeshSection>* slab = &slabSections[threadId];
+		waitingSlabs.Add(Async(EAsyncExecution::ThreadPool, [this, input, startX, endX, slab]() {
+			Mesher->MeshSlab(input, startX, endX, *slab);
+			}));
+	}
+	//End creating threads
 
-			for (auto& buffer : subTypeBuffers) {
-				for (int ti = 0; ti < buffer.Value.ShiftedVertices.Num() / 3; ti++) {
-					FVector va = buffer.Value.ShiftedVertices[(3 * ti)];
-					FVector vb = buffer.Value.ShiftedVertices[(3 * ti) + 1];
-					FVector vc = buffer.Value.ShiftedVertices[(3 * ti) + 2];
+	for (TFuture<void>& waitingSlab : waitingSlabs) {
+		waitingSlab.Wait();
+	}
 
-					FVector e1 = va - vb;
-					FVector e2 = vc - vb;
-					FVector no = FVector().CrossProduct(e1, e2);
-					no.Normalize();
+	TMap<EVoxelType, FProcMeshSection> sections;
+	MergeSlabSections(slabSections, sections);
 
-					buffer.Value.normals.Add(no);
-					buffer.Value.normals.Add(no);
-					buffer.Value.normals.Add(no);
-				}
-			}
+	if (lodLevel > 0) {
+		SimplifySections(chunk, lodLevel, sections);
+	}
 
-			return subTypeBuffers;
-			}));
+	UploadChunkSections(iChunk, contentHash, lodLevel, MoveTemp(sections));
+
+	ChunksDrawn.Add(chunk->offset);
+}
+
+FVoxelMeshInput AVObject::MakeMeshInput(FChunk* chunk)
+{
+	FVoxelMeshInput input;
+	input.chunk = chunk;
+	input.storage = storage;
+	input.marchingCubesUtil = MarchingCubesUtil;
+	input.unitScale = params.unitScale;
+	input.bUseVoxelInterpolation = params.bUseVoxelInterpolation;
+	return input;
+}
+
+int AVObject::GetSimplificationLevel(FVector chunkOffset)
+{
+	if (!params.bSimplifyDistantChunks) {
+		return 0;
 	}
-	//End creating threads
 
-	//Buffer map. Master buffer map that all sub buffers will be added into
-	TMap<EVoxelType, FTypeBuffer> typeBuffers;
-	for (int threadId = 0; threadId < threadCount; threadId++) {
-		while (!waitingSubBuffers[threadId].IsReady()) {
-			//Wait until ready
+	float distance = FVector::Dist(chunkOffset, centerChunk);
+	if (distance <= params.simplificationStartDistance) {
+		return 0;
+	}
+	return FMath::FloorToInt(distance - params.simplificationStartDistance) + 1;
+}
+
+void AVObject::MergeSlabSections(TArray<TMap<EVoxelType, FProcMeshSection>>& slabSections, TMap<EVoxelType, FProcMeshSection>& outSections)
+{
+	struct FSlabCopy {
+		const FProcMeshSection* source;
+		FProcMeshSection* target;
+		int32 vertexOffset;
+		int32 indexOffset;
+	};
+
+	//Size every type's final buffers once, before anything is written to them
+	TMap<EVoxelType, FIntPoint> totals;
+	for (TMap<EVoxelType, FProcMeshSection>& slab : slabSections) {
+		for (auto& sectionPair : slab) {
+			FIntPoint& total = totals.FindOrAdd(sectionPair.Key);
+			total.X += sectionPair.Value.ProcVertexBuffer.Num();
+			total.Y += sectionPair.Value.ProcIndexBuffer.Num();
+			outSections.FindOrAdd(sectionPair.Key).SectionLocalBox += sectionPair.Value.SectionLocalBox;
 		}
+	}
+	for (auto& totalPair : totals) {
+		FProcMeshSection* target = outSections.Find(totalPair.Key);
+		target->ProcVertexBuffer.SetNumUninitialized(totalPair.Value.X);
+		target->ProcIndexBuffer.SetNumUninitialized(totalPair.Value.Y);
+	}
 
-		//UE_LOG(LogTemp, Warning, TEXT("Thread %d begin merging into chunk id: %d"), threadId, iChunk);
-		for (auto& bufferPair : waitingSubBuffers[threadId].Get()) {
-			//Check if buffer of needed type has been created yet.
-			if (!typeBuffers.Contains(bufferPair.Key)) {
-				typeBuffers.Add(bufferPair.Key, FTypeBuffer());
-			}
+	//Give each slab its range in them, in slab order
+	TArray<FSlabCopy> copies;
+	TMap<EVoxelType, FIntPoint> offsets;
+	for (TMap<EVoxelType, FProcMeshSection>& slab : slabSections) {
+		for (auto& sectionPair : slab) {
+			FIntPoint& offset = offsets.FindOrAdd(sectionPair.Key);
+			copies.Add({ &sectionPair.Value, outSections.Find(sectionPair.Key), offset.X, offset.Y });
+			offset.X += sectionPair.Value.ProcVertexBuffer.Num();
+			offset.Y += sectionPair.Value.ProcIndexBuffer.Num();
+		}
+	}
 
-			//Get associated buffer
-			FTypeBuffer* buffer = typeBuffers.Find(bufferPair.Key);
+	//Slab ranges never overlap so they are filled in parallel. Slab indices start at 0 so shift them to the slab's vertex offset.
+	ParallelFor(copies.Num(), [&copies](int32 copyIndex) {
+		const FSlabCopy& copy = copies[copyIndex];
+		FMemory::Memcpy(copy.target->ProcVertexBuffer.GetData() + copy.vertexOffset, copy.source->ProcVertexBuffer.GetData(), copy.source->ProcVertexBuffer.Num() * sizeof(FProcMeshVertex));
 
-			//Add sub buffer to master buffer
-			buffer->NumOfVertices += bufferPair.Value.NumOfVertices;
-			buffer->ShiftedVertices += bufferPair.Value.ShiftedVertices;
-			buffer->Triangles += bufferPair.Value.Triangles;
-			buffer->normals += bufferPair.Value.normals;
-			buffer->UV0 += bufferPair.Value.UV0;
-			buffer->vertexColors += bufferPair.Value.vertexColors;
+		uint32* targetIndex = copy.target->ProcIndexBuffer.GetData() + copy.indexOffset;
+		for (uint32 index : copy.source->ProcIndexBuffer) {
+			*targetIndex++ = index + copy.vertexOffset;
 		}
+		});
+}
+
+void AVObject::SimplifySections(FChunk* chunk, int lodLevel, TMap<EVoxelType, FProcMeshSection>& sections)
+{
+	float ratio = FMath::Max(params.simplificationMinRatio, FMath::Pow(0.5f, lodLevel));
+	float scale = params.unitScale;
+
+	//Vertices on the chunk faces stay put so the neighbours remain watertight
+	FVector chunkMin = chunk->offset * chunk->resolution * params.unitScale;
+	FBox chunkBounds = FBox(chunkMin, chunkMin + FVector(chunk->resolution * params.unitScale));
+
+	//One worker per voxel type
+	TArray<TFuture<void>> waitingSections;
+	for (auto& sectionPair : sections) {
+		FProcMeshSection* section = &sectionPair.Value;
+		int targetTriangles = FMath::Max(1, FMath::FloorToInt((section->ProcIndexBuffer.Num() / 3) * ratio));
+
+		waitingSections.Add(Async(EAsyncExecution::ThreadPool, [section, targetTriangles, chunkBounds, scale]() {
+			TArray<FVector> inPositions;
+			inPositions.Reserve(section->ProcVertexBuffer.Num());
+			for (const FProcMeshVertex& vertex : section->ProcVertexBuffer) {
+				inPositions.Add(vertex.Position);
+			}
+			TArray<int32> inIndices;
+			inIndices.Reserve(section->ProcIndexBuffer.Num());
+			for (uint32 index : section->ProcIndexBuffer) {
+				inIndices.Add(index);
+			}
+
+			TArray<FVector> positions;
+			TArray<int32> indices;
+			TArray<FVector> normals;
+			FMeshSimplifier::Simplify(inPositions, inIndices, targetTriangles, chunkBounds, scale, positions, indices, normals);
+
+			section->ProcVertexBuffer.SetNum(positions.Num());
+			section->SectionLocalBox.Init();
+			for (int v = 0; v < positions.Num(); v++) {
+				FProcMeshVertex& vertex = section->ProcVertexBuffer[v];
+				vertex.Position = positions[v];
+				vertex.Normal = normals[v];
+				vertex.UV0 = FVector2D(0, 0);
+				vertex.Color = FColor::Black;
+				section->SectionLocalBox += positions[v];
+			}
+			section->ProcIndexBuffer.SetNumUninitialized(indices.Num());
+			for (int i = 0; i < indices.Num(); i++) {
+				section->ProcIndexBuffer[i] = indices[i];
+			}
+			}));
 	}
 
-	//Per buffer, draw buffer
+	for (TFuture<void>& waitingSection : waitingSections) {
+		waitingSection.Wait();
+	}
+}
+
+void AVObject::UploadChunkSections(int iChunk, uint32 contentHash, int lodLevel, TMap<EVoxelType, FProcMeshSection>&& sections)
+{
+	UProceduralMeshComponent* chunkMesh = *ChunkMeshMap.Find(iChunk);
+	FDrawnChunkMesh& drawnMesh = DrawnChunkMeshes.FindOrAdd(iChunk);
+	drawnMesh.contentHash = contentHash;
+	drawnMesh.lodLevel = lodLevel;
+	drawnMesh.drawSerial = ++DrawSerialCounter;
+	drawnMesh.sectionTypes.Reset();
+
 	int meshSections = 0;
-	for (auto& bufferPair : typeBuffers) {
-		EVoxelType key = bufferPair.Key;
-		UE_LOG(LogTemp, Warning, TEXT("Before Coloring"));
-		(*ChunkMeshMap.Find(iChunk))->CreateMeshSection_LinearColor(meshSections, bufferPair.Value.ShiftedVertices, bufferPair.Value.Triangles, bufferPair.Value.normals, bufferPair.Value.UV0, bufferPair.Value.vertexColors, bufferPair.Value.tangents, params.bCalcCollision);
-		UE_LOG(LogTemp, Warning, TEXT("Before collision setting"));
-		(*ChunkMeshMap.Find(iChunk))->ContainsPhysicsTriMeshData(params.bCalcCollision);
-		UE_LOG(LogTemp, Warning, TEXT("before mat check"));
+	for (auto& sectionPair : sections) {
+		EVoxelType key = sectionPair.Key;
+
+		//SetProcMeshSection only copies, so move the buffers into the component's own section and hand that back to it
+		//to refresh bounds and render state. Render sections never cook collision, UpdateCollision builds it separately.
+		if (meshSections >= chunkMesh->GetNumSections()) {
+			chunkMesh->SetProcMeshSection(meshSections, FProcMeshSection());
+		}
+		FProcMeshSection* meshSection = chunkMesh->GetProcMeshSection(meshSections);
+		*meshSection = MoveTemp(sectionPair.Value);
+		meshSection->bEnableCollision = false;
+		chunkMesh->SetProcMeshSection(meshSections, *meshSection);
+		drawnMesh.sectionTypes.Add(key);
+
 		if (mapVoxelTypeToMaterial.materialMap.Num() > 0) {
-			UE_LOG(LogTemp, Warning, TEXT("before setting material"));
-			(*ChunkMeshMap.Find(iChunk))->SetMaterial(meshSections, *mapVoxelTypeToMaterial.materialMap.Find(key));
-			UE_LOG(LogTemp, Warning, TEXT("after setting material"));
+			chunkMesh->SetMaterial(meshSections, *mapVoxelTypeToMaterial.materialMap.Find(key));
 		}
 		else {
 			if (HasAuthority()) {
@@ -504,7 +603,250 @@ void AVObject::DrawChunk(FChunk* chunk)
 
 		meshSections++;
 	}
-	typeBuffers.Empty();
 
-	ChunksDrawn.Add(chunk->offset);
+	//Drop sections left over from a previous draw with more voxel types
+	for (int section = meshSections; section < chunkMesh->GetNumSections(); section++) {
+		chunkMesh->ClearMeshSection(section);
+	}
+}
+
+void AVObject::StashChunkMesh(int iChunk)
+{
+	FDrawnChunkMesh* drawnMesh = DrawnChunkMeshes.Find(iChunk);
+	UProceduralMeshComponent** chunkMesh = ChunkMeshMap.Find(iChunk);
+	if (drawnMesh == nullptr || chunkMesh == nullptr) {
+		return;
+	}
+
+	//Take the buffers out of the component, it is about to be destroyed or refilled
+	TMap<EVoxelType, FProcMeshSection> sections;
+	for (int section = 0; section < drawnMesh->sectionTypes.Num() && section < (*chunkMesh)->GetNumSections(); section++) {
+		sections.Add(drawnMesh->sectionTypes[section], MoveTemp(*(*chunkMesh)->GetProcMeshSection(section)));
+	}
+	AddCachedMesh(iChunk, drawnMesh->contentHash, drawnMesh->lodLevel, MoveTemp(sections));
+}
+
+FChunkMeshCacheEntry* AVObject::FindCachedMesh(int iChunk, uint32 contentHash, int lodLevel)
+{
+	int64 cacheKey = MeshCacheKey(iChunk, lodLevel);
+	FChunkMeshCacheEntry* entry = MeshCache.Find(cacheKey);
+	if (entry == nullptr) {
+		return nullptr;
+	}
+
+	//Built from content the chunk no longer has
+	if (entry->contentHash != contentHash) {
+		RemoveCachedMesh(cacheKey);
+		return nullptr;
+	}
+
+	entry->lastUsed = ++MeshCacheClock;
+	return entry;
+}
+
+void AVObject::AddCachedMesh(int iChunk, uint32 contentHash, int lodLevel, TMap<EVoxelType, FProcMeshSection>&& sections)
+{
+	//Only the newest mesh of a chunk is kept per detail level
+	int64 cacheKey = MeshCacheKey(iChunk, lodLevel);
+	RemoveCachedMesh(cacheKey);
+
+	FChunkMeshCacheEntry entry;
+	entry.contentHash = contentHash;
+	entry.lodLevel = lodLevel;
+	entry.lastUsed = ++MeshCacheClock;
+	entry.sections = MoveTemp(sections);
+	for (auto& sectionPair : entry.sections) {
+		entry.sizeBytes += sectionPair.Value.ProcVertexBuffer.GetAllocatedSize() + sectionPair.Value.ProcIndexBuffer.GetAllocatedSize();
+	}
+
+	SIZE_T budget = (SIZE_T)params.meshCacheBudgetMB * 1024 * 1024;
+	if (entry.sizeBytes > budget) {
+		return;
+	}
+
+	MeshCacheBytes += entry.sizeBytes;
+	MeshCache.Add(cacheKey, MoveTemp(entry));
+
+	//Evict least recently used meshes until back under budget
+	while (MeshCacheBytes > budget) {
+		int64 oldestKey = cacheKey;
+		uint64 oldestUse = MAX_uint64;
+		for (auto& cachePair : MeshCache) {
+			if (cachePair.Value.lastUsed < oldestUse) {
+				oldestUse = cachePair.Value.lastUsed;
+				oldestKey = cachePair.Key;
+			}
+		}
+		RemoveCachedMesh(oldestKey);
+	}
+}
+
+void AVObject::RemoveCachedMesh(int64 cacheKey)
+{
+	FChunkMeshCacheEntry* entry = MeshCache.Find(cacheKey);
+	if (entry != nullptr) {
+		MeshCacheBytes -= entry->sizeBytes;
+		MeshCache.Remove(cacheKey);
+	}
+}
+
+void AVObject::UpdateCollision()
+{
+	//Chunk coordinates of every pawn in the world
+	TArray<FVector> pawnChunks;
+	for (TActorIterator<APawn> pawnIt(GetWorld()); pawnIt; ++pawnIt) {
+		pawnChunks.Add(getChunkCoordinatesFromWorldLocation(pawnIt->GetActorLocation()));
+	}
+
+	TSet<int> chunksInRange;
+	for (auto& meshPair : ChunkMeshMap) {
+		FChunk* chunk = storage->getChunk((uint32)meshPair.Key);
+		if (chunk == nullptr) {
+			continue;
+		}
+
+		for (const FVector& pawnChunk : pawnChunks) {
+			if (FVector::Dist(chunk->offset, pawnChunk) <= params.collisionRadius) {
+				chunksInRange.Add(meshPair.Key);
+				break;
+			}
+		}
+	}
+
+	//Drop collision that left the radius
+	TArray<int> collisionChunks;
+	ChunkCollisionStates.GetKeys(collisionChunks);
+	for (int iChunk : collisionChunks) {
+		if (!chunksInRange.Contains(iChunk)) {
+			RemoveChunkCollision(iChunk);
+		}
+	}
+
+	//Build collision that is missing or older than the drawn mesh
+	for (int iChunk : chunksInRange) {
+		FDrawnChunkMesh* drawnMesh = DrawnChunkMeshes.Find(iChunk);
+		if (drawnMesh == nullptr) {
+			continue;
+		}
+
+		FChunkCollisionState& state = ChunkCollisionStates.FindOrAdd(iChunk);
+		if (state.builtDrawSerial != drawnMesh->drawSerial && state.pendingDrawSerial != drawnMesh->drawSerial) {
+			BuildChunkCollision(iChunk);
+		}
+	}
+}
+
+void AVObject::BuildChunkCollision(int iChunk)
+{
+	UProceduralMeshComponent* chunkMesh = *ChunkMeshMap.Find(iChunk);
+	uint32 drawSerial = DrawnChunkMeshes.Find(iChunk)->drawSerial;
+	ChunkCollisionStates.FindOrAdd(iChunk).pendingDrawSerial = drawSerial;
+
+	//Merge every voxel type section into one collision mesh
+	TArray<FVector> positions;
+	TArray<int32> indices;
+	for (int section = 0; section < chunkMesh->GetNumSections(); section++) {
+		FProcMeshSection* meshSection = chunkMesh->GetProcMeshSection(section);
+		int32 baseVertex = positions.Num();
+		for (const FProcMeshVertex& vertex : meshSection->ProcVertexBuffer) {
+			positions.Add(vertex.Position);
+		}
+		for (uint32 index : meshSection->ProcIndexBuffer) {
+			indices.Add(baseVertex + index);
+		}
+	}
+
+	FChunk* chunk = storage->getChunk((uint32)iChunk);
+	FVector chunkMin = chunk->offset * chunk->resolution * params.unitScale;
+	FBox chunkBounds = FBox(chunkMin, chunkMin + FVector(chunk->resolution * params.unitScale));
+	bool bSimplify = params.bSimplifyCollision;
+	float ratio = params.collisionSimplificationRatio;
+	float scale = params.unitScale;
+	TWeakObjectPtr<AVObject> weakThis(this);
+
+	Async(EAsyncExecution::ThreadPool, [weakThis, iChunk, drawSerial, bSimplify, ratio, scale, chunkBounds, positions = MoveTemp(positions), indices = MoveTemp(indices)]() mutable {
+		if (bSimplify) {
+			TArray<FVector> simplePositions;
+			TArray<int32> simpleIndices;
+			TArray<FVector> normals;
+			int targetTriangles = FMath::Max(1, FMath::FloorToInt((indices.Num() / 3) * ratio));
+			FMeshSimplifier::Simplify(positions, indices, targetTriangles, chunkBounds, scale, simplePositions, simpleIndices, normals);
+			positions = MoveTemp(simplePositions);
+			indices = MoveTemp(simpleIndices);
+		}
+
+		AsyncTask(ENamedThreads::GameThread, [weakThis, iChunk, drawSerial, positions = MoveTemp(positions), indices = MoveTemp(indices)]() mutable {
+			if (weakThis.IsValid()) {
+				weakThis->ApplyChunkCollision(iChunk, drawSerial, positions, indices);
+			}
+			});
+		});
+}
+
+void AVObject::ApplyChunkCollision(int iChunk, uint32 drawSerial, TArray<FVector>& positions, TArray<int32>& indices)
+{
+	//Chunk left the collision radius or was redrawn while this was building
+	FChunkCollisionState* state = ChunkCollisionStates.Find(iChunk);
+	if (state == nullptr || state->pendingDrawSerial != drawSerial) {
+		return;
+	}
+	state->pendingDrawSerial = 0;
+	state->builtDrawSerial = drawSerial;
+
+	if (!ChunkCollisionMap.Contains(iChunk))
+	{
+		UProceduralMeshComponent* collisionMesh = NewObject<UProceduralMeshComponent>(this, UProceduralMeshComponent::StaticClass());
+		collisionMesh->bUseAsyncCooking = true;
+		collisionMesh->SetVisibility(false);
+		collisionMesh->SetHiddenInGame(true);
+		ChunkCollisionMap.Add(iChunk, collisionMesh);
+		collisionMesh->AttachToComponent(root, FAttachmentTransformRules::SnapToTargetIncludingScale);
+		collisionMesh->RegisterComponent();
+	}
+
+	(*ChunkCollisionMap.Find(iChunk))->CreateMeshSection(0, positions, indices, TArray<FVector>(), TArray<FVector2D>(), TArray<FColor>(), TArray<FProcMeshTangent>(), true);
+}
+
+void AVObject::RemoveChunkCollision(int iChunk)
+{
+	ChunkCollisionStates.Remove(iChunk);
+
+	UProceduralMeshComponent** collisionMesh = ChunkCollisionMap.Find(iChunk);
+	if (collisionMesh != nullptr) {
+		(*collisionMesh)->DestroyComponent();
+		ChunkCollisionMap.Remove(iChunk);
+	}
+}
+
+void AVObject::BenchmarkMeshers()
+{
+	TArray<EVoxelMesherType> mesherTypes = { EVoxelMesherType::MarchingCubes, EVoxelMesherType::SurfaceNets };
+	for (EVoxelMesherType mesherType : mesherTypes) {
+		TSharedRef<FVoxelMesher> mesher = FVoxelMesher::Create(mesherType);
+
+		int chunkCount = 0;
+		int vertexCount = 0;
+		int triangleCount = 0;
+		double startTime = FPlatformTime::Seconds();
+
+		for (uint32 chunkId : storage->getChunkSet()) {
+			FChunk* chunk = storage->getChunk(chunkId);
+			if (chunk->bIsEmpty) {
+				continue;
+			}
+
+			TMap<EVoxelType, FProcMeshSection> sections;
+			mesher->MeshSlab(MakeMeshInput(chunk), 0, chunk->resolution, sections);
+
+			chunkCount++;
+			for (auto& sectionPair : sections) {
+				vertexCount += sectionPair.Value.ProcVertexBuffer.Num();
+				triangleCount += sectionPair.Value.ProcIndexBuffer.Num() / 3;
+			}
+		}
+
+		double milliseconds = (FPlatformTime::Seconds() - startTime) * 1000.0;
+		UE_LOG(LogTemp, Display, TEXT("Mesher %s: %d chunks in %.2f ms (%.3f ms/chunk), %d vertices, %d triangles"),
+			*UEnum::GetValueAsString(mesherType), chunkCount, milliseconds, chunkCount > 0 ? milliseconds / chunkCount : 0.0, vertexCount, triangleCount);
+	}
 }
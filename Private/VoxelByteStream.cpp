@@ -0,0 +1,167 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "VoxelByteStream.h"
+
+const uint8* FVoxelByteReader::Take(int32 Num)
+{
+    if (bError || Num < 0 || Num > Remaining())
+    {
+        bError = true;
+        return nullptr;
+    }
+
+    const uint8* data = Bytes.GetData() + Pos;
+    Pos += Num;
+    return data;
+}
+
+uint8 FVoxelByteReader::ReadUInt8()
+{
+    const uint8* data = Take(1);
+    return data ? data[0] : 0;
+}
+
+uint32 FVoxelByteReader::ReadUInt32LE()
+{
+    const uint8* data = Take(4);
+    if (!data)
+    {
+        return 0;
+    }
+    return (uint32)data[0] | ((uint32)data[1] << 8) | ((uint32)data[2] << 16) | ((uint32)data[3] << 24);
+}
+
+uint32 FVoxelByteReader::ReadUInt32BE()
+{
+    const uint8* data = Take(4);
+    if (!data)
+    {
+        return 0;
+    }
+    return ((uint32)data[0] << 24) | ((uint32)data[1] << 16) | ((uint32)data[2] << 8) | (uint32)data[3];
+}
+
+uint64 FVoxelByteReader::ReadUInt64LE()
+{
+    uint64 low = ReadUInt32LE();
+    uint64 high = ReadUInt32LE();
+    return low | (high << 32);
+}
+
+float FVoxelByteReader::ReadFloatLE()
+{
+    uint32 bits = ReadUInt32LE();
+    float result;
+    FMemory::Memcpy(&result, &bits, sizeof(float));
+    return result;
+}
+
+uint64 FVoxelByteReader::ReadVarUInt64()
+{
+    uint64 result = 0;
+    for (int32 shift = 0; shift < 64; shift += 7)
+    {
+        uint8 byte = ReadUInt8();
+        result |= (uint64)(byte & 0x7f) << shift;
+        if (bError || !(byte & 0x80))
+        {
+            return bError ? 0 : result;
+        }
+    }
+
+    bError = true;
+    return 0;
+}
+
+TArrayView<const uint8> FVoxelByteReader::ReadSpan(int32 Num)
+{
+    const uint8* data = Take(Num);
+    return data ? TArrayView<const uint8>(data, Num) : TArrayView<const uint8>();
+}
+
+bool FVoxelByteReader::ReadBytes(int32 Num, TArray<uint8>& Out)
+{
+    const uint8* data = Take(Num);
+    if (!data)
+    {
+        return false;
+    }
+    Out.Append(data, Num);
+    return true;
+}
+
+bool FVoxelByteReader::Skip(int32 Num)
+{
+    return Take(Num) != nullptr;
+}
+
+void FVoxelByteWriter::WriteUInt8(uint8 Value)
+{
+    Bytes.Add(Value);
+}
+
+void FVoxelByteWriter::WriteUInt32LE(uint32 Value)
+{
+    uint8 data[4] = { (uint8)Value, (uint8)(Value >> 8), (uint8)(Value >> 16), (uint8)(Value >> 24) };
+    Bytes.Append(data, 4);
+}
+
+void FVoxelByteWriter::WriteUInt32BE(uint32 Value)
+{
+    uint8 data[4] = { (uint8)(Value >> 24), (uint8)(Value >> 16), (uint8)(Value >> 8), (uint8)Value };
+    Bytes.Append(data, 4);
+}
+
+void FVoxelByteWriter::WriteUInt64LE(uint64 Value)
+{
+    WriteUInt32LE((uint32)Value);
+    WriteUInt32LE((uint32)(Value >> 32));
+}
+
+void FVoxelByteWriter::WriteFloatLE(float Value)
+{
+    uint32 bits;
+    FMemory::Memcpy(&bits, &Value, sizeof(float));
+    WriteUInt32LE(bits);
+}
+
+void FVoxelByteWriter::WriteVarUInt64(uint64 Value)
+{
+    while (Value >= 0x80)
+    {
+        Bytes.Add((uint8)(Value | 0x80));
+        Value >>= 7;
+    }
+    Bytes.Add((uint8)Value);
+}
+
+void FVoxelByteWriter::WriteBytes(TArrayView<const uint8> Value)
+{
+    Bytes.Append(Value.GetData(), Value.Num());
+}
+
+int32 FVoxelByteWriter::ReserveUInt32()
+{
+    int32 offset = Bytes.Num();
+    Bytes.AddZeroed(4);
+    return offset;
+}
+
+void FVoxelByteWriter::PatchUInt32LE(int32 Offset, uint32 Value)
+{
+    check(Offset >= 0 && Offset + 4 <= Bytes.Num());
+    Bytes[Offset] = (uint8)Value;
+    Bytes[Offset + 1] = (uint8)(Value >> 8);
+    Bytes[Offset + 2] = (uint8)(Value >> 16);
+    Bytes[Offset + 3] = (uint8)(Value >> 24);
+}
+
+void FVoxelByteWriter::PatchUInt32BE(int32 Offset, uint32 Value)
+{
+    check(Offset >= 0 && Offset + 4 <= Bytes.Num());
+    Bytes[Offset] = (uint8)(Value >> 24);
+    Bytes[Offset + 1] = (uint8)(Value >> 16);
+    Bytes[Offset + 2] = (uint8)(Value >> 8);
+    Bytes[Offset + 3] = (uint8)Value;
+}
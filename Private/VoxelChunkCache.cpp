@@ -0,0 +1,89 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "VoxelChunkCache.h"
+#include "VoxelChunkCodec.h"
+
+void FVoxelChunkCache::SetBudget(SIZE_T InBudgetBytes)
+{
+    FScopeLock ScopeLock(&Lock);
+    BudgetBytes = InBudgetBytes;
+}
+
+void FVoxelChunkCache::Put(const FIntVector& Chunk, uint32 Version, TArrayView<const uint8> Materials, TArrayView<const uint8> Densities)
+{
+    // encode before taking the lock, the socket thread may be waiting on it
+    FCachedChunk entry;
+    entry.Version = Version;
+    FVoxelByteWriter writer(entry.Data);
+    FVoxelChunkCodec::Encode(FVoxelChunkCodec::ChooseCodec(FVoxelChunkCodec::GetSupportedCodecMask()), Materials, Densities, writer);
+
+    FScopeLock ScopeLock(&Lock);
+
+    // only the newest copy of a chunk is kept
+    RemoveLocked(Chunk);
+
+    SIZE_T size = entry.Data.GetAllocatedSize();
+    if (size > BudgetBytes)
+    {
+        return;
+    }
+
+    StoreOrder.AddTail(Chunk);
+    entry.OrderNode = StoreOrder.GetTail();
+    Bytes += size;
+    Entries.Add(Chunk, MoveTemp(entry));
+
+    // evict least recently stored chunks until back under budget, the new one is at the tail and fits on its own
+    while (Bytes > BudgetBytes)
+    {
+        // copied, RemoveLocked frees the node holding it
+        FIntVector oldestChunk = StoreOrder.GetHead()->GetValue();
+        RemoveLocked(oldestChunk);
+    }
+}
+
+uint32 FVoxelChunkCache::GetVersion(const FIntVector& Chunk) const
+{
+    FScopeLock ScopeLock(&Lock);
+    const FCachedChunk* entry = Entries.Find(Chunk);
+    return entry != nullptr ? entry->Version : 0;
+}
+
+bool FVoxelChunkCache::Take(const FIntVector& Chunk, uint32& OutVersion, TArray<uint8>& OutMaterials, TArray<uint8>& OutDensities)
+{
+    TArray<uint8> data;
+    {
+        FScopeLock ScopeLock(&Lock);
+        FCachedChunk* entry = Entries.Find(Chunk);
+        if (entry == nullptr)
+        {
+            return false;
+        }
+        OutVersion = entry->Version;
+        Bytes -= entry->Data.GetAllocatedSize();
+        data = MoveTemp(entry->Data);
+        StoreOrder.RemoveNode(entry->OrderNode);
+        Entries.Remove(Chunk);
+    }
+
+    FVoxelByteReader reader(data);
+    return FVoxelChunkCodec::Decode(reader, OutMaterials, OutDensities);
+}
+
+void FVoxelChunkCache::Remove(const FIntVector& Chunk)
+{
+    FScopeLock ScopeLock(&Lock);
+    RemoveLocked(Chunk);
+}
+
+void FVoxelChunkCache::RemoveLocked(const FIntVector& Chunk)
+{
+    FCachedChunk* entry = Entries.Find(Chunk);
+    if (entry != nullptr)
+    {
+        Bytes -= entry->Data.GetAllocatedSize();
+        StoreOrder.RemoveNode(entry->OrderNode);
+        Entries.Remove(Chunk);
+    }
+}
@@ -0,0 +1,182 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "VoxelChunkCodec.h"
+#include "Misc/Compression.h"
+
+uint32 FVoxelChunkCodec::GetSupportedCodecMask()
+{
+    return GetCodecBit(EVoxelChunkCodec::None) | GetCodecBit(EVoxelChunkCodec::Rle) | GetCodecBit(EVoxelChunkCodec::RleLz4);
+}
+
+EVoxelChunkCodec FVoxelChunkCodec::ChooseCodec(uint32 CodecMask)
+{
+    uint32 common = CodecMask & GetSupportedCodecMask();
+    if (common & GetCodecBit(EVoxelChunkCodec::RleLz4))
+    {
+        return EVoxelChunkCodec::RleLz4;
+    }
+    if (common & GetCodecBit(EVoxelChunkCodec::Rle))
+    {
+        return EVoxelChunkCodec::Rle;
+    }
+    return EVoxelChunkCodec::None;
+}
+
+void FVoxelChunkCodec::Encode(EVoxelChunkCodec Codec, TArrayView<const uint8> Materials, TArrayView<const uint8> Densities, FVoxelByteWriter& Writer)
+{
+    check(Materials.Num() == Densities.Num());
+
+    if (Codec == EVoxelChunkCodec::None)
+    {
+        Writer.WriteUInt8((uint8)Codec);
+        Writer.WriteUInt32BE(Materials.Num());
+        Writer.WriteBytes(Materials);
+        Writer.WriteBytes(Densities);
+        return;
+    }
+
+    TArray<uint8> rle;
+    RleEncode(Materials, rle);
+    RleEncode(Densities, rle);
+
+    // RleLz4: the run stream still repeats (air runs of the same length), LZ4 takes those out
+    int32 compressedSize = 0;
+    TArray<uint8> compressed;
+    if (Codec == EVoxelChunkCodec::RleLz4)
+    {
+        compressedSize = FCompression::CompressMemoryBound(NAME_LZ4, rle.Num());
+        compressed.SetNumUninitialized(compressedSize);
+        if (!FCompression::CompressMemory(NAME_LZ4, compressed.GetData(), compressedSize, rle.GetData(), rle.Num()))
+        {
+            // the run stream alone is still a valid chunk, and every decoder of RleLz4 decodes Rle as its first stage
+            UE_LOG(LogTemp, Warning, TEXT("LZ4 failed on a %d byte run stream, sending the chunk as Rle"), rle.Num());
+            Codec = EVoxelChunkCodec::Rle;
+        }
+    }
+
+    Writer.WriteUInt8((uint8)Codec);
+    Writer.WriteUInt32BE(Materials.Num());
+
+    if (Codec == EVoxelChunkCodec::Rle)
+    {
+        Writer.WriteUInt32BE(rle.Num());
+        Writer.WriteBytes(rle);
+        return;
+    }
+
+    Writer.WriteUInt32BE(rle.Num());
+    Writer.WriteUInt32BE(compressedSize);
+    Writer.WriteBytes(TArrayView<const uint8>(compressed.GetData(), compressedSize));
+}
+
+bool FVoxelChunkCodec::Decode(FVoxelByteReader& Reader, TArray<uint8>& OutMaterials, TArray<uint8>& OutDensities)
+{
+    EVoxelChunkCodec codec = (EVoxelChunkCodec)Reader.ReadUInt8();
+    uint32 numVoxels = Reader.ReadUInt32BE();
+    if (Reader.IsError() || numVoxels > MaxVoxels)
+    {
+        return false;
+    }
+
+    OutMaterials.Reset();
+    OutDensities.Reset();
+
+    switch (codec)
+    {
+    case EVoxelChunkCodec::None:
+        return Reader.ReadBytes(numVoxels, OutMaterials) && Reader.ReadBytes(numVoxels, OutDensities);
+
+    case EVoxelChunkCodec::Rle:
+    {
+        uint32 rleSize = Reader.ReadUInt32BE();
+        FVoxelByteReader rleReader(Reader.ReadSpan(rleSize));
+        return !Reader.IsError()
+            && RleDecode(rleReader, numVoxels, OutMaterials)
+            && RleDecode(rleReader, numVoxels, OutDensities);
+    }
+
+    case EVoxelChunkCodec::RleLz4:
+    {
+        uint32 rleSize = Reader.ReadUInt32BE();
+        uint32 compressedSize = Reader.ReadUInt32BE();
+        TArrayView<const uint8> compressed = Reader.ReadSpan(compressedSize);
+
+        // two runs per voxel is the worst case for the run stream
+        if (Reader.IsError() || rleSize > numVoxels * 2 * 6)
+        {
+            return false;
+        }
+
+        TArray<uint8> rle;
+        rle.SetNumUninitialized(rleSize);
+        if (!FCompression::UncompressMemory(NAME_LZ4, rle.GetData(), rleSize, compressed.GetData(), compressed.Num()))
+        {
+            return false;
+        }
+
+        FVoxelByteReader rleReader(rle);
+        return RleDecode(rleReader, numVoxels, OutMaterials) && RleDecode(rleReader, numVoxels, OutDensities);
+    }
+
+    default:
+        return false;
+    }
+}
+
+void FVoxelChunkCodec::RleEncode(TArrayView<const uint8> In, TArray<uint8>& Out)
+{
+    int32 i = 0;
+    while (i < In.Num())
+    {
+        uint8 value = In[i];
+        uint32 run = 1;
+        while (i + (int32)run < In.Num() && In[i + run] == value)
+        {
+            run++;
+        }
+        i += run;
+
+        Out.Add(value);
+        do
+        {
+            uint8 lengthByte = run & 0x7F;
+            run >>= 7;
+            Out.Add(run ? (lengthByte | 0x80) : lengthByte);
+        } while (run);
+    }
+}
+
+bool FVoxelChunkCodec::RleDecode(FVoxelByteReader& Reader, int32 NumValues, TArray<uint8>& Out)
+{
+    int32 start = Out.Num();
+    Out.SetNumUninitialized(start + NumValues);
+    uint8* write = Out.GetData() + start;
+    int32 written = 0;
+
+    while (written < NumValues)
+    {
+        uint8 value = Reader.ReadUInt8();
+
+        uint32 run = 0;
+        for (int shift = 0; shift < 35; shift += 7)
+        {
+            uint8 lengthByte = Reader.ReadUInt8();
+            run |= (uint32)(lengthByte & 0x7F) << shift;
+            if (!(lengthByte & 0x80))
+            {
+                break;
+            }
+        }
+
+        // a run past the end means the stream is corrupt
+        if (Reader.IsError() || run == 0 || run > (uint32)(NumValues - written))
+        {
+            return false;
+        }
+
+        FMemory::Memset(write + written, value, run);
+        written += run;
+    }
+    return true;
+}
@@ -5,6 +5,10 @@
 #include <string>
 #include "TcpSocket.h"
 #include "VoxelTcpSocket.h"
+#include "VoxelChunkCodec.h"
+#include "VoxelChunkCache.h"
+#include "VoxelPayloadDecoder.h"
+#include "VoxelStandInServer.h"
 #include "Engine.h"
 #include "VObject.h"
 
@@ -22,6 +26,33 @@ AVoxelManager::AVoxelManager()
 void AVoxelManager::BeginPlay()
 {
 	Super::BeginPlay();
+
+	//Local stand-in storage servers for tests and benchmarks, e.g. -VoxelStandInServers=7001,7002 -VoxelStandInLatencyMs=40
+	//-VoxelStandInSharedMemory connects to them through shared memory instead of loopback
+	FString standInPorts;
+	if (FParse::Value(FCommandLine::Get(), TEXT("VoxelStandInServers="), standInPorts))
+	{
+		float latencyMs = 0.0f;
+		int bandwidthKBps = 0;
+		float lossPercent = 0.0f;
+		FParse::Value(FCommandLine::Get(), TEXT("VoxelStandInLatencyMs="), latencyMs);
+		FParse::Value(FCommandLine::Get(), TEXT("VoxelStandInBandwidthKBps="), bandwidthKBps);
+		FParse::Value(FCommandLine::Get(), TEXT("VoxelStandInLossPercent="), lossPercent);
+		bool bSharedMemory = FParse::Param(FCommandLine::Get(), TEXT("VoxelStandInSharedMemory"));
+
+		TArray<FString> ports;
+		standInPorts.ParseIntoArray(ports, TEXT(","));
+		for (const FString& port : ports)
+		{
+			StartStandInServer(FCString::Atoi(*port), latencyMs, bandwidthKBps, lossPercent, bSharedMemory);
+		}
+	}
+}
+
+void AVoxelManager::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	StopStandInServers();
+	Super::EndPlay(EndPlayReason);
 }
 
 // Called every frame
@@ -29,50 +60,47 @@ void AVoxelManager::Tick(float DeltaTime)
 {
 	Super::Tick(DeltaTime);
 
-	//Check for data from storage server
+	//Apply data from storage server, decoded and built on the socket thread, for as long as the frame budget allows
 	if (IsValid(storageServerConnection))
 	{
-		if (storageServerConnection->getPayloadQueue().Num() > 0)
-		{
-			//UE_LOG(LogTemp, Log, TEXT("Processing data from server. Current Queue Size: %d"), storageServerConnection->getPayloadQueue().Num());
-			FNetPayload netPayload = storageServerConnection->PopFromPayloadQueue();
-
-			//Convert payload data to correct struct
-			//handle the payload
-
-			//Currently only can handle one vObject
+		FVoxelPayloadDecoder& decoder = storageServerConnection->GetPayloadDecoder();
+		maxInboundQueueAge = FMath::Max(maxInboundQueueAge, decoder.GetOldestQueuedAge());
 
-			if (netPayload.payload_type == EPayloadType::Diff) {
-				
-				FNetDiff netDiff;
-				netDiff.fromBytes(netPayload.data);
+		double deadline = FPlatformTime::Seconds() + inboundBudgetMs / 1000.0;
+		bool bStorageChanged = false;
+		payloadsLastTick = 0;
 
-				FPoint point = FPoint(static_cast<EVoxelType>(netDiff.material), netDiff.density);
-				UE_LOG(LogTemp, Warning, TEXT("Processing Diff: (x,y,z): %d %d %d  chunkId: %d  type: %d density: %d "), netDiff.x, netDiff.y, netDiff.z, netDiff.chunk_id, point.type, point.density);
-				createdVObjects[0]->SetPointInChunk(netDiff.x, netDiff.y, netDiff.z, netDiff.chunk_id, point);
-				createdVObjects[0]->ChangeAffectedChunks();
-			}
-			else if (netPayload.payload_type == EPayloadType::Chunk)
-			{
-				FNetChunk netChunk;
-				netChunk.fromBytes(netPayload.data);
-				//UE_LOG(LogTemp, Log, TEXT("Recieved Chunk: %d, %d, %d"), netChunk.x, netChunk.y, netChunk.z);
-
-				createdVObjects[0]->SetChunk(netChunk.x, netChunk.y, netChunk.z, netChunk.density, netChunk.material);
-				createdVObjects[0]->ChangeAffectedChunks();
+		FVoxelDecodedPayload decodedPayload;
+		while ((payloadsLastTick == 0 || FPlatformTime::Seconds() < deadline) && storageServerConnection->DequeueDecodedPayload(decodedPayload))
+		{
+			bStorageChanged |= applyDecodedPayload(decodedPayload);
+			payloadsLastTick++;
+		}
 
-				chunkRequestPending.Remove(FVector(netChunk.x, netChunk.y, netChunk.z));
-				chunkCurrentlyBeingProcessed = false;
-			}
+		//Redraw once for everything applied this frame
+		if (bStorageChanged)
+		{
+			createdVObjects[0]->ChangeAffectedChunks();
 		}
+
+		payloadsApplied += payloadsLastTick;
+		maxPayloadsPerTick = FMath::Max(maxPayloadsPerTick, payloadsLastTick);
 	}
 
-	if (!chunkCurrentlyBeingProcessed && chunkRequestQueue.Num() > 0)
+	if (IsValid(storageServerConnection))
 	{
-		FVector chunkToProcess = chunkRequestQueue.Pop();
-		requestChunk(chunkToProcess.X, chunkToProcess.Y, chunkToProcess.Z);
-		chunkCurrentlyBeingProcessed = true;
+		pumpChunkRequests();
+	}
 
+	if (bReplayingCapture && !storageServerConnection->IsReplaying())
+	{
+		FVoxelPayloadDecoder& decoder = storageServerConnection->GetPayloadDecoder();
+		if (decoder.GetInteractiveDepth() + decoder.GetBulkDepth() == 0)
+		{
+			bReplayingCapture = false;
+			UE_LOG(LogTemp, Display, TEXT("Capture replay applied: %lld frames, %lld payloads in %.1f ms"),
+				storageServerConnection->GetReplayedFrames(), payloadsApplied - replayStartPayloads, (FPlatformTime::Seconds() - replayStartTime) * 1000.0);
+		}
 	}
 
 	if (createdVObjects.Num() > 0)
@@ -107,19 +135,121 @@ AVObject* AVoxelManager::createVOjbect(FVector location, FRotator rotation, FVOb
 bool AVoxelManager::connectToVoxelServer()
 {
 	UE_LOG(LogTemp, Warning, TEXT("Attempting to Connect"));
-	FActorSpawnParameters spawnInfo;
+	if (bConnectingToServer || isVoxelServerConnected())
+	{
+		return true;
+	}
 	if (GetWorld() != nullptr)
 	{
-		storageServerConnection = GetWorld()->SpawnActor<AVoxelTcpSocket>(FVector().ZeroVector, FRotator().ZeroRotator, spawnInfo);
-		storageServerConnection->ConnectToGameServer();
+		spawnStorageServerConnection();
 
-		while (!storageServerConnection->isConnected(0));
+		//A connect that timed out keeps retrying in the background, wait for it again instead of opening a second set
+		bool bAlreadyConnecting = storageServerConnection->HasActiveShards();
+		if (!bAlreadyConnecting)
+		{
+			reseedStorageEndpoints();
+		}
+
+		//The connect runs on the socket threads, the world keeps initializing meanwhile
+		bConnectingToServer = true;
+		connectStartTime = FPlatformTime::Seconds();
+		GetWorldTimerManager().SetTimer(connectTimeoutHandle, this, &AVoxelManager::onConnectTimeout, FMath::Max(connectTimeout, 0.1f), false);
+		if (!bAlreadyConnecting)
+		{
+			storageServerConnection->ConnectToGameServer();
+		}
 
 		return true;
 	}
 	return false;
 }
 
+void AVoxelManager::reseedStorageEndpoints()
+{
+	//Connections of the old endpoints would be left open with nothing tracking them
+	storageServerConnection->DisconnectStorageServers();
+
+	TArray<FString> endpoints = storageServerEndpoints;
+	FString commandLineEndpoints;
+	if (FParse::Value(FCommandLine::Get(), TEXT("VoxelStorageServers="), commandLineEndpoints))
+	{
+		commandLineEndpoints.ParseIntoArray(endpoints, TEXT(","));
+	}
+	else if (standInServers.Num() > 0)
+	{
+		endpoints.Reset();
+		for (const TSharedPtr<FVoxelStandInServer>& standInServer : standInServers)
+		{
+			const FVoxelStandInSettings& settings = standInServer->GetSettings();
+			if (settings.SharedMemoryName.IsEmpty())
+			{
+				endpoints.Add(FString::Printf(TEXT("127.0.0.1:%d"), settings.Port));
+			}
+			else
+			{
+				endpoints.Add(FString::Printf(TEXT("%s%s:%d"), FSharedMemoryTransportFormat::Scheme, *settings.SharedMemoryName, settings.Port));
+			}
+		}
+	}
+	if (!storageServerConnection->SetStorageEndpoints(endpoints))
+	{
+		UE_LOG(LogTemp, Error, TEXT("No valid storage server endpoints, using the default"));
+	}
+
+	FString capturePath;
+	if (FParse::Value(FCommandLine::Get(), TEXT("VoxelNetCapture="), capturePath))
+	{
+		storageServerConnection->StartCapture(capturePath);
+	}
+}
+
+void AVoxelManager::spawnStorageServerConnection()
+{
+	if (IsValid(storageServerConnection))
+	{
+		return;
+	}
+
+	FActorSpawnParameters spawnInfo;
+	storageServerConnection = GetWorld()->SpawnActor<AVoxelTcpSocket>(FVector().ZeroVector, FRotator().ZeroRotator, spawnInfo);
+	storageServerConnection->GetChunkCache().SetBudget((SIZE_T)chunkCacheBudgetMB * 1024 * 1024);
+	storageServerConnection->SetFlowControl(chunkCreditPayloads, chunkCreditMB * 1024 * 1024, maxQueuedChunks);
+	storageServerConnection->GetPayloadDecoder().SetChunkIdStride(MakeVObjectSettings(VoxelTypeMaterialList).chunkResolution);
+	storageServerConnection->OnStorageShardReconnected.AddUObject(this, &AVoxelManager::onStorageShardReconnected);
+	storageServerConnection->OnStorageServerConnected.AddUObject(this, &AVoxelManager::onStorageServerConnected);
+}
+
+bool AVoxelManager::isVoxelServerConnected()
+{
+	return IsValid(storageServerConnection) && storageServerConnection->IsStorageServerConnected();
+}
+
+void AVoxelManager::onStorageServerConnected()
+{
+	if (!bConnectingToServer)
+	{
+		return;
+	}
+
+	bConnectingToServer = false;
+	GetWorldTimerManager().ClearTimer(connectTimeoutHandle);
+	UE_LOG(LogTemp, Log, TEXT("Connected to every storage server in %.1f ms"), (FPlatformTime::Seconds() - connectStartTime) * 1000.0);
+	OnVoxelServerConnected.Broadcast(true);
+}
+
+void AVoxelManager::onConnectTimeout()
+{
+	if (!bConnectingToServer)
+	{
+		return;
+	}
+
+	bConnectingToServer = false;
+	//The shards stay active, so connecting again waits on these retries instead of starting over
+	UE_LOG(LogTemp, Error, TEXT("Storage servers not reachable after %.1f s, still retrying in the background"), connectTimeout);
+	OnVoxelServerConnected.Broadcast(false);
+}
+
 bool AVoxelManager::areVObjectsInitialized()
 {
 	if (createdVObjects.Num() == 0) {
@@ -134,14 +264,18 @@ bool AVoxelManager::areVObjectsInitialized()
 	return true;
 }
 
+FVObjectSettings AVoxelManager::MakeVObjectSettings(UDataTable* voxelTypeMaterialList)
+{
+	return FVObjectSettings(100, 32, 100, 0.5, true, true, true, voxelTypeMaterialList);
+}
+
 void AVoxelManager::InitializeVObjects()
 {
 
 	hasVObjectsInitialized = false;
 
 	//Create vObj
-	FVObjectSettings settings = FVObjectSettings(100, 32, 100, 0.5, true, true, true, VoxelTypeMaterialList);
-	createVOjbect(FVector().ZeroVector, FRotator().ZeroRotator, settings);
+	createVOjbect(FVector().ZeroVector, FRotator().ZeroRotator, MakeVObjectSettings(VoxelTypeMaterialList));
 
 	//get player spawn location
 		//needs to be done on server on gamemode or state
@@ -160,7 +294,7 @@ void AVoxelManager::InitializeVObjects()
 				{
 					//UE_LOG(LogTemp, Warning, TEXT("Queuing %d %d %d to be requested"), x, y, z);
 					chunkRequestQueue.Push(FVector(x, y, z));
-					chunkRequestPending.Add(FVector(x, y, z));
+					addPendingChunk(FVector(x, y, z));
 				}
 			}
 		}
@@ -191,7 +325,7 @@ void AVoxelManager::changeCenterChunk(FVector newCenter)
 					{
 						//UE_LOG(LogTemp, Warning, TEXT("Queuing %f %f %f to be requested"), chunk.X, chunk.Y, chunk.Z);
 						chunkRequestQueue.Push(chunkCoord);
-						chunkRequestPending.Add(chunkCoord);
+						addPendingChunk(chunkCoord);
 						reqCount++;
 					}
 					else if (chunkCoord.X >= 0 && chunkCoord.Y >= 0 && chunkCoord.Z >= 0) {
@@ -203,48 +337,213 @@ void AVoxelManager::changeCenterChunk(FVector newCenter)
 	}
 
 	UE_LOG(LogTemp, Warning, TEXT("Requesting %d chunks"), reqCount);
-	createdVObjects[0]->SetCenterChunk(newCenter);
 
-	//UnRegister from old chunks
+	//Keep old chunks around before the object drops them from storage
+	TArray<uint32> oldChunks;
 	for (uint32 chunkId : chunkSet)
 	{
 		if (!newSet.Contains(chunkId))
 		{
-			unregisterChunk(chunkId);
+			oldChunks.Add(chunkId);
+			if (bUseChunkVersions)
+			{
+				cacheChunk(chunkId);
+			}
 		}
 	}
 
+	createdVObjects[0]->SetCenterChunk(newCenter);
+
+	//UnRegister from old chunks, all in one message
+	unregisterChunks(oldChunks);
+
 }
 
 void AVoxelManager::unregisterChunk(int chunkId)
 {
 	//UE_LOG(LogTemp, Warning, TEXT("UnRequesting Chunk %d %d %d"), x, y, z);
-	//Store struct data into a payload request
-	FNetPayload netPayload;
-	netPayload.payload_type = EPayloadType::UnRegisterChunk;
+	storageServerConnection->SendChunkPayload(chunkId, EPayloadType::UnRegisterChunk, FNetDeRegisterRequest(chunkId));
+}
+
+void AVoxelManager::unregisterChunks(const TArray<uint32>& chunkIds)
+{
+	if (chunkIds.Num() == 0)
+	{
+		return;
+	}
+
+	if (!bUseBatchedRequests)
+	{
+		for (uint32 chunkId : chunkIds)
+		{
+			unregisterChunk(chunkId);
+		}
+		return;
+	}
+
+	//One list per storage server, each only holding the chunks that server owns
+	TArray<FNetDeRegisterRequestList> shardLists;
+	shardLists.SetNum(storageServerConnection->GetShardCount());
+	for (uint32 chunkId : chunkIds)
+	{
+		shardLists[storageServerConnection->GetShardForChunk(chunkId)].chunkIds.Add(chunkId);
+	}
+	for (int shard = 0; shard < shardLists.Num(); shard++)
+	{
+		if (shardLists[shard].chunkIds.Num() > 0)
+		{
+			storageServerConnection->SendPayloadToShard(shard, EPayloadType::UnRegisterChunkList, shardLists[shard]);
+		}
+	}
+}
+
+bool AVoxelManager::applyDecodedPayload(FVoxelDecodedPayload& decodedPayload)
+{
+	//Currently only can handle one vObject
+	if (decodedPayload.Type == EVoxelDecodedPayloadType::Diffs) {
+		for (const FNetDiff& netDiff : decodedPayload.Diffs) {
+			applyNetDiff(netDiff);
+		}
+		return true;
+	}
+	else if (decodedPayload.Type == EVoxelDecodedPayloadType::Chunks) {
+		for (FVoxelBuiltChunk& builtChunk : decodedPayload.Chunks) {
+			publishChunk(builtChunk);
+		}
+		return true;
+	}
+	else if (decodedPayload.Type == EVoxelDecodedPayloadType::CacheMiss) {
+		return onChunkCacheMiss(decodedPayload);
+	}
+	return false;
+}
 
-	FNetDeRegisterRequest DeRegisterRequest = FNetDeRegisterRequest(chunkId);
-	TArray<uint8> data = DeRegisterRequest.serialize();
-	netPayload.data = data;
+void AVoxelManager::addPendingChunk(const FVector& chunk)
+{
+	chunkRequestPending.Add(chunk);
+	chunkIdsPending.Add(createdVObjects[0]->getChunkId(chunk.X, chunk.Y, chunk.Z));
+}
 
-	TArray<uint8> wrappedRequest = netPayload.serialize();
+void AVoxelManager::removePendingChunk(const FVector& chunk)
+{
+	chunkRequestPending.Remove(chunk);
+	chunkIdsPending.Remove(createdVObjects[0]->getChunkId(chunk.X, chunk.Y, chunk.Z));
+}
 
-	uint8* header = new uint8[4];
-	uint32 hSize = wrappedRequest.Num();
-	header[0] = hSize >> 24;
-	header[1] = hSize >> 16;
-	header[2] = hSize >> 8;
-	header[3] = hSize;
+void AVoxelManager::applyNetDiff(const FNetDiff& netDiff)
+{
+	//Diffs are applied ahead of queued chunks, so one can arrive before the chunk it edits,
+	//or before the copy of a resident chunk re-requested after a reconnect that would overwrite it
+	if (chunkIdsPending.Contains(netDiff.chunk_id))
+	{
+		deferredDiffs.FindOrAdd(netDiff.chunk_id).Add(netDiff);
+		return;
+	}
 
-	TArray<uint8> output;
-	for (int i = 0; i < 4; i++)
+	if (!createdVObjects[0]->containsChunkId(netDiff.chunk_id))
 	{
-		output.Add(header[i]);
+		UE_LOG(LogTemp, Warning, TEXT("Dropping diff for chunk %d, it is not in storage"), netDiff.chunk_id);
+		return;
 	}
-	output.Append(wrappedRequest);
 
-	//Send byte array
-	storageServerConnection->SendData(storageServerConnection->connectionIdGameServer, output);
+	FPoint point = FPoint(static_cast<EVoxelType>(netDiff.material), netDiff.density);
+	UE_LOG(LogTemp, Warning, TEXT("Processing Diff: (x,y,z): %d %d %d  chunkId: %d  type: %d density: %d "), netDiff.x, netDiff.y, netDiff.z, netDiff.chunk_id, point.type, point.density);
+	createdVObjects[0]->SetPointInChunk(netDiff.x, netDiff.y, netDiff.z, netDiff.chunk_id, point);
+}
+
+void AVoxelManager::publishChunk(FVoxelBuiltChunk& builtChunk)
+{
+	FVector chunk = builtChunk.Chunk.offset;
+	//UE_LOG(LogTemp, Log, TEXT("Recieved Chunk: %f, %f, %f"), chunk.X, chunk.Y, chunk.Z);
+
+	//A late reply to a resent request carries older data than diffs that may have been applied since
+	if (!chunkRequestPending.Contains(chunk) && createdVObjects[0]->containsChunk(chunk.X, chunk.Y, chunk.Z))
+	{
+		UE_LOG(LogTemp, Log, TEXT("Ignoring duplicate chunk %f %f %f"), chunk.X, chunk.Y, chunk.Z);
+		return;
+	}
+
+	if (!createdVObjects[0]->PublishChunk(MoveTemp(builtChunk.Chunk), builtChunk.DataHash))
+	{
+		return;
+	}
+
+	uint32 chunkId = createdVObjects[0]->getChunkId(chunk.X, chunk.Y, chunk.Z);
+	if (builtChunk.Version != 0)
+	{
+		chunkVersions.Add(chunkId, builtChunk.Version);
+	}
+	else
+	{
+		chunkVersions.Remove(chunkId);
+	}
+
+	//No longer pending, so the deferred diffs are applied instead of deferred again
+	onChunkReceived(chunk);
+
+	TArray<FNetDiff> chunkDiffs;
+	if (deferredDiffs.RemoveAndCopyValue(chunkId, chunkDiffs))
+	{
+		for (const FNetDiff& netDiff : chunkDiffs)
+		{
+			applyNetDiff(netDiff);
+		}
+	}
+}
+
+bool AVoxelManager::onChunkCacheMiss(const FVoxelDecodedPayload& decodedPayload)
+{
+	//Late reply to a resent request, the first one already restored the chunk
+	FVector chunk(decodedPayload.MissedChunk);
+	if (!chunkRequestPending.Contains(chunk))
+	{
+		return false;
+	}
+
+	//Resident chunk re-requested after a reconnect, the reply is applied to the stored copy.
+	//Only chunks the diffs touch are marked changed, so an unchanged reply remeshes nothing.
+	uint32 chunkId = createdVObjects[0]->getChunkId(chunk.X, chunk.Y, chunk.Z);
+	if (createdVObjects[0]->containsChunkId(chunkId) && chunkVersions.Contains(chunkId))
+	{
+		chunkVersions.Add(chunkId, decodedPayload.DeltaVersion);
+		onChunkReceived(chunk);
+
+		TArray<FNetDiff> chunkDiffs = decodedPayload.Diffs;
+		TArray<FNetDiff> deferred;
+		if (deferredDiffs.RemoveAndCopyValue(chunkId, deferred))
+		{
+			chunkDiffs.Append(deferred);
+		}
+		for (const FNetDiff& netDiff : chunkDiffs)
+		{
+			applyNetDiff(netDiff);
+		}
+		return chunkDiffs.Num() > 0;
+	}
+
+	//Evicted while the request was in flight, ask again without a version for the full chunk
+	UE_LOG(LogTemp, Warning, TEXT("No cached copy of chunk %f %f %f for its delta, requesting it in full"), chunk.X, chunk.Y, chunk.Z);
+	chunkRequestsInFlight.Remove(chunk);
+	chunkRequestQueue.Push(chunk);
+	return false;
+}
+
+void AVoxelManager::cacheChunk(uint32 chunkId)
+{
+	//Without a version the server could not tell what changed, so there is nothing to gain from keeping it
+	uint32 version = 0;
+	if (!chunkVersions.RemoveAndCopyValue(chunkId, version))
+	{
+		return;
+	}
+
+	FVector offset = createdVObjects[0]->getChunkOffset(chunkId);
+	TArray<uint8> densities;
+	TArray<uint8> materials;
+	if (createdVObjects[0]->GetChunkData(offset.X, offset.Y, offset.Z, densities, materials))
+	{
+		storageServerConnection->GetChunkCache().Put(FIntVector(offset), version, materials, densities);
+	}
 }
 
 void AVoxelManager::updatePlayerLocation(FVector worldCoordinates)
@@ -265,10 +564,6 @@ void AVoxelManager::editPoint(int x, int y, int z, FPoint point)
 		return;
 	}
 
-	//Store struct data into a payload request
-	FNetPayload netPayload;
-	netPayload.payload_type = EPayloadType::Diff;
-
 	FVector chunk = createdVObjects[0]->getChunkCoordinatesFromVoxelPoint(FVector(x, y, z));
 	int relX = x % 32;
 	int relY = y % 32;
@@ -277,77 +572,449 @@ void AVoxelManager::editPoint(int x, int y, int z, FPoint point)
 
 	UE_LOG(LogTemp, Warning, TEXT("Editing Chunk %d, %f %f %f"), iChunk, chunk.X, chunk.Y, chunk.Z);
 
-	FNetDiff netDiff = FNetDiff(iChunk, relX, relY, relZ, point.density, (uint8)point.type);
-	TArray<uint8> data = netDiff.serialize();
-	netPayload.data = data;
+	storageServerConnection->SendChunkPayload(iChunk, EPayloadType::Diff, FNetDiff(iChunk, relX, relY, relZ, point.density, (uint8)point.type));
+}
 
-	TArray<uint8> wrappedRequest = netPayload.serialize();
+void AVoxelManager::DrawChunk(int x, int y, int z)
+{
+	createdVObjects[0]->DrawChunk(x, y, z);
+}
 
-	uint8* header = new uint8[4];
-	uint32 hSize = wrappedRequest.Num();
-	header[0] = hSize >> 24;
-	header[1] = hSize >> 16;
-	header[2] = hSize >> 8;
-	header[3] = hSize;
+void AVoxelManager::PrintChunk(int x, int y, int z)
+{
+	createdVObjects[0]->PrintChunk(x, y, z);
+}
 
+void AVoxelManager::BenchmarkMeshers()
+{
+	createdVObjects[0]->BenchmarkMeshers();
+}
 
-	TArray<uint8> output;
-	for (int i = 0; i < 4; i++)
+void AVoxelManager::BenchmarkChunkCodecs()
+{
+	//Chunks as they were received, plus any edits since
+	TArray<TArray<uint8>> chunkMaterials;
+	TArray<TArray<uint8>> chunkDensities;
+	for (uint32 chunkId : createdVObjects[0]->getChunkSet())
 	{
-		output.Add(header[i]);
+		FVector offset = createdVObjects[0]->getChunkOffset(chunkId);
+		TArray<uint8> densities;
+		TArray<uint8> materials;
+		if (createdVObjects[0]->GetChunkData(offset.X, offset.Y, offset.Z, densities, materials))
+		{
+			chunkMaterials.Add(MoveTemp(materials));
+			chunkDensities.Add(MoveTemp(densities));
+		}
 	}
-	output.Append(wrappedRequest);
 
-	//Send byte array
-	storageServerConnection->SendData(storageServerConnection->connectionIdGameServer, output);
+	TArray<EVoxelChunkCodec> codecs = { EVoxelChunkCodec::None, EVoxelChunkCodec::Rle, EVoxelChunkCodec::RleLz4 };
+	for (EVoxelChunkCodec codec : codecs)
+	{
+		int64 rawBytes = 0;
+		int64 encodedBytes = 0;
+		double encodeSeconds = 0.0;
+		double decodeSeconds = 0.0;
+		bool bRoundTrips = true;
+
+		for (int i = 0; i < chunkMaterials.Num(); i++)
+		{
+			TArray<uint8> encoded;
+			FVoxelByteWriter writer(encoded);
+			double startTime = FPlatformTime::Seconds();
+			FVoxelChunkCodec::Encode(codec, chunkMaterials[i], chunkDensities[i], writer);
+			encodeSeconds += FPlatformTime::Seconds() - startTime;
+
+			TArray<uint8> materials;
+			TArray<uint8> densities;
+			FVoxelByteReader reader(encoded);
+			startTime = FPlatformTime::Seconds();
+			bool bDecoded = FVoxelChunkCodec::Decode(reader, materials, densities);
+			decodeSeconds += FPlatformTime::Seconds() - startTime;
+
+			bRoundTrips &= bDecoded && materials == chunkMaterials[i] && densities == chunkDensities[i];
+			rawBytes += chunkMaterials[i].Num() + chunkDensities[i].Num();
+			encodedBytes += encoded.Num();
+		}
+
+		double rawMB = rawBytes / (1024.0 * 1024.0);
+		UE_LOG(LogTemp, Display, TEXT("Codec %s: %d chunks, %lld -> %lld bytes (ratio %.1f), encode %.1f MB/s, decode %.1f MB/s%s"),
+			*UEnum::GetValueAsString(codec), chunkMaterials.Num(), rawBytes, encodedBytes,
+			encodedBytes > 0 ? (double)rawBytes / encodedBytes : 0.0,
+			encodeSeconds > 0.0 ? rawMB / encodeSeconds : 0.0,
+			decodeSeconds > 0.0 ? rawMB / decodeSeconds : 0.0,
+			bRoundTrips ? TEXT("") : TEXT(", ROUND TRIP FAILED"));
+	}
 }
 
-void AVoxelManager::DrawChunk(int x, int y, int z)
+void AVoxelManager::BenchmarkProtocol()
 {
-	createdVObjects[0]->DrawChunk(x, y, z);
+	FVoxelWire::RunBenchmark(1000000);
 }
 
-void AVoxelManager::PrintChunk(int x, int y, int z)
+void AVoxelManager::PrintNetStats()
 {
-	createdVObjects[0]->PrintChunk(x, y, z);
+	if (!IsValid(storageServerConnection))
+	{
+		UE_LOG(LogTemp, Display, TEXT("Not connected to the storage server"));
+		return;
+	}
+
+	FVoxelPayloadDecoder& decoder = storageServerConnection->GetPayloadDecoder();
+	UE_LOG(LogTemp, Display, TEXT("Inbound queue: %d diffs, %d chunk payloads, oldest %.1f ms, max %.1f ms since last print"),
+		decoder.GetInteractiveDepth(), decoder.GetBulkDepth(), decoder.GetOldestQueuedAge() * 1000.0, maxInboundQueueAge * 1000.0);
+	UE_LOG(LogTemp, Display, TEXT("Queued built chunks: %d of %d, %s, backlogged %lld times"),
+		decoder.GetQueuedChunks(), maxQueuedChunks, decoder.IsBacklogged() ? TEXT("chunk reads paused") : TEXT("reading"), decoder.GetBacklogCount());
+	UE_LOG(LogTemp, Display, TEXT("Applied %lld payloads, %d last frame, max %d per frame since last print, %d deferred diff chunks"),
+		payloadsApplied, payloadsLastTick, maxPayloadsPerTick, deferredDiffs.Num());
+	UE_LOG(LogTemp, Display, TEXT("Requests: %d in flight, %d queued, window %.1f, smoothed rtt %.1f ms"),
+		chunkRequestsInFlight.Num(), chunkRequestQueue.Num(), requestWindow, smoothedRequestRtt * 1000.0);
+
+	for (int shard = 0; shard < storageServerConnection->GetShardCount(); shard++)
+	{
+		for (EVoxelChannel channel : { EVoxelChannel::Interactive, EVoxelChannel::Bulk })
+		{
+			FTcpConnectionStats stats;
+			if (storageServerConnection->GetChannelStats(shard, channel, stats))
+			{
+				UE_LOG(LogTemp, Display, TEXT("%s %s channel: sent %lld messages (%lld bytes), received %lld messages (%lld bytes)"),
+					*storageServerConnection->GetShardEndpoint(shard), *UEnum::GetValueAsString(channel),
+					stats.MessagesSent, stats.BytesSent, stats.MessagesReceived, stats.BytesReceived);
+				UE_LOG(LogTemp, Display, TEXT("    outbox %d (%lld bytes), %lld refused, inbox %d (%lld bytes), reads paused %lld times%s"),
+					stats.OutboxDepth, stats.OutboxBytes, stats.SendsRejected, stats.InboxDepth, stats.InboxBytes,
+					stats.ReceivePauses, stats.bReceivePaused ? TEXT(", paused now") : TEXT(""));
+			}
+		}
+
+		const FVoxelStorageShard& shardState = storageServerConnection->storageShards[shard];
+		UE_LOG(LogTemp, Display, TEXT("    %s, %d failed connects in a row, %lld credit grants, %d payloads and %lld bytes applied since the last"),
+			*UEnum::GetValueAsString(shardState.state), shardState.reconnectAttempts,
+			shardState.creditGrantsSent, shardState.unreturnedCreditPayloads, shardState.unreturnedCreditBytes);
+	}
+
+	maxInboundQueueAge = 0.0;
+	maxPayloadsPerTick = 0;
 }
 
+bool AVoxelManager::StartStandInServer(int port, float latencyMs, int bandwidthKBps, float lossPercent, bool sharedMemory)
+{
+	FVoxelStandInSettings settings;
+	settings.Port = port;
+	settings.SharedMemoryName = sharedMemory ? TEXT("VoxelStandIn") : TEXT("");
+	settings.bListenOnAllInterfaces = FParse::Param(FCommandLine::Get(), TEXT("VoxelStandInAllInterfaces"));
+	settings.LatencyMs = FMath::Max(latencyMs, 0.0f);
+	settings.BandwidthBytesPerSecond = FMath::Max(bandwidthKBps, 0) * 1024;
+	settings.LossRate = FMath::Clamp(lossPercent / 100.0f, 0.0f, 1.0f);
+
+	//Chunks the size the client meshes and numbered the way UVGridComponent::getChunkId numbers them
+	FVObjectSettings vObjectSettings = MakeVObjectSettings(VoxelTypeMaterialList);
+	settings.ChunkSize = vObjectSettings.voxelResPerChunk;
+	settings.ChunkIdStride = vObjectSettings.chunkResolution;
+
+	TSharedPtr<FVoxelStandInServer> standInServer = MakeShared<FVoxelStandInServer>(settings);
+	if (!standInServer->Start())
+	{
+		return false;
+	}
+	standInServers.Add(standInServer);
+	return true;
+}
 
-void AVoxelManager::requestChunk(int x, int y, int z)
+void AVoxelManager::StopStandInServers()
 {
+	for (const TSharedPtr<FVoxelStandInServer>& standInServer : standInServers)
+	{
+		standInServer->Stop();
+	}
+	standInServers.Reset();
+}
 
-	if (x < 0 || y < 0 || z < 0)
+void AVoxelManager::PrintStandInStats()
+{
+	if (standInServers.Num() == 0)
 	{
+		UE_LOG(LogTemp, Display, TEXT("No stand-in storage server running"));
 		return;
 	}
-	//UE_LOG(LogTemp, Warning, TEXT("Requesting Chunk %d %d %d"), x, y, z);
 
-	//Store struct data into a payload request
-	FNetPayload netPayload;
-	netPayload.payload_type = EPayloadType::ChunkRequest;
+	for (const TSharedPtr<FVoxelStandInServer>& standInServer : standInServers)
+	{
+		FVoxelStandInStats stats = standInServer->GetStats();
+		UE_LOG(LogTemp, Display, TEXT("Stand-in port %d: %lld connections, received %lld messages (%lld bytes), sent %lld messages (%lld bytes)"),
+			standInServer->GetSettings().Port, stats.Connections, stats.MessagesReceived, stats.BytesReceived, stats.MessagesSent, stats.BytesSent);
+		UE_LOG(LogTemp, Display, TEXT("    %lld chunks, %lld deltas, %lld unchanged, %lld diffs applied, %lld replies dropped, %d waiting for credit"),
+			stats.ChunksSent, stats.DeltasSent, stats.UnchangedSent, stats.DiffsApplied, stats.RepliesDropped, stats.RepliesAwaitingCredit);
+	}
+}
 
-	FNetChunkRequest chunkRequest = FNetChunkRequest(x, y, z);
-	TArray<uint8> data = chunkRequest.serialize();
-	netPayload.data = data;
+void AVoxelManager::StartNetCapture(const FString& path)
+{
+	if (!IsValid(storageServerConnection))
+	{
+		UE_LOG(LogTemp, Display, TEXT("Not connected to the storage server"));
+		return;
+	}
 
-	TArray<uint8> wrappedRequest = netPayload.serialize();
+	FString capturePath = path;
+	if (capturePath.IsEmpty())
+	{
+		capturePath = FPaths::ProjectSavedDir() / TEXT("NetCaptures") / FString::Printf(TEXT("%s.tcap"), *FDateTime::Now().ToString());
+	}
+	storageServerConnection->StartCapture(capturePath);
+}
 
-	uint8* header = new uint8[4];
-	uint32 hSize = wrappedRequest.Num();
-	header[0] = hSize >> 24;
-	header[1] = hSize >> 16;
-	header[2] = hSize >> 8;
-	header[3] = hSize;
+void AVoxelManager::StopNetCapture()
+{
+	if (IsValid(storageServerConnection))
+	{
+		storageServerConnection->StopCapture();
+	}
+}
 
+void AVoxelManager::ReplayNetCapture(const FString& path, bool bAsFastAsPossible)
+{
+	spawnStorageServerConnection();
+	if (createdVObjects.Num() == 0)
+	{
+		InitializeVObjects();
+	}
 
-	TArray<uint8> output;
-	for (int i = 0; i < 4; i++)
+	if (storageServerConnection->StartReplay(path, bAsFastAsPossible))
 	{
-		output.Add(header[i]);
+		bReplayingCapture = true;
+		replayStartTime = FPlatformTime::Seconds();
+		replayStartPayloads = payloadsApplied;
+	}
+}
+
+void AVoxelManager::onStorageShardReconnected(int32 shard)
+{
+	if (createdVObjects.Num() == 0)
+	{
+		return;
 	}
-	output.Append(wrappedRequest);
 
-	//Send byte array
-	storageServerConnection->SendData(storageServerConnection->connectionIdGameServer, output);
+	//Replies to what was in flight were lost with the old connection
+	int resent = 0;
+	TArray<FVector> inFlight;
+	chunkRequestsInFlight.GetKeys(inFlight);
+	for (const FVector& chunk : inFlight)
+	{
+		if (storageServerConnection->GetShardForChunk(createdVObjects[0]->getChunkId(chunk.X, chunk.Y, chunk.Z)) == shard)
+		{
+			chunkRequestsInFlight.Remove(chunk);
+			chunkRequestQueue.Push(chunk);
+			resent++;
+		}
+	}
+
+	//The new session has no subscriptions. Resident chunks are requested again with the version they hold,
+	//so the server answers with what changed while we were away instead of the whole chunk. They stay in storage
+	//and out of the cache, the reply is applied to them in place by onChunkCacheMiss.
+	//They go to the front of the queue, which is popped from the back, so chunks still missing are filled in first.
+	TArray<FVector> resident;
+	for (uint32 chunkId : createdVObjects[0]->getChunkSet())
+	{
+		FVector chunk = createdVObjects[0]->getChunkOffset(chunkId);
+		if (storageServerConnection->GetShardForChunk(chunkId) != shard || chunkRequestPending.Contains(chunk))
+		{
+			continue;
+		}
+
+		addPendingChunk(chunk);
+		resident.Add(chunk);
+	}
+	chunkRequestQueue.Insert(resident, 0);
+
+	UE_LOG(LogTemp, Warning, TEXT("Storage server %s is back, resending %d requests and re-registering %d resident chunks"),
+		*storageServerConnection->GetShardEndpoint(shard), resent, resident.Num());
+}
+
+bool AVoxelManager::isChunkShardConnected(const FVector& chunk)
+{
+	return storageServerConnection->IsShardConnected(storageServerConnection->GetShardForChunk(createdVObjects[0]->getChunkId(chunk.X, chunk.Y, chunk.Z)));
+}
+
+void AVoxelManager::pumpChunkRequests()
+{
+	double now = FPlatformTime::Seconds();
+
+	//Resend requests whose reply is overdue, a lost reply would otherwise hold its slot in the window forever
+	double timeout = FMath::Max<double>(minRequestTimeout, 4.0 * smoothedRequestRtt);
+	bool bTimedOut = false;
+	TArray<FVector> toRequest;
+	TArray<FVector> inFlight;
+	chunkRequestsInFlight.GetKeys(inFlight);
+	for (const FVector& chunk : inFlight)
+	{
+		//Its server is down, the request is sent again once it reconnects
+		FChunkRequestState& state = chunkRequestsInFlight[chunk];
+		if (now - state.sentTime < timeout || !isChunkShardConnected(chunk))
+		{
+			continue;
+		}
+
+		bTimedOut = true;
+		if (state.attempts > maxRequestRetries)
+		{
+			//Stop waiting so the load can finish, the chunk is asked for again the next time the center chunk changes
+			UE_LOG(LogTemp, Error, TEXT("Giving up on chunk %f %f %f after %d requests"), chunk.X, chunk.Y, chunk.Z, state.attempts);
+			chunkRequestsInFlight.Remove(chunk);
+			removePendingChunk(chunk);
+			deferredDiffs.Remove(createdVObjects[0]->getChunkId(chunk.X, chunk.Y, chunk.Z));
+			continue;
+		}
+
+		UE_LOG(LogTemp, Warning, TEXT("Chunk %f %f %f timed out after %.2f s, resending"), chunk.X, chunk.Y, chunk.Z, now - state.sentTime);
+		state.attempts++;
+		state.sentTime = now;
+		toRequest.Add(chunk);
+	}
+
+	//Loss or a stalled server, back off once per pump however many requests expired
+	if (bTimedOut)
+	{
+		requestWindow = FMath::Max<float>(minRequestWindow, requestWindow / 2);
+		bRequestSlowStart = false;
+		lastRequestWindowCut = now;
+	}
+
+	//Fill the window, unless what was already sent has not gone out yet
+	bool bSendBackedUp = storageServerConnection->IsStorageSendBackedUp();
+	TArray<FVector> heldBack;
+	while (!bSendBackedUp && chunkRequestsInFlight.Num() < FMath::FloorToInt(requestWindow) && chunkRequestQueue.Num() > 0)
+	{
+		FVector chunk = chunkRequestQueue.Pop();
+		if (chunkRequestsInFlight.Contains(chunk))
+		{
+			continue;
+		}
+
+		//Sending into a dead connection would lose it, wait for the reconnect
+		if (!isChunkShardConnected(chunk))
+		{
+			heldBack.Add(chunk);
+			continue;
+		}
+
+		FChunkRequestState& state = chunkRequestsInFlight.Add(chunk);
+		state.sentTime = now;
+		state.attempts = 1;
+		toRequest.Add(chunk);
+	}
+	chunkRequestQueue.Insert(heldBack, 0);
+
+	requestChunks(toRequest);
+}
+
+void AVoxelManager::requestChunks(const TArray<FVector>& chunks)
+{
+	if (chunks.Num() == 0)
+	{
+		return;
+	}
+
+	if (bUseChunkVersions)
+	{
+		//Cached and resident chunks are asked for with their version so the server can answer with only what changed
+		TArray<FNetVersionedChunkRequestList> versionedLists;
+		versionedLists.SetNum(storageServerConnection->GetShardCount());
+		for (const FVector& chunk : chunks)
+		{
+			uint32 chunkId = createdVObjects[0]->getChunkId(chunk.X, chunk.Y, chunk.Z);
+			uint32 knownVersion = createdVObjects[0]->containsChunkId(chunkId) ? chunkVersions.FindRef(chunkId)
+				: storageServerConnection->GetChunkCache().GetVersion(FIntVector(chunk));
+			int shard = storageServerConnection->GetShardForChunk(chunkId);
+			versionedLists[shard].list.Add(FNetVersionedChunkRequest(chunk.X, chunk.Y, chunk.Z, knownVersion));
+
+			if (!bUseBatchedRequests)
+			{
+				storageServerConnection->SendPayloadToShard(shard, EPayloadType::VersionedChunkRequestList, versionedLists[shard]);
+				versionedLists[shard].list.Reset();
+			}
+		}
+
+		for (int shard = 0; shard < versionedLists.Num(); shard++)
+		{
+			if (versionedLists[shard].list.Num() > 0)
+			{
+				storageServerConnection->SendPayloadToShard(shard, EPayloadType::VersionedChunkRequestList, versionedLists[shard]);
+			}
+		}
+		return;
+	}
+
+	if (!bUseBatchedRequests)
+	{
+		for (const FVector& chunk : chunks)
+		{
+			requestChunk(chunk.X, chunk.Y, chunk.Z);
+		}
+		return;
+	}
+
+	//Resends and new requests of one pump go out as a single message per storage server, all servers streaming at once
+	TArray<FNetChunkRequestList> requestLists;
+	requestLists.SetNum(storageServerConnection->GetShardCount());
+	for (const FVector& chunk : chunks)
+	{
+		int shard = storageServerConnection->GetShardForChunk(createdVObjects[0]->getChunkId(chunk.X, chunk.Y, chunk.Z));
+		requestLists[shard].list.Add(FNetChunkRequest(chunk.X, chunk.Y, chunk.Z));
+	}
+	for (int shard = 0; shard < requestLists.Num(); shard++)
+	{
+		if (requestLists[shard].list.Num() > 0)
+		{
+			storageServerConnection->SendPayloadToShard(shard, EPayloadType::ChunkRequestList, requestLists[shard]);
+		}
+	}
 }
 
+void AVoxelManager::onChunkReceived(const FVector& chunk)
+{
+	removePendingChunk(chunk);
+
+	//Unrequested, or a late reply to a request that was already answered by a resend
+	FChunkRequestState* state = chunkRequestsInFlight.Find(chunk);
+	if (state == nullptr)
+	{
+		return;
+	}
+
+	//Only first attempts give a round trip sample, a reply to a resent request could belong to either copy
+	if (state->attempts == 1)
+	{
+		double now = FPlatformTime::Seconds();
+		double rtt = now - state->sentTime;
+		smoothedRequestRtt = (smoothedRequestRtt == 0.0) ? rtt : smoothedRequestRtt * 0.875 + rtt * 0.125;
+		minRequestRtt = (minRequestRtt == 0.0) ? rtt : FMath::Min(minRequestRtt, rtt);
+
+		//Replies coming back near the unloaded round trip mean the server keeps up, so open the window.
+		//Once they queue up behind each other the server or link is at its throughput, so back off,
+		//but only once per round trip since every reply in the window saw the same queue.
+		if (rtt <= 2.0 * minRequestRtt)
+		{
+			requestWindow += bRequestSlowStart ? 1.0f : 1.0f / requestWindow;
+		}
+		else if (now - lastRequestWindowCut > smoothedRequestRtt)
+		{
+			requestWindow *= 0.75f;
+			bRequestSlowStart = false;
+			lastRequestWindowCut = now;
+		}
+		requestWindow = FMath::Clamp<float>(requestWindow, minRequestWindow, maxRequestWindow);
+	}
+
+	chunkRequestsInFlight.Remove(chunk);
+}
+
+void AVoxelManager::requestChunk(int x, int y, int z)
+{
+
+	if (x < 0 || y < 0 || z < 0)
+	{
+		return;
+	}
+	//UE_LOG(LogTemp, Warning, TEXT("Requesting Chunk %d %d %d"), x, y, z);
+
+	storageServerConnection->SendChunkPayload(createdVObjects[0]->getChunkId(x, y, z), EPayloadType::ChunkRequest, FNetChunkRequest(x, y, z));
+}
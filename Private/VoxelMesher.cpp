@@ -0,0 +1,258 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "VoxelMesher.h"
+#include "VGridComponent.h"
+#include "MarchingCubesUtil.h"
+
+namespace
+{
+	//Axis of an edge followed by the two axes spanning its quad, kept cyclic so every quad has the same handedness
+	const int SurfaceNetsAxes[3][3] = { { 0, 1, 2 }, { 1, 2, 0 }, { 2, 0, 1 } };
+
+	//Voxel corner one step from corner 0 along x, y and z
+	const int AxisCorner[3] = { 1, 3, 4 };
+
+	//UVs of the three corners of every marching cubes triangle
+	const FVector2D TriangleUVs[3] = { FVector2D(0, 0), FVector2D(1, 0), FVector2D(0, 1) };
+
+	enum class ECellState : uint8
+	{
+		Unknown,
+		Surface,
+		NoSurface
+	};
+}
+
+TSharedRef<FVoxelMesher> FVoxelMesher::Create(EVoxelMesherType mesherType)
+{
+	switch (mesherType) {
+	case EVoxelMesherType::SurfaceNets:
+		return MakeShared<FSurfaceNetsMesher>();
+	case EVoxelMesherType::MarchingCubes:
+	default:
+		return MakeShared<FMarchingCubesMesher>();
+	}
+}
+
+void FMarchingCubesMesher::MeshSlab(const FVoxelMeshInput& input, int startX, int endX, TMap<EVoxelType, FProcMeshSection>& subSections) const
+{
+	FChunk* chunk = input.chunk;
+	UMarchingCubesUtil* MarchingCubesUtil = input.marchingCubesUtil;
+	FVector offset = chunk->offset;
+
+	if (!MarchingCubesUtil) {
+		UE_LOG(LogTemp, Warning, TEXT("MC util not valid"));
+		return;
+	}
+
+	for (int x = startX; x < endX; x++) {
+		for (int y = 0; y < chunk->resolution; y++) {
+			for (int z = 0; z < chunk->resolution; z++) {
+				const FVoxel& voxel = chunk->voxelArray[MarchingCubesUtil->mortonEncode(x, y, z, chunk->resolution)];
+				int shapeIndex = voxel.shape;
+				if (shapeIndex != 0 && shapeIndex != 255) {
+					//Get type for whole voxel. Based on the lowest index vertex thats not air.
+					EVoxelType voxelType = EVoxelType::Air;
+					for (int v = 0; v < 8; v++) {
+						if (voxel.pointArray[v].type != EVoxelType::Air) {
+							voxelType = voxel.pointArray[v].type;
+							break;
+						}
+					}
+
+					//Get triangle data for shape
+					TArray<int> voxelVertices = MarchingCubesUtil->GetMCTrianglePoints(shapeIndex);
+
+					FProcMeshSection& curSection = subSections.FindOrAdd(voxelType);
+
+					//Insert triangle data straight into the section's vertex and index buffers
+					for (int ti = 0; ti + 2 < voxelVertices.Num(); ti += 3) {
+						FVector corners[3];
+						for (int k = 0; k < 3; k++) {
+							//Calc edge intersection point for "smoother" surface
+							FVector2D points = MarchingCubesUtil->GetVerticesForMidPoints(voxelVertices[ti + k]);
+
+							FVector P;
+							FVector P1 = MarchingCubesUtil->GetVoxelVertex(points.X);
+							FVector P2 = MarchingCubesUtil->GetVoxelVertex(points.Y);
+
+							//Check if interpolation is needed
+							if (input.bUseVoxelInterpolation) {
+								uint8 V1 = voxel.pointArray[(int)points.X].density;
+								uint8 V2 = voxel.pointArray[(int)points.Y].density;
+								//P = P1 + ((params.densityValue - V1) * (P2 - P1) / (V2 - V1));
+
+								if (V1 != 0) {
+									P1 = P1 * (V1 / 100);
+								}
+
+								if (V2 != 0) {
+									P2 = P2 * (V2 / 100);
+								}
+
+								P = (P1 + P2) / 2;
+							}
+							else {
+								P = (P1 + P2) / 2;
+							}
+
+							corners[k] = (offset * chunk->resolution + FVector(x, y, z) + P) * input.unitScale;
+						}
+
+						//Flat normal for the whole triangle
+						FVector normal = FVector::CrossProduct(corners[0] - corners[1], corners[2] - corners[1]);
+						normal.Normalize();
+
+						for (int k = 0; k < 3; k++) {
+							curSection.ProcIndexBuffer.Add(curSection.ProcVertexBuffer.Num());
+							FProcMeshVertex& vertex = curSection.ProcVertexBuffer.AddDefaulted_GetRef();
+							vertex.Position = corners[k];
+							vertex.Normal = normal;
+							vertex.UV0 = TriangleUVs[k];
+							vertex.Color = FColor::Black;
+							curSection.SectionLocalBox += corners[k];
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+void FSurfaceNetsMesher::MeshSlab(const FVoxelMeshInput& input, int startX, int endX, TMap<EVoxelType, FProcMeshSection>& outSections) const
+{
+	FChunk* chunk = input.chunk;
+	UMarchingCubesUtil* util = input.marchingCubesUtil;
+	int res = chunk->resolution;
+	FIntVector chunkOrigin = FIntVector(chunk->offset.X * res, chunk->offset.Y * res, chunk->offset.Z * res);
+
+	//Cells this slab reads: x in [startX - 1, endX - 1], y and z in [-1, res - 1]
+	int cellsX = endX - startX + 1;
+	int cellsYZ = res + 1;
+	int numCells = cellsX * cellsYZ * cellsYZ;
+	auto cellIndex = [startX, cellsYZ](const FIntVector& cell) {
+		return ((cell.X - startX + 1) * cellsYZ + (cell.Y + 1)) * cellsYZ + (cell.Z + 1);
+	};
+
+	//Surface vertex of each cell, worked out on first use
+	TArray<ECellState> cellStates;
+	cellStates.Init(ECellState::Unknown, numCells);
+	TArray<FVector> cellVertices;
+	cellVertices.SetNumUninitialized(numCells);
+	TArray<FVector> cellNormals;
+	cellNormals.SetNumUninitialized(numCells);
+
+	//Index of each cell's vertex in every type section
+	TMap<EVoxelType, TArray<int32>> typeVertexIndices;
+
+	auto resolveCell = [&](const FIntVector& cell) {
+		int ci = cellIndex(cell);
+		if (cellStates[ci] != ECellState::Unknown) {
+			return cellStates[ci] == ECellState::Surface;
+		}
+
+		//Cells below the chunk are read from the neighbouring chunks
+		cellStates[ci] = ECellState::NoSurface;
+		const FVoxel* voxel = input.storage->FindVoxel(chunkOrigin.X + cell.X, chunkOrigin.Y + cell.Y, chunkOrigin.Z + cell.Z);
+		if (voxel == nullptr || voxel->shape == 0 || voxel->shape == 255) {
+			return false;
+		}
+
+		//Normal points from solid corners towards air corners
+		FVector normal = FVector::ZeroVector;
+		for (int c = 0; c < 8; c++) {
+			FVector corner = util->GetVoxelVertex(c) - FVector(0.5f, 0.5f, 0.5f);
+			normal += (voxel->pointArray[c].type != EVoxelType::Air) ? -corner : corner;
+		}
+		if (!normal.Normalize()) {
+			normal = FVector::UpVector;
+		}
+
+		//Vertex at the average of the edge crossings
+		FVector crossingSum = FVector::ZeroVector;
+		int crossings = 0;
+		for (int e = 0; e < 12; e++) {
+			FVector2D ends = util->GetVerticesForMidPoints(e);
+			int corner0 = (int)ends.X;
+			int corner1 = (int)ends.Y;
+			bool bSolid0 = voxel->pointArray[corner0].type != EVoxelType::Air;
+			bool bSolid1 = voxel->pointArray[corner1].type != EVoxelType::Air;
+			if (bSolid0 != bSolid1) {
+				crossingSum += (util->GetVoxelVertex(corner0) + util->GetVoxelVertex(corner1)) / 2;
+				crossings++;
+			}
+		}
+
+		cellVertices[ci] = (FVector(chunkOrigin) + FVector(cell) + crossingSum / crossings) * input.unitScale;
+		cellNormals[ci] = normal;
+		cellStates[ci] = ECellState::Surface;
+		return true;
+	};
+
+	auto cellVertex = [&](FProcMeshSection& section, TArray<int32>& vertexIndices, const FIntVector& cell) {
+		int ci = cellIndex(cell);
+		if (vertexIndices[ci] == INDEX_NONE) {
+			vertexIndices[ci] = section.ProcVertexBuffer.Num();
+			FProcMeshVertex& vertex = section.ProcVertexBuffer.AddDefaulted_GetRef();
+			vertex.Position = cellVertices[ci];
+			vertex.Normal = cellNormals[ci];
+			vertex.UV0 = FVector2D(0, 0);
+			vertex.Color = FColor::Black;
+			section.SectionLocalBox += cellVertices[ci];
+		}
+		return (uint32)vertexIndices[ci];
+	};
+
+	//Every grid edge starting at a point of this chunk belongs to this chunk
+	for (int x = startX; x < endX; x++) {
+		for (int y = 0; y < res; y++) {
+			for (int z = 0; z < res; z++) {
+				const FVoxel& voxel = chunk->voxelArray[util->mortonEncode(x, y, z, res)];
+				const FPoint& point0 = voxel.pointArray[0];
+				bool bSolid0 = point0.type != EVoxelType::Air;
+
+				for (int axis = 0; axis < 3; axis++) {
+					const FPoint& point1 = voxel.pointArray[AxisCorner[axis]];
+					bool bSolid1 = point1.type != EVoxelType::Air;
+					if (bSolid0 == bSolid1) {
+						continue;
+					}
+
+					//The four cells sharing the edge, in order around it
+					int b = SurfaceNetsAxes[axis][1];
+					int c = SurfaceNetsAxes[axis][2];
+					FIntVector cells[4] = { FIntVector(x, y, z), FIntVector(x, y, z), FIntVector(x, y, z), FIntVector(x, y, z) };
+					cells[0][b] -= 1;
+					cells[0][c] -= 1;
+					cells[1][c] -= 1;
+					cells[3][b] -= 1;
+
+					if (!resolveCell(cells[0]) || !resolveCell(cells[1]) || !resolveCell(cells[2]) || !resolveCell(cells[3])) {
+						continue;
+					}
+
+					EVoxelType voxelType = bSolid0 ? point0.type : point1.type;
+					FProcMeshSection& section = outSections.FindOrAdd(voxelType);
+					TArray<int32>& vertexIndices = typeVertexIndices.FindOrAdd(voxelType);
+					if (vertexIndices.Num() == 0) {
+						vertexIndices.Init(INDEX_NONE, numCells);
+					}
+
+					uint32 v00 = cellVertex(section, vertexIndices, cells[0]);
+					uint32 v10 = cellVertex(section, vertexIndices, cells[1]);
+					uint32 v11 = cellVertex(section, vertexIndices, cells[2]);
+					uint32 v01 = cellVertex(section, vertexIndices, cells[3]);
+
+					//Faces point from the solid end of the edge to the air end, same winding as the MC normals
+					if (bSolid0) {
+						section.ProcIndexBuffer.Append({ v00, v11, v10, v00, v01, v11 });
+					}
+					else {
+						section.ProcIndexBuffer.Append({ v00, v10, v11, v00, v11, v01 });
+					}
+				}
+			}
+		}
+	}
+}
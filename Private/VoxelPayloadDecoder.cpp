@@ -0,0 +1,231 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "VoxelPayloadDecoder.h"
+#include "VoxelChunkCache.h"
+#include "VGridComponent.h"
+#include "Async/ParallelFor.h"
+
+FVoxelPayloadDecoder::FVoxelPayloadDecoder(TSharedRef<FVoxelChunkCache, ESPMode::ThreadSafe> InChunkCache)
+    : ChunkCache(InChunkCache)
+{
+}
+
+void FVoxelPayloadDecoder::SetQueueLimits(int32 InHighWatermark, int32 InLowWatermark)
+{
+    HighWatermark = FMath::Max(InHighWatermark, 1);
+    LowWatermark = FMath::Clamp(InLowWatermark, 0, HighWatermark);
+}
+
+void FVoxelPayloadDecoder::SetChunkIdStride(int32 InChunkIdStride)
+{
+    ChunkIdStride = FMath::Max(InChunkIdStride, 0);
+}
+
+bool FVoxelPayloadDecoder::Decode(TArray<uint8>& Message, int32 SourceConnection)
+{
+    if (Message.Num() < 1)
+    {
+        return false;
+    }
+
+    EPayloadType type = (EPayloadType)Message[0];
+    TArrayView<const uint8> data = TArrayView<const uint8>(Message).Slice(1, Message.Num() - 1);
+
+    FVoxelDecodedPayload payload;
+    payload.SourceConnection = SourceConnection;
+    bool bDecoded = false;
+    switch (type)
+    {
+    case EPayloadType::Diff:
+    {
+        payload.Type = EVoxelDecodedPayloadType::Diffs;
+        bDecoded = payload.Diffs.AddDefaulted_GetRef().fromBytes(data);
+        break;
+    }
+    case EPayloadType::DiffList:
+    {
+        FNetDiffList diffList;
+        payload.Type = EVoxelDecodedPayloadType::Diffs;
+        bDecoded = diffList.fromBytes(data);
+        payload.Diffs = MoveTemp(diffList.list);
+        break;
+    }
+    case EPayloadType::Chunk:
+    case EPayloadType::CompressedChunk:
+    {
+        FNetChunk netChunk;
+        payload.Type = EVoxelDecodedPayloadType::Chunks;
+        bDecoded = (type == EPayloadType::Chunk) ? netChunk.fromBytes(data) : netChunk.fromCompressedBytes(data);
+        bDecoded = bDecoded && BuildChunk(netChunk, 0, payload.Chunks.AddDefaulted_GetRef());
+        break;
+    }
+    case EPayloadType::VersionedChunk:
+    {
+        FNetVersionedChunk versionedChunk;
+        payload.Type = EVoxelDecodedPayloadType::Chunks;
+        bDecoded = versionedChunk.fromBytes(data)
+            && BuildChunk(versionedChunk.chunk, versionedChunk.version, payload.Chunks.AddDefaulted_GetRef());
+        break;
+    }
+    case EPayloadType::ChunkList:
+    {
+        FNetChunkList chunkList;
+        payload.Type = EVoxelDecodedPayloadType::Chunks;
+        bDecoded = chunkList.fromBytes(data);
+        if (bDecoded)
+        {
+            // chunks of one list are independent, so they are built side by side
+            FThreadSafeBool bBuilt = true;
+            payload.Chunks.SetNum(chunkList.list.Num());
+            ParallelFor(chunkList.list.Num(), [&](int32 i)
+                {
+                    if (!BuildChunk(chunkList.list[i], 0, payload.Chunks[i]))
+                    {
+                        bBuilt = false;
+                    }
+                });
+            bDecoded = bBuilt;
+        }
+        break;
+    }
+    case EPayloadType::ChunkUnchanged:
+    case EPayloadType::ChunkDelta:
+    {
+        FNetChunkDelta chunkDelta;
+        payload.Type = EVoxelDecodedPayloadType::Chunks;
+        bDecoded = chunkDelta.fromBytes(data, type == EPayloadType::ChunkDelta) && RestoreChunk(chunkDelta, payload);
+        break;
+    }
+    default:
+        return false;
+    }
+
+    // everything but diffs is sent against our credit, which is returned once the game thread has taken the payload
+    if (payload.Type != EVoxelDecodedPayloadType::Diffs)
+    {
+        payload.CreditBytes = Message.Num();
+    }
+
+    if (!bDecoded)
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Dropping malformed payload of type %d, %d bytes"), (int32)type, Message.Num());
+        if (payload.CreditBytes == 0)
+        {
+            return true;
+        }
+        payload.Type = EVoxelDecodedPayloadType::Dropped;
+        payload.Chunks.Reset();
+    }
+
+    payload.QueuedTime = FPlatformTime::Seconds();
+    if (payload.Type == EVoxelDecodedPayloadType::Chunks)
+    {
+        if (QueuedChunks.Add(payload.Chunks.Num()) + payload.Chunks.Num() >= HighWatermark && !bBacklogged.AtomicSet(true))
+        {
+            BacklogCount.Increment();
+        }
+        BulkDepth.Increment();
+        BulkQueue.Enqueue(MoveTemp(payload));
+    }
+    else
+    {
+        InteractiveDepth.Increment();
+        InteractiveQueue.Enqueue(MoveTemp(payload));
+    }
+    return true;
+}
+
+bool FVoxelPayloadDecoder::Dequeue(FVoxelDecodedPayload& OutPayload)
+{
+    if (InteractiveQueue.Dequeue(OutPayload))
+    {
+        InteractiveDepth.Decrement();
+        return true;
+    }
+    if (BulkQueue.Dequeue(OutPayload))
+    {
+        BulkDepth.Decrement();
+        if (QueuedChunks.Subtract(OutPayload.Chunks.Num()) - OutPayload.Chunks.Num() <= LowWatermark && bBacklogged.AtomicSet(false))
+        {
+            bResumeSignal = true;
+        }
+        return true;
+    }
+    return false;
+}
+
+double FVoxelPayloadDecoder::GetOldestQueuedAge()
+{
+    double oldest = FPlatformTime::Seconds();
+    double now = oldest;
+    if (FVoxelDecodedPayload* head = InteractiveQueue.Peek())
+    {
+        oldest = FMath::Min(oldest, head->QueuedTime);
+    }
+    if (FVoxelDecodedPayload* head = BulkQueue.Peek())
+    {
+        oldest = FMath::Min(oldest, head->QueuedTime);
+    }
+    return now - oldest;
+}
+
+bool FVoxelPayloadDecoder::BuildChunk(const FNetChunk& NetChunk, uint32 Version, FVoxelBuiltChunk& OutChunk)
+{
+    // a full chunk replaces any cached copy
+    FIntVector coords(NetChunk.x, NetChunk.y, NetChunk.z);
+    ChunkCache->Remove(coords);
+
+    OutChunk.Version = Version;
+    return UVGridComponent::BuildChunk(coords, NetChunk.density, NetChunk.material, OutChunk.Chunk, OutChunk.DataHash);
+}
+
+bool FVoxelPayloadDecoder::RestoreChunk(const FNetChunkDelta& Delta, FVoxelDecodedPayload& OutPayload)
+{
+    FIntVector coords(Delta.x, Delta.y, Delta.z);
+
+    // diffs are indexed within the chunk, one meant for another chunk would overwrite the voxel at its position in this one.
+    // Checked before the cached copy is taken, so it is still there when the request is resent.
+    if (ChunkIdStride > 0)
+    {
+        uint32 chunkId = (uint32)(coords.X + coords.Y * ChunkIdStride + coords.Z * ChunkIdStride * ChunkIdStride);
+        for (const FNetDiff& diff : Delta.diffs.list)
+        {
+            if (diff.chunk_id != chunkId)
+            {
+                UE_LOG(LogTemp, Warning, TEXT("Delta for chunk %d holds a diff for chunk %d"), chunkId, diff.chunk_id);
+                return false;
+            }
+        }
+    }
+
+    uint32 cachedVersion = 0;
+    TArray<uint8> materials;
+    TArray<uint8> densities;
+    if (!ChunkCache->Take(coords, cachedVersion, materials, densities))
+    {
+        // the game thread may still hold the chunk in storage, so the reply goes along for it to apply there
+        OutPayload.Type = EVoxelDecodedPayloadType::CacheMiss;
+        OutPayload.MissedChunk = coords;
+        OutPayload.DeltaVersion = Delta.version;
+        OutPayload.Diffs = Delta.diffs.list;
+        return true;
+    }
+
+    // diffs set absolute values, so any that were already applied before the chunk was cached are harmless to replay
+    for (const FNetDiff& diff : Delta.diffs.list)
+    {
+        uint32 index = UVGridComponent::MortonIndex(diff.x, diff.y, diff.z);
+        if (diff.x >= 1024 || diff.y >= 1024 || diff.z >= 1024 || index >= (uint32)materials.Num())
+        {
+            return false;
+        }
+        materials[index] = diff.material;
+        densities[index] = diff.density;
+    }
+
+    OutPayload.Type = EVoxelDecodedPayloadType::Chunks;
+    FVoxelBuiltChunk& builtChunk = OutPayload.Chunks.AddDefaulted_GetRef();
+    builtChunk.Version = Delta.version;
+    return UVGridComponent::BuildChunk(coords, densities, materials, builtChunk.Chunk, builtChunk.DataHash);
+}
@@ -37,4 +37,44 @@ void AVoxelPlayerController::RequestChunk(int x, int y, int z) {
 
 void AVoxelPlayerController::PrintChunk(int x, int y, int z) {
 	voxelManager->PrintChunk(x, y, z);
+}
+
+void AVoxelPlayerController::BenchmarkMeshers() {
+	voxelManager->BenchmarkMeshers();
+}
+
+void AVoxelPlayerController::BenchmarkChunkCodecs() {
+	voxelManager->BenchmarkChunkCodecs();
+}
+
+void AVoxelPlayerController::BenchmarkProtocol() {
+	voxelManager->BenchmarkProtocol();
+}
+
+void AVoxelPlayerController::PrintNetStats() {
+	voxelManager->PrintNetStats();
+}
+
+void AVoxelPlayerController::StartStandInServer(int port, float latencyMs, int bandwidthKBps, float lossPercent, bool sharedMemory) {
+	voxelManager->StartStandInServer(port, latencyMs, bandwidthKBps, lossPercent, sharedMemory);
+}
+
+void AVoxelPlayerController::StopStandInServers() {
+	voxelManager->StopStandInServers();
+}
+
+void AVoxelPlayerController::PrintStandInStats() {
+	voxelManager->PrintStandInStats();
+}
+
+void AVoxelPlayerController::StartNetCapture(const FString& path) {
+	voxelManager->StartNetCapture(path);
+}
+
+void AVoxelPlayerController::StopNetCapture() {
+	voxelManager->StopNetCapture();
+}
+
+void AVoxelPlayerController::ReplayNetCapture(const FString& path, bool bAsFastAsPossible) {
+	voxelManager->ReplayNetCapture(path, bAsFastAsPossible);
 }
\ No newline at end of file
@@ -0,0 +1,757 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "VoxelStandInServer.h"
+#include "Common/TcpListener.h"
+#include "Interfaces/IPv4/IPv4Endpoint.h"
+#include "SocketSubsystem.h"
+#include "Sockets.h"
+#include "HAL/Thread.h"
+#include "HAL/PlatformProcess.h"
+#include "VGridComponent.h"
+#include "VoxelByteStream.h"
+#include "VoxelChunkCodec.h"
+
+namespace
+{
+    // frames the way the client expects them, 4 byte big endian length then the type byte
+    template<typename BodyWriter>
+    TArray<uint8> MakeFrame(EPayloadType Type, BodyWriter&& WriteBody)
+    {
+        TArray<uint8> frame;
+        FVoxelByteWriter writer(frame);
+        int32 lengthOffset = writer.ReserveUInt32();
+        writer.WriteUInt8((uint8)Type);
+        WriteBody(writer);
+        writer.PatchUInt32BE(lengthOffset, frame.Num() - 4);
+        return frame;
+    }
+
+    // what the server sends is the mirror of what the client sends, the same schema in the other byte order
+    constexpr EVoxelByteOrder InOrder = FVoxelWire::ClientOrder;
+    constexpr EVoxelByteOrder OutOrder = FVoxelWire::ServerOrder;
+
+    FNetChunkDelta MakeDeltaHeader(const FIntVector& Chunk, uint32 Version)
+    {
+        FNetChunkDelta header;
+        header.x = Chunk.X;
+        header.y = Chunk.Y;
+        header.z = Chunk.Z;
+        header.version = Version;
+        return header;
+    }
+
+    // longest the server thread sleeps when there is nothing to do, which bounds how late a delayed message goes out
+    constexpr float IdleSleepSeconds = 0.0005f;
+
+    constexpr int32 ReceiveChunkSize = 64 * 1024;
+}
+
+FVoxelStandInServer::FVoxelStandInServer(const FVoxelStandInSettings& InSettings)
+    : Settings(InSettings)
+    , LossRandom(InSettings.Seed)
+{
+}
+
+FVoxelStandInServer::~FVoxelStandInServer()
+{
+    Stop();
+}
+
+bool FVoxelStandInServer::Start()
+{
+    if (bRunning)
+    {
+        return true;
+    }
+
+    if (Settings.ChunkSize <= 0 || Settings.ChunkIdStride <= 0)
+    {
+        UE_LOG(LogTemp, Error, TEXT("Stand-in storage server needs the client's chunk size and chunk id stride"));
+        return false;
+    }
+
+    FIPv4Address address = Settings.bListenOnAllInterfaces ? FIPv4Address::Any : FIPv4Address(127, 0, 0, 1);
+    Listener = MakeUnique<FTcpListener>(FIPv4Endpoint(address, Settings.Port), FTimespan::FromMilliseconds(10));
+    if (!Listener->IsActive())
+    {
+        UE_LOG(LogTemp, Error, TEXT("Stand-in storage server could not listen on port %d"), Settings.Port);
+        Listener.Reset();
+        return false;
+    }
+    Listener->OnConnectionAccepted().BindRaw(this, &FVoxelStandInServer::HandleConnectionAccepted);
+
+    if (!Settings.SharedMemoryName.IsEmpty())
+    {
+        SharedMemoryListener = MakeUnique<FSharedMemoryListener>();
+        if (!SharedMemoryListener->Start(Settings.SharedMemoryName, Settings.Port))
+        {
+            Listener.Reset();
+            SharedMemoryListener.Reset();
+            return false;
+        }
+        UE_LOG(LogTemp, Log, TEXT("Stand-in storage server also at %s%s:%d"), FSharedMemoryTransportFormat::Scheme, *Settings.SharedMemoryName, Settings.Port);
+    }
+
+    bRunning = true;
+    Thread = MakeUnique<FThread>(*FString::Printf(TEXT("FVoxelStandInServer %d"), Settings.Port), [this]() { Run(); });
+
+    UE_LOG(LogTemp, Log, TEXT("Stand-in storage server listening on %s, latency %.1fms, bandwidth %d B/s, loss %.1f%%"),
+        *FIPv4Endpoint(address, Settings.Port).ToString(), Settings.LatencyMs, Settings.BandwidthBytesPerSecond, Settings.LossRate * 100.0f);
+    return true;
+}
+
+void FVoxelStandInServer::Stop()
+{
+    // no new connections once the server thread is gone
+    Listener.Reset();
+
+    if (Thread)
+    {
+        bRunning = false;
+        Thread->Join();
+        Thread.Reset();
+    }
+
+    ISocketSubsystem* socketSubsystem = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM);
+    FSocket* accepted = nullptr;
+    while (AcceptedSockets.Dequeue(accepted))
+    {
+        accepted->Close();
+        socketSubsystem->DestroySocket(accepted);
+    }
+
+    for (TUniquePtr<FConnection>& connection : Connections)
+    {
+        if (connection->Socket)
+        {
+            connection->Socket->Close();
+            socketSubsystem->DestroySocket(connection->Socket);
+        }
+    }
+    Connections.Reset();
+    SharedMemoryListener.Reset();
+    Sessions.Reset();
+    StatRepliesAwaitingCredit.Reset();
+}
+
+FVoxelStandInStats FVoxelStandInServer::GetStats() const
+{
+    FVoxelStandInStats stats;
+    stats.Connections = StatConnections.GetValue();
+    stats.MessagesReceived = StatMessagesReceived.GetValue();
+    stats.BytesReceived = StatBytesReceived.GetValue();
+    stats.MessagesSent = StatMessagesSent.GetValue();
+    stats.BytesSent = StatBytesSent.GetValue();
+    stats.ChunksSent = StatChunksSent.GetValue();
+    stats.DeltasSent = StatDeltasSent.GetValue();
+    stats.UnchangedSent = StatUnchangedSent.GetValue();
+    stats.DiffsApplied = StatDiffsApplied.GetValue();
+    stats.RepliesDropped = StatRepliesDropped.GetValue();
+    stats.RepliesAwaitingCredit = StatRepliesAwaitingCredit.GetValue();
+    return stats;
+}
+
+void FVoxelStandInServer::GenerateChunk(const FIntVector& Chunk, int32 ChunkSize, int32 Seed, TArray<uint8>& OutMaterials, TArray<uint8>& OutDensities)
+{
+    int32 numVoxels = ChunkSize * ChunkSize * ChunkSize;
+    OutMaterials.SetNumZeroed(numVoxels);
+    OutDensities.SetNumUninitialized(numVoxels);
+
+    // rolling hills around the middle of the second chunk layer, the seed moves the sample window
+    FVector2D seedOffset(Seed * 113.17f, Seed * 71.31f);
+    float baseHeight = ChunkSize * 1.5f;
+    float amplitude = ChunkSize * 0.75f;
+
+    for (int x = 0; x < ChunkSize; x++)
+    {
+        for (int y = 0; y < ChunkSize; y++)
+        {
+            FVector2D world((float)(Chunk.X * ChunkSize + x), (float)(Chunk.Y * ChunkSize + y));
+            float noise = FMath::PerlinNoise2D(world / 64.0f + seedOffset) + 0.5f * FMath::PerlinNoise2D(world / 16.0f + seedOffset);
+            int32 height = FMath::RoundToInt(baseHeight + amplitude * noise);
+
+            for (int z = 0; z < ChunkSize; z++)
+            {
+                int32 worldZ = Chunk.Z * ChunkSize + z;
+                EVoxelType type = EVoxelType::Air;
+                if (worldZ <= height - 4)
+                {
+                    type = EVoxelType::Stone;
+                }
+                else if (worldZ <= height)
+                {
+                    type = EVoxelType::Ground;
+                }
+
+                // solid points take the density VObject::FillVoxel gives them, air keeps FPoint's default
+                uint32 index = UVGridComponent::MortonIndex(x, y, z);
+                OutMaterials[index] = (uint8)type;
+                OutDensities[index] = type == EVoxelType::Air ? 100 : 0;
+            }
+        }
+    }
+}
+
+bool FVoxelStandInServer::HandleConnectionAccepted(FSocket* Socket, const FIPv4Endpoint& Endpoint)
+{
+    if (!bRunning)
+    {
+        return false;
+    }
+
+    StatConnections.Increment();
+    AcceptedSockets.Enqueue(Socket);
+    return true;
+}
+
+void FVoxelStandInServer::Run()
+{
+    while (bRunning)
+    {
+        FSocket* accepted = nullptr;
+        while (AcceptedSockets.Dequeue(accepted))
+        {
+            accepted->SetNonBlocking(true);
+            accepted->SetNoDelay(true);
+
+            TUniquePtr<FConnection> connection = MakeUnique<FConnection>();
+            connection->Socket = accepted;
+            connection->LastRefill = FPlatformTime::Seconds();
+            Connections.Add(MoveTemp(connection));
+        }
+
+        while (SharedMemoryListener)
+        {
+            TUniquePtr<FSharedMemoryConnection> sharedMemory = SharedMemoryListener->Accept();
+            if (!sharedMemory)
+            {
+                break;
+            }
+
+            StatConnections.Increment();
+            TUniquePtr<FConnection> connection = MakeUnique<FConnection>();
+            connection->SharedMemory = MoveTemp(sharedMemory);
+            connection->LastRefill = FPlatformTime::Seconds();
+            Connections.Add(MoveTemp(connection));
+        }
+
+        // a connection's messages can queue frames on any other, so everything is received before anything is flushed
+        bool bBusy = false;
+        for (TUniquePtr<FConnection>& connection : Connections)
+        {
+            bBusy |= Receive(*connection);
+        }
+
+        double now = FPlatformTime::Seconds();
+        for (TUniquePtr<FConnection>& connection : Connections)
+        {
+            ReleaseCredit(*connection, now);
+            bBusy |= Flush(*connection, now);
+        }
+
+        for (int32 i = Connections.Num() - 1; i >= 0; i--)
+        {
+            if (Connections[i]->bClosed)
+            {
+                CloseConnection(*Connections[i]);
+                Connections.RemoveAt(i);
+            }
+        }
+
+        if (!bBusy)
+        {
+            FPlatformProcess::Sleep(IdleSleepSeconds);
+        }
+    }
+}
+
+bool FVoxelStandInServer::Receive(FConnection& Connection)
+{
+    if (Connection.bClosed)
+    {
+        return false;
+    }
+
+    bool bReceivedAny = false;
+    while (true)
+    {
+        int32 writable = 0;
+        uint8* writeTo = Connection.ReceiveBuffer.PrepareWrite(ReceiveChunkSize, writable);
+
+        // non-blocking, so nothing to read is a successful read of 0 bytes and a failed read is a closed connection
+        int32 bytesRead = 0;
+        bool bReceived = Connection.SharedMemory ? Connection.SharedMemory->Recv(writeTo, writable, bytesRead)
+            : Connection.Socket->Recv(writeTo, writable, bytesRead);
+        if (!bReceived)
+        {
+            Connection.bClosed = true;
+            break;
+        }
+        if (bytesRead == 0)
+        {
+            break;
+        }
+        Connection.ReceiveBuffer.CommitWrite(bytesRead);
+        bReceivedAny = true;
+
+        TArrayView<const uint8> frame;
+        FTcpReceiveBuffer::EFrameResult result;
+        while ((result = Connection.ReceiveBuffer.NextFrame(frame)) == FTcpReceiveBuffer::EFrameResult::Frame)
+        {
+            StatMessagesReceived.Increment();
+            StatBytesReceived.Add(frame.Num());
+            HandleMessage(Connection, frame);
+        }
+
+        if (result == FTcpReceiveBuffer::EFrameResult::TooLarge)
+        {
+            UE_LOG(LogTemp, Warning, TEXT("Stand-in storage server closing a connection sending an oversized frame"));
+            Connection.bClosed = true;
+            break;
+        }
+    }
+    return bReceivedAny;
+}
+
+void FVoxelStandInServer::HandleMessage(FConnection& Connection, TArrayView<const uint8> Message)
+{
+    FVoxelByteReader reader(Message);
+    EPayloadType type = (EPayloadType)reader.ReadUInt8();
+    if (reader.IsError())
+    {
+        return;
+    }
+
+    switch (type)
+    {
+    case EPayloadType::Hello:
+        HandleHello(Connection, reader);
+        break;
+    case EPayloadType::Diff:
+    {
+        FNetDiff diff;
+        if (diff.ReadFields<InOrder>(reader))
+        {
+            HandleDiff(diff);
+        }
+        break;
+    }
+    case EPayloadType::ChunkRequest:
+    {
+        FNetChunkRequest request;
+        if (request.ReadFields<InOrder>(reader))
+        {
+            HandleChunkRequest(Connection, FIntVector(request.x, request.y, request.z), false, 0);
+        }
+        break;
+    }
+    case EPayloadType::ChunkRequestList:
+    {
+        FNetChunkRequestList requests;
+        if (FVoxelWire::ReadList<InOrder>(reader, requests.list, FNetChunkRequest::MinWireSize))
+        {
+            for (const FNetChunkRequest& request : requests.list)
+            {
+                HandleChunkRequest(Connection, FIntVector(request.x, request.y, request.z), false, 0);
+            }
+        }
+        break;
+    }
+    case EPayloadType::VersionedChunkRequestList:
+    {
+        FNetVersionedChunkRequestList requests;
+        if (FVoxelWire::ReadList<InOrder>(reader, requests.list, FNetVersionedChunkRequest::MinWireSize))
+        {
+            for (const FNetVersionedChunkRequest& request : requests.list)
+            {
+                HandleChunkRequest(Connection, FIntVector(request.x, request.y, request.z), true, request.version);
+            }
+        }
+        break;
+    }
+    case EPayloadType::UnRegisterChunk:
+    {
+        FNetDeRegisterRequest request;
+        FSession* session = Sessions.Find(Connection.SessionId);
+        if (session && request.ReadFields<InOrder>(reader))
+        {
+            session->Chunks.Remove(request.chunkId);
+        }
+        break;
+    }
+    case EPayloadType::UnRegisterChunkList:
+    {
+        FNetDeRegisterRequestList requests;
+        FSession* session = Sessions.Find(Connection.SessionId);
+        if (session && FVoxelWire::ReadList<InOrder>(reader, requests.chunkIds, sizeof(uint32)))
+        {
+            for (uint32 chunkId : requests.chunkIds)
+            {
+                session->Chunks.Remove(chunkId);
+            }
+        }
+        break;
+    }
+    case EPayloadType::Credit:
+    {
+        FNetCredit credit;
+        FSession* session = Sessions.Find(Connection.SessionId);
+        if (session && credit.ReadFields<InOrder>(reader))
+        {
+            session->bCreditEnabled = true;
+            session->CreditPayloads += credit.payloads;
+            session->CreditBytes += credit.bytes;
+        }
+        break;
+    }
+    default:
+        UE_LOG(LogTemp, Warning, TEXT("Stand-in storage server ignoring payload type %d"), (int32)type);
+        break;
+    }
+}
+
+void FVoxelStandInServer::HandleHello(FConnection& Connection, FVoxelByteReader& Reader)
+{
+    if (Connection.bGreeted)
+    {
+        return;
+    }
+
+    // clients from before channels send only the codec mask, their one connection is a session of its own
+    FNetHello hello;
+    if (!hello.ReadFields<InOrder>(Reader))
+    {
+        return;
+    }
+    uint32 sessionId = hello.sessionId;
+    if (sessionId == 0)
+    {
+        do
+        {
+            sessionId = (uint32)LossRandom.GetUnsignedInt();
+        } while (sessionId == 0 || Sessions.Contains(sessionId));
+    }
+
+    FSession& session = Sessions.FindOrAdd(sessionId);
+    session.CodecMask = hello.codecMask & FVoxelChunkCodec::GetSupportedCodecMask();
+    session.Connections++;
+
+    Connection.SessionId = sessionId;
+    Connection.Channel = hello.channel == EVoxelChannel::Bulk ? EVoxelChannel::Bulk : EVoxelChannel::Interactive;
+    Connection.bGreeted = true;
+
+    FNetHello reply;
+    reply.codecMask = session.CodecMask;
+    reply.sessionId = sessionId;
+    reply.channel = Connection.Channel;
+    reply.protocolVersion = VoxelProtocolVersion;
+    QueueMessage(Connection, MakeFrame(EPayloadType::Hello, [&reply](FVoxelByteWriter& writer)
+        {
+            reply.WriteFields<OutOrder>(writer);
+        }), false);
+}
+
+void FVoxelStandInServer::HandleChunkRequest(FConnection& Connection, const FIntVector& Chunk, bool bVersioned, uint32 ClientVersion)
+{
+    FSession* session = Sessions.Find(Connection.SessionId);
+    if (!session)
+    {
+        return;
+    }
+
+    uint32 chunkId = GetChunkId(Chunk);
+    session->Chunks.Add(chunkId);
+
+    FWorldChunk& worldChunk = FindOrGenerateChunk(Chunk);
+    uint32 oldestDeltaVersion = worldChunk.Version - worldChunk.History.Num();
+
+    if (bVersioned && ClientVersion == worldChunk.Version)
+    {
+        StatUnchangedSent.Increment();
+        QueueMessage(Connection, MakeFrame(EPayloadType::ChunkUnchanged, [&Chunk, &worldChunk](FVoxelByteWriter& writer)
+            {
+                MakeDeltaHeader(Chunk, worldChunk.Version).WriteFields<OutOrder>(writer);
+            }), true);
+        return;
+    }
+
+    if (bVersioned && ClientVersion != 0 && ClientVersion >= oldestDeltaVersion && ClientVersion < worldChunk.Version)
+    {
+        StatDeltasSent.Increment();
+        int32 firstDiff = ClientVersion - oldestDeltaVersion;
+        QueueMessage(Connection, MakeFrame(EPayloadType::ChunkDelta, [&Chunk, &worldChunk, firstDiff](FVoxelByteWriter& writer)
+            {
+                MakeDeltaHeader(Chunk, worldChunk.Version).WriteFields<OutOrder>(writer);
+                FVoxelWire::Write<OutOrder>(writer, (uint32)(worldChunk.History.Num() - firstDiff));
+                for (int32 i = firstDiff; i < worldChunk.History.Num(); i++)
+                {
+                    worldChunk.History[i].WriteFields<OutOrder>(writer);
+                }
+            }), true);
+        return;
+    }
+
+    StatChunksSent.Increment();
+    if (bVersioned)
+    {
+        QueueMessage(Connection, MakeFrame(EPayloadType::VersionedChunk, [&Chunk, &worldChunk](FVoxelByteWriter& writer)
+            {
+                FNetVersionedChunk versionedChunk;
+                versionedChunk.version = worldChunk.Version;
+                versionedChunk.chunk.x = Chunk.X;
+                versionedChunk.chunk.y = Chunk.Y;
+                versionedChunk.chunk.z = Chunk.Z;
+                versionedChunk.chunk.material = worldChunk.Materials;
+                versionedChunk.chunk.density = worldChunk.Densities;
+                versionedChunk.WriteFields<OutOrder>(writer);
+            }), true);
+        return;
+    }
+
+    EVoxelChunkCodec codec = FVoxelChunkCodec::ChooseCodec(session->CodecMask);
+    if (codec != EVoxelChunkCodec::None)
+    {
+        QueueMessage(Connection, MakeFrame(EPayloadType::CompressedChunk, [&Chunk, &worldChunk, codec](FVoxelByteWriter& writer)
+            {
+                FVoxelWire::Write<OutOrder>(writer, (uint32)Chunk.X);
+                FVoxelWire::Write<OutOrder>(writer, (uint32)Chunk.Y);
+                FVoxelWire::Write<OutOrder>(writer, (uint32)Chunk.Z);
+                FVoxelChunkCodec::Encode(codec, worldChunk.Materials, worldChunk.Densities, writer);
+            }), true);
+        return;
+    }
+
+    QueueMessage(Connection, MakeFrame(EPayloadType::Chunk, [&Chunk, &worldChunk](FVoxelByteWriter& writer)
+        {
+            FNetChunk netChunk;
+            netChunk.x = Chunk.X;
+            netChunk.y = Chunk.Y;
+            netChunk.z = Chunk.Z;
+            netChunk.material = worldChunk.Materials;
+            netChunk.density = worldChunk.Densities;
+            netChunk.WriteFields<OutOrder>(writer);
+        }), true);
+}
+
+void FVoxelStandInServer::HandleDiff(const FNetDiff& Diff)
+{
+    if (Diff.x >= (uint32)Settings.ChunkSize || Diff.y >= (uint32)Settings.ChunkSize || Diff.z >= (uint32)Settings.ChunkSize)
+    {
+        return;
+    }
+
+    FWorldChunk& worldChunk = FindOrGenerateChunk(GetChunkCoords(Diff.chunk_id));
+    uint32 index = UVGridComponent::MortonIndex(Diff.x, Diff.y, Diff.z);
+    worldChunk.Materials[index] = Diff.material;
+    worldChunk.Densities[index] = Diff.density;
+
+    worldChunk.Version++;
+    worldChunk.History.Add(Diff);
+    if (worldChunk.History.Num() > Settings.MaxDiffHistory)
+    {
+        worldChunk.History.RemoveAt(0, worldChunk.History.Num() - Settings.MaxDiffHistory);
+    }
+    StatDiffsApplied.Increment();
+
+    // every registered session gets the edit on its interactive connection, the sender included, like the real server
+    for (TPair<uint32, FSession>& session : Sessions)
+    {
+        if (!session.Value.Chunks.Contains(Diff.chunk_id))
+        {
+            continue;
+        }
+
+        FConnection* connection = FindInteractiveConnection(session.Key);
+        if (connection)
+        {
+            QueueMessage(*connection, MakeFrame(EPayloadType::Diff, [&Diff](FVoxelByteWriter& writer)
+                {
+                    Diff.WriteFields<OutOrder>(writer);
+                }), false);
+        }
+    }
+}
+
+void FVoxelStandInServer::QueueMessage(FConnection& Connection, TArray<uint8>&& Frame, bool bChunkReply)
+{
+    if (!bChunkReply)
+    {
+        FOutgoingMessage message;
+        message.DueTime = FPlatformTime::Seconds() + Settings.LatencyMs / 1000.0;
+        message.Frame = MoveTemp(Frame);
+        Connection.Outgoing.Enqueue(MoveTemp(message));
+        return;
+    }
+
+    // a lost reply is never sent and never charged, the client's request timeout asks again
+    if (Settings.LossRate > 0.0f && LossRandom.GetFraction() < Settings.LossRate)
+    {
+        StatRepliesDropped.Increment();
+        return;
+    }
+
+    Connection.AwaitingCredit.Enqueue(MoveTemp(Frame));
+    Connection.AwaitingCreditCount++;
+    StatRepliesAwaitingCredit.Increment();
+}
+
+void FVoxelStandInServer::ReleaseCredit(FConnection& Connection, double Now)
+{
+    FSession* session = Sessions.Find(Connection.SessionId);
+    if (!session)
+    {
+        return;
+    }
+
+    TArray<uint8>* frame = nullptr;
+    while ((frame = Connection.AwaitingCredit.Peek()) != nullptr)
+    {
+        if (session->bCreditEnabled)
+        {
+            if (session->CreditPayloads <= 0 || session->CreditBytes <= 0)
+            {
+                break;
+            }
+
+            // the client returns what it received, which is the frame without its length
+            session->CreditPayloads--;
+            session->CreditBytes -= frame->Num() - 4;
+        }
+
+        FOutgoingMessage message;
+        message.DueTime = Now + Settings.LatencyMs / 1000.0;
+        message.Frame = MoveTemp(*frame);
+        Connection.Outgoing.Enqueue(MoveTemp(message));
+
+        Connection.AwaitingCredit.Pop();
+        Connection.AwaitingCreditCount--;
+        StatRepliesAwaitingCredit.Decrement();
+    }
+}
+
+bool FVoxelStandInServer::Flush(FConnection& Connection, double Now)
+{
+    if (Connection.bClosed)
+    {
+        return false;
+    }
+
+    if (Settings.BandwidthBytesPerSecond > 0)
+    {
+        // at most a tenth of a second saved up, so an idle connection cannot burst far past the limit
+        double rate = Settings.BandwidthBytesPerSecond;
+        Connection.BandwidthTokens = FMath::Min(Connection.BandwidthTokens + (Now - Connection.LastRefill) * rate, rate * 0.1);
+    }
+    Connection.LastRefill = Now;
+
+    bool bSentAny = false;
+    while (true)
+    {
+        if (Connection.SendOffset >= Connection.Sending.Num())
+        {
+            FOutgoingMessage* next = Connection.Outgoing.Peek();
+            if (!next || next->DueTime > Now)
+            {
+                break;
+            }
+            if (Settings.BandwidthBytesPerSecond > 0)
+            {
+                if (Connection.BandwidthTokens <= 0.0)
+                {
+                    break;
+                }
+                Connection.BandwidthTokens -= next->Frame.Num();
+            }
+
+            Connection.Sending = MoveTemp(next->Frame);
+            Connection.SendOffset = 0;
+            Connection.Outgoing.Pop();
+            StatMessagesSent.Increment();
+            StatBytesSent.Add(Connection.Sending.Num());
+        }
+
+        int32 bytesSent = 0;
+        const uint8* sendFrom = Connection.Sending.GetData() + Connection.SendOffset;
+        int32 sendCount = Connection.Sending.Num() - Connection.SendOffset;
+        bool bSent = Connection.SharedMemory ? Connection.SharedMemory->Send(sendFrom, sendCount, bytesSent)
+            : Connection.Socket->Send(sendFrom, sendCount, bytesSent);
+        if (!bSent)
+        {
+            Connection.bClosed = true;
+            break;
+        }
+        if (bytesSent == 0)
+        {
+            // the socket buffer or ring is full, the client is not reading
+            break;
+        }
+        Connection.SendOffset += bytesSent;
+        bSentAny = true;
+    }
+    return bSentAny;
+}
+
+void FVoxelStandInServer::CloseConnection(FConnection& Connection)
+{
+    // the server forgets a session with its last connection, as the real one does
+    FSession* session = Sessions.Find(Connection.SessionId);
+    if (session && --session->Connections <= 0)
+    {
+        Sessions.Remove(Connection.SessionId);
+    }
+    StatRepliesAwaitingCredit.Subtract(Connection.AwaitingCreditCount);
+
+    if (Connection.SharedMemory)
+    {
+        Connection.SharedMemory->Close();
+        Connection.SharedMemory.Reset();
+    }
+    if (Connection.Socket)
+    {
+        Connection.Socket->Close();
+        ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->DestroySocket(Connection.Socket);
+        Connection.Socket = nullptr;
+    }
+}
+
+FVoxelStandInServer::FWorldChunk& FVoxelStandInServer::FindOrGenerateChunk(const FIntVector& Chunk)
+{
+    FWorldChunk* worldChunk = World.Find(Chunk);
+    if (!worldChunk)
+    {
+        worldChunk = &World.Add(Chunk);
+        GenerateChunk(Chunk, Settings.ChunkSize, Settings.Seed, worldChunk->Materials, worldChunk->Densities);
+    }
+    return *worldChunk;
+}
+
+uint32 FVoxelStandInServer::GetChunkId(const FIntVector& Chunk) const
+{
+    return Chunk.X + Chunk.Y * Settings.ChunkIdStride + Chunk.Z * Settings.ChunkIdStride * Settings.ChunkIdStride;
+}
+
+FIntVector FVoxelStandInServer::GetChunkCoords(uint32 ChunkId) const
+{
+    int32 stride = Settings.ChunkIdStride;
+    return FIntVector(ChunkId % stride, (ChunkId / stride) % stride, ChunkId / (stride * stride));
+}
+
+FVoxelStandInServer::FConnection* FVoxelStandInServer::FindInteractiveConnection(uint32 SessionId)
+{
+    // a session without a separate bulk connection uses its one connection for everything
+    FConnection* fallback = nullptr;
+    for (TUniquePtr<FConnection>& connection : Connections)
+    {
+        if (connection->bClosed || !connection->bGreeted || connection->SessionId != SessionId)
+        {
+            continue;
+        }
+        if (connection->Channel == EVoxelChannel::Interactive)
+        {
+            return connection.Get();
+        }
+        fallback = connection.Get();
+    }
+    return fallback;
+}
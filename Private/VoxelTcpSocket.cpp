@@ -2,59 +2,531 @@
 
 
 #include "VoxelTcpSocket.h"
+#include "VoxelChunkCache.h"
+#include "VoxelPayloadDecoder.h"
+#include "TcpFrameCapture.h"
+#include "Async/Async.h"
+#include "Algo/BinarySearch.h"
+#include "Misc/Crc.h"
+
+AVoxelTcpSocket::AVoxelTcpSocket()
+{
+    ChunkCache = MakeShared<FVoxelChunkCache, ESPMode::ThreadSafe>();
+    PayloadDecoder = MakeShared<FVoxelPayloadDecoder, ESPMode::ThreadSafe>(ChunkCache.ToSharedRef());
+
+    SetStorageEndpoints({ TEXT("10.0.0.75:6969") });
+}
+
+bool AVoxelTcpSocket::SetStorageEndpoints(const TArray<FString>& endpoints)
+{
+    TArray<FVoxelStorageShard> shards;
+    for (const FString& endpoint : endpoints)
+    {
+        FVoxelStorageShard shard;
+        FString port;
+        if (!endpoint.TrimStartAndEnd().Split(TEXT(":"), &shard.host, &port, ESearchCase::CaseSensitive, ESearchDir::FromEnd) ||
+            shard.host.IsEmpty() || !port.IsNumeric())
+        {
+            UE_LOG(LogTemp, Error, TEXT("Ignoring storage server endpoint '%s', expected host:port"), *endpoint);
+            continue;
+        }
+        shard.port = FCString::Atoi(*port);
+        shards.Add(shard);
+    }
+
+    if (shards.Num() == 0)
+    {
+        return false;
+    }
+
+    storageShards = MoveTemp(shards);
+    BuildShardRing();
+    return true;
+}
+
+void AVoxelTcpSocket::BuildShardRing()
+{
+    //Points are placed by hashing the endpoint, not the shard index, so a chunk keeps its server when others are added or removed
+    ShardRing.Reset(storageShards.Num() * ShardRingPointsPerShard);
+    for (int32 shard = 0; shard < storageShards.Num(); shard++)
+    {
+        FString endpoint = GetShardEndpoint(shard);
+        for (int32 point = 0; point < ShardRingPointsPerShard; point++)
+        {
+            ShardRing.Emplace(FCrc::StrCrc32(*FString::Printf(TEXT("%s#%d"), *endpoint, point)), shard);
+        }
+    }
+    ShardRing.Sort([](const TPair<uint32, int32>& A, const TPair<uint32, int32>& B) { return A.Key < B.Key; });
+}
+
+int32 AVoxelTcpSocket::GetShardForChunk(uint32 chunkId) const
+{
+    if (ShardRing.Num() == 0)
+    {
+        return 0;
+    }
+
+    //Chunk ids of neighbours are consecutive, hash them so a region spreads over every shard
+    uint32 key = FCrc::MemCrc32(&chunkId, sizeof(chunkId));
+    int32 index = Algo::LowerBoundBy(ShardRing, key, [](const TPair<uint32, int32>& Point) { return Point.Key; });
+    return ShardRing[index < ShardRing.Num() ? index : 0].Value;
+}
+
+FString AVoxelTcpSocket::GetShardEndpoint(int32 shard) const
+{
+    if (!storageShards.IsValidIndex(shard))
+    {
+        return FString();
+    }
+    return FString::Printf(TEXT("%s:%d"), *storageShards[shard].host, storageShards[shard].port);
+}
+
+int32 AVoxelTcpSocket::FindShardByConnection(int32 ConnectionId, EVoxelChannel& OutChannel) const
+{
+    for (int32 shard = 0; shard < storageShards.Num(); shard++)
+    {
+        if (storageShards[shard].connectionIdInteractive == ConnectionId)
+        {
+            OutChannel = EVoxelChannel::Interactive;
+            return shard;
+        }
+        if (storageShards[shard].connectionIdBulk == ConnectionId)
+        {
+            OutChannel = EVoxelChannel::Bulk;
+            return shard;
+        }
+    }
+    return INDEX_NONE;
+}
 
 void AVoxelTcpSocket::ConnectToGameServer() {
-    if (isConnected(connectionIdGameServer))
+    if (IsStorageServerConnected())
     {
         //UE_LOG(LogError, Log, TEXT("Log: Can't connect SECOND time. We're already connected!"));
         return;
     }
-    FTcpSocketDisconnectDelegate disconnectDelegate;
-    disconnectDelegate.BindDynamic(this, &AVoxelTcpSocket::OnDisconnected);
-    FTcpSocketConnectDelegate connectDelegate;
-    connectDelegate.BindDynamic(this, &AVoxelTcpSocket::OnConnected);
-    FTcpSocketReceivedMessageDelegate receivedDelegate;
-    receivedDelegate.BindDynamic(this, &AVoxelTcpSocket::OnMessageReceived);
+
+    sessionId = FGuid::NewGuid().A;
     if (GetNetConnection()) {
         //Server
         UE_LOG(LogTemp, Warning, TEXT("Attempting Server Connect"));
-        Connect("10.0.0.75", 6969, disconnectDelegate, connectDelegate, receivedDelegate, connectionIdGameServer);
     }
     else {
         //Client
         UE_LOG(LogTemp, Warning, TEXT("Attempting Client Connect"));
         FString ip = GetWorld()->GetAddressURL();
         UE_LOG(LogTemp, Log, TEXT("Log: IP %s"), *ip);
-        Connect("10.0.0.75", 6969, disconnectDelegate, connectDelegate, receivedDelegate, connectionIdGameServer);
     }
 
+    for (int32 shard = 0; shard < storageShards.Num(); shard++)
+    {
+        storageShards[shard].reconnectAttempts = 0;
+        storageShards[shard].bHasConnected = false;
+        ConnectShard(shard);
+    }
+}
+
+bool AVoxelTcpSocket::HasActiveShards() const
+{
+    for (const FVoxelStorageShard& storageShard : storageShards)
+    {
+        if (storageShard.state != EVoxelShardState::Disconnected)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void AVoxelTcpSocket::DisconnectStorageServers()
+{
+    for (FVoxelStorageShard& storageShard : storageShards)
+    {
+        //Forget the ids first so OnDisconnected takes them for connections we closed ourselves
+        int32 connectionInteractive = storageShard.connectionIdInteractive;
+        int32 connectionBulk = storageShard.connectionIdBulk;
+        storageShard.connectionIdInteractive = INDEX_NONE;
+        storageShard.connectionIdBulk = INDEX_NONE;
+        storageShard.state = EVoxelShardState::Disconnected;
+        if (connectionInteractive != INDEX_NONE)
+        {
+            Disconnect(connectionInteractive);
+        }
+        if (connectionBulk != INDEX_NONE)
+        {
+            Disconnect(connectionBulk);
+        }
+    }
+}
+
+void AVoxelTcpSocket::ConnectShard(int32 shard)
+{
+    FTcpSocketDisconnectDelegate disconnectDelegate;
+    disconnectDelegate.BindDynamic(this, &AVoxelTcpSocket::OnDisconnected);
+    FTcpSocketConnectDelegate connectDelegate;
+    connectDelegate.BindDynamic(this, &AVoxelTcpSocket::OnConnected);
+    FTcpSocketReceivedMessageDelegate receivedDelegate;
+    receivedDelegate.BindDynamic(this, &AVoxelTcpSocket::OnMessageReceived);
+
+    //Payloads are decoded and their chunks built on the socket thread, only the handshake reaches OnMessageReceived.
+    //Every channel of every shard shares the decoder, so chunks from Bulk and diffs from Interactive still end up in its two queues.
+    //Reads that would grow the chunk queue past its limit wait, diffs on a separate interactive connection keep flowing.
+    TSharedPtr<FVoxelPayloadDecoder, ESPMode::ThreadSafe> decoder = PayloadDecoder;
+    FTcpSocketBackpressureHook backlogHook = [decoder]() { return decoder->IsBacklogged(); };
+    ReceivedMessageHook = [decoder](int32 ConnectionId, TArray<uint8>& Message) { return !decoder->Decode(Message, ConnectionId); };
+
+    FVoxelStorageShard& storageShard = storageShards[shard];
+    UE_LOG(LogTemp, Log, TEXT("Log: Connecting to storage server %s:%d"), *storageShard.host, storageShard.port);
+    storageShard.state = EVoxelShardState::Connecting;
+    storageShard.codecMask = 0;
+    storageShard.protocolVersion = 0;
+    storageShard.connectionIdBulk = INDEX_NONE;
+    storageShard.unreturnedCreditPayloads = 0;
+    storageShard.unreturnedCreditBytes = 0;
+
+    ReceiveBackpressureHook = bUseBulkChannel ? FTcpSocketBackpressureHook() : backlogHook;
+    Connect(storageShard.host, storageShard.port, disconnectDelegate, connectDelegate, receivedDelegate, storageShard.connectionIdInteractive);
+    if (bUseBulkChannel)
+    {
+        ReceiveBackpressureHook = backlogHook;
+        Connect(storageShard.host, storageShard.port, disconnectDelegate, connectDelegate, receivedDelegate, storageShard.connectionIdBulk);
+    }
+}
+
+void AVoxelTcpSocket::Tick(float DeltaTime)
+{
+    Super::Tick(DeltaTime);
+
+    double now = FPlatformTime::Seconds();
+    for (int32 shard = 0; shard < storageShards.Num(); shard++)
+    {
+        if (storageShards[shard].state == EVoxelShardState::WaitingToReconnect && now >= storageShards[shard].nextReconnectTime)
+        {
+            ConnectShard(shard);
+        }
+    }
+}
+
+bool AVoxelTcpSocket::IsShardConnected(int32 shard) const
+{
+    return storageShards.IsValidIndex(shard) && storageShards[shard].state == EVoxelShardState::Connected;
+}
+
+void AVoxelTcpSocket::SetFlowControl(int32 creditPayloads, int32 creditBytes, int32 maxQueuedChunks)
+{
+    chunkCreditPayloads = FMath::Max(creditPayloads, 0);
+    chunkCreditBytes = FMath::Max(creditBytes, 0);
+    PayloadDecoder->SetQueueLimits(maxQueuedChunks, maxQueuedChunks / 2);
+}
+
+bool AVoxelTcpSocket::IsStorageSendBackedUp()
+{
+    for (int32 shard = 0; shard < storageShards.Num(); shard++)
+    {
+        if (IsSendBackedUp(GetConnectionId(shard, EVoxelChannel::Interactive)) || IsSendBackedUp(GetConnectionId(shard, EVoxelChannel::Bulk)))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void AVoxelTcpSocket::ReturnCredit(int32 sourceConnection, int32 bytes)
+{
+    //Credit of a dropped connection went with it, the new one starts from a full window
+    EVoxelChannel channel;
+    int32 shard = FindShardByConnection(sourceConnection, channel);
+    if (chunkCreditPayloads == 0 || shard == INDEX_NONE)
+    {
+        return;
+    }
+
+    FVoxelStorageShard& storageShard = storageShards[shard];
+    storageShard.unreturnedCreditPayloads++;
+    storageShard.unreturnedCreditBytes += bytes;
+    if (storageShard.unreturnedCreditPayloads >= FMath::Max(chunkCreditPayloads / 4, 1) || storageShard.unreturnedCreditBytes >= chunkCreditBytes / 4)
+    {
+        //Kept for the next payload to try again if the grant did not go out
+        if (SendCredit(shard, storageShard.unreturnedCreditPayloads, storageShard.unreturnedCreditBytes))
+        {
+            storageShard.unreturnedCreditPayloads = 0;
+            storageShard.unreturnedCreditBytes = 0;
+        }
+    }
+}
+
+bool AVoxelTcpSocket::SendCredit(int32 shard, int32 payloads, int64 bytes)
+{
+    FNetCredit credit;
+    credit.payloads = payloads;
+    credit.bytes = (uint32)FMath::Min<int64>(bytes, MAX_uint32);
+    if (!SendPayloadToShard(shard, EPayloadType::Credit, credit))
+    {
+        return false;
+    }
+    storageShards[shard].creditGrantsSent++;
+    return true;
+}
+
+EVoxelChannel AVoxelTcpSocket::GetPayloadChannel(EPayloadType payloadType)
+{
+    switch (payloadType)
+    {
+    case EPayloadType::ChunkRequest:
+    case EPayloadType::ChunkRequestList:
+    case EPayloadType::VersionedChunkRequestList:
+    case EPayloadType::UnRegisterChunk:
+    case EPayloadType::UnRegisterChunkList:
+    case EPayloadType::Credit:
+        return EVoxelChannel::Bulk;
+    default:
+        return EVoxelChannel::Interactive;
+    }
+}
+
+int32 AVoxelTcpSocket::GetConnectionId(int32 shard, EVoxelChannel channel) const
+{
+    if (!storageShards.IsValidIndex(shard))
+    {
+        return INDEX_NONE;
+    }
+    if (channel == EVoxelChannel::Bulk && bUseBulkChannel)
+    {
+        return storageShards[shard].connectionIdBulk;
+    }
+    return storageShards[shard].connectionIdInteractive;
+}
+
+bool AVoxelTcpSocket::IsStorageServerConnected()
+{
+    for (int32 shard = 0; shard < storageShards.Num(); shard++)
+    {
+        if (!isConnected(GetConnectionId(shard, EVoxelChannel::Interactive)) || !isConnected(GetConnectionId(shard, EVoxelChannel::Bulk)))
+        {
+            return false;
+        }
+    }
+    return storageShards.Num() > 0;
+}
+
+bool AVoxelTcpSocket::GetChannelStats(int32 shard, EVoxelChannel channel, FTcpConnectionStats& OutStats)
+{
+    return GetConnectionStats(GetConnectionId(shard, channel), OutStats);
 }
 
 void AVoxelTcpSocket::OnConnected(int32 ConId) {
-    UE_LOG(LogTemp, Log, TEXT("Log: Connected to server."));
+    FNetHello hello;
+    hello.codecMask = FVoxelChunkCodec::GetSupportedCodecMask();
+    hello.sessionId = sessionId;
+    hello.protocolVersion = VoxelProtocolVersion;
+    int32 shard = FindShardByConnection(ConId, hello.channel);
+    if (shard == INDEX_NONE)
+    {
+        //Closed while connecting, its shard already moved on
+        return;
+    }
+    UE_LOG(LogTemp, Log, TEXT("Log: Connected to storage server %s on %s channel."), *GetShardEndpoint(shard), *UEnum::GetValueAsString(hello.channel));
+
+    SendPayloadOn(ConId, EPayloadType::Hello, hello);
+
+    //Chunk replies come back on the connection their requests use, so that is the one the window is opened on
+    if (chunkCreditPayloads > 0 && ConId == GetConnectionId(shard, EVoxelChannel::Bulk))
+    {
+        SendCredit(shard, chunkCreditPayloads, chunkCreditBytes);
+    }
+
+    FVoxelStorageShard& storageShard = storageShards[shard];
+    if (isConnected(GetConnectionId(shard, EVoxelChannel::Interactive)) && isConnected(GetConnectionId(shard, EVoxelChannel::Bulk)))
+    {
+        storageShard.state = EVoxelShardState::Connected;
+        storageShard.reconnectAttempts = 0;
+        if (storageShard.bHasConnected)
+        {
+            OnStorageShardReconnected.Broadcast(shard);
+        }
+        storageShard.bHasConnected = true;
+
+        bool bAllConnected = true;
+        for (int32 other = 0; other < storageShards.Num(); other++)
+        {
+            bAllConnected &= IsShardConnected(other);
+        }
+        if (bAllConnected)
+        {
+            OnStorageServerConnected.Broadcast();
+        }
+    }
 }
 
-void AVoxelTcpSocket::OnDisconnected(int32 ConId) {
-    UE_LOG(LogTemp, Log, TEXT("Log: OnDisconnected."));
+bool AVoxelTcpSocket::DequeueDecodedPayload(FVoxelDecodedPayload& OutPayload) {
+    if (!PayloadDecoder->Dequeue(OutPayload))
+    {
+        return false;
+    }
+
+    if (OutPayload.CreditBytes > 0)
+    {
+        ReturnCredit(OutPayload.SourceConnection, OutPayload.CreditBytes);
+    }
+
+    //The chunk queue drained below its low watermark, let the bulk connections read again
+    if (PayloadDecoder->TakeResumeSignal())
+    {
+        for (int32 shard = 0; shard < storageShards.Num(); shard++)
+        {
+            ResumeReceiving(GetConnectionId(shard, EVoxelChannel::Bulk));
+        }
+    }
+    return true;
 }
 
-void AVoxelTcpSocket::OnMessageReceived(int32 ConId, TArray<uint8>& Message) {
-    uint8 payload_type = 0;
-    try
+void AVoxelTcpSocket::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+    StopReplay();
+    Super::EndPlay(EndPlayReason);
+}
+
+bool AVoxelTcpSocket::StartReplay(const FString& path, bool bAsFastAsPossible)
+{
+    if (HasActiveShards() || HasConnections())
+    {
+        UE_LOG(LogTemp, Error, TEXT("Not replaying %s while storage server connections are open or connecting"), *path);
+        return false;
+    }
+
+    StopReplay();
+    bStopReplay = false;
+    bReplayRunning = true;
+    ReplayedFrames.Reset();
+    ReplayThread = MakeUnique<FThread>(TEXT("AVoxelTcpSocket Replay"), [this, path, bAsFastAsPossible]() { RunReplay(path, bAsFastAsPossible); });
+    return true;
+}
+
+void AVoxelTcpSocket::StopReplay()
+{
+    if (ReplayThread)
+    {
+        bStopReplay = true;
+        ReplayThread->Join();
+        ReplayThread.Reset();
+    }
+}
+
+void AVoxelTcpSocket::RunReplay(const FString& path, bool bAsFastAsPossible)
+{
+    FTcpFrameCaptureReader reader;
+    if (!reader.Open(path))
     {
-        payload_type = Message[0];
-        Message.RemoveAt(0);
+        bReplayRunning = false;
+        return;
     }
-    catch (const std::exception& e)
+
+    TSharedPtr<FVoxelPayloadDecoder, ESPMode::ThreadSafe> decoder = PayloadDecoder;
+    TWeakObjectPtr<AVoxelTcpSocket> owner(this);
+    double startTime = FPlatformTime::Seconds();
+
+    FTcpCapturedFrame frame;
+    while (!bStopReplay && reader.Next(frame))
     {
-        UE_LOG(LogTemp, Log, TEXT("ERROR: Length of byte array: %s"), e.what());
+        if (frame.Direction != ETcpFrameDirection::Inbound)
+        {
+            continue;
+        }
+
+        if (!bAsFastAsPossible)
+        {
+            double due = startTime + frame.Time;
+            while (!bStopReplay && FPlatformTime::Seconds() < due)
+            {
+                FPlatformProcess::Sleep(FMath::Min<float>(due - FPlatformTime::Seconds(), 0.005f));
+            }
+        }
+
+        //A live connection stops reading here too
+        while (!bStopReplay && decoder->IsBacklogged())
+        {
+            FPlatformProcess::Sleep(0.001f);
+        }
+
+        //Never one of our own connection ids, so credit for replayed payloads is not sent anywhere
+        int32 connectionId = -2 - frame.ConnectionId;
+        TArray<uint8> message(frame.Payload.GetData(), frame.Payload.Num());
+        if (!decoder->Decode(message, connectionId))
+        {
+            AsyncTask(ENamedThreads::GameThread, [owner, connectionId, message = MoveTemp(message)]() mutable
+                {
+                    if (owner.IsValid())
+                    {
+                        owner->OnMessageReceived(connectionId, message);
+                    }
+                });
+        }
+        ReplayedFrames.Increment();
+    }
+
+    UE_LOG(LogTemp, Log, TEXT("Replayed %lld inbound frames covering %.1f s of %s in %.1f s"),
+        ReplayedFrames.GetValue(), reader.GetTime(), *path, FPlatformTime::Seconds() - startTime);
+    bReplayRunning = false;
+}
+
+void AVoxelTcpSocket::OnDisconnected(int32 ConId) {
+    EVoxelChannel channel;
+    int32 shard = FindShardByConnection(ConId, channel);
+    if (shard == INDEX_NONE || !HasActorBegunPlay())
+    {
+        //One we closed ourselves, or the game is shutting down
+        return;
+    }
+
+    //The server pairs the channels by session, so they always go down and come back together
+    FVoxelStorageShard& storageShard = storageShards[shard];
+    int32 otherConnection = (channel == EVoxelChannel::Bulk) ? storageShard.connectionIdInteractive : storageShard.connectionIdBulk;
+    storageShard.connectionIdInteractive = INDEX_NONE;
+    storageShard.connectionIdBulk = INDEX_NONE;
+    if (otherConnection != INDEX_NONE)
+    {
+        Disconnect(otherConnection);
+    }
+
+    float delay = FMath::Min(reconnectDelayMin * FMath::Pow(2.0f, (float)storageShard.reconnectAttempts), reconnectDelayMax);
+    //Spread out clients that lost the same server at the same moment
+    delay *= FMath::FRandRange(0.75f, 1.25f);
+    storageShard.reconnectAttempts++;
+    storageShard.state = EVoxelShardState::WaitingToReconnect;
+    storageShard.nextReconnectTime = FPlatformTime::Seconds() + delay;
+
+    UE_LOG(LogTemp, Warning, TEXT("Lost storage server %s, reconnecting in %.1f s (attempt %d)"),
+        *GetShardEndpoint(shard), delay, storageShard.reconnectAttempts);
+}
+
+void AVoxelTcpSocket::OnMessageReceived(int32 ConId, TArray<uint8>& Message) {
+    if (Message.Num() < 1)
+    {
+        UE_LOG(LogTemp, Log, TEXT("ERROR: Empty message from storage server"));
+        return;
     }
 
     //Add Verification on if message is correct format
 
-    FNetPayload netPayload;
-    netPayload.payload_type = (EPayloadType)payload_type;
-    netPayload.data = Message;
+    if (Message[0] == (uint8)EPayloadType::Hello)
+    {
+        FNetHello hello;
+        EVoxelChannel channel;
+        int32 shard = FindShardByConnection(ConId, channel);
+        if (shard != INDEX_NONE && hello.fromBytes(TArrayView<const uint8>(Message).Slice(1, Message.Num() - 1)))
+        {
+            storageShards[shard].codecMask = hello.codecMask;
+            storageShards[shard].protocolVersion = hello.protocolVersion;
+            UE_LOG(LogTemp, Log, TEXT("Log: Storage server %s protocol %u, chunk codecs 0x%x"), *GetShardEndpoint(shard), hello.protocolVersion, hello.codecMask);
+
+            //Optional fields keep older and newer peers talking, only a version change means a payload is read differently
+            if (hello.protocolVersion != VoxelProtocolVersion)
+            {
+                UE_LOG(LogTemp, Warning, TEXT("Storage server %s speaks protocol %u, this build %u"), *GetShardEndpoint(shard), hello.protocolVersion, VoxelProtocolVersion);
+            }
+        }
+        return;
+    }
 
-    payloadQueue.Add(netPayload);
+    UE_LOG(LogTemp, Warning, TEXT("Ignoring unknown payload type %d from storage server"), Message[0]);
 }
\ No newline at end of file
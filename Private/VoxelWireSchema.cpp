@@ -0,0 +1,66 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "VoxelWireSchema.h"
+#include "Math/RandomStream.h"
+#include "VoxelTcpSocket.h"
+
+void FVoxelWire::RunBenchmark(int32 Iterations)
+{
+    FRandomStream random(1);
+
+    // diffs are the most frequent payload from the server, versioned requests the biggest from the client
+    FNetDiffList diffs;
+    FNetVersionedChunkRequestList requests;
+    diffs.list.Reserve(Iterations);
+    requests.list.Reserve(Iterations);
+    for (int32 i = 0; i < Iterations; i++)
+    {
+        diffs.list.Add(FNetDiff::MakeRandom(random));
+        requests.list.Add(FNetVersionedChunkRequest(random.RandRange(0, 99), random.RandRange(0, 99), random.RandRange(0, 99), random.GetUnsignedInt()));
+    }
+
+    auto measure = [Iterations](const TCHAR* Name, TFunctionRef<void(TArray<uint8>&)> Encode, TFunctionRef<bool(TArrayView<const uint8>)> Decode)
+        {
+            TArray<uint8> bytes;
+            double startTime = FPlatformTime::Seconds();
+            Encode(bytes);
+            double encodeSeconds = FPlatformTime::Seconds() - startTime;
+
+            startTime = FPlatformTime::Seconds();
+            bool bDecoded = Decode(bytes);
+            double decodeSeconds = FPlatformTime::Seconds() - startTime;
+
+            double megabytes = bytes.Num() / (1024.0 * 1024.0);
+            UE_LOG(LogTemp, Display, TEXT("%s: %d in %d bytes, encode %.1f MB/s (%.1f M/s), decode %.1f MB/s (%.1f M/s)%s"),
+                Name, Iterations, bytes.Num(),
+                encodeSeconds > 0.0 ? megabytes / encodeSeconds : 0.0, encodeSeconds > 0.0 ? Iterations / encodeSeconds / 1000000.0 : 0.0,
+                decodeSeconds > 0.0 ? megabytes / decodeSeconds : 0.0, decodeSeconds > 0.0 ? Iterations / decodeSeconds / 1000000.0 : 0.0,
+                bDecoded ? TEXT("") : TEXT(", DECODE FAILED"));
+        };
+
+    measure(TEXT("FNetDiffList"),
+        [&diffs](TArray<uint8>& Bytes)
+        {
+            FVoxelByteWriter writer(Bytes);
+            diffs.WriteFields<ServerOrder>(writer);
+        },
+        [](TArrayView<const uint8> Bytes)
+        {
+            FNetDiffList decoded;
+            return decoded.fromBytes(Bytes);
+        });
+
+    measure(TEXT("FNetVersionedChunkRequestList"),
+        [&requests](TArray<uint8>& Bytes)
+        {
+            FVoxelByteWriter writer(Bytes);
+            requests.serialize(writer);
+        },
+        [](TArrayView<const uint8> Bytes)
+        {
+            FNetVersionedChunkRequestList decoded;
+            FVoxelByteReader reader(Bytes);
+            return ReadList<ClientOrder>(reader, decoded.list, FNetVersionedChunkRequest::MinWireSize);
+        });
+}
@@ -125,6 +125,16 @@ struct FChunk {
 
 	UPROPERTY()
 	bool bIsEmpty = true;
+	//Bumped by the grid every time the chunk's data changes. Unique across chunks of one grid.
+	UPROPERTY()
+	uint32 version = 0;
+	//Hash of the chunk's voxel data including its seam points, read it through UVGridComponent::getContentHash.
+	//Computed from the data alone, so equal data gives an equal hash however it was reached.
+	UPROPERTY()
+	uint32 contentHash = 0;
+	//Set by edits, contentHash is recomputed from the data before it is read again
+	UPROPERTY()
+	bool bContentHashStale = false;
 	UPROPERTY()
 	FVector offset;
 	UPROPERTY()
@@ -0,0 +1,26 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Quadric error metric edge-collapse decimation for chunk meshes.
+ * Plain C++ so it can run on pool threads without touching any UObject.
+ */
+class VOXELGAME_API FMeshSimplifier
+{
+public:
+
+	/*
+	Welds the input triangles by position and collapses edges in order of quadric error until the
+	mesh is down to TargetTriangleCount (or no further collapse is legal).
+	Vertices lying on a face of LockedBounds, or on an open edge (e.g. a seam with another voxel type's section),
+	never move, so the result stays watertight against neighbouring chunks and sections.
+	VertexScale is the size of one voxel in the input units; error thresholds are tuned to voxel sized features.
+	*/
+	static void Simplify(const TArray<FVector>& InPositions, const TArray<int32>& InIndices, int32 TargetTriangleCount,
+		const FBox& LockedBounds, float VertexScale,
+		TArray<FVector>& OutPositions, TArray<int32>& OutIndices, TArray<FVector>& OutNormals);
+
+};
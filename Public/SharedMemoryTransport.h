@@ -0,0 +1,136 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/ThreadSafeBool.h"
+#include "HAL/ThreadSafeCounter64.h"
+
+/**
+ * Shared memory stand-in for a TCP connection to a server on the same machine, addressed as shm://name:port.
+ * The server maps one region per listener, named after the endpoint, holding SlotCount slots. A slot is one connection:
+ * a ring of RingCapacity bytes in each direction and four doorbells, interprocess semaphores posted only when the other
+ * side sleeps on them. The rings carry exactly the bytes a socket would, frames included, so nothing above the
+ * transport can tell them apart.
+ *
+ * Layout, native byte order as both processes run on one machine:
+ * header (magic, version, slot count, ring capacity, server process id) then per slot its state, client process id and
+ * the write position, read position and sleeper flags of its two rings, each on its own cache line.
+ * The ring data follows at the next 4 KB boundary, client to server then server to client for every slot.
+ *
+ * A client claims a Free slot, resets its rings and marks it Connecting. The server marks it Open when it accepts.
+ * The first side to close marks it Closed, the second hands it back as Free.
+ */
+struct FSharedMemoryTransportFormat
+{
+	static constexpr uint32 Magic = 'V' | ('S' << 8) | ('H' << 16) | ('M' << 24);
+	static constexpr uint32 Version = 1;
+
+	static constexpr int32 SlotCount = 32;
+
+	enum ESlotState : int32
+	{
+		SlotFree = 0,
+		SlotClaimed,
+		SlotConnecting,
+		SlotOpen,
+		SlotClosed
+	};
+
+	/* Bytes of each ring, a power of two. Frames larger than this go through in pieces like on a socket. */
+	static constexpr uint32 RingCapacity = 1024 * 1024;
+
+	/* Host part of an endpoint that selects this transport, the rest of the host is the region name */
+	static constexpr const TCHAR* Scheme = TEXT("shm://");
+
+	/* False for hosts without the scheme */
+	static bool ParseHost(const FString& Host, FString& OutName);
+
+	static FString GetRegionName(const FString& Name, int32 Port);
+};
+
+/* Mapped region and its doorbells, shared by a listener and the connections accepted through it */
+class FSharedMemoryTransportRegion;
+
+/**
+ * One end of a shared memory connection, used like a non-blocking FSocket.
+ * Recv and Send may run on two threads at once, each of them on one thread only. Close is safe from any thread.
+ */
+class VOXELGAME_API FSharedMemoryConnection
+{
+public:
+	/* Client side. Claims a slot of the server's region and waits up to Timeout for the server to take it.
+	Null if no server is running there, every slot is taken or the server did not answer. */
+	static TUniquePtr<FSharedMemoryConnection> Connect(const FString& Name, int32 Port, FTimespan Timeout);
+
+	FSharedMemoryConnection(TSharedRef<FSharedMemoryTransportRegion> InRegion, int32 InSlot, bool bInServer);
+	~FSharedMemoryConnection();
+
+	/* Copies out whatever has arrived, true with nothing read when nothing has. False once the peer is gone and
+	everything it sent before has been read. */
+	bool Recv(uint8* Data, int32 BufferSize, int32& BytesRead);
+
+	/* Copies in as much as fits, true with nothing sent when the ring is full. False once either side closed. */
+	bool Send(const uint8* Data, int32 Count, int32& BytesSent);
+
+	/* Bytes Recv would return right now */
+	int32 GetPendingData() const;
+
+	/* Sleeps until Recv has something to do, data or a closed connection. False when WaitTime ran out first. */
+	bool WaitForRead(FTimespan WaitTime);
+
+	/* Sleeps until Send has room or the connection closed. False when WaitTime ran out first. */
+	bool WaitForWrite(FTimespan WaitTime);
+
+	/* Neither side has closed and the peer process still runs */
+	bool IsOpen();
+
+	/* The peer reads what was sent before, then its Recv fails. Wakes every sleeper on the slot. */
+	void Close();
+
+	int32 GetSlot() const { return Slot; }
+
+	/* Closed once one side closed, Free again once both have */
+	FSharedMemoryTransportFormat::ESlotState GetSlotState() const;
+
+#if WITH_DEV_AUTOMATION_TESTS
+	/* Records ProcessId as the peer's and checks it on the next IsOpen, so a test can stand in for a peer that died */
+	void SetPeerProcessIdForTest(int32 ProcessId);
+#endif
+
+private:
+	TSharedRef<FSharedMemoryTransportRegion> Region;
+	int32 Slot;
+	bool bServer;
+
+	/* Index of the ring this side reads from, the other one it writes to */
+	int32 ReadRing;
+	int32 WriteRing;
+
+	FThreadSafeBool bClosed;
+
+	/* Cycles64 after which IsOpen asks the OS again whether the peer still runs */
+	FThreadSafeCounter64 NextPeerCheck;
+	FThreadSafeBool bPeerGone;
+};
+
+/* Server side, publishes a region for shm://name:port and hands out the clients connecting to it */
+class VOXELGAME_API FSharedMemoryListener
+{
+public:
+	~FSharedMemoryListener();
+
+	/* False if the region or its doorbells cannot be created */
+	bool Start(const FString& Name, int32 Port);
+
+	/* No new clients. Accepted connections keep the region mapped until they are gone. */
+	void Stop();
+
+	bool IsActive() const { return Region.IsValid(); }
+
+	/* Next client waiting to be accepted, null when there is none. Never blocks. */
+	TUniquePtr<FSharedMemoryConnection> Accept();
+
+private:
+	TSharedPtr<FSharedMemoryTransportRegion> Region;
+};
@@ -0,0 +1,124 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/ThreadSafeBool.h"
+#include "HAL/ThreadSafeCounter64.h"
+
+class FThread;
+
+enum class ETcpFrameDirection : uint8
+{
+	Inbound,
+	Outbound
+};
+
+/* One record of a capture file. Payload points into the reader and stays valid until its next Next. */
+struct FTcpCapturedFrame
+{
+	/* Seconds since the capture started */
+	double Time = 0.0;
+
+	int32 ConnectionId = INDEX_NONE;
+	ETcpFrameDirection Direction = ETcpFrameDirection::Inbound;
+
+	/* Frame payload without its length prefix */
+	TArrayView<const uint8> Payload;
+};
+
+/**
+ * Capture file layout, all ints little endian:
+ * "TCAP", u32 version, u64 unix time of the start, then one record per frame:
+ * varint microseconds since the previous record, u8 direction, varint connection id, varint payload length, payload.
+ */
+struct FTcpFrameCaptureFormat
+{
+	static constexpr uint32 Magic = 'T' | ('C' << 8) | ('A' << 16) | ('P' << 24);
+	static constexpr uint32 Version = 1;
+};
+
+/**
+ * Writes every frame an ATcpSocket sends and receives to a capture file, in the order its threads see them.
+ * Shared by all workers of the socket, Record is cheap when not recording and safe from any thread.
+ * Records are appended to memory and written out by a thread of the recorder, so a slow disk never holds up a socket.
+ */
+class VOXELGAME_API FTcpFrameRecorder
+{
+public:
+	FTcpFrameRecorder();
+	~FTcpFrameRecorder();
+
+	/* Starts a new file, stopping any capture in progress. False if the file cannot be created. */
+	bool Start(const FString& Path);
+
+	/* Waits for everything recorded so far to be written, then closes the file */
+	void Stop();
+
+	bool IsRecording() const { return bRecording; }
+
+	void Record(int32 ConnectionId, ETcpFrameDirection Direction, TArrayView<const uint8> Payload);
+
+	int64 GetFramesRecorded() const { return FramesRecorded.GetValue(); }
+	int64 GetBytesRecorded() const { return BytesRecorded.GetValue(); }
+
+private:
+	/* Writer thread body */
+	void WriteLoop();
+
+	/* Pending bytes that wake the writer early, below this it writes every WriteIntervalMs */
+	static constexpr int32 WakeWriterBytes = 256 * 1024;
+	static constexpr uint32 WriteIntervalMs = 50;
+
+	FThreadSafeBool bRecording;
+
+	/* Held by the socket threads while they append a record, and by the writer while it takes them */
+	FCriticalSection Lock;
+	TArray<uint8> Pending;
+	double StartTime = 0.0;
+	uint64 LastMicros = 0;
+
+	/* Owned by the writer thread while it runs */
+	TUniquePtr<FArchive> File;
+	TArray<uint8> Writing;
+
+	/* Triggered when Pending passes WakeWriterBytes or the capture stops */
+	FEvent* PendingEvent = nullptr;
+	TUniquePtr<FThread> WriterThread;
+	FThreadSafeBool bStopWriter;
+
+	FThreadSafeCounter64 FramesRecorded;
+	FThreadSafeCounter64 BytesRecorded;
+};
+
+/* Streams a capture file front to back, one record in memory at a time. Positions are 64 bit, so captures of any size replay. */
+class VOXELGAME_API FTcpFrameCaptureReader
+{
+public:
+	/* False if the file is missing or not a capture of a version this build reads */
+	bool Open(const FString& Path);
+
+	/* False at the end of the file, or at a truncated record which then sets IsError */
+	bool Next(FTcpCapturedFrame& OutFrame);
+
+	bool IsError() const { return bError; }
+
+	/* Seconds covered by the records read so far */
+	double GetTime() const { return Micros / 1000000.0; }
+
+private:
+	/* Delta, connection id and payload length varints of up to 10 bytes each, and the direction */
+	static constexpr int32 MaxRecordHeaderSize = 31;
+
+	TUniquePtr<FArchive> File;
+	int64 FileSize = 0;
+
+	/* Start of the next record */
+	int64 Position = 0;
+
+	/* Payload of the last record read */
+	TArray<uint8> Payload;
+
+	uint64 Micros = 0;
+	bool bError = false;
+};
@@ -0,0 +1,44 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Receive side of a framed TCP stream. Every frame is a 4 byte big endian payload length followed by the payload.
+ * The socket is read straight into the free space at the end of the buffer, and complete frames are handed out
+ * as views into it, so a burst of frames costs one Recv and no per frame copies.
+ * Unread bytes are moved back to the front only when the free space runs out.
+ */
+class VOXELGAME_API FTcpReceiveBuffer
+{
+public:
+	enum class EFrameResult : uint8
+	{
+		Frame,
+		NeedMoreData,
+		TooLarge
+	};
+
+	/* Frames announcing a bigger payload are treated as a corrupt stream */
+	static constexpr uint32 MaxFrameSize = 64 * 1024 * 1024;
+
+	explicit FTcpReceiveBuffer(int32 InitialCapacity = 64 * 1024);
+
+	/* Makes room for at least MinBytes and returns where to write them. OutWritable is all the free space, which can be more. */
+	uint8* PrepareWrite(int32 MinBytes, int32& OutWritable);
+
+	/* Marks BytesWritten bytes after the last PrepareWrite as received */
+	void CommitWrite(int32 BytesWritten);
+
+	/* Takes the next complete frame's payload. The view stays valid until the next PrepareWrite. */
+	EFrameResult NextFrame(TArrayView<const uint8>& OutFrame);
+
+	/* Bytes received but not yet handed out, including partial headers */
+	int32 Num() const { return WritePos - ReadPos; }
+
+private:
+	TArray<uint8> Data;
+	int32 ReadPos = 0;
+	int32 WritePos = 0;
+};
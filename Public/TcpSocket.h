@@ -6,10 +6,43 @@
 #include "GameFramework/Actor.h"
 #include "TcpSocket.generated.h"
 
+class FTcpFrameRecorder;
+
 DECLARE_DYNAMIC_DELEGATE_OneParam(FTcpSocketDisconnectDelegate, int32, ConnectionId);
 DECLARE_DYNAMIC_DELEGATE_OneParam(FTcpSocketConnectDelegate, int32, ConnectionId);
 DECLARE_DYNAMIC_DELEGATE_TwoParams(FTcpSocketReceivedMessageDelegate, int32, ConnectionId, UPARAM(ref) TArray<uint8>&, Message);
 
+/* Traffic counters of one connection, see ATcpSocket::GetConnectionStats */
+struct FTcpConnectionStats
+{
+	int64 MessagesSent = 0;
+	int64 BytesSent = 0;
+	int64 MessagesReceived = 0;
+	int64 BytesReceived = 0;
+
+	/* Messages waiting for the send thread */
+	int32 OutboxDepth = 0;
+	int64 OutboxBytes = 0;
+
+	/* Messages waiting for the game thread */
+	int32 InboxDepth = 0;
+	int64 InboxBytes = 0;
+
+	/* Times reading was held back for the game thread to catch up, and whether it is right now */
+	int64 ReceivePauses = 0;
+	bool bReceivePaused = false;
+
+	/* Messages SendData refused because the outbox was at OutboxMaxBytes */
+	int64 SendsRejected = 0;
+};
+
+/* Runs on the socket thread for every received message before it is queued for the game thread. Returning false drops the message. */
+typedef TFunction<bool(int32 ConnectionId, TArray<uint8>& Message)> FTcpSocketMessageHook;
+
+/* Runs on the socket thread before every read. While it returns true nothing more is read, so the peer is held back by TCP itself.
+Whoever drains the queue behind it calls ATcpSocket::ResumeReceiving once it is below its low watermark. */
+typedef TFunction<bool()> FTcpSocketBackpressureHook;
+
 UCLASS()
 class VOXELGAME_API ATcpSocket : public AActor
 {
@@ -19,7 +52,8 @@ public:
 	// Sets default values for this actor's properties
 	ATcpSocket();
 
-	/* Returns the ID of the new connection. */
+	/* Returns the ID of the new connection. An ipAddress of shm://name reaches a server on this machine through shared memory
+	instead of loopback, with the same frames and callbacks, see FSharedMemoryTransportFormat. */
 	UFUNCTION(BlueprintCallable, Category = "Socket")
 		void Connect(const FString& ipAddress, int32 port,
 			const FTcpSocketDisconnectDelegate& OnDisconnected, const FTcpSocketConnectDelegate& OnConnected,
@@ -34,6 +68,13 @@ public:
 	UFUNCTION(BlueprintCallable, Category = "Socket") // use meta to set first default param to 0
 		bool SendData(int32 ConnectionId, TArray<uint8> DataToSend);
 
+	/* SendData for a message that starts with its own 4 byte length, which captures record it without, like received frames */
+	bool SendFrame(int32 ConnectionId, TArray<uint8> Frame);
+
+	/* Empty buffer with capacity left over from an earlier send, to serialize the next message into without allocating.
+	Hand it back through SendData. */
+	TArray<uint8> AcquireSendBuffer(int32 ConnectionId);
+
 	/*
 	When hitting Stop in PIE while a connection is being established (it's a blocking operation that takes a while to timeout),
 	our ATcpSocketConnection actor will be destroyed, an then the thread will send a message through AsyncTask to call ExecuteOnConnected,
@@ -49,6 +90,7 @@ public:
 	//UFUNCTION(Category = "Socket")
 	void ExecuteOnDisconnected(int32 WorkerId, TWeakObjectPtr<ATcpSocket> thisObj);
 
+	/* Hands every message waiting in the connection's inbox to the received delegate. Posted once per batch, not per message. */
 	//UFUNCTION(Category = "Socket")
 	void ExecuteOnMessageReceived(int32 ConnectionId, TWeakObjectPtr<ATcpSocket> thisObj);
 
@@ -58,7 +100,7 @@ public:
 	UFUNCTION(BlueprintPure, meta = (DisplayName = "Append Bytes", CommutativeAssociativeBinaryOperator = "true"), Category = "Socket")
 		static TArray<uint8> Concat_BytesBytes(TArray<uint8> A, TArray<uint8> B);
 
-	/** Converts an integer to an array of bytes */
+	/** Converts an integer to an array of bytes in FVoxelWire::ClientOrder, little endian. Not the inverse of Message_ReadInt. */
 	UFUNCTION(BlueprintPure, meta = (DisplayName = "Int To Bytes", CompactNodeTitle = "->", Keywords = "cast convert", BlueprintAutocast), Category = "Socket")
 		static TArray<uint8> Conv_IntToBytes(int32 InInt);
 
@@ -74,6 +116,7 @@ public:
 	UFUNCTION(BlueprintPure, meta = (DisplayName = "Byte To Bytes", CompactNodeTitle = "->", Keywords = "cast convert", BlueprintAutocast), Category = "Socket")
 		static TArray<uint8> Conv_ByteToBytes(uint8 InByte);
 
+	/** Reads an integer in FVoxelWire::ServerOrder, big endian, the byte order the storage server sends */
 	UFUNCTION(BlueprintCallable, meta = (DisplayName = "Read Int", Keywords = "read int"), Category = "Socket")
 		static int32 Message_ReadInt(UPARAM(ref) TArray<uint8>& Message);
 
@@ -92,6 +135,25 @@ public:
 	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "Socket")
 		bool isConnected(int32 ConnectionId);
 
+	/* Some connection is open or still connecting */
+	bool HasConnections() const { return TcpWorkers.Num() > 0; }
+
+	/* False if there is no such connection */
+	bool GetConnectionStats(int32 ConnectionId, FTcpConnectionStats& OutStats);
+
+	/* True from the outbox reaching OutboxHighWatermark until it drains to OutboxLowWatermark. Producers that can wait should. */
+	bool IsSendBackedUp(int32 ConnectionId);
+
+	/* Wakes a connection whose reads are held by its backpressure hook */
+	void ResumeReceiving(int32 ConnectionId);
+
+	/* Records every frame of every connection, open or opened later, to a capture file until StopCapture. See FTcpFrameRecorder. */
+	bool StartCapture(const FString& Path);
+
+	void StopCapture();
+
+	const FTcpFrameRecorder& GetFrameRecorder() const { return *FrameRecorder; }
+
 	/* Used by the separate threads to print to console on the main thread. */
 	static void PrintToConsole(FString Str, bool Error);
 
@@ -103,15 +165,44 @@ public:
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Socket")
 		int32 ReceiveBufferSize = 204800;
 
-	/* Time between ticks. Please account for the fact that it takes 1ms to wake up on a modern PC, so 0.01f would effectively be 0.011f */
+	/* Longest time in seconds the worker blocks waiting for the socket before checking whether it should stop.
+	Data is handled as soon as it arrives or is queued, this only bounds how long a disconnect takes. */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Socket")
+		float MaxWaitTime = 0.1f;
+
+	/* Bytes of received messages the game thread has not taken yet. Reading stops at the high watermark and resumes at the low one. */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Socket")
+		int32 InboxHighWatermark = 16 * 1024 * 1024;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Socket")
+		int32 InboxLowWatermark = 4 * 1024 * 1024;
+
+	/* Bytes queued to send. IsSendBackedUp reports the high watermark until the low one is reached, SendData refuses past OutboxMaxBytes. */
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Socket")
-		float TimeBetweenTicks = 0.008f;
+		int32 OutboxHighWatermark = 1024 * 1024;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Socket")
+		int32 OutboxLowWatermark = 256 * 1024;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Socket")
+		int32 OutboxMaxBytes = 32 * 1024 * 1024;
 
 protected:
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
 	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
 
+	/* Handed to the workers of connections made after it is set. Must not touch UObjects, it runs off the game thread. */
+	FTcpSocketMessageHook ReceivedMessageHook;
+
+	/* Same, for the backpressure check */
+	FTcpSocketBackpressureHook ReceiveBackpressureHook;
+
+	/* Shared with every worker, records nothing until StartCapture */
+	TSharedRef<FTcpFrameRecorder, ESPMode::ThreadSafe> FrameRecorder;
+
+	bool QueueSend(int32 ConnectionId, TArray<uint8>&& Message, bool bFramed);
+
 public:
 	// Called every frame
 	virtual void Tick(float DeltaTime) override;
@@ -119,6 +210,9 @@ public:
 private:
 	TMap<int32, TSharedRef<class FTcpSocketWorker>> TcpWorkers;
 
+	/* Ids are never reused, so a late callback from a closed connection cannot reach a newer one */
+	int32 NextConnectionId = 0;
+
 	FTcpSocketDisconnectDelegate DisconnectedDelegate;
 	FTcpSocketConnectDelegate ConnectedDelegate;
 	FTcpSocketReceivedMessageDelegate MessageReceivedDelegate;
@@ -133,6 +227,10 @@ class FTcpSocketWorker : public FRunnable, public TSharedFromThis<FTcpSocketWork
 
 private:
 	class FSocket* Socket = nullptr;
+
+	/* Used instead of Socket for shm:// addresses */
+	TUniquePtr<class FSharedMemoryConnection> SharedMemory;
+
 	FString ipAddress;
 	int port;
 	TWeakObjectPtr<ATcpSocket> ThreadSpawnerActor;
@@ -141,26 +239,109 @@ private:
 	int32 ActualRecvBufferSize;
 	int32 SendBufferSize;
 	int32 ActualSendBufferSize;
-	float TimeBetweenTicks;
+	float MaxWaitTime;
 	FThreadSafeBool bConnected = false;
 
 	TQueue<TArray<uint8>, EQueueMode::Spsc> Inbox;
 	TQueue<TArray<uint8>, EQueueMode::Spsc> Outbox;
 
+	int32 InboxHighWatermark = MAX_int32;
+	int32 InboxLowWatermark = MAX_int32;
+	int32 OutboxHighWatermark = MAX_int32;
+	int32 OutboxLowWatermark = MAX_int32;
+	int32 OutboxMaxBytes = MAX_int32;
+
+	/** Worker thread only. Set at the inbox high watermark, cleared at the low one. */
+	bool bInboxFull = false;
+
+	/** Set at the outbox high watermark by the game thread, cleared at the low one by the send thread */
+	FThreadSafeBool bOutboxFull = false;
+
+	FThreadSafeBool bReceivePaused = false;
+
+	/** Triggered when a paused reader may continue, or the worker stops */
+	FEvent* ResumeEvent = nullptr;
+
+	FTcpSocketBackpressureHook ReceiveBackpressureHook;
+
+	/** Set while a game thread task to drain the inbox is posted and has not started draining yet */
+	FThreadSafeBool bInboxNotifyPending = false;
+
+	FTcpSocketMessageHook ReceivedMessageHook;
+
+	TSharedPtr<FTcpFrameRecorder, ESPMode::ThreadSafe> FrameRecorder;
+
+	/** Triggered when the outbox gets a message or the worker stops, wakes the send thread */
+	FEvent* OutboxEvent = nullptr;
+
+	/** Drains the outbox, so a slow send never holds up receiving and the other way around */
+	TUniquePtr<class FThread> SendThread;
+
+	/** Longest a shm:// connect waits for the server to accept, a TCP connect is bounded by the OS instead */
+	static constexpr float SharedMemoryConnectTimeout = 5.0f;
+
+	/** Smallest read handed to Recv, so frames split across packets are picked up in as few calls as possible */
+	static constexpr int32 MinReceiveSize = 16 * 1024;
+
+	/** Messages queued together are copied into one buffer of up to this size and sent with a single write. Larger ones go out on their own. */
+	static constexpr int32 MaxCoalescedSize = 64 * 1024;
+
+	/** Sent message buffers go back to the game thread for reuse, up to this many of at most MaxPooledBufferSize capacity */
+	static constexpr int32 MaxPooledBuffers = 64;
+	static constexpr int32 MaxPooledBufferSize = 64 * 1024;
+
+	TQueue<TArray<uint8>, EQueueMode::Mpsc> FreeBuffers;
+	FThreadSafeCounter FreeBufferCount;
+
+	FThreadSafeCounter64 MessagesSent;
+	FThreadSafeCounter64 BytesSent;
+	FThreadSafeCounter64 MessagesReceived;
+	FThreadSafeCounter64 BytesReceived;
+	FThreadSafeCounter OutboxDepth;
+	FThreadSafeCounter64 OutboxBytes;
+	FThreadSafeCounter InboxDepth;
+	FThreadSafeCounter64 InboxBytes;
+	FThreadSafeCounter64 ReceivePauses;
+	FThreadSafeCounter64 SendsRejected;
+
 public:
 
 	//Constructor / Destructor
-	FTcpSocketWorker(FString inIp, const int32 inPort, TWeakObjectPtr<ATcpSocket> InOwner, int32 inId, int32 inRecvBufferSize, int32 inSendBufferSize, float inTimeBetweenTicks);
+	FTcpSocketWorker(FString inIp, const int32 inPort, TWeakObjectPtr<ATcpSocket> InOwner, int32 inId, int32 inRecvBufferSize, int32 inSendBufferSize, float inMaxWaitTime);
 	virtual ~FTcpSocketWorker();
 
 	/*  Starts processing of the connection. Needs to be called immediately after construction	 */
 	void Start();
 
-	/* Adds a message to the outgoing message queue */
-	void AddToOutbox(TArray<uint8> Message);
+	/* Set before Start. Runs on the worker thread for every received message. */
+	void SetReceivedMessageHook(FTcpSocketMessageHook InHook) { ReceivedMessageHook = MoveTemp(InHook); }
+
+	/* Set before Start. Runs on the worker thread before every read. */
+	void SetReceiveBackpressureHook(FTcpSocketBackpressureHook InHook) { ReceiveBackpressureHook = MoveTemp(InHook); }
+
+	/* Set before Start. Sees every frame received and every message queued. */
+	void SetFrameRecorder(TSharedPtr<FTcpFrameRecorder, ESPMode::ThreadSafe> InRecorder) { FrameRecorder = MoveTemp(InRecorder); }
+
+	/* Set before Start, all in bytes */
+	void SetQueueLimits(int32 InInboxHigh, int32 InInboxLow, int32 InOutboxHigh, int32 InOutboxLow, int32 InOutboxMax);
+
+	/* Adds a message to the outgoing message queue, false if the outbox is at its byte limit.
+	bFramed says the message starts with its 4 byte length, which the capture leaves out. */
+	bool AddToOutbox(TArray<uint8> Message, bool bFramed);
 
-	/* Reads a message from the inbox queue */
-	TArray<uint8> ReadFromInbox();
+	bool IsSendBackedUp() const { return bOutboxFull; }
+
+	/* Any thread. Wakes the worker if its reads are paused. */
+	void ResumeReceiving();
+
+	/* Game thread. An empty buffer from the pool, or a new one if the pool is empty. */
+	TArray<uint8> AcquireSendBuffer();
+
+	/* Reads the oldest message from the inbox queue, false when it is empty */
+	bool ReadFromInbox(TArray<uint8>& OutMessage);
+
+	/* Called by the game thread before it drains the inbox, so messages arriving during the drain post a new notification */
+	void ClearInboxNotify() { bInboxNotifyPending = false; }
 
 	// Begin FRunnable interface.
 	virtual bool Init() override;
@@ -175,10 +356,22 @@ public:
 	/* Getter for bConnected */
 	bool isConnected();
 
+	/* Safe from any thread, counters are read one by one so they can be a message apart */
+	FTcpConnectionStats GetStats() const;
+
 private:
-	/* Blocking send */
+	/* Blocking send, gives up on shared memory when the worker stops */
 	bool BlockingSend(const uint8* Data, int32 BytesToSend);
 
+	/* Body of the send thread. Sleeps on OutboxEvent and sends everything queued each time it wakes, small messages coalesced. */
+	void SendLoop();
+
+	/* Send thread. Returns a sent message's buffer to the pool. */
+	void RecycleSendBuffer(TArray<uint8>&& Buffer);
+
+	/* Worker thread. Whether to hold off reading, from the inbox watermarks and the backpressure hook. */
+	bool ShouldPauseReceiving();
+
 	/** thread should continue running */
 	FThreadSafeBool bRun = false;
 
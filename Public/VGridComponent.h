@@ -34,6 +34,9 @@ public:
 
 	FVoxel GetVoxel(int x, int y, int z);
 
+	/* Voxel at global voxel coordinates, or nullptr if the coordinates are negative or the chunk is not stored */
+	const FVoxel* FindVoxel(int x, int y, int z);
+
 	void FillVoxel(int x, int y, int z, FPoint point);
 
 	void RemoveVoxel(int x, int y, int z);
@@ -44,6 +47,22 @@ public:
 
 	void SetChunk(int x, int y, int z, TArray<uint8> densities, TArray<uint8> materials);
 
+	/* Builds a chunk from Morton ordered point data without touching any grid, so it can run on any thread.
+	Points the chunk takes from its neighbours are left empty for PublishChunk. Fails if the data is not a power of two cube. */
+	static bool BuildChunk(const FIntVector& chunkCoords, TArrayView<const uint8> densities, TArrayView<const uint8> materials, FChunk& outChunk, uint32& outDataHash);
+
+	/* Stores a chunk made by BuildChunk in place of any old copy and fills the seams it shares with its neighbours */
+	bool PublishChunk(FChunk&& chunk, uint32 dataHash);
+
+	/* Morton index of a point in its chunk, same as UMarchingCubesUtil::mortonEncode but safe off the game thread */
+	static uint32 MortonIndex(int x, int y, int z);
+
+	/* Current densities and materials of a stored chunk in the layout SetChunk takes. False if the chunk is not stored. */
+	bool GetChunkData(int x, int y, int z, TArray<uint8>& densities, TArray<uint8>& materials);
+
+	/* Hash of a stored chunk's points and seams, recomputed from the data if edits made it stale. 0 if the chunk is not stored. */
+	uint32 getContentHash(uint32 chunkId);
+
 	FChunk* getChunk(int x, int y, int z);
 
 	FChunk* getChunk(uint32 chunkId);
@@ -60,12 +79,20 @@ public:
 
 	void addChunkToChangedChunkSet(int x, int y, int z);
 
-	TSet<FChunk*> changedChunksSet;
+	/* Ids of the chunks to redraw. Ids rather than pointers, adding a chunk can move every chunk already stored. */
+	TSet<uint32> changedChunksSet;
 
 	uint32 getChunkId(int x, int y, int z);
 
 private:
 
+	static uint32 GetPointHash(FPoint point);
+
+	static uint32 GetDataHash(TArrayView<const uint8> densities, TArrayView<const uint8> materials);
+
+	/* Seam points of a chunk as its neighbours hold them */
+	uint32 GetSeamHash(int x, int y, int z);
+
 	UPROPERTY()
 		UMarchingCubesUtil* MarchingCubesUtil;
 
@@ -78,4 +105,7 @@ private:
 	UPROPERTY()
 		TMap<uint32, FChunk> Chunks;
 
+	UPROPERTY()
+		uint32 chunkVersionCounter = 0;
+
 };
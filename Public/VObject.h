@@ -11,21 +11,54 @@
 #include "Engine.h"
 #include "VObject.generated.h"
 
+class FVoxelMesher;
+struct FVoxelMeshInput;
+
+UENUM()
+enum class EVoxelMesherType : uint8
+{
+	MarchingCubes,
+	SurfaceNets
+};
+
 USTRUCT()
-struct FTypeBuffer {
+struct FChunkMeshCacheEntry {
 	GENERATED_USTRUCT_BODY();
-	FTypeBuffer() {
-		NumOfVertices = 0;
-	}
 
-	//Proc Mesh Inputs
-	int NumOfVertices;
-	TArray<int32> Triangles;
-	TArray<FVector> ShiftedVertices;
-	TArray<FVector> normals;
-	TArray<FVector2D> UV0;
-	TArray<FProcMeshTangent> tangents;
-	TArray<FLinearColor> vertexColors;
+	//Chunk content and detail level the buffers were built from
+	uint32 contentHash = 0;
+	int lodLevel = 0;
+
+	SIZE_T sizeBytes = 0;
+	uint64 lastUsed = 0;
+
+	TMap<EVoxelType, FProcMeshSection> sections;
+};
+
+USTRUCT()
+struct FDrawnChunkMesh {
+	GENERATED_USTRUCT_BODY();
+
+	//Chunk content and detail level the component's sections were built from
+	uint32 contentHash = 0;
+	int lodLevel = 0;
+
+	//Bumped each time the chunk's render mesh is uploaded
+	uint32 drawSerial = 0;
+
+	//Voxel type of each section, in section index order
+	TArray<EVoxelType> sectionTypes;
+};
+
+USTRUCT()
+struct FChunkCollisionState {
+	GENERATED_USTRUCT_BODY();
+
+	//Draw serial of the render mesh the current collision was built from
+	uint32 builtDrawSerial = 0;
+
+	//Draw serial of a collision build still running on a worker
+	uint32 pendingDrawSerial = 0;
 };
 
 USTRUCT()
@@ -62,6 +95,32 @@ struct FVObjectSettings {
 		bool bCalcCollision;
 	UPROPERTY()
 		UDataTable* MaterialsForVoxelTypes;
+
+	//Decimate chunks further than simplificationStartDistance (in chunks) from the center chunk.
+	//Each chunk of distance past the start halves the triangle budget, down to simplificationMinRatio.
+	UPROPERTY()
+		bool bSimplifyDistantChunks = false;
+	UPROPERTY()
+		float simplificationStartDistance = 1.0f;
+	UPROPERTY()
+		float simplificationMinRatio = 0.125f;
+
+	//Upper bound for meshes kept around for chunks that leave and re-enter render range
+	UPROPERTY()
+		int meshCacheBudgetMB = 64;
+
+	//Collision is only built for drawn chunks within this many chunks of any pawn, and cooked asynchronously.
+	//With bSimplifyCollision the collision mesh is decimated to collisionSimplificationRatio of the drawn triangles.
+	UPROPERTY()
+		float collisionRadius = 1.5f;
+	UPROPERTY()
+		bool bSimplifyCollision = false;
+	UPROPERTY()
+		float collisionSimplificationRatio = 0.25f;
+
+	//Surface extraction algorithm used for this object's chunks
+	UPROPERTY()
+		EVoxelMesherType mesherType = EVoxelMesherType::MarchingCubes;
 };
 
 UCLASS()
@@ -120,6 +179,12 @@ public:
 	UFUNCTION()
 		void SetChunk(int x, int y, int z, TArray<uint8> densities, TArray<uint8> materials);
 
+	UFUNCTION()
+		bool GetChunkData(int x, int y, int z, TArray<uint8>& densities, TArray<uint8>& materials);
+
+	/* Stores a chunk built off the game thread by UVGridComponent::BuildChunk */
+	bool PublishChunk(FChunk&& chunk, uint32 dataHash);
+
 	UFUNCTION()
 		bool containsChunk(int x, int y, int z);
 
@@ -190,6 +255,8 @@ public:
 
 	uint32 getChunkId(int x, int y, int z);
 
+	bool containsChunkId(uint32 chunkId);
+
 	FVector getChunkOffset(uint32 chunkId);
 
 	UFUNCTION()
@@ -198,6 +265,13 @@ public:
 	UFUNCTION()
 	void PrintChunk(int x, int y, int z);
 
+	UFUNCTION()
+	void UpdateCollision();
+
+	/* Meshes every stored chunk with each mesher on one thread and logs time and triangle counts */
+	UFUNCTION()
+	void BenchmarkMeshers();
+
 private:
 
 	UPROPERTY()
@@ -209,6 +283,8 @@ private:
 	UPROPERTY()
 		UMarchingCubesUtil* MarchingCubesUtil;
 
+	TSharedPtr<FVoxelMesher> Mesher;
+
 	UPROPERTY()
 		TArray<UProceduralMeshComponent*> ChunkMeshes;
 
@@ -221,8 +297,60 @@ private:
 	UPROPERTY()
 		FTypeToMaterialMap mapVoxelTypeToMaterial;
 
+	//Meshes of chunks that left render range or changed detail level, keyed by MeshCacheKey(chunk id, detail level),
+	//least recently used dropped first once over meshCacheBudgetMB.
+	//Sections are moved between here and the chunk's component, so a mesh only ever lives in one place.
+	UPROPERTY()
+		TMap<int64, FChunkMeshCacheEntry> MeshCache;
+
+	SIZE_T MeshCacheBytes = 0;
+
+	uint64 MeshCacheClock = 0;
+
+	//What each drawn chunk's component currently holds, keyed by chunk id
+	UPROPERTY()
+		TMap<int, FDrawnChunkMesh> DrawnChunkMeshes;
+
+	UPROPERTY()
+		uint32 DrawSerialCounter = 0;
+
+	//Hidden meshes carrying only collision, keyed by chunk id
+	UPROPERTY()
+		TMap<int, UProceduralMeshComponent*> ChunkCollisionMap;
+
+	UPROPERTY()
+		TMap<int, FChunkCollisionState> ChunkCollisionStates;
+
+	FTimerHandle CollisionTimerHandle;
+
 	void DrawChunk(FChunk* chunk);
 
+	FVoxelMeshInput MakeMeshInput(FChunk* chunk);
+
+	int GetSimplificationLevel(FVector chunkOffset);
+
+	void MergeSlabSections(TArray<TMap<EVoxelType, FProcMeshSection>>& slabSections, TMap<EVoxelType, FProcMeshSection>& outSections);
+
+	void SimplifySections(FChunk* chunk, int lodLevel, TMap<EVoxelType, FProcMeshSection>& sections);
+
+	void UploadChunkSections(int iChunk, uint32 contentHash, int lodLevel, TMap<EVoxelType, FProcMeshSection>&& sections);
+
+	void StashChunkMesh(int iChunk);
+
+	FChunkMeshCacheEntry* FindCachedMesh(int iChunk, uint32 contentHash, int lodLevel);
+
+	void AddCachedMesh(int iChunk, uint32 contentHash, int lodLevel, TMap<EVoxelType, FProcMeshSection>&& sections);
+
+	void RemoveCachedMesh(int64 cacheKey);
+
+	static int64 MeshCacheKey(int iChunk, int lodLevel) { return ((int64)lodLevel << 32) | (uint32)iChunk; }
+
+	void BuildChunkCollision(int iChunk);
+
+	void ApplyChunkCollision(int iChunk, uint32 drawSerial, TArray<FVector>& positions, TArray<int32>& indices);
+
+	void RemoveChunkCollision(int iChunk);
+
 };
 
 
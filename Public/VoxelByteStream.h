@@ -0,0 +1,84 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Reads protocol fields from a byte span without modifying or copying it.
+ * Every read is bounds checked. A read past the end returns zero and sets a sticky error flag,
+ * so a decoder can read all of its fields and check IsError() once at the end.
+ */
+class VOXELGAME_API FVoxelByteReader
+{
+public:
+	explicit FVoxelByteReader(TArrayView<const uint8> InBytes)
+		: Bytes(InBytes)
+	{
+	}
+
+	uint8 ReadUInt8();
+	uint32 ReadUInt32LE();
+	uint32 ReadUInt32BE();
+	uint64 ReadUInt64LE();
+	float ReadFloatLE();
+
+	/* LEB128, 7 bits per byte with the high bit set on all but the last. More than 10 bytes is an error. */
+	uint64 ReadVarUInt64();
+
+	int32 ReadInt32LE() { return (int32)ReadUInt32LE(); }
+	int32 ReadInt32BE() { return (int32)ReadUInt32BE(); }
+
+	/* Next Num bytes as a view into the source, empty on error */
+	TArrayView<const uint8> ReadSpan(int32 Num);
+
+	/* Appends the next Num bytes to Out with one copy */
+	bool ReadBytes(int32 Num, TArray<uint8>& Out);
+
+	bool Skip(int32 Num);
+
+	int32 Tell() const { return Pos; }
+	int32 Remaining() const { return Bytes.Num() - Pos; }
+	TArrayView<const uint8> RemainingSpan() const { return Bytes.Slice(Pos, Remaining()); }
+	bool IsError() const { return bError; }
+
+private:
+	/* Reserves Num bytes for a read and returns them, or nullptr (setting the error flag) if there aren't enough */
+	const uint8* Take(int32 Num);
+
+	TArrayView<const uint8> Bytes;
+	int32 Pos = 0;
+	bool bError = false;
+};
+
+/**
+ * Appends protocol fields to a byte array.
+ */
+class VOXELGAME_API FVoxelByteWriter
+{
+public:
+	explicit FVoxelByteWriter(TArray<uint8>& InBytes)
+		: Bytes(InBytes)
+	{
+	}
+
+	void WriteUInt8(uint8 Value);
+	void WriteUInt32LE(uint32 Value);
+	void WriteUInt32BE(uint32 Value);
+	void WriteUInt64LE(uint64 Value);
+	void WriteFloatLE(float Value);
+	void WriteVarUInt64(uint64 Value);
+	void WriteBytes(TArrayView<const uint8> Value);
+
+	void WriteInt32LE(int32 Value) { WriteUInt32LE((uint32)Value); }
+
+	/* Writes a placeholder for a 4 byte field that is only known later, e.g. a frame length, and returns its offset */
+	int32 ReserveUInt32();
+	void PatchUInt32LE(int32 Offset, uint32 Value);
+	void PatchUInt32BE(int32 Offset, uint32 Value);
+
+	int32 Tell() const { return Bytes.Num(); }
+
+private:
+	TArray<uint8>& Bytes;
+};
@@ -0,0 +1,57 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Containers/List.h"
+
+struct FCachedChunk
+{
+	/* Server version the data was synced to */
+	uint32 Version = 0;
+
+	/* Place in FVoxelChunkCache::StoreOrder, owned by the list */
+	TDoubleLinkedList<FIntVector>::TDoubleLinkedListNode* OrderNode = nullptr;
+
+	/* Chunk codec encoded materials and densities, see FVoxelChunkCodec */
+	TArray<uint8> Data;
+};
+
+/**
+ * Chunks that left storage range, kept compressed so a re-request can name the version the client already has.
+ * The game thread adds chunks and reads versions, the payload decoder takes them back out on the socket thread,
+ * so every call locks.
+ */
+class VOXELGAME_API FVoxelChunkCache
+{
+public:
+
+	/* Least recently stored chunks are dropped once the encoded data is over budget */
+	void SetBudget(SIZE_T InBudgetBytes);
+
+	/* Encodes a chunk's data and stores it in place of any older copy */
+	void Put(const FIntVector& Chunk, uint32 Version, TArrayView<const uint8> Materials, TArrayView<const uint8> Densities);
+
+	/* Version of the cached copy, 0 if there is none */
+	uint32 GetVersion(const FIntVector& Chunk) const;
+
+	/* Removes the cached copy and decodes it. False if there was none or it failed to decode. */
+	bool Take(const FIntVector& Chunk, uint32& OutVersion, TArray<uint8>& OutMaterials, TArray<uint8>& OutDensities);
+
+	void Remove(const FIntVector& Chunk);
+
+private:
+
+	void RemoveLocked(const FIntVector& Chunk);
+
+	mutable FCriticalSection Lock;
+
+	TMap<FIntVector, FCachedChunk> Entries;
+
+	/* Cached chunks oldest stored first, so eviction takes the head instead of searching Entries */
+	TDoubleLinkedList<FIntVector> StoreOrder;
+
+	SIZE_T Bytes = 0;
+
+	SIZE_T BudgetBytes = 32 * 1024 * 1024;
+};
@@ -0,0 +1,51 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "VoxelByteStream.h"
+#include "VoxelChunkCodec.generated.h"
+
+/* Encodings for chunk voxel data on the wire. Values are sent as bytes and used as bits in capability masks, only append. */
+UENUM()
+enum class EVoxelChunkCodec : uint8
+{
+	None,
+	Rle,
+	RleLz4
+};
+
+/**
+ * Chunk voxel data codecs.
+ * Materials and densities are encoded together, each in the chunk's Morton order, where neighbouring voxels
+ * sit next to each other and the long runs of air and solid ground compress well.
+ * Plain C++ so the socket worker can decode without touching any UObject.
+ */
+class VOXELGAME_API FVoxelChunkCodec
+{
+public:
+
+	static uint32 GetCodecBit(EVoxelChunkCodec Codec) { return 1u << (uint32)Codec; }
+
+	/* Every codec this build can decode */
+	static uint32 GetSupportedCodecMask();
+
+	/* Best codec present in both masks */
+	static EVoxelChunkCodec ChooseCodec(uint32 CodecMask);
+
+	/*
+	Writes codec, voxel count and the encoded data. Ints are big endian like everything else the storage server sends.
+	Materials and densities must have the same length. If LZ4 fails RleLz4 is written as Rle, the codec byte says which.
+	*/
+	static void Encode(EVoxelChunkCodec Codec, TArrayView<const uint8> Materials, TArrayView<const uint8> Densities, FVoxelByteWriter& Writer);
+
+	/* Reads what Encode wrote. Fails on unknown codecs, corrupt data or voxel counts over MaxVoxels. */
+	static bool Decode(FVoxelByteReader& Reader, TArray<uint8>& OutMaterials, TArray<uint8>& OutDensities);
+
+	/* Byte runs as value followed by a LEB128 run length */
+	static void RleEncode(TArrayView<const uint8> In, TArray<uint8>& Out);
+	static bool RleDecode(FVoxelByteReader& Reader, int32 NumValues, TArray<uint8>& Out);
+
+	/* Largest chunk accepted from the wire, 64^3 voxels */
+	static constexpr uint32 MaxVoxels = 64 * 64 * 64;
+};
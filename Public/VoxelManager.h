@@ -7,10 +7,28 @@
 #include "TcpSocket.h"
 #include "GameFramework/Actor.h"
 #include "VObject.h"
+#include "VoxelTcpSocket.h"
 #include "Net/UnrealNetwork.h"
 #include "VoxelManager.generated.h"
 
 class AVoxelTcpSocket;
+class FVoxelStandInServer;
+struct FVoxelBuiltChunk;
+
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FVoxelServerConnectedDelegate, bool, bConnected);
+
+USTRUCT()
+struct FChunkRequestState
+{
+	GENERATED_BODY()
+
+	//When the latest copy of the request went out
+	double sentTime = 0.0;
+
+	//Times the request has been sent
+	int attempts = 0;
+};
+
 UCLASS()
 class VOXELGAME_API AVoxelManager : public AActor
 {
@@ -24,26 +42,90 @@ protected:
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
 
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
 public:
 
 	UPROPERTY(EditAnywhere, BlueprintReadWrite)
 		UDataTable* VoxelTypeMaterialList;
 
+	//Bounds for the number of chunk requests kept in flight. The window adapts between them to the measured round trip.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+		int minRequestWindow = 1;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+		int maxRequestWindow = 32;
+
+	//A request is resent after max(minRequestTimeout, 4 x smoothed round trip) without a reply, and given up after maxRequestRetries resends
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+		float minRequestTimeout = 1.0f;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+		int maxRequestRetries = 3;
+
+	//Send chunk requests and unregistrations as one list message per batch instead of one message per chunk
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+		bool bUseBatchedRequests = true;
+
+	//Keep chunks that leave storage range and re-request them with their version, so the server only sends what changed since
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+		bool bUseChunkVersions = true;
+
+	//Time per frame spent applying payloads from the storage server. At least one payload is applied every frame.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+		float inboundBudgetMs = 4.0f;
+
+	//Upper bound for the compressed chunks kept for re-requests, least recently cached dropped first
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+		int chunkCacheBudgetMB = 32;
+
+	//Chunk payloads and megabytes each storage server may send ahead of what the game thread has applied, 0 payloads for no limit
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+		int chunkCreditPayloads = 64;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+		int chunkCreditMB = 8;
+
+	//Built chunks waiting to be applied before reading chunk payloads stops, until half of them are applied
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+		int maxQueuedChunks = 256;
+
+	//Seconds connectToVoxelServer waits for every storage server before reporting failure. Reconnecting carries on in the background.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+		float connectTimeout = 10.0f;
+
+	//Fires once per connectToVoxelServer, with true when every storage server is up or false on connectTimeout
+	UPROPERTY(BlueprintAssignable)
+		FVoxelServerConnectedDelegate OnVoxelServerConnected;
+
+	//Storage servers as "host:port", chunks are spread over them by chunk id. -VoxelStorageServers=a:1,b:2 on the command line overrides.
+	//A server on the same machine can be reached through shared memory as "shm://name:port" if it publishes one.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+		TArray<FString> storageServerEndpoints = { TEXT("10.0.0.75:6969") };
+
 	// Called every frame
 	virtual void Tick(float DeltaTime) override;
 
 	UFUNCTION()
 		AVObject* createVOjbect(FVector location, FRotator rotation, FVObjectSettings settings);
 
+	//Starts connecting and returns straight away, OnVoxelServerConnected reports the outcome.
+	//InitializeVObjects does not have to wait for it, chunk requests queue until their server is up.
 	UFUNCTION(BlueprintCallable)
 		bool connectToVoxelServer();
 
+	UFUNCTION(BlueprintCallable)
+		bool isVoxelServerConnected();
+
 	UFUNCTION()
 		bool areVObjectsInitialized();
 
 	UFUNCTION(BlueprintCallable)
 		void InitializeVObjects();
 
+	//Settings of the VObject InitializeVObjects creates. Stand-in servers size and number their chunks by them.
+	static FVObjectSettings MakeVObjectSettings(UDataTable* voxelTypeMaterialList);
+
 	UFUNCTION()
 		void changeCenterChunk(FVector newCenter);
 
@@ -53,6 +135,12 @@ public:
 	UFUNCTION()
 		void unregisterChunk(int chunkId);
 
+	UFUNCTION()
+		void requestChunks(const TArray<FVector>& chunks);
+
+	UFUNCTION()
+		void unregisterChunks(const TArray<uint32>& chunkIds);
+
 	UFUNCTION()
 		AVObject* getVObject()
 	{
@@ -72,6 +160,45 @@ public:
 	UFUNCTION()
 		void PrintChunk(int x, int y, int z);
 
+	UFUNCTION()
+		void BenchmarkMeshers();
+
+	/* Encodes and decodes every stored chunk with each chunk codec and logs compression ratio and throughput */
+	UFUNCTION()
+		void BenchmarkChunkCodecs();
+
+	/* Logs encode and decode throughput of the wire schema. Its round trips and golden encodings are the VoxelGame.Network.WireSchema test. */
+	UFUNCTION()
+		void BenchmarkProtocol();
+
+	/* Logs inbound queue depth and age, how many payloads the last frames applied and per connection traffic and backpressure */
+	UFUNCTION()
+		void PrintNetStats();
+
+	/* Runs a stand-in storage server on this machine, see FVoxelStandInServer. Connect afterwards with -VoxelStorageServers=127.0.0.1:port,
+	or start them with -VoxelStandInServers=port,port before connecting, which points the storage endpoints at them.
+	With sharedMemory it is also reachable as shm://VoxelStandIn:port, which those endpoints then use.
+	It only accepts connections from this machine unless started with -VoxelStandInAllInterfaces. */
+	UFUNCTION()
+		bool StartStandInServer(int port, float latencyMs, int bandwidthKBps, float lossPercent, bool sharedMemory = false);
+
+	UFUNCTION()
+		void StopStandInServers();
+
+	UFUNCTION()
+		void PrintStandInStats();
+
+	/* Records every frame to and from the storage servers, by default to Saved/NetCaptures. -VoxelNetCapture=path starts it on connect. */
+	UFUNCTION()
+		void StartNetCapture(const FString& path);
+
+	UFUNCTION()
+		void StopNetCapture();
+
+	/* Plays a capture's storage server traffic into this manager instead of a live connection and logs how long applying it took */
+	UFUNCTION()
+		void ReplayNetCapture(const FString& path, bool bAsFastAsPossible);
+
 
 private:
 
@@ -84,12 +211,43 @@ private:
 	UPROPERTY()
 		TArray<AVObject*> createdVObjects;
 
+	//Chunk requests sent and not answered yet, keyed by chunk coordinate
 	UPROPERTY()
-		bool chunkCurrentlyBeingProcessed = false;
+		TMap<FVector, FChunkRequestState> chunkRequestsInFlight;
+
+	float requestWindow = 4.0f;
+
+	bool bRequestSlowStart = true;
+
+	double smoothedRequestRtt = 0.0;
+
+	double minRequestRtt = 0.0;
+
+	double lastRequestWindowCut = 0.0;
+
+	//Server version of each stored chunk, keyed by chunk id. Chunks received without a version are not listed and not cached.
+	UPROPERTY()
+		TMap<uint32, uint32> chunkVersions;
 
 	UPROPERTY()
 		TSet<FVector> chunkRequestPending;
 
+	//Ids of the chunks in chunkRequestPending, changed only through addPendingChunk and removePendingChunk
+	UPROPERTY()
+		TSet<uint32> chunkIdsPending;
+
+	//Diffs that overtook the requested chunk they edit, keyed by chunk id, applied once it is published
+	TMap<uint32, TArray<FNetDiff>> deferredDiffs;
+
+	//Inbound drain counters, the max values are reset by PrintNetStats
+	int32 payloadsLastTick = 0;
+
+	int32 maxPayloadsPerTick = 0;
+
+	int64 payloadsApplied = 0;
+
+	double maxInboundQueueAge = 0.0;
+
 	UPROPERTY()
 		TArray<FVector> chunkRequestQueue;
 
@@ -102,5 +260,52 @@ private:
 	UPROPERTY()
 		bool hasVObjectsInitialized = false;
 
+	void pumpChunkRequests();
+
+	void onChunkReceived(const FVector& chunk);
+
+	void applyNetDiff(const struct FNetDiff& netDiff);
+
+	bool applyDecodedPayload(struct FVoxelDecodedPayload& decodedPayload);
+
+	void addPendingChunk(const FVector& chunk);
+
+	void removePendingChunk(const FVector& chunk);
+
+	void publishChunk(FVoxelBuiltChunk& builtChunk);
+
+	bool onChunkCacheMiss(const struct FVoxelDecodedPayload& decodedPayload);
+
+	void cacheChunk(uint32 chunkId);
+
+	//Requests in flight to the shard are sent again and its resident chunks re-requested with their versions
+	void onStorageShardReconnected(int32 shard);
+
+	bool isChunkShardConnected(const FVector& chunk);
+
+	void onStorageServerConnected();
+
+	void onConnectTimeout();
+
+	bool bConnectingToServer = false;
+
+	double connectStartTime = 0.0;
+
+	FTimerHandle connectTimeoutHandle;
+
+	TArray<TSharedPtr<FVoxelStandInServer>> standInServers;
+
+	void spawnStorageServerConnection();
+
+	/* Closes whatever the connection still has open and points it at the configured storage servers */
+	void reseedStorageEndpoints();
+
+	//Set from ReplayNetCapture until everything replayed is applied
+	bool bReplayingCapture = false;
+
+	double replayStartTime = 0.0;
+
+	int64 replayStartPayloads = 0;
+
 
 };
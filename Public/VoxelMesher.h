@@ -0,0 +1,57 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "VObject.h"
+
+class UVGridComponent;
+class UMarchingCubesUtil;
+
+/**
+ * Everything a mesher reads while building one chunk.
+ * Storage is only read, and the game thread is blocked on the mesher, so it is safe to share between workers.
+ */
+struct FVoxelMeshInput
+{
+	FChunk* chunk = nullptr;
+	UVGridComponent* storage = nullptr;
+	UMarchingCubesUtil* marchingCubesUtil = nullptr;
+	float unitScale = 1.0f;
+	bool bUseVoxelInterpolation = false;
+};
+
+/**
+ * Surface extraction algorithm used by AVObject::DrawChunk.
+ * Meshers are stateless and run on pool threads, one slab of the chunk per call.
+ */
+class VOXELGAME_API FVoxelMesher
+{
+public:
+	virtual ~FVoxelMesher() {}
+
+	/* Meshes the voxels of the chunk with local x in [startX, endX) into one section per voxel type. Indices are relative to each section. */
+	virtual void MeshSlab(const FVoxelMeshInput& input, int startX, int endX, TMap<EVoxelType, FProcMeshSection>& outSections) const = 0;
+
+	static TSharedRef<FVoxelMesher> Create(EVoxelMesherType mesherType);
+};
+
+/**
+ * Classic marching cubes. One unshared vertex per triangle corner with flat normals.
+ */
+class VOXELGAME_API FMarchingCubesMesher : public FVoxelMesher
+{
+public:
+	virtual void MeshSlab(const FVoxelMeshInput& input, int startX, int endX, TMap<EVoxelType, FProcMeshSection>& outSections) const override;
+};
+
+/**
+ * Naive surface nets. One shared vertex per surface cell, placed at the average of the cell's edge crossings,
+ * and one quad per grid edge crossing the surface. Normals come from the cell's corner occupancy so they match across slabs and chunks.
+ * Quads on the chunk's lower faces use the neighbouring chunks' cells, which is why those chunks are kept in storage range.
+ */
+class VOXELGAME_API FSurfaceNetsMesher : public FVoxelMesher
+{
+public:
+	virtual void MeshSlab(const FVoxelMeshInput& input, int startX, int endX, TMap<EVoxelType, FProcMeshSection>& outSections) const override;
+};
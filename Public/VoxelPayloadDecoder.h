@@ -0,0 +1,125 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Containers/Queue.h"
+#include "MarchingCubesUtil.h"
+#include "VoxelTcpSocket.h"
+
+class FVoxelChunkCache;
+
+/* A chunk built off the game thread, ready for UVGridComponent::PublishChunk */
+struct FVoxelBuiltChunk
+{
+	FChunk Chunk;
+
+	uint32 DataHash = 0;
+
+	/* Server version, 0 when the chunk came without one */
+	uint32 Version = 0;
+};
+
+enum class EVoxelDecodedPayloadType : uint8
+{
+	/* Edits for chunks already in storage */
+	Diffs,
+	/* Built chunks */
+	Chunks,
+	/* Delta or unchanged reply with no cached copy to apply it to, Diffs and DeltaVersion are the reply. A resident chunk re-requested
+	   after a reconnect is brought up to date in storage, a chunk whose cached copy is gone has to be requested again in full. */
+	CacheMiss,
+	/* Malformed chunk payload, nothing to apply but its flow control credit still has to be returned */
+	Dropped
+};
+
+struct FVoxelDecodedPayload
+{
+	EVoxelDecodedPayloadType Type = EVoxelDecodedPayloadType::Diffs;
+
+	TArray<FNetDiff> Diffs;
+
+	TArray<FVoxelBuiltChunk> Chunks;
+
+	FIntVector MissedChunk = FIntVector::ZeroValue;
+
+	/* Server version of a CacheMiss reply */
+	uint32 DeltaVersion = 0;
+
+	/* FPlatformTime::Seconds when the payload was queued, for queue age */
+	double QueuedTime = 0.0;
+
+	/* Connection the payload arrived on. Ids are never reused, so payloads from a dropped connection can be told apart. */
+	int32 SourceConnection = INDEX_NONE;
+
+	/* Size on the wire of chunk payloads, which the server sends against our credit. 0 for payloads outside flow control. */
+	int32 CreditBytes = 0;
+};
+
+/**
+ * Turns storage server payloads into diffs and fully built chunks on the socket thread.
+ * Compressed chunks are inflated, chunk lists are built in parallel and delta replies are applied to the cached copy,
+ * in arrival order, so the game thread only publishes results and never touches payload bytes.
+ */
+class VOXELGAME_API FVoxelPayloadDecoder
+{
+public:
+
+	explicit FVoxelPayloadDecoder(TSharedRef<FVoxelChunkCache, ESPMode::ThreadSafe> InChunkCache);
+
+	/* Socket thread. Decodes payload types it knows into the queue and returns true, leaves the handshake and unknown types to the game thread. */
+	bool Decode(TArray<uint8>& Message, int32 SourceConnection);
+
+	/* Game thread. Diffs and cache misses first so edits never wait behind bulk chunks, otherwise oldest first. */
+	bool Dequeue(FVoxelDecodedPayload& OutPayload);
+
+	/* Payloads waiting in each queue */
+	int32 GetInteractiveDepth() const { return InteractiveDepth.GetValue(); }
+	int32 GetBulkDepth() const { return BulkDepth.GetValue(); }
+
+	/* Built chunks waiting in the bulk queue, the bulk of the memory held by the decoder */
+	int32 GetQueuedChunks() const { return QueuedChunks.GetValue(); }
+
+	/* Built chunks the bulk queue may hold before IsBacklogged reports true, until it drains to the low watermark */
+	void SetQueueLimits(int32 InHighWatermark, int32 InLowWatermark);
+
+	/* Chunks per axis, as UVGridComponent::getChunkId numbers them. Delta replies with a diff for any other chunk are dropped.
+	   Set before connecting, 0 checks nothing. */
+	void SetChunkIdStride(int32 InChunkIdStride);
+
+	/* Any thread. Bulk connections stop reading while this is true. */
+	bool IsBacklogged() const { return bBacklogged; }
+
+	/* Game thread. True once after the queue drained out of a backlog, the connections should be resumed. */
+	bool TakeResumeSignal() { return bResumeSignal.AtomicSet(false); }
+
+	int64 GetBacklogCount() const { return BacklogCount.GetValue(); }
+
+	/* Game thread. Seconds the oldest waiting payload has been queued, 0 when both queues are empty. */
+	double GetOldestQueuedAge();
+
+private:
+
+	bool BuildChunk(const FNetChunk& NetChunk, uint32 Version, FVoxelBuiltChunk& OutChunk);
+
+	bool RestoreChunk(const FNetChunkDelta& Delta, FVoxelDecodedPayload& OutPayload);
+
+	TSharedRef<FVoxelChunkCache, ESPMode::ThreadSafe> ChunkCache;
+
+	/* Several producers so connections can share one decoder */
+	TQueue<FVoxelDecodedPayload, EQueueMode::Mpsc> InteractiveQueue;
+	TQueue<FVoxelDecodedPayload, EQueueMode::Mpsc> BulkQueue;
+
+	FThreadSafeCounter InteractiveDepth;
+	FThreadSafeCounter BulkDepth;
+
+	FThreadSafeCounter QueuedChunks;
+	int32 HighWatermark = MAX_int32;
+	int32 LowWatermark = MAX_int32;
+
+	int32 ChunkIdStride = 0;
+
+	FThreadSafeBool bBacklogged = false;
+	FThreadSafeBool bResumeSignal = false;
+	FThreadSafeCounter64 BacklogCount;
+};
@@ -31,5 +31,35 @@ public:
 	UFUNCTION(Exec)
 	void PrintChunk(int x, int y, int z);
 
+	UFUNCTION(Exec)
+	void BenchmarkMeshers();
+
+	UFUNCTION(Exec)
+	void BenchmarkChunkCodecs();
+
+	UFUNCTION(Exec)
+	void BenchmarkProtocol();
+
+	UFUNCTION(Exec)
+	void PrintNetStats();
+
+	UFUNCTION(Exec)
+	void StartStandInServer(int port, float latencyMs, int bandwidthKBps, float lossPercent, bool sharedMemory = false);
+
+	UFUNCTION(Exec)
+	void StopStandInServers();
+
+	UFUNCTION(Exec)
+	void PrintStandInStats();
+
+	UFUNCTION(Exec)
+	void StartNetCapture(const FString& path);
+
+	UFUNCTION(Exec)
+	void StopNetCapture();
+
+	UFUNCTION(Exec)
+	void ReplayNetCapture(const FString& path, bool bAsFastAsPossible);
+
 	AVoxelManager* voxelManager;
 };
@@ -0,0 +1,227 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Containers/Queue.h"
+#include "HAL/ThreadSafeBool.h"
+#include "HAL/ThreadSafeCounter64.h"
+#include "Math/RandomStream.h"
+#include "SharedMemoryTransport.h"
+#include "TcpReceiveBuffer.h"
+#include "VoxelTcpSocket.h"
+
+class FSocket;
+class FTcpListener;
+class FThread;
+struct FIPv4Endpoint;
+
+/* Knobs of FVoxelStandInServer */
+struct FVoxelStandInSettings
+{
+	int32 Port = 6969;
+
+	/* Accepts connections from other machines as well. Off by default, anyone who can reach the port can read and edit
+	the world, there is no authentication. */
+	bool bListenOnAllInterfaces = false;
+
+	/* Also serves clients on this machine at shm://SharedMemoryName:Port when set */
+	FString SharedMemoryName;
+
+	/* Added to every message the server sends, on top of loopback */
+	float LatencyMs = 0.0f;
+
+	/* Outbound bytes per second of each connection, 0 for no limit */
+	int32 BandwidthBytesPerSecond = 0;
+
+	/* Share of chunk replies thrown away, as if the server lost the request. TCP itself never loses anything. */
+	float LossRate = 0.0f;
+
+	/* Terrain seed, the same seed always builds the same world */
+	int32 Seed = 1;
+
+	/* Voxels along each side of a chunk and the stride of chunk ids, the voxelResPerChunk and chunkResolution of the
+	client's FVObjectSettings (see AVoxelManager::MakeVObjectSettings). Start fails while either is unset. */
+	int32 ChunkSize = 0;
+	int32 ChunkIdStride = 0;
+
+	/* Diffs kept per chunk for delta replies, clients with an older version get the whole chunk */
+	int32 MaxDiffHistory = 256;
+};
+
+/* Counters of FVoxelStandInServer since Start */
+struct FVoxelStandInStats
+{
+	int64 Connections = 0;
+	int64 MessagesReceived = 0;
+	int64 BytesReceived = 0;
+	int64 MessagesSent = 0;
+	int64 BytesSent = 0;
+	int64 ChunksSent = 0;
+	int64 DeltasSent = 0;
+	int64 UnchangedSent = 0;
+	int64 DiffsApplied = 0;
+	int64 RepliesDropped = 0;
+
+	/* Chunk replies waiting for credit right now */
+	int32 RepliesAwaitingCredit = 0;
+};
+
+/**
+ * Storage server speaking the client protocol, so streaming, diffs and protocol changes can be tested and benchmarked
+ * on loopback without the real service.
+ * Chunks are generated from a seeded height field the first time they are asked for. Edits are applied, versioned and sent
+ * to every session registered for the chunk. Chunk replies honour the client's credit and can be delayed, throttled and dropped.
+ * All connections are served by one thread, this is a harness and not a server to deploy.
+ */
+class VOXELGAME_API FVoxelStandInServer
+{
+public:
+
+	explicit FVoxelStandInServer(const FVoxelStandInSettings& InSettings);
+	~FVoxelStandInServer();
+
+	/* Listens on loopback, or on every interface with bListenOnAllInterfaces. False if the port is taken. */
+	bool Start();
+
+	/* Closes every connection. Safe to call when not running. */
+	void Stop();
+
+	bool IsRunning() const { return bRunning; }
+
+	const FVoxelStandInSettings& GetSettings() const { return Settings; }
+
+	FVoxelStandInStats GetStats() const;
+
+	/* Chunk voxel data in Morton order, the same for the same seed on every machine */
+	static void GenerateChunk(const FIntVector& Chunk, int32 ChunkSize, int32 Seed, TArray<uint8>& OutMaterials, TArray<uint8>& OutDensities);
+
+private:
+
+	struct FWorldChunk
+	{
+		TArray<uint8> Materials;
+		TArray<uint8> Densities;
+
+		/* Starts at 1, 0 is what clients send when they have no copy */
+		uint32 Version = 1;
+
+		/* The last diffs, the newest brought the chunk to Version */
+		TArray<FNetDiff> History;
+	};
+
+	struct FSession
+	{
+		/* Chunk ids the client is registered for */
+		TSet<uint32> Chunks;
+
+		/* Codecs both sides support */
+		uint32 CodecMask = 0;
+
+		/* Chunk replies are unlimited until the client sends its first credit */
+		bool bCreditEnabled = false;
+		int64 CreditPayloads = 0;
+		int64 CreditBytes = 0;
+
+		int32 Connections = 0;
+	};
+
+	struct FOutgoingMessage
+	{
+		double DueTime = 0.0;
+		TArray<uint8> Frame;
+	};
+
+	struct FConnection
+	{
+		/* One of the two is set */
+		FSocket* Socket = nullptr;
+		TUniquePtr<FSharedMemoryConnection> SharedMemory;
+
+		FTcpReceiveBuffer ReceiveBuffer;
+
+		uint32 SessionId = 0;
+		bool bGreeted = false;
+		EVoxelChannel Channel = EVoxelChannel::Interactive;
+
+		/* Chunk replies held until the session has credit for them */
+		TQueue<TArray<uint8>> AwaitingCredit;
+		int32 AwaitingCreditCount = 0;
+
+		/* Frames in send order, each held back until its latency has passed */
+		TQueue<FOutgoingMessage> Outgoing;
+
+		/* Frame being written, the socket has taken SendOffset bytes of it so far */
+		TArray<uint8> Sending;
+		int32 SendOffset = 0;
+
+		/* Bandwidth token bucket, can go negative by one frame */
+		double BandwidthTokens = 0.0;
+		double LastRefill = 0.0;
+
+		bool bClosed = false;
+	};
+
+	/* Listener thread */
+	bool HandleConnectionAccepted(FSocket* Socket, const FIPv4Endpoint& Endpoint);
+
+	/* Everything below runs on the server thread */
+	void Run();
+
+	bool Receive(FConnection& Connection);
+
+	void HandleMessage(FConnection& Connection, TArrayView<const uint8> Message);
+
+	void HandleHello(FConnection& Connection, FVoxelByteReader& Reader);
+
+	void HandleChunkRequest(FConnection& Connection, const FIntVector& Chunk, bool bVersioned, uint32 ClientVersion);
+
+	void HandleDiff(const FNetDiff& Diff);
+
+	/* Chunk replies go through loss and credit, everything else straight to the send queue */
+	void QueueMessage(FConnection& Connection, TArray<uint8>&& Frame, bool bChunkReply);
+
+	void ReleaseCredit(FConnection& Connection, double Now);
+
+	bool Flush(FConnection& Connection, double Now);
+
+	void CloseConnection(FConnection& Connection);
+
+	FWorldChunk& FindOrGenerateChunk(const FIntVector& Chunk);
+
+	uint32 GetChunkId(const FIntVector& Chunk) const;
+
+	FIntVector GetChunkCoords(uint32 ChunkId) const;
+
+	/* Interactive connection of a session, where its diffs go */
+	FConnection* FindInteractiveConnection(uint32 SessionId);
+
+	FVoxelStandInSettings Settings;
+
+	TUniquePtr<FTcpListener> Listener;
+
+	/* Polled by the server thread, which owns it while running */
+	TUniquePtr<FSharedMemoryListener> SharedMemoryListener;
+	TUniquePtr<FThread> Thread;
+	FThreadSafeBool bRunning;
+
+	/* Handed from the listener thread to the server thread */
+	TQueue<FSocket*, EQueueMode::Mpsc> AcceptedSockets;
+
+	TArray<TUniquePtr<FConnection>> Connections;
+	TMap<uint32, FSession> Sessions;
+	TMap<FIntVector, FWorldChunk> World;
+	FRandomStream LossRandom;
+
+	FThreadSafeCounter64 StatConnections;
+	FThreadSafeCounter64 StatMessagesReceived;
+	FThreadSafeCounter64 StatBytesReceived;
+	FThreadSafeCounter64 StatMessagesSent;
+	FThreadSafeCounter64 StatBytesSent;
+	FThreadSafeCounter64 StatChunksSent;
+	FThreadSafeCounter64 StatDeltasSent;
+	FThreadSafeCounter64 StatUnchangedSent;
+	FThreadSafeCounter64 StatDiffsApplied;
+	FThreadSafeCounter64 StatRepliesDropped;
+	FThreadSafeCounter StatRepliesAwaitingCredit;
+};
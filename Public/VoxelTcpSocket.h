@@ -3,22 +3,106 @@
 #pragma once
 
 #include "CoreMinimal.h"
+#include "HAL/Thread.h"
+#include "Math/RandomStream.h"
 #include "TcpSocket.h"
+#include "VoxelByteStream.h"
+#include "VoxelChunkCodec.h"
+#include "VoxelWireSchema.h"
 
 #include "VoxelTcpSocket.generated.h"
 
+class FVoxelChunkCache;
+class FVoxelPayloadDecoder;
+struct FVoxelDecodedPayload;
+
 
 /**
 * PAYLOAD DATA WRAPPER
 */
 
+/* Sent in both hellos. Bump it when a payload changes in a way an older peer would misread. Optional fields appended
+at the end of a payload do not need a bump. Peers from before the field report 1. */
+static constexpr uint32 VoxelProtocolVersion = 2;
+
 UENUM()
 enum class EPayloadType : uint8
 {
 	Diff,
 	Chunk,
 	ChunkRequest,
-	UnRegisterChunk
+	UnRegisterChunk,
+	ChunkRequestList,
+	UnRegisterChunkList,
+	ChunkList,
+	DiffList,
+	Hello,
+	CompressedChunk,
+	VersionedChunkRequestList,
+	VersionedChunk,
+	ChunkUnchanged,
+	ChunkDelta,
+	Credit
+};
+
+/* Connections to the storage server. Edits and control messages never queue behind chunk transfers on Bulk. */
+UENUM()
+enum class EVoxelChannel : uint8
+{
+	Interactive,
+	Bulk
+};
+
+UENUM()
+enum class EVoxelShardState : uint8
+{
+	Disconnected,
+	Connecting,
+	Connected,
+	WaitingToReconnect
+};
+
+/* One storage server of the set chunks are spread over, with its pair of channel connections */
+USTRUCT()
+struct FVoxelStorageShard
+{
+	GENERATED_BODY()
+
+	UPROPERTY()
+		FString host;
+
+	UPROPERTY()
+		int32 port = 6969;
+
+	UPROPERTY()
+		int32 connectionIdInteractive = INDEX_NONE;
+
+	UPROPERTY()
+		int32 connectionIdBulk = INDEX_NONE;
+
+	/* Codecs this server answered the hello with */
+	UPROPERTY()
+		uint32 codecMask = 0;
+
+	/* Protocol version this server answered the hello with, 0 until it has */
+	UPROPERTY()
+		uint32 protocolVersion = 0;
+
+	UPROPERTY()
+		EVoxelShardState state = EVoxelShardState::Disconnected;
+
+	/* Failed connects in a row, each one doubles the delay before the next */
+	int32 reconnectAttempts = 0;
+	double nextReconnectTime = 0.0;
+
+	/* Connected at least once, so connecting again is a reconnect */
+	bool bHasConnected = false;
+
+	/* Credit used up by payloads the game thread has taken since the last grant */
+	int32 unreturnedCreditPayloads = 0;
+	int64 unreturnedCreditBytes = 0;
+
+	int64 creditGrantsSent = 0;
 };
 
 USTRUCT()
@@ -45,8 +129,19 @@ struct FNetPayload
 
 /**
  * STORAGE SERVER INBOUND STRUCTS
+ *
+ * Each struct's wire layout is its field list, see FVoxelWire. serialize writes the client's byte order and fromBytes reads
+ * the server's, WriteFields and ReadFields take either.
  */
 
+#define FNET_DIFF_FIELDS(Field, Optional) \
+	Field(uint32, chunk_id) \
+	Field(uint32, x) \
+	Field(uint32, y) \
+	Field(uint32, z) \
+	Field(uint8, density) \
+	Field(uint8, material)
+
 USTRUCT()
 struct FNetDiff
 {
@@ -72,29 +167,13 @@ struct FNetDiff
 		material = mat;
 	}
 
-	TArray<uint8> serialize()
-	{
-		TArray<uint8> output;
-
-		output.Append(ATcpSocket::Conv_IntToBytes(this->chunk_id));
-		output.Append(ATcpSocket::Conv_IntToBytes(this->x));
-		output.Append(ATcpSocket::Conv_IntToBytes(this->y));
-		output.Append(ATcpSocket::Conv_IntToBytes(this->z));
-		output.Add(density);
-		output.Add(material);
-
-		return output;
-	}
+	VOXEL_WIRE_STRUCT(FNetDiff, FNET_DIFF_FIELDS)
 
-	void fromBytes(TArray<uint8> bytes)
+	//Any chunk, a point inside a 32 voxel chunk and any voxel, for wire tests and the benchmark
+	static FNetDiff MakeRandom(FRandomStream& random)
 	{
-		this->chunk_id = ATcpSocket::Message_ReadInt(bytes);
-		this->x = ATcpSocket::Message_ReadInt(bytes);
-		this->y = ATcpSocket::Message_ReadInt(bytes);
-		this->z = ATcpSocket::Message_ReadInt(bytes);
-		this->material = bytes.Pop();
-		this->density = bytes.Pop();
-		
+		return FNetDiff(random.GetUnsignedInt(), random.RandRange(0, 31), random.RandRange(0, 31), random.RandRange(0, 31),
+			(uint8)random.RandRange(0, 255), (uint8)random.RandRange(0, 255));
 	}
 
 };
@@ -106,8 +185,33 @@ struct FNetDiffList
 
 		TArray<FNetDiff> list;
 
+	//Diff count, then the diffs back to back
+	template<EVoxelByteOrder Order>
+	void WriteFields(FVoxelByteWriter& writer) const
+	{
+		FVoxelWire::WriteList<Order>(writer, this->list);
+	}
+
+	template<EVoxelByteOrder Order>
+	bool ReadFields(FVoxelByteReader& reader)
+	{
+		return FVoxelWire::ReadList<Order>(reader, this->list, FNetDiff::MinWireSize);
+	}
+
+	bool fromBytes(TArrayView<const uint8> bytes)
+	{
+		FVoxelByteReader reader(bytes);
+		return ReadFields<FVoxelWire::ServerOrder>(reader);
+	}
+
 };
 
+//Coordinates, then the voxel data as the body
+#define FNET_CHUNK_FIELDS(Field, Optional) \
+	Field(uint32, x) \
+	Field(uint32, y) \
+	Field(uint32, z)
+
 USTRUCT()
 struct FNetChunk
 {
@@ -119,22 +223,50 @@ struct FNetChunk
 	TArray<uint8> density;
 	TArray<uint8> material;
 
-	void fromBytes(TArray<uint8> bytes)
+	VOXEL_WIRE_STRUCT_WITH_BODY(FNetChunk, FNET_CHUNK_FIELDS)
+
+	//Materials, then densities in reverse order, the same bytes in either byte order
+	template<EVoxelByteOrder Order>
+	void WriteBody(FVoxelByteWriter& writer) const
+	{
+		writer.WriteBytes(this->material);
+		for (int i = this->density.Num() - 1; i >= 0; i--)
+		{
+			writer.WriteUInt8(this->density[i]);
+		}
+	}
+
+	//The body runs to the end of the payload, half of it materials and half densities
+	template<EVoxelByteOrder Order>
+	bool ReadBody(FVoxelByteReader& reader)
 	{
-		this->x = ATcpSocket::Message_ReadInt(bytes);
-		this->y = ATcpSocket::Message_ReadInt(bytes);
-		this->z = ATcpSocket::Message_ReadInt(bytes);
+		int size = reader.Remaining() / 2;
 
-		int size = (int)bytes.Num() / 2;
+		this->material.Reset();
+		reader.ReadBytes(reader.Remaining() - size, this->material);
 
-		TArray<uint8> toDensity;
-		for (int i = 0; i < size; i++)
+		TArrayView<const uint8> reversedDensity = reader.ReadSpan(size);
+		this->density.SetNumUninitialized(reversedDensity.Num());
+		for (int i = 0; i < reversedDensity.Num(); i++)
 		{
-			toDensity.Add(bytes.Pop());
+			this->density[i] = reversedDensity[reversedDensity.Num() - 1 - i];
 		}
+		return !reader.IsError();
+	}
+
+	bool BodyEquals(const FNetChunk& Other) const
+	{
+		return this->material == Other.material && this->density == Other.density;
+	}
 
-		this->density = toDensity;
-		this->material = bytes;
+	//Coordinates, then codec encoded voxel data, see FVoxelChunkCodec
+	bool fromCompressedBytes(TArrayView<const uint8> bytes)
+	{
+		FVoxelByteReader reader(bytes);
+		FVoxelWire::Read<FVoxelWire::ServerOrder>(reader, this->x);
+		FVoxelWire::Read<FVoxelWire::ServerOrder>(reader, this->y);
+		FVoxelWire::Read<FVoxelWire::ServerOrder>(reader, this->z);
+		return !reader.IsError() && FVoxelChunkCodec::Decode(reader, this->material, this->density);
 	}
 
 };
@@ -146,12 +278,185 @@ struct FNetChunkList
 
 		TArray<FNetChunk> list;
 
+	//Chunk count, then each chunk as its byte length followed by a Chunk payload
+	template<EVoxelByteOrder Order>
+	void WriteFields(FVoxelByteWriter& writer) const
+	{
+		FVoxelWire::Write<Order>(writer, (uint32)this->list.Num());
+		for (const FNetChunk& chunk : this->list)
+		{
+			int32 sizeOffset = writer.ReserveUInt32();
+			chunk.WriteFields<Order>(writer);
+			FVoxelWire::Patch<Order>(writer, sizeOffset, writer.Tell() - sizeOffset - 4);
+		}
+	}
+
+	template<EVoxelByteOrder Order>
+	bool ReadFields(FVoxelByteReader& reader)
+	{
+		uint32 count;
+		FVoxelWire::Read<Order>(reader, count);
+		if (reader.IsError() || count > (uint32)reader.Remaining() / (4 + FNetChunk::MinWireSize))
+		{
+			return false;
+		}
+
+		this->list.SetNum(count);
+		for (FNetChunk& chunk : this->list)
+		{
+			uint32 size;
+			FVoxelWire::Read<Order>(reader, size);
+			if (reader.IsError() || size > (uint32)reader.Remaining())
+			{
+				return false;
+			}
+
+			FVoxelByteReader chunkReader(reader.ReadSpan(size));
+			if (!chunk.ReadFields<Order>(chunkReader))
+			{
+				return false;
+			}
+		}
+		return !reader.IsError();
+	}
+
+	bool fromBytes(TArrayView<const uint8> bytes)
+	{
+		FVoxelByteReader reader(bytes);
+		return ReadFields<FVoxelWire::ServerOrder>(reader);
+	}
+
+};
+
+
+//Version, then a Chunk payload as the body
+#define FNET_VERSIONED_CHUNK_FIELDS(Field, Optional) \
+	Field(uint32, version)
+
+//Full chunk tagged with the server's version of it
+USTRUCT()
+struct FNetVersionedChunk
+{
+	GENERATED_BODY()
+
+	uint32 version;
+	FNetChunk chunk;
+
+	VOXEL_WIRE_STRUCT_WITH_BODY(FNetVersionedChunk, FNET_VERSIONED_CHUNK_FIELDS)
+
+	template<EVoxelByteOrder Order>
+	void WriteBody(FVoxelByteWriter& writer) const
+	{
+		this->chunk.WriteFields<Order>(writer);
+	}
+
+	template<EVoxelByteOrder Order>
+	bool ReadBody(FVoxelByteReader& reader)
+	{
+		return this->chunk.ReadFields<Order>(reader);
+	}
+
+	bool BodyEquals(const FNetVersionedChunk& Other) const
+	{
+		return this->chunk.WireEquals(Other.chunk);
+	}
+
+};
+
+//Coordinates and the version the diffs bring the chunk to. ChunkUnchanged is only this, ChunkDelta adds a DiffList payload.
+#define FNET_CHUNK_DELTA_FIELDS(Field, Optional) \
+	Field(uint32, x) \
+	Field(uint32, y) \
+	Field(uint32, z) \
+	Field(uint32, version)
+
+//Reply to a versioned request when the client's copy is current, or can be brought up to date with a few diffs
+USTRUCT()
+struct FNetChunkDelta
+{
+	GENERATED_BODY()
+
+	uint32 x;
+	uint32 y;
+	uint32 z;
+	uint32 version;
+
+	//Diffs since the version the client asked with, oldest first. Empty for ChunkUnchanged.
+	FNetDiffList diffs;
+
+	VOXEL_WIRE_STRUCT(FNetChunkDelta, FNET_CHUNK_DELTA_FIELDS)
+
+	bool fromBytes(TArrayView<const uint8> bytes, bool bHasDiffs)
+	{
+		FVoxelByteReader reader(bytes);
+		if (!ReadFields<FVoxelWire::ServerOrder>(reader))
+		{
+			return false;
+		}
+
+		this->diffs.list.Reset();
+		return !bHasDiffs || this->diffs.ReadFields<FVoxelWire::ServerOrder>(reader);
+	}
+
+};
+
+
+/**
+* HANDSHAKE
+*/
+
+//Everything after the codec mask is optional, older servers answer with the mask alone
+#define FNET_HELLO_FIELDS(Field, Optional) \
+	Field(uint32, codecMask) \
+	Optional(uint32, sessionId) \
+	Optional(uint8, channel) \
+	Optional(uint32, protocolVersion)
+
+//First message each way on every connection. The client sends every codec it can decode and which channel of its session
+//the connection is, so the server can pair the connections up. The server answers with the codecs it will use.
+//Both sides send their VoxelProtocolVersion.
+USTRUCT()
+struct FNetHello
+{
+	GENERATED_BODY()
+
+	uint32 codecMask = 0;
+	uint32 sessionId = 0;
+	EVoxelChannel channel = EVoxelChannel::Interactive;
+	uint32 protocolVersion = 1;
+
+	VOXEL_WIRE_STRUCT(FNetHello, FNET_HELLO_FIELDS)
+
 };
 
 
 /**
 * OUTBOUND STRUCTS
 */
+
+//Grants the server more room to send chunk payloads. The first grant after the hello is the whole window, later ones return
+//what the game thread has taken. The server sends a chunk payload while it holds at least one payload and one byte of credit.
+#define FNET_CREDIT_FIELDS(Field, Optional) \
+	Field(uint32, payloads) \
+	Field(uint32, bytes)
+
+USTRUCT()
+struct FNetCredit
+{
+	GENERATED_BODY()
+
+	uint32 payloads = 0;
+	uint32 bytes = 0;
+
+	VOXEL_WIRE_STRUCT(FNetCredit, FNET_CREDIT_FIELDS)
+
+};
+
+#define FNET_CHUNK_REQUEST_FIELDS(Field, Optional) \
+	Field(int32, x) \
+	Field(int32, y) \
+	Field(int32, z)
+
 USTRUCT()
 struct FNetChunkRequest
 {
@@ -177,19 +482,83 @@ struct FNetChunkRequest
 	UPROPERTY()
 		int z;
 
-	TArray<uint8> serialize()
+	VOXEL_WIRE_STRUCT(FNetChunkRequest, FNET_CHUNK_REQUEST_FIELDS)
+
+};
+
+USTRUCT()
+struct FNetChunkRequestList
+{
+	GENERATED_BODY()
+
+	UPROPERTY()
+		TArray<FNetChunkRequest> list;
+
+	void serialize(FVoxelByteWriter& writer) const
 	{
-		TArray<uint8> output;
+		FVoxelWire::WriteList<FVoxelWire::ClientOrder>(writer, this->list);
+	}
+
+};
 
-		output.Append(ATcpSocket::Conv_IntToBytes(this->x));
-		output.Append(ATcpSocket::Conv_IntToBytes(this->y));
-		output.Append(ATcpSocket::Conv_IntToBytes(this->z));
+#define FNET_VERSIONED_CHUNK_REQUEST_FIELDS(Field, Optional) \
+	Field(int32, x) \
+	Field(int32, y) \
+	Field(int32, z) \
+	Field(uint32, version)
 
-		return output;
+//Chunk request carrying the version of the client's cached copy, 0 if it has none
+USTRUCT()
+struct FNetVersionedChunkRequest
+{
+	GENERATED_BODY()
+
+		FNetVersionedChunkRequest()
+	{
+	}
+
+	FNetVersionedChunkRequest(int chunkX, int chunkY, int chunkZ, uint32 cachedVersion)
+	{
+		x = chunkX;
+		y = chunkY;
+		z = chunkZ;
+		version = cachedVersion;
+	}
+
+	UPROPERTY()
+		int x;
+
+	UPROPERTY()
+		int y;
+
+	UPROPERTY()
+		int z;
+
+	UPROPERTY()
+		uint32 version;
+
+	VOXEL_WIRE_STRUCT(FNetVersionedChunkRequest, FNET_VERSIONED_CHUNK_REQUEST_FIELDS)
+
+};
+
+USTRUCT()
+struct FNetVersionedChunkRequestList
+{
+	GENERATED_BODY()
+
+	UPROPERTY()
+		TArray<FNetVersionedChunkRequest> list;
+
+	void serialize(FVoxelByteWriter& writer) const
+	{
+		FVoxelWire::WriteList<FVoxelWire::ClientOrder>(writer, this->list);
 	}
 
 };
 
+#define FNET_DEREGISTER_REQUEST_FIELDS(Field, Optional) \
+	Field(uint32, chunkId)
+
 USTRUCT()
 struct FNetDeRegisterRequest
 {
@@ -206,24 +575,42 @@ struct FNetDeRegisterRequest
 		chunkId = id;
 	}
 
-	TArray<uint8> serialize()
-	{
-		TArray<uint8> output;
+	VOXEL_WIRE_STRUCT(FNetDeRegisterRequest, FNET_DEREGISTER_REQUEST_FIELDS)
 
-		output.Append(ATcpSocket::Conv_IntToBytes(this->chunkId));
+};
+
+USTRUCT()
+struct FNetDeRegisterRequestList
+{
+	GENERATED_BODY()
 
+	UPROPERTY()
+		TArray<uint32> chunkIds;
 
-		return output;
+	void serialize(FVoxelByteWriter& writer) const
+	{
+		FVoxelWire::WriteList<FVoxelWire::ClientOrder>(writer, this->chunkIds);
 	}
 
 };
 
 
+/* A shard came back after losing its connection. The server forgot everything about us with the old session. */
+DECLARE_MULTICAST_DELEGATE_OneParam(FOnStorageShardReconnected, int32 /* shard */);
+
+/* Every channel of every shard is up, after ConnectToGameServer or after the last lost shard came back */
+DECLARE_MULTICAST_DELEGATE(FOnStorageServerConnected);
+
 UCLASS()
 class VOXELGAME_API AVoxelTcpSocket : public ATcpSocket
 {
 	GENERATED_BODY()
 public:
+	AVoxelTcpSocket();
+
+	/* Reconnects shards whose backoff has run out */
+	virtual void Tick(float DeltaTime) override;
+
 	UFUNCTION()
 		void OnConnected(int32 ConnectionId);
 
@@ -236,23 +623,158 @@ public:
 	UFUNCTION(BlueprintCallable)
 		void ConnectToGameServer();
 
-	UFUNCTION()
-		TArray<FNetPayload> getPayloadQueue() {
-		return payloadQueue;
+	/* Replaces the storage servers chunks are spread over, each "host:port" or "shm://name:port". Only takes effect on the next ConnectToGameServer. */
+	bool SetStorageEndpoints(const TArray<FString>& endpoints);
+
+	int32 GetShardCount() const { return storageShards.Num(); }
+
+	/* Some shard is connected, connecting or waiting to reconnect since the last ConnectToGameServer */
+	bool HasActiveShards() const;
+
+	/* Closes both channels of every shard without scheduling reconnects */
+	void DisconnectStorageServers();
+
+	/* Shard owning a chunk, by consistent hashing of its chunk id so adding a server only moves the chunks it takes over */
+	int32 GetShardForChunk(uint32 chunkId) const;
+
+	/* Queues a payload about one chunk on the shard owning it, on the channel its type belongs to */
+	template<typename PayloadStruct>
+	bool SendChunkPayload(uint32 chunkId, EPayloadType payloadType, const PayloadStruct& payload)
+	{
+		return SendPayloadToShard(GetShardForChunk(chunkId), payloadType, payload);
 	}
 
-	UFUNCTION()
-		FNetPayload PopFromPayloadQueue()
+	/* Queues payload on a shard, on the channel its type belongs to. List payloads must only hold that shard's chunks. */
+	template<typename PayloadStruct>
+	bool SendPayloadToShard(int32 shard, EPayloadType payloadType, const PayloadStruct& payload)
 	{
-		return payloadQueue.Pop();
+		return SendPayloadOn(GetConnectionId(shard, GetPayloadChannel(payloadType)), payloadType, payload);
 	}
 
+	/* Frames payload behind its type byte and 4 byte big endian length and queues it on the given connection */
+	template<typename PayloadStruct>
+	bool SendPayloadOn(int32 connectionId, EPayloadType payloadType, const PayloadStruct& payload)
+	{
+		TArray<uint8> output = AcquireSendBuffer(connectionId);
+		FVoxelByteWriter writer(output);
+		int32 lengthOffset = writer.ReserveUInt32();
+		writer.WriteUInt8((uint8)payloadType);
+		payload.serialize(writer);
+		writer.PatchUInt32BE(lengthOffset, output.Num() - 4);
+
+		return SendFrame(connectionId, MoveTemp(output));
+	}
+
+	/* Chunk requests go on Bulk so their replies come back there, unregisters with them so they never overtake the
+	request they cancel. Everything else on Interactive. */
+	static EVoxelChannel GetPayloadChannel(EPayloadType payloadType);
+
+	/* Connection carrying a channel of a shard, both channels share one connection without bUseBulkChannel */
+	int32 GetConnectionId(int32 shard, EVoxelChannel channel) const;
+
+	/* True once every channel of every shard is connected. Never blocks, connecting happens on the socket threads. */
+	bool IsStorageServerConnected();
+
+	/* Both channels of the shard are up and greeted */
+	bool IsShardConnected(int32 shard) const;
+
+	FOnStorageShardReconnected OnStorageShardReconnected;
+
+	FOnStorageServerConnected OnStorageServerConnected;
+
+	bool GetChannelStats(int32 shard, EVoxelChannel channel, FTcpConnectionStats& OutStats);
+
+	/* Chunk payloads and bytes each storage server may have outstanding, and the built chunks the decoder may queue before
+	bulk reads stop. Zero credit turns credit off. Only takes effect on the next ConnectToGameServer. */
+	void SetFlowControl(int32 creditPayloads, int32 creditBytes, int32 maxQueuedChunks);
+
+	/* True while the outbox of any storage server connection is past its high watermark */
+	bool IsStorageSendBackedUp();
+
+	FString GetShardEndpoint(int32 shard) const;
+
+	/* Next payload from the storage server, decoded and with its chunks built on the socket thread. Returns its credit to the server. */
+	bool DequeueDecodedPayload(FVoxelDecodedPayload& OutPayload);
+
+	FVoxelPayloadDecoder& GetPayloadDecoder() { return *PayloadDecoder; }
+
+	/* Chunks kept for versioned re-requests. Restored by the decoder when the server answers with a delta. */
+	FVoxelChunkCache& GetChunkCache() { return *ChunkCache; }
+
+	/*
+	Feeds the inbound frames of a capture (see ATcpSocket::StartCapture) to the decoder and OnMessageReceived as the socket
+	threads would, at the pace they were captured or as fast as the decoder takes them. Outbound frames are skipped.
+	Refused unless every connection is down, replayed payloads would mix with live ones even from a shard still connecting.
+	*/
+	bool StartReplay(const FString& path, bool bAsFastAsPossible);
+
+	void StopReplay();
+
+	bool IsReplaying() const { return bReplayRunning; }
+
+	int64 GetReplayedFrames() const { return ReplayedFrames.GetValue(); }
+
+
+	/* Open a second connection for chunk transfers, so edits do not queue behind megabytes of chunks */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+		bool bUseBulkChannel = true;
 
 	UPROPERTY()
-		int32 connectionIdGameServer;
+		TArray<FVoxelStorageShard> storageShards;
 
-private:
+	/* Delay before reconnecting a lost storage server, doubled on every failed attempt up to reconnectDelayMax */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+		float reconnectDelayMin = 0.5f;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+		float reconnectDelayMax = 30.0f;
+
+	UPROPERTY()
+		int32 chunkCreditPayloads = 64;
+
+	UPROPERTY()
+		int32 chunkCreditBytes = 8 * 1024 * 1024;
+
+	/* Sent in the hello on every channel so each server knows the connections belong together */
 	UPROPERTY()
-		TArray<FNetPayload> payloadQueue;
+		uint32 sessionId = 0;
+
+protected:
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
+private:
+	/* Shard and channel of one of our connections, INDEX_NONE if it is not ours */
+	int32 FindShardByConnection(int32 ConnectionId, EVoxelChannel& OutChannel) const;
+
+	void BuildShardRing();
+
+	/* Opens the channels of a shard, ids of its old connections are dropped */
+	void ConnectShard(int32 shard);
+
+	/* Grants are batched to a quarter of the window so credit does not cost a message per chunk */
+	void ReturnCredit(int32 sourceConnection, int32 bytes);
+
+	/* False if the grant could not be sent, the server still waits for it */
+	bool SendCredit(int32 shard, int32 payloads, int64 bytes);
+
+	/* Points of every shard on the hash ring, sorted by hash. Each shard owns the keys up to its points. */
+	TArray<TPair<uint32, int32>> ShardRing;
+
+	static const int32 ShardRingPointsPerShard = 64;
+
+	TSharedPtr<FVoxelChunkCache, ESPMode::ThreadSafe> ChunkCache;
+
+	TSharedPtr<FVoxelPayloadDecoder, ESPMode::ThreadSafe> PayloadDecoder;
+
+	/* Replay thread body */
+	void RunReplay(const FString& path, bool bAsFastAsPossible);
+
+	TUniquePtr<FThread> ReplayThread;
+
+	FThreadSafeBool bReplayRunning;
+
+	FThreadSafeBool bStopReplay;
+
+	FThreadSafeCounter64 ReplayedFrames;
 
 };
\ No newline at end of file
@@ -0,0 +1,212 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "VoxelByteStream.h"
+
+enum class EVoxelByteOrder : uint8
+{
+	Little,
+	Big
+};
+
+/**
+ * Field codecs behind the wire schema. Payload structs list their fields once, in wire order, and VOXEL_WIRE_STRUCT
+ * generates the encoder, decoder, equality and size from that list:
+ *
+ *	#define FNET_EXAMPLE_FIELDS(Field, Optional) \
+ *		Field(uint32, chunkId) \
+ *		Optional(uint8, flags)
+ *
+ *	struct FNetExample { uint32 chunkId; uint8 flags = 0; VOXEL_WIRE_STRUCT(FNetExample, FNET_EXAMPLE_FIELDS) };
+ *
+ * The first argument is the type on the wire, which the member is cast to and from. Optional fields must come after
+ * all required ones. A reader keeps an optional field's default when the payload ends before it and ignores bytes after
+ * the last field it knows, so fields can be appended without breaking older peers. Elements of lists have no optional
+ * fields, their size must be fixed.
+ *
+ * Payloads that end in variable length data use VOXEL_WIRE_STRUCT_WITH_BODY instead and supply WriteBody, ReadBody and
+ * BodyEquals for what follows the fields. The body runs to the end of the payload, so these have no optional fields.
+ */
+struct VOXELGAME_API FVoxelWire
+{
+	/* The storage server fixes both, clients send little endian and it answers big endian */
+	static constexpr EVoxelByteOrder ClientOrder = EVoxelByteOrder::Little;
+	static constexpr EVoxelByteOrder ServerOrder = EVoxelByteOrder::Big;
+
+	template<EVoxelByteOrder Order>
+	static void Write(FVoxelByteWriter& Writer, uint8 Value)
+	{
+		Writer.WriteUInt8(Value);
+	}
+
+	template<EVoxelByteOrder Order>
+	static void Write(FVoxelByteWriter& Writer, uint32 Value)
+	{
+		if (Order == EVoxelByteOrder::Little)
+		{
+			Writer.WriteUInt32LE(Value);
+		}
+		else
+		{
+			Writer.WriteUInt32BE(Value);
+		}
+	}
+
+	template<EVoxelByteOrder Order>
+	static void Write(FVoxelByteWriter& Writer, int32 Value)
+	{
+		Write<Order>(Writer, (uint32)Value);
+	}
+
+	/* Fills in a field written with FVoxelByteWriter::ReserveUInt32, e.g. a length only known after what it measures */
+	template<EVoxelByteOrder Order>
+	static void Patch(FVoxelByteWriter& Writer, int32 Offset, uint32 Value)
+	{
+		if (Order == EVoxelByteOrder::Little)
+		{
+			Writer.PatchUInt32LE(Offset, Value);
+		}
+		else
+		{
+			Writer.PatchUInt32BE(Offset, Value);
+		}
+	}
+
+	template<EVoxelByteOrder Order>
+	static void Read(FVoxelByteReader& Reader, uint8& OutValue)
+	{
+		OutValue = Reader.ReadUInt8();
+	}
+
+	template<EVoxelByteOrder Order>
+	static void Read(FVoxelByteReader& Reader, uint32& OutValue)
+	{
+		OutValue = (Order == EVoxelByteOrder::Little) ? Reader.ReadUInt32LE() : Reader.ReadUInt32BE();
+	}
+
+	template<EVoxelByteOrder Order>
+	static void Read(FVoxelByteReader& Reader, int32& OutValue)
+	{
+		uint32 value;
+		Read<Order>(Reader, value);
+		OutValue = (int32)value;
+	}
+
+	/* List elements are schema structs or plain ints */
+	template<EVoxelByteOrder Order, typename ElementType>
+	static void WriteElement(FVoxelByteWriter& Writer, const ElementType& Element)
+	{
+		Element.template WriteFields<Order>(Writer);
+	}
+
+	template<EVoxelByteOrder Order>
+	static void WriteElement(FVoxelByteWriter& Writer, const uint32& Element)
+	{
+		Write<Order>(Writer, Element);
+	}
+
+	template<EVoxelByteOrder Order, typename ElementType>
+	static void ReadElement(FVoxelByteReader& Reader, ElementType& OutElement)
+	{
+		OutElement.template ReadFields<Order>(Reader);
+	}
+
+	template<EVoxelByteOrder Order>
+	static void ReadElement(FVoxelByteReader& Reader, uint32& OutElement)
+	{
+		Read<Order>(Reader, OutElement);
+	}
+
+	/* Element count, then the elements back to back */
+	template<EVoxelByteOrder Order, typename ElementType>
+	static void WriteList(FVoxelByteWriter& Writer, const TArray<ElementType>& List)
+	{
+		Write<Order>(Writer, (uint32)List.Num());
+		for (const ElementType& element : List)
+		{
+			WriteElement<Order>(Writer, element);
+		}
+	}
+
+	/* A count the payload cannot hold at ElementSize bytes each is rejected before allocating. ElementSize must be at least 1,
+	   a list of empty elements could claim any count. */
+	template<EVoxelByteOrder Order, typename ElementType>
+	static bool ReadList(FVoxelByteReader& Reader, TArray<ElementType>& OutList, int32 ElementSize)
+	{
+		if (ElementSize <= 0)
+		{
+			return false;
+		}
+
+		uint32 count;
+		Read<Order>(Reader, count);
+		if (Reader.IsError() || count > (uint32)Reader.Remaining() / ElementSize)
+		{
+			return false;
+		}
+
+		OutList.SetNum(count);
+		for (ElementType& element : OutList)
+		{
+			ReadElement<Order>(Reader, element);
+		}
+		return !Reader.IsError();
+	}
+
+	/* Logs encode and decode throughput of the payloads sent most often */
+	static void RunBenchmark(int32 Iterations);
+};
+
+#define VOXEL_WIRE_WRITE_FIELD(Type, Name) FVoxelWire::Write<Order>(Writer, (Type)this->Name);
+#define VOXEL_WIRE_READ_FIELD(Type, Name) { Type value; FVoxelWire::Read<Order>(Reader, value); this->Name = (decltype(this->Name))value; }
+#define VOXEL_WIRE_READ_OPTIONAL(Type, Name) if (!Reader.IsError() && Reader.Remaining() > 0) VOXEL_WIRE_READ_FIELD(Type, Name)
+#define VOXEL_WIRE_EQUAL_FIELD(Type, Name) && this->Name == Other.Name
+#define VOXEL_WIRE_SIZE_FIELD(Type, Name) + (int32)sizeof(Type)
+#define VOXEL_WIRE_SIZE_NONE(Type, Name)
+
+#define VOXEL_WIRE_BODY_NONE
+
+/*
+Generates, from a field list as described at FVoxelWire:
+WriteFields/ReadFields in either byte order, serialize (client order) and fromBytes (server order) for the socket,
+WireEquals for tests, and MinWireSize, the bytes of the required fields.
+*/
+#define VOXEL_WIRE_STRUCT(StructType, FieldList) \
+	VOXEL_WIRE_STRUCT_IMPL(StructType, FieldList, VOXEL_WIRE_BODY_NONE, VOXEL_WIRE_BODY_NONE, VOXEL_WIRE_BODY_NONE)
+
+/* Same as VOXEL_WIRE_STRUCT, with the struct's body written, read and compared after the fields */
+#define VOXEL_WIRE_STRUCT_WITH_BODY(StructType, FieldList) \
+	VOXEL_WIRE_STRUCT_IMPL(StructType, FieldList, \
+		this->template WriteBody<Order>(Writer);, \
+		&& this->template ReadBody<Order>(Reader), \
+		&& this->BodyEquals(Other))
+
+#define VOXEL_WIRE_STRUCT_IMPL(StructType, FieldList, WriteBodyCall, ReadBodyCall, BodyEqualsCall) \
+	static constexpr int32 MinWireSize = 0 FieldList(VOXEL_WIRE_SIZE_FIELD, VOXEL_WIRE_SIZE_NONE); \
+	template<EVoxelByteOrder Order> \
+	void WriteFields(FVoxelByteWriter& Writer) const \
+	{ \
+		FieldList(VOXEL_WIRE_WRITE_FIELD, VOXEL_WIRE_WRITE_FIELD) \
+		WriteBodyCall \
+	} \
+	template<EVoxelByteOrder Order> \
+	bool ReadFields(FVoxelByteReader& Reader) \
+	{ \
+		FieldList(VOXEL_WIRE_READ_FIELD, VOXEL_WIRE_READ_OPTIONAL) \
+		return !Reader.IsError() ReadBodyCall; \
+	} \
+	void serialize(FVoxelByteWriter& writer) const \
+	{ \
+		WriteFields<FVoxelWire::ClientOrder>(writer); \
+	} \
+	bool fromBytes(TArrayView<const uint8> bytes) \
+	{ \
+		FVoxelByteReader reader(bytes); \
+		return ReadFields<FVoxelWire::ServerOrder>(reader); \
+	} \
+	bool WireEquals(const StructType& Other) const \
+	{ \
+		return true FieldList(VOXEL_WIRE_EQUAL_FIELD, VOXEL_WIRE_EQUAL_FIELD) BodyEqualsCall; \
+	}
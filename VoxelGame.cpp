@@ -2,6 +2,20 @@
 
 #include "VoxelGame.h"
 #include "Modules/ModuleManager.h"
+#include "UObject/CoreRedirects.h"
 
-IMPLEMENT_PRIMARY_GAME_MODULE( FDefaultGameModuleImpl, VoxelGame, "VoxelGame" );
+class FVoxelGameModule : public FDefaultGameModuleImpl
+{
+public:
+	virtual void StartupModule() override
+	{
+		//Renamed properties, so values saved in levels and blueprints under the old name still load.
+		//Registered before any of them load, subclasses such as AVoxelTcpSocket are covered through their parent.
+		TArray<FCoreRedirect> redirects;
+		redirects.Emplace(ECoreRedirectFlags::Type_Property, TEXT("/Script/VoxelGame.TcpSocket.TimeBetweenTicks"), TEXT("MaxWaitTime"));
+		FCoreRedirects::AddRedirectList(redirects, TEXT("VoxelGame"));
+	}
+};
+
+IMPLEMENT_PRIMARY_GAME_MODULE( FVoxelGameModule, VoxelGame, "VoxelGame" );
  
\ No newline at end of file